@@ -104,6 +104,9 @@ class Platform(object):
         return self._platform in ('freebsd', 'linux', 'openbsd', 'bitrig',
                                   'dragonfly')
 
+    def supports_epoll(self):
+        return self._platform == 'linux'
+
     def supports_ninja_browse(self):
         return (not self.is_windows()
                 and not self.is_solaris()
@@ -218,6 +221,9 @@ parser.add_option('--with-python', metavar='EXE',
 parser.add_option('--force-pselect', action='store_true',
                   help='ppoll() is used by default where available, '
                        'but some platforms may need to use pselect instead',)
+parser.add_option('--force-ppoll', action='store_true',
+                  help='epoll() is used by default on Linux; use ppoll '
+                       '(or pselect) instead',)
 (options, args) = parser.parse_args()
 if args:
     print('ERROR: extra unparsed command-line arguments:', args)
@@ -381,8 +387,16 @@ else:
         cflags.append('-fno-omit-frame-pointer')
         libs.extend(['-Wl,--no-as-needed', '-lprofiler'])
 
+if not platform.is_windows():
+    # The manifest parser uses threads.
+    cflags.append('-pthread')
+    ldflags.append('-pthread')
+
 if platform.supports_ppoll() and not options.force_pselect:
     cflags.append('-DUSE_PPOLL')
+if (platform.supports_epoll() and not options.force_ppoll
+        and not options.force_pselect):
+    cflags.append('-DUSE_EPOLL')
 if platform.supports_ninja_browse():
     cflags.append('-DNINJA_HAVE_BROWSE')
 
@@ -488,8 +502,11 @@ n.comment('Core source files all build into ninja library.')
 cxxvariables = []
 if platform.is_msvc():
     cxxvariables = [('pdb', 'ninja.pdb')]
-for name in ['build',
+for name in ['action_cache',
+             'arena',
+             'build',
              'build_log',
+             'change_journal',
              'clean',
              'clparser',
              'debug_flags',
@@ -500,17 +517,22 @@ for name in ['build',
              'eval_env',
              'graph',
              'graphviz',
+             'jobserver',
              'lexer',
              'line_printer',
+             'manifest_cache',
              'manifest_parser',
+             'mapped_file',
              'metrics',
              'state',
              'string_piece_util',
+             'thread_pool',
              'util',
              'version']:
     objs += cxx(name, variables=cxxvariables) 
 if platform.is_windows():
     for name in ['subprocess-win32',
+                 'jobserver-win32',
                  'includes_normalize-win32',
                  'msvc_helper-win32',
                  'msvc_helper_main-win32']:
@@ -519,6 +541,9 @@ if platform.is_windows():
         objs += cxx('minidump-win32', variables=cxxvariables)
     objs += cc('getopt')
 else:
+    objs += cxx('build_server-posix')
+    objs += cxx('jobserver-posix')
+    objs += cxx('remote_exec-posix')
     objs += cxx('subprocess-posix')
 if platform.is_aix():
     objs += cc('getopt')
@@ -557,8 +582,11 @@ objs = []
 if platform.is_msvc():
     cxxvariables = [('pdb', 'ninja_test.pdb')]
 
-for name in ['build_log_test',
+for name in ['action_cache_test',
+             'arena_test',
+             'build_log_test',
              'build_test',
+             'change_journal_test',
              'clean_test',
              'clparser_test',
              'depfile_parser_test',
@@ -566,7 +594,9 @@ for name in ['build_log_test',
              'disk_interface_test',
              'edit_distance_test',
              'graph_test',
+             'jobserver_test',
              'lexer_test',
+             'manifest_cache_test',
              'manifest_parser_test',
              'ninja_test',
              'state_test',
@@ -578,6 +608,9 @@ for name in ['build_log_test',
 if platform.is_windows():
     for name in ['includes_normalize_test', 'msvc_helper_test']:
         objs += cxx(name, variables=cxxvariables)
+else:
+    for name in ['build_server_test', 'remote_exec_test']:
+        objs += cxx(name, variables=cxxvariables)
 
 ninja_test = n.build(binary('ninja_test'), 'link', objs, implicit=ninja_lib,
                      variables=[('libs', libs)])
@@ -589,15 +622,24 @@ n.comment('Ancillary executables.')
 
 for name in ['build_log_perftest',
              'canon_perftest',
+             'dependency_scan_perftest',
+             'deps_log_perftest',
              'depfile_parser_perftest',
              'hash_collision_bench',
              'manifest_parser_perftest',
-             'clparser_perftest']:
+             'clparser_perftest',
+             'plan_perftest',
+             'stat_perftest',
+             'subprocess_perftest']:
   if platform.is_msvc():
     cxxvariables = [('pdb', name + '.pdb')]
   objs = cxx(name, variables=cxxvariables)
   all_targets += n.build(binary(name), 'link', objs,
                          implicit=ninja_lib, variables=[('libs', libs)])
+if not platform.is_windows():
+    objs = cxx('ninja_worker')
+    all_targets += n.build(binary('ninja_worker'), 'link', objs,
+                           implicit=ninja_lib, variables=[('libs', libs)])
 
 n.newline()
 
@@ -99,5 +99,32 @@ red
 \x1b[31mred\x1b[0m
 ''')
 
+    @unittest.skipIf(platform.system() == 'Windows', 'no ninja_worker')
+    def test_remote(self):
+        with tempfile.TemporaryDirectory() as scratch:
+            address = os.path.join(scratch, 'worker.sock')
+            worker = subprocess.Popen(['./ninja_worker', address,
+                                       os.path.join(scratch, 'dir')])
+            try:
+                while not os.path.exists(address):
+                    pass
+                out = os.path.relpath(os.path.join(scratch, 'out'))
+                self.assertEqual(run(
+'''rule pwd
+  command = pwd > $out
+  remote = 1
+
+build {}: pwd
+'''.format(out), flags='--remote=' + address, pipe=True),
+'''[1/1] pwd > {}
+'''.format(out))
+                # The command ran in the worker's scratch directory.
+                with open(out) as f:
+                    self.assertIn(os.path.join(scratch, 'dir', 'jobs'),
+                                  f.read())
+            finally:
+                worker.terminate()
+                worker.wait()
+
 if __name__ == '__main__':
     unittest.main()
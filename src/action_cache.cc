@@ -0,0 +1,458 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _WIN32
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+#endif
+
+#include "action_cache.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <inttypes.h>
+#include <unistd.h>
+#endif
+
+#include "build_log.h"
+#include "depfile_parser.h"
+#include "disk_interface.h"
+#include "graph.h"
+#include "metrics.h"
+#include "state.h"
+
+namespace {
+
+string HexHash(uint64_t hash) {
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016" PRIx64, hash);
+  return buf;
+}
+
+/// Escape |path| for a depfile.
+string EscapeForDepfile(const string& path) {
+  string result;
+  for (string::const_iterator c = path.begin(); c != path.end(); ++c) {
+    if (*c == ' ' || *c == '#')
+      result += '\\';
+    else if (*c == '$')
+      result += '$';
+    result += *c;
+  }
+  return result;
+}
+
+/// The names in |dir|, without "." and "..".
+bool ListDirectory(const string& dir, vector<string>* names, string* err) {
+#ifdef _WIN32
+  WIN32_FIND_DATAA ffd;
+  HANDLE find_handle = FindFirstFileA((dir + "\\*").c_str(), &ffd);
+  if (find_handle == INVALID_HANDLE_VALUE) {
+    DWORD win_err = GetLastError();
+    if (win_err == ERROR_FILE_NOT_FOUND || win_err == ERROR_PATH_NOT_FOUND)
+      return true;
+    *err = "FindFirstFileA(" + dir + "): " + GetLastErrorString();
+    return false;
+  }
+  do {
+    names->push_back(ffd.cFileName);
+  } while (FindNextFileA(find_handle, &ffd));
+  FindClose(find_handle);
+#else
+  DIR* d = opendir(dir.c_str());
+  if (!d) {
+    if (errno == ENOENT)
+      return true;
+    *err = "opendir(" + dir + "): " + strerror(errno);
+    return false;
+  }
+  while (struct dirent* entry = readdir(d))
+    names->push_back(entry->d_name);
+  closedir(d);
+#endif
+  names->erase(remove(names->begin(), names->end(), string(".")),
+               names->end());
+  names->erase(remove(names->begin(), names->end(), string("..")),
+               names->end());
+  return true;
+}
+
+/// A name for a temporary file or directory of this process in the cache
+/// directory |dir|, which other processes share.
+string TempPath(const string& dir, uint64_t hash, const char* suffix) {
+#ifdef _WIN32
+  unsigned long pid = GetCurrentProcessId();
+#else
+  unsigned long pid = getpid();
+#endif
+  char name[64];
+  snprintf(name, sizeof(name), "/tmp/%016" PRIx64 ".%lu%s", hash, pid,
+           suffix);
+  return dir + name;
+}
+
+bool RemoveDir(const string& path) {
+#ifdef _WIN32
+  return RemoveDirectoryA(path.c_str()) != 0;
+#else
+  return rmdir(path.c_str()) == 0;
+#endif
+}
+
+/// An entry of the cache, for ActionCache::Trim().
+struct CacheEntry {
+  string path;
+  TimeStamp used;
+  int64_t size;
+  /// The number of output files.
+  int outputs;
+
+  bool operator<(const CacheEntry& other) const {
+    return used < other.used;
+  }
+};
+
+}  // namespace
+
+bool ActionCache::Caches(Edge* edge) const {
+  return enabled() && !edge->is_phony() && edge->GetBindingBool("cache") &&
+      !edge->use_console();
+}
+
+uint64_t ActionCache::HashInputs(uint64_t command_hash,
+                                 const vector<string>& paths,
+                                 const Started* started) {
+  string all((const char*)&command_hash, sizeof(command_hash));
+  for (vector<string>::const_iterator p = paths.begin(); p != paths.end();
+       ++p) {
+    Node* node = state_->LookupNode(*p);
+    if (node && node->immutable())
+      continue;
+    uint64_t content_hash;
+    map<string, pair<TimeStamp, uint64_t> >::const_iterator i;
+    if (started && (i = started->inputs.find(*p)) != started->inputs.end()) {
+      string err;
+      if (disk_interface_->Stat(*p, &err) != i->second.first)
+        return 0;
+      content_hash = i->second.second;
+    } else {
+      // A dependency that the command found must be older than it.
+      TimeStamp mtime;
+      content_hash = HashFile(*p, &mtime);
+      if (started && mtime >= started->time)
+        return 0;
+    }
+    if (!content_hash)
+      return 0;
+    all += *p;
+    all += '\0';
+    all.append((const char*)&content_hash, sizeof(content_hash));
+  }
+  return BuildLog::LogEntry::HashContent(all);
+}
+
+uint64_t ActionCache::HashFile(const string& path, TimeStamp* mtime) {
+  string err;
+  *mtime = disk_interface_->Stat(path, &err);
+  if (*mtime <= 0)
+    return 0;
+  map<string, pair<TimeStamp, uint64_t> >::iterator i = hashes_.find(path);
+  if (i != hashes_.end() && i->second.first == *mtime)
+    return i->second.second;
+  string content;
+  if (disk_interface_->ReadFile(path, &content, &err) != DiskInterface::Okay ||
+      disk_interface_->Stat(path, &err) != *mtime) {
+    return 0;
+  }
+  uint64_t hash = BuildLog::LogEntry::HashContent(content) | 1;
+  hashes_[path] = make_pair(*mtime, hash);
+  return hash;
+}
+
+bool ActionCache::Restore(Edge* edge, string* output) {
+  METRIC_RECORD("action cache restore");
+  uint64_t command_hash =
+      BuildLog::LogEntry::HashCommand(edge->EvaluateCommand(true));
+  string deps, err;
+  if (disk_interface_->ReadFile(dir_ + "/deps/" + HexHash(command_hash),
+                                &deps, &err) != DiskInterface::Okay) {
+    return false;
+  }
+  vector<string> paths;
+  for (size_t start = 0, end; start < deps.size(); start = end + 1) {
+    end = deps.find('\n', start);
+    if (end == string::npos)
+      end = deps.size();
+    paths.push_back(deps.substr(start, end - start));
+  }
+  uint64_t hash = HashInputs(command_hash, paths, NULL);
+  if (!hash)
+    return false;
+  string entry = dir_ + "/" + HexHash(hash) + "/";
+  if (disk_interface_->ReadFile(entry + "stdout", output, &err) !=
+      DiskInterface::Okay) {
+    return false;
+  }
+
+  // Copy the outputs next to where they go first, so that they are all
+  // from the entry or all as they were.
+  vector<string> temps;
+  bool ok = true;
+  for (size_t i = 0; i < edge->outputs_.size() && ok; ++i) {
+    char name[16];
+    snprintf(name, sizeof(name), "%d", (int)i);
+    const string& path = edge->outputs_[i]->path();
+    temps.push_back(path + ".ninja_restore");
+    ok = disk_interface_->MakeDirs(path) &&
+        disk_interface_->Copy(entry + name, temps.back(), &err);
+  }
+  for (size_t i = 0; i < edge->outputs_.size() && ok; ++i)
+    ok = disk_interface_->Rename(temps[i], edge->outputs_[i]->path(), &err);
+  if (!ok) {
+    for (vector<string>::iterator t = temps.begin(); t != temps.end(); ++t)
+      disk_interface_->RemoveFile(*t);
+    return false;
+  }
+
+  // Builder::ExtractDeps() reads the dependencies of deps = gcc from the
+  // depfile, and the next build those of other edges with one.
+  string depfile = edge->GetUnescapedDepfile();
+  if (!depfile.empty()) {
+    string content = EscapeForDepfile(edge->outputs_[0]->path()) + ":";
+    for (vector<string>::iterator p = paths.begin(); p != paths.end(); ++p)
+      content += " " + EscapeForDepfile(*p);
+    content += "\n";
+    if (!disk_interface_->MakeDirs(depfile) ||
+        !disk_interface_->WriteFile(depfile, content)) {
+      return false;
+    }
+  }
+
+  disk_interface_->Touch(entry + "stdout", &err);
+  return true;
+}
+
+void ActionCache::Start(Edge* edge) {
+  METRIC_RECORD("action cache start");
+  Started& started = started_[edge];
+  started.command_hash =
+      BuildLog::LogEntry::HashCommand(edge->EvaluateCommand(true));
+
+  // Files written after this one may have been written by the command.
+  string err;
+  string marker = dir_ + "/tmp/" + HexHash(started.command_hash);
+  if (!disk_interface_->MakeDirs(marker) ||
+      !disk_interface_->WriteFile(marker, "") ||
+      (started.time = disk_interface_->Stat(marker, &err)) <= 0) {
+    started_.erase(edge);
+    return;
+  }
+  disk_interface_->RemoveFile(marker);
+
+  for (vector<Node*>::iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end() - edge->order_only_deps_; ++i) {
+    if ((*i)->immutable())
+      continue;
+    TimeStamp mtime;
+    uint64_t hash = HashFile((*i)->path(), &mtime);
+    if (!hash) {
+      started_.erase(edge);
+      return;
+    }
+    started.inputs[(*i)->path()] = make_pair(mtime, hash);
+  }
+}
+
+void ActionCache::Store(Edge* edge, const vector<Node*>& deps_nodes,
+                        const string& output) {
+  METRIC_RECORD("action cache store");
+  map<Edge*, Started>::iterator s = started_.find(edge);
+  if (s == started_.end())
+    return;
+  Started started = s->second;
+  started_.erase(s);
+
+  vector<string> paths;
+  for (vector<Node*>::iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end() - edge->order_only_deps_; ++i) {
+    paths.push_back((*i)->path());
+  }
+  for (vector<Node*>::const_iterator i = deps_nodes.begin();
+       i != deps_nodes.end(); ++i) {
+    paths.push_back((*i)->path());
+  }
+
+  // The dependencies of an edge without deps stay in its depfile.
+  string err;
+  string depfile = edge->GetUnescapedDepfile();
+  if (!depfile.empty() && edge->GetBinding("deps").empty()) {
+    string content;
+    if (disk_interface_->ReadFile(depfile, &content, &err) !=
+        DiskInterface::Okay) {
+      return;
+    }
+    DepfileParser parser;
+    if (!parser.Parse(&content, &err)) {
+      Warning("action cache: %s: %s", depfile.c_str(), err.c_str());
+      return;
+    }
+    for (vector<StringPiece>::iterator i = parser.ins_.begin();
+         i != parser.ins_.end(); ++i) {
+      string path = i->AsString();
+      uint64_t slash_bits;
+      if (!CanonicalizePath(&path, &slash_bits, &err))
+        return;
+      paths.push_back(path);
+    }
+  }
+  sort(paths.begin(), paths.end());
+  paths.erase(unique(paths.begin(), paths.end()), paths.end());
+
+  uint64_t command_hash = started.command_hash;
+  uint64_t hash = HashInputs(command_hash, paths, &started);
+  if (!hash)
+    return;
+  string entry = dir_ + "/" + HexHash(hash);
+  if (disk_interface_->Stat(entry + "/stdout", &err) > 0)
+    return;
+
+  // Other builds may read the cache or store the same entry at the same
+  // time, so write the entry in a directory of this process and rename it
+  // into place; if another build got there first, the entry is stored.
+  string temp = TempPath(dir_, hash, "");
+  size_t written = 0;
+  bool ok = disk_interface_->MakeDirs(temp + "/stdout");
+  for (; ok && written < edge->outputs_.size(); ++written) {
+    char name[16];
+    snprintf(name, sizeof(name), "/%d", (int)written);
+    ok = disk_interface_->Copy(edge->outputs_[written]->path(), temp + name,
+                               &err);
+  }
+  if (ok && !disk_interface_->WriteFile(temp + "/stdout", output)) {
+    err = "can't write " + temp + "/stdout";
+    ok = false;
+  }
+  if (ok && !disk_interface_->Rename(temp, entry, &err) &&
+      disk_interface_->Stat(entry + "/stdout", &err) <= 0) {
+    ok = false;
+  }
+  if (!ok)
+    Warning("action cache: %s", err.c_str());
+  for (size_t i = 0; i < written; ++i) {
+    char name[16];
+    snprintf(name, sizeof(name), "/%d", (int)i);
+    disk_interface_->RemoveFile(temp + name);
+  }
+  disk_interface_->RemoveFile(temp + "/stdout");
+  RemoveDir(temp);
+  if (!ok)
+    return;
+
+  string deps;
+  for (vector<string>::iterator p = paths.begin(); p != paths.end(); ++p) {
+    if (p != paths.begin())
+      deps += '\n';
+    deps += *p;
+  }
+  string deps_path = dir_ + "/deps/" + HexHash(command_hash);
+  string deps_temp = TempPath(dir_, command_hash, ".deps");
+  if (!disk_interface_->MakeDirs(deps_path) ||
+      !disk_interface_->WriteFile(deps_temp, deps) ||
+      !disk_interface_->Rename(deps_temp, deps_path, &err)) {
+    Warning("action cache: can't write %s", deps_path.c_str());
+    disk_interface_->RemoveFile(deps_temp);
+  }
+}
+
+// static
+bool ActionCache::Trim(const string& dir, int64_t max_size,
+                       RealDiskInterface* disk_interface, string* err) {
+  vector<string> names;
+  if (!ListDirectory(dir, &names, err))
+    return false;
+
+  vector<CacheEntry> entries;
+  int64_t total = 0;
+  for (vector<string>::iterator n = names.begin(); n != names.end(); ++n) {
+    if (n->size() != 16 || *n == "deps")
+      continue;
+    CacheEntry entry;
+    entry.path = dir + "/" + *n;
+    int64_t size;
+    entry.used = disk_interface->StatWithSize(entry.path + "/stdout", &size,
+                                              err);
+    if (entry.used < 0)
+      return false;
+    entry.size = size;
+    entry.outputs = 0;
+    for (;;) {
+      char name[16];
+      snprintf(name, sizeof(name), "/%d", entry.outputs);
+      TimeStamp mtime = disk_interface->StatWithSize(entry.path + name,
+                                                     &size, err);
+      if (mtime < 0)
+        return false;
+      if (mtime == 0)
+        break;
+      entry.size += size;
+      ++entry.outputs;
+    }
+    total += entry.size;
+    entries.push_back(entry);
+  }
+
+  // Remove the least recently used entries first.
+  sort(entries.begin(), entries.end());
+  vector<CacheEntry>::iterator e = entries.begin();
+  for (; e != entries.end() && total > max_size; ++e) {
+    for (int i = 0; i < e->outputs; ++i) {
+      char name[16];
+      snprintf(name, sizeof(name), "/%d", i);
+      disk_interface->RemoveFile(e->path + name);
+    }
+    disk_interface->RemoveFile(e->path + "/stdout");
+    if (!RemoveDir(e->path)) {
+      *err = "can't remove " + e->path;
+      return false;
+    }
+    total -= e->size;
+  }
+
+  // The lists of dependencies that are older than the entries kept are
+  // unlikely to be used again.
+  if (e == entries.begin())
+    return true;
+  TimeStamp oldest_used = e == entries.end() ? TimeStamp(-1) : e->used;
+  names.clear();
+  if (!ListDirectory(dir + "/deps", &names, err))
+    return false;
+  for (vector<string>::iterator n = names.begin(); n != names.end(); ++n) {
+    string path = dir + "/deps/" + *n;
+    int64_t size;
+    TimeStamp mtime = disk_interface->StatWithSize(path, &size, err);
+    if (mtime < 0)
+      return false;
+    if (oldest_used < 0 || mtime < oldest_used)
+      disk_interface->RemoveFile(path);
+  }
+  return true;
+}
@@ -0,0 +1,113 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_ACTION_CACHE_H_
+#define NINJA_ACTION_CACHE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "timestamp.h"
+#include "util.h"  // int64_t
+
+struct DiskInterface;
+struct Edge;
+struct Node;
+struct RealDiskInterface;
+struct State;
+
+/// A directory of the outputs of the commands of edges with cache = 1,
+/// shared by the build directories of a machine, from which the outputs of
+/// a command that already ran with the same inputs are copied instead of
+/// running it again.
+///
+/// An edge's inputs include the dependencies that its last run found, so
+/// the lookup is in two steps: the hash of the command names the list of
+/// dependency paths that its last run stored, <dir>/deps/<hash>, and the
+/// hash of the command with the contents of those files names the entry,
+/// <dir>/<hash>/.  An entry has the outputs as files 0, 1, ... and the
+/// output of the command as file "stdout", which is written last and
+/// touched on each use, for Trim().
+///
+/// The entry is named after the inputs as they were when the command
+/// started, and isn't written if one changed while it ran, since the
+/// outputs may then match neither version.
+struct ActionCache {
+  /// |dir|, which is empty if there is no cache, must outlive the cache.
+  ActionCache(const string& dir, State* state, DiskInterface* disk_interface)
+      : dir_(dir), state_(state), disk_interface_(disk_interface) {}
+
+  bool enabled() const { return !dir_.empty(); }
+
+  /// Whether the outputs of |edge| are looked up in the cache.
+  bool Caches(Edge* edge) const;
+
+  /// Copy the outputs of |edge| from the cache, and write its depfile, if
+  /// it has one.  The outputs are only replaced once all were copied.
+  /// @return false if the cache has no entry for the edge's inputs, with
+  /// |output| set to the output of the command otherwise.
+  bool Restore(Edge* edge, string* output);
+
+  /// Hash the inputs of |edge|, whose command is about to start, for
+  /// Store().
+  void Start(Edge* edge);
+
+  /// Copy the outputs of |edge|, whose command succeeded with |output| and
+  /// found the dependencies |deps_nodes|, to the cache, unless an input
+  /// changed since Start().  Errors are only warned about.
+  void Store(Edge* edge, const vector<Node*>& deps_nodes,
+             const string& output);
+
+  /// Drop what Start() recorded for |edge|, whose command failed.
+  void Forget(Edge* edge) {
+    started_.erase(edge);
+  }
+
+  /// Remove the least recently used entries of the cache in |dir| until
+  /// its entries take at most |max_size| bytes.
+  /// @return false on error.
+  static bool Trim(const string& dir, int64_t max_size,
+                   RealDiskInterface* disk_interface, string* err);
+
+ private:
+  /// The inputs of an edge when its command started.
+  struct Started {
+    uint64_t command_hash;
+    /// The mtime of a file written just before the command started.
+    TimeStamp time;
+    /// The mtimes and hashes of the contents of the inputs then.
+    map<string, pair<TimeStamp, uint64_t> > inputs;
+  };
+
+  /// The hash of the command of |edge| with the contents of |paths|, or 0
+  /// if one can't be read.  With |started|, the hashes of its inputs are
+  /// used, and 0 is returned if a file changed since then.
+  uint64_t HashInputs(uint64_t command_hash, const vector<string>& paths,
+                      const Started* started);
+
+  /// The hash of the contents of |path|, with its mtime in |mtime|, or 0 if
+  /// it can't be read or changes while it is.
+  uint64_t HashFile(const string& path, TimeStamp* mtime);
+
+  const string& dir_;
+  State* state_;
+  DiskInterface* disk_interface_;
+  map<Edge*, Started> started_;
+  /// The hashes of HashFile(), with the mtimes of the files then.
+  map<string, pair<TimeStamp, uint64_t> > hashes_;
+};
+
+#endif  // NINJA_ACTION_CACHE_H_
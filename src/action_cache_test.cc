@@ -0,0 +1,236 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "action_cache.h"
+
+#include <sys/types.h>
+#ifdef _WIN32
+#include <sys/utime.h>
+#else
+#include <utime.h>
+#endif
+
+#include "disk_interface.h"
+#include "graph.h"
+#include "test.h"
+
+namespace {
+
+struct ActionCacheTest : public StateTestWithBuiltinRules {
+  ActionCacheTest() : dir_("cache"), cache_(dir_, &state_, &fs_) {}
+
+  VirtualFileSystem fs_;
+  string dir_;
+  ActionCache cache_;
+};
+
+TEST_F(ActionCacheTest, StoreRestore) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $in\n"
+"  depfile = $out.d\n"
+"  cache = 1\n"
+"build out: cc in\n"));
+  Edge* edge = GetNode("out")->in_edge();
+  ASSERT_TRUE(cache_.Caches(edge));
+  fs_.Create("in", "int main() {}");
+  fs_.Create("in.h", "#define X");
+  fs_.Tick();
+  cache_.Start(edge);
+  fs_.Create("out", "object");
+  fs_.Create("out.d", "out: in in.h\n");
+
+  cache_.Store(edge, vector<Node*>(), "warning\n");
+  fs_.RemoveFile("out");
+  fs_.RemoveFile("out.d");
+
+  string output;
+  EXPECT_TRUE(cache_.Restore(edge, &output));
+  EXPECT_EQ("warning\n", output);
+  EXPECT_EQ("object", fs_.files_["out"].contents);
+  EXPECT_EQ("out: in in.h\n", fs_.files_["out.d"].contents);
+
+  // A change to a dependency that the depfile named is a miss.
+  fs_.Create("in.h", "#define Y");
+  EXPECT_FALSE(cache_.Restore(edge, &output));
+}
+
+TEST_F(ActionCacheTest, CommandChanged) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $flags $in\n"
+"  cache = 1\n"
+"build out1: cc in\n"
+"build out2: cc in\n"
+"  flags = -O2\n"));
+  fs_.Create("in", "int main() {}");
+  cache_.Start(GetNode("out1")->in_edge());
+  fs_.Create("out1", "object");
+
+  cache_.Store(GetNode("out1")->in_edge(), vector<Node*>(), "");
+  string output;
+  EXPECT_FALSE(cache_.Restore(GetNode("out2")->in_edge(), &output));
+  EXPECT_EQ(0, fs_.Stat("out2", &output));
+}
+
+TEST_F(ActionCacheTest, InputChangedWhileRunning) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $in\n"
+"  depfile = $out.d\n"
+"  cache = 1\n"
+"build out: cc in\n"));
+  Edge* edge = GetNode("out")->in_edge();
+  fs_.Create("in", "int main() {}");
+  cache_.Start(edge);
+  fs_.Tick();
+  fs_.Create("in", "int main() { return 1; }");
+  fs_.Create("out", "object");
+  fs_.Create("out.d", "out: in\n");
+  cache_.Store(edge, vector<Node*>(), "");
+
+  // Neither version of the input has an entry.
+  string output;
+  EXPECT_FALSE(cache_.Restore(edge, &output));
+  fs_.Create("in", "int main() {}");
+  EXPECT_FALSE(cache_.Restore(edge, &output));
+
+  // Nor does one with a dependency that was written while the command ran.
+  cache_.Start(edge);
+  fs_.Tick();
+  fs_.Create("in.h", "#define X");
+  fs_.Create("out.d", "out: in in.h\n");
+  cache_.Store(edge, vector<Node*>(), "");
+  EXPECT_FALSE(cache_.Restore(edge, &output));
+}
+
+TEST_F(ActionCacheTest, StoredByAnotherBuild) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $in\n"
+"  cache = 1\n"
+"build out: cc in\n"));
+  Edge* edge = GetNode("out")->in_edge();
+  fs_.Create("in", "int main() {}");
+  ActionCache other(dir_, &state_, &fs_);
+  cache_.Start(edge);
+  other.Start(edge);
+  fs_.Create("out", "object");
+  cache_.Store(edge, vector<Node*>(), "first\n");
+
+  // The entry that is in place stays as it is.
+  fs_.Create("out", "other object");
+  other.Store(edge, vector<Node*>(), "second\n");
+  fs_.RemoveFile("out");
+  string output;
+  EXPECT_TRUE(cache_.Restore(edge, &output));
+  EXPECT_EQ("first\n", output);
+  EXPECT_EQ("object", fs_.files_["out"].contents);
+
+  // Nothing is left in the temporary directory.
+  for (VirtualFileSystem::FileMap::iterator i = fs_.files_.begin();
+       i != fs_.files_.end(); ++i) {
+    EXPECT_NE(0, i->first.compare(0, 10, "cache/tmp/"));
+  }
+}
+
+TEST_F(ActionCacheTest, RestoreAllOrNothing) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $in\n"
+"  cache = 1\n"
+"build out1 out2: cc in\n"));
+  Edge* edge = GetNode("out1")->in_edge();
+  fs_.Create("in", "int main() {}");
+  cache_.Start(edge);
+  fs_.Create("out1", "object");
+  fs_.Create("out2", "listing");
+  cache_.Store(edge, vector<Node*>(), "");
+
+  // Lose the second output of the entry.
+  string missing;
+  for (VirtualFileSystem::FileMap::iterator i = fs_.files_.begin();
+       i != fs_.files_.end(); ++i) {
+    if (i->first.size() > 2 &&
+        i->first.compare(i->first.size() - 2, 2, "/1") == 0) {
+      missing = i->first;
+    }
+  }
+  ASSERT_NE("", missing);
+  fs_.RemoveFile(missing);
+  fs_.Create("out1", "old object");
+
+  string output;
+  EXPECT_FALSE(cache_.Restore(edge, &output));
+  EXPECT_EQ("old object", fs_.files_["out1"].contents);
+  EXPECT_EQ(0u, fs_.files_.count("out1.ninja_restore"));
+}
+
+TEST_F(ActionCacheTest, Disabled) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $in\n"
+"build out: cc in\n"));
+  EXPECT_FALSE(cache_.Caches(GetNode("out")->in_edge()));
+  dir_.clear();
+  EXPECT_FALSE(cache_.enabled());
+}
+
+struct ActionCacheTrimTest : public testing::Test {
+  virtual void SetUp() {
+    // These tests do real disk accesses, so create a temp dir.
+    temp_dir_.CreateAndEnter("Ninja-ActionCacheTrimTest");
+  }
+
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  /// Write |path| with |contents| and give it the mtime |when|.
+  void Write(const string& path, const string& contents, time_t when) {
+    ASSERT_TRUE(disk_.MakeDirs(path));
+    ASSERT_TRUE(disk_.WriteFile(path, contents));
+    struct utimbuf times;
+    times.actime = times.modtime = when;
+    ASSERT_EQ(0, utime(path.c_str(), &times));
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_;
+};
+
+TEST_F(ActionCacheTrimTest, Trim) {
+  Write("cache/0000000000000001/0", "0123456789", 1000);
+  Write("cache/0000000000000001/stdout", "0123456789", 1000);
+  Write("cache/0000000000000002/0", "0123456789", 3000);
+  Write("cache/0000000000000002/1", "0123456789", 3000);
+  Write("cache/0000000000000002/stdout", "", 3000);
+  Write("cache/deps/0000000000000003", "in", 2000);
+  Write("cache/deps/0000000000000004", "in", 4000);
+
+  string err;
+  EXPECT_TRUE(ActionCache::Trim("cache", 20, &disk_, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(0, disk_.Stat("cache/0000000000000001", &err));
+  EXPECT_GT(disk_.Stat("cache/0000000000000002/1", &err), 0);
+  EXPECT_EQ(0, disk_.Stat("cache/deps/0000000000000003", &err));
+  EXPECT_GT(disk_.Stat("cache/deps/0000000000000004", &err), 0);
+
+  EXPECT_TRUE(ActionCache::Trim("cache", 0, &disk_, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(0, disk_.Stat("cache/0000000000000002", &err));
+  EXPECT_EQ(0, disk_.Stat("cache/deps/0000000000000004", &err));
+}
+
+}  // anonymous namespace
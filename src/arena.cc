@@ -0,0 +1,54 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "arena.h"
+
+#include <stdlib.h>
+
+#include "util.h"
+
+Arena::Arena() : ptr_(NULL), left_(0), used_(0), reserved_(0) {}
+
+Arena::~Arena() {
+  for (vector<char*>::iterator i = blocks_.begin(); i != blocks_.end(); ++i)
+    free(*i);
+}
+
+void* Arena::AllocSlow(size_t size) {
+  // Big allocations get a block of their own, so that the rest of the
+  // current block isn't wasted.
+  size_t block_size = size > kBlockSize / 4 ? size : (size_t)kBlockSize;
+  char* block = static_cast<char*>(malloc(block_size));
+  if (!block)
+    Fatal("out of memory allocating %u bytes", (unsigned)block_size);
+  blocks_.push_back(block);
+  reserved_ += block_size;
+  used_ += size;
+  if (block_size == size)
+    return block;
+  ptr_ = block + size;
+  left_ = block_size - size;
+  return block;
+}
+
+void Arena::Absorb(Arena* other) {
+  blocks_.insert(blocks_.end(), other->blocks_.begin(), other->blocks_.end());
+  used_ += other->used_;
+  reserved_ += other->reserved_;
+  other->blocks_.clear();
+  other->ptr_ = NULL;
+  other->left_ = 0;
+  other->used_ = 0;
+  other->reserved_ = 0;
+}
@@ -0,0 +1,68 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_ARENA_H_
+#define NINJA_ARENA_H_
+
+#include <stddef.h>
+
+#include <vector>
+using namespace std;
+
+/// A bump allocator: memory is handed out from large blocks and only
+/// released, all at once, when the Arena is destroyed.  The Arena never
+/// runs destructors; owners of objects that hold other resources must
+/// destroy them explicitly.
+struct Arena {
+  Arena();
+  ~Arena();
+
+  /// Return |size| bytes of memory, suitably aligned for any object the
+  /// build graph uses.
+  void* Alloc(size_t size) {
+    size = (size + kAlignment - 1) & ~(kAlignment - 1);
+    if (size > left_)
+      return AllocSlow(size);
+    void* result = ptr_;
+    ptr_ += size;
+    left_ -= size;
+    used_ += size;
+    return result;
+  }
+
+  /// Take over all blocks of |other|, which is left empty.  Memory
+  /// allocated from |other| stays valid for the lifetime of this Arena.
+  void Absorb(Arena* other);
+
+  /// Bytes handed out by Alloc().
+  size_t bytes_used() const { return used_; }
+  /// Bytes allocated from the system.
+  size_t bytes_reserved() const { return reserved_; }
+
+ private:
+  enum { kAlignment = 8, kBlockSize = 64 * 1024 };
+
+  void* AllocSlow(size_t size);
+
+  vector<char*> blocks_;
+  char* ptr_;
+  size_t left_;
+  size_t used_;
+  size_t reserved_;
+
+  Arena(const Arena&);
+  void operator=(const Arena&);
+};
+
+#endif  // NINJA_ARENA_H_
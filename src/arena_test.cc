@@ -0,0 +1,58 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "arena.h"
+
+#include <string.h>
+
+#include "test.h"
+
+TEST(Arena, Alloc) {
+  Arena arena;
+  EXPECT_EQ(0u, arena.bytes_used());
+  EXPECT_EQ(0u, arena.bytes_reserved());
+
+  char* a = static_cast<char*>(arena.Alloc(3));
+  char* b = static_cast<char*>(arena.Alloc(8));
+  EXPECT_EQ(0u, (size_t)a % 8);
+  EXPECT_EQ(a + 8, b);
+  EXPECT_EQ(16u, arena.bytes_used());
+
+  // Big allocations get their own block and don't disturb the current one.
+  char* big = static_cast<char*>(arena.Alloc(100000));
+  memset(big, 'x', 100000);
+  char* c = static_cast<char*>(arena.Alloc(8));
+  EXPECT_EQ(b + 8, c);
+  EXPECT_EQ(100024u, arena.bytes_used());
+}
+
+TEST(Arena, Absorb) {
+  Arena arena;
+  Arena other;
+  char* a = static_cast<char*>(other.Alloc(16));
+  strcpy(a, "hello");
+  size_t reserved = other.bytes_reserved();
+
+  arena.Alloc(8);
+  arena.Absorb(&other);
+  EXPECT_EQ(0u, other.bytes_used());
+  EXPECT_EQ(0u, other.bytes_reserved());
+  EXPECT_EQ(24u, arena.bytes_used());
+  EXPECT_EQ(2 * reserved, arena.bytes_reserved());
+  EXPECT_EQ(string("hello"), a);
+
+  // |other| is still usable.
+  other.Alloc(8);
+  EXPECT_EQ(8u, other.bytes_used());
+}
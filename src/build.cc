@@ -18,11 +18,14 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
 #include <functional>
 
 #ifdef _WIN32
 #include <fcntl.h>
 #include <io.h>
+#else
+#include "remote_exec.h"
 #endif
 
 #if defined(__SVR4) && defined(__sun)
@@ -36,6 +39,7 @@
 #include "deps_log.h"
 #include "disk_interface.h"
 #include "graph.h"
+#include "jobserver.h"
 #include "state.h"
 #include "subprocess.h"
 #include "util.h"
@@ -74,6 +78,18 @@ bool DryRunCommandRunner::WaitForCommand(Result* result) {
    return true;
 }
 
+/// Whether all edges that use |node| have content_hash, so that they stay
+/// clean once its contents are found unchanged, even though its mtime is
+/// newer than their outputs.
+bool DependentsHashContent(Node* node) {
+  for (vector<Edge*>::const_iterator e = node->out_edges().begin();
+       e != node->out_edges().end(); ++e) {
+    if (!(*e)->GetBindingBool("content_hash"))
+      return false;
+  }
+  return true;
+}
+
 }  // namespace
 
 BuildStatus::BuildStatus(const BuildConfig& config)
@@ -287,16 +303,26 @@ void BuildStatus::PrintStatus(Edge* edge, EdgeStatus status) {
                  force_full_command ? LinePrinter::FULL : LinePrinter::ELIDE);
 }
 
-Plan::Plan() : command_edges_(0), wanted_edges_(0) {}
+Plan::Plan(BuildLog* build_log)
+    : command_edges_(0), wanted_edges_(0), build_log_(build_log),
+      prepared_(true), memory_budget_(0), memory_used_(0) {}
 
 void Plan::Reset() {
   command_edges_ = 0;
   wanted_edges_ = 0;
   ready_.clear();
   want_.clear();
+  pending_inputs_.clear();
+  dirty_inputs_.clear();
+  edges_.clear();
+  memory_.clear();
+  batch_keys_.clear();
+  prepared_ = true;
+  memory_used_ = 0;
 }
 
 bool Plan::AddTarget(Node* node, string* err) {
+  prepared_ = false;
   return AddSubTarget(node, NULL, err);
 }
 
@@ -316,24 +342,23 @@ bool Plan::AddSubTarget(Node* node, Node* dependent, string* err) {
   if (edge->outputs_ready())
     return false;  // Don't need to do anything.
 
-  // If an entry in want_ does not already exist for edge, create an entry which
-  // maps to kWantNothing, indicating that we do not want to build this entry itself.
-  pair<map<Edge*, Want>::iterator, bool> want_ins =
-    want_.insert(make_pair(edge, kWantNothing));
-  Want& want = want_ins.first->second;
+  // If the edge isn't in the plan yet, add it with kWantNothing, indicating
+  // that we do not want to build this entry itself.
+  bool planned = GetWant(edge) != kNotPlanned;
+  if (!planned)
+    PlanEdge(edge);
+  Want& want = want_[edge->id_];
 
   // If we do need to build edge and we haven't already marked it as wanted,
   // mark it now.
   if (node->dirty() && want == kWantNothing) {
     want = kWantToStart;
     ++wanted_edges_;
-    if (edge->AllInputsReady())
-      ScheduleWork(want_ins.first);
     if (!edge->is_phony())
       ++command_edges_;
   }
 
-  if (!want_ins.second)
+  if (planned)
     return true;  // We've already processed the inputs.
 
   for (vector<Node*>::iterator i = edge->inputs_.begin();
@@ -345,45 +370,262 @@ bool Plan::AddSubTarget(Node* node, Node* dependent, string* err) {
   return true;
 }
 
+void Plan::PlanEdge(Edge* edge) {
+  if (edge->id_ >= want_.size()) {
+    want_.resize(edge->id_ + 1, kNotPlanned);
+    pending_inputs_.resize(edge->id_ + 1);
+    dirty_inputs_.resize(edge->id_ + 1);
+    memory_.resize(edge->id_ + 1, -1);
+  }
+  want_[edge->id_] = kWantNothing;
+  int pending = 0;
+  int dirty = 0;
+  for (vector<Node*>::iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end(); ++i) {
+    if ((*i)->in_edge() && !(*i)->in_edge()->outputs_ready())
+      ++pending;
+    if ((*i)->dirty())
+      ++dirty;
+  }
+  pending_inputs_[edge->id_] = pending;
+  dirty_inputs_[edge->id_] = dirty;
+  edges_.push_back(edge);
+}
+
 Edge* Plan::FindWork() {
-  if (ready_.empty())
-    return NULL;
-  set<Edge*>::iterator e = ready_.begin();
-  Edge* edge = *e;
-  ready_.erase(e);
+  if (!prepared_)
+    PrepareQueue();
+  if (memory_budget_ <= 0) {
+    if (ready_.empty())
+      return NULL;
+    Edge* edge = ready_.top();
+    ready_.pop();
+    return edge;
+  }
+
+  Edge* edge = NULL;
+  vector<Edge*> skipped;
+  while (!ready_.empty()) {
+    Edge* next = ready_.top();
+    ready_.pop();
+    int64_t memory = GetMemory(next);
+    if (memory_used_ > 0 && memory > memory_budget_ - memory_used_) {
+      skipped.push_back(next);
+      continue;
+    }
+    memory_used_ += memory;
+    edge = next;
+    break;
+  }
+  for (vector<Edge*>::iterator e = skipped.begin(); e != skipped.end(); ++e)
+    ready_.push(*e);
   return edge;
 }
 
-void Plan::ScheduleWork(map<Edge*, Want>::iterator want_e) {
-  if (want_e->second == kWantToFinish) {
+void Plan::FindBatch(Edge* edge, vector<Edge*>* batch) {
+  batch->assign(1, edge);
+  int limit = atoi(edge->GetBinding("batch").c_str());
+  if (limit < 2 || !edge->GetUnescapedRspfile().empty() ||
+      edge->GetBinding("deps") == "msvc" || edge->GetBindingBool("cache")) {
+    return;
+  }
+
+  const string& key = GetBatchKey(edge);
+  vector<Edge*> others;
+  const vector<Edge*>& ready = ready_.edges();
+  for (vector<Edge*>::const_iterator e = ready.begin(); e != ready.end();
+       ++e) {
+    if ((*e)->rule_ == edge->rule_ && (*e)->pool() == edge->pool() &&
+        GetBatchKey(*e) == key) {
+      others.push_back(*e);
+    }
+  }
+  sort(others.begin(), others.end(), EdgePriorityGreater());
+  // The edges of a batch log the peak RSS of its command, so the batch
+  // takes the memory of its largest edge.  Each edge holds what it added,
+  // for EdgeFinished() to give back.
+  int64_t batch_memory = memory_budget_ > 0 ? GetMemory(edge) : 0;
+  for (vector<Edge*>::iterator e = others.begin();
+       e != others.end() && (int)batch->size() < limit; ++e) {
+    if (memory_budget_ > 0) {
+      int64_t memory = max(GetMemory(*e) - batch_memory, (int64_t)0);
+      if (memory > memory_budget_ - memory_used_)
+        continue;
+      memory_used_ += memory;
+      batch_memory += memory;
+      memory_[(*e)->id_] = memory;
+    }
+    batch->push_back(*e);
+  }
+
+  others.assign(batch->begin() + 1, batch->end());
+  sort(others.begin(), others.end());
+  ready_.Remove(others);
+}
+
+const string& Plan::GetBatchKey(Edge* edge) {
+  map<Edge*, string>::iterator i = batch_keys_.find(edge);
+  if (i == batch_keys_.end()) {
+    i = batch_keys_.insert(make_pair(
+        edge, edge->EvaluateBatchCommand(vector<Edge*>()))).first;
+  }
+  return i->second;
+}
+
+int64_t Plan::GetMemory(Edge* edge) {
+  int64_t& memory = memory_[edge->id_];
+  if (memory >= 0)
+    return memory;
+  memory = 0;
+  BuildLog::LogEntry* entry = NULL;
+  if (build_log_)
+    entry = build_log_->LookupByOutput(edge->outputs_[0]->path());
+  if (entry && entry->peak_rss > 0)
+    memory = entry->peak_rss;
+  else
+    ParseMemorySize(edge->GetBinding("memory"), &memory);
+  return memory;
+}
+
+void Plan::PrepareQueue() {
+  prepared_ = true;
+  ComputeCriticalPath();
+
+  // Delay edges in full pools first and retrieve them at the end, so that
+  // each pool hands out its highest priority edges.
+  set<Pool*> pools;
+  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e) {
+    Edge* edge = *e;
+    if (want_[edge->id_] != kWantToStart || pending_inputs_[edge->id_])
+      continue;
+    Pool* pool = edge->pool();
+    if (pool->ShouldDelayEdge()) {
+      want_[edge->id_] = kWantToFinish;
+      pool->DelayEdge(edge);
+      pools.insert(pool);
+    } else {
+      ScheduleWork(edge);
+    }
+  }
+  for (set<Pool*>::iterator p = pools.begin(); p != pools.end(); ++p)
+    (*p)->RetrieveReadyEdges(&ready_);
+}
+
+void Plan::ComputeCriticalPath() {
+  METRIC_RECORD("critical path");
+
+  // Take the duration of each edge that will run from the build log.  For
+  // edges that aren't in the log, guess the average of the logged edges of
+  // the same rule, or of all logged edges.
+  vector<int64_t> durations(want_.size());
+  vector<Edge*> unlogged;
+  map<const Rule*, pair<int64_t, int> > rule_totals;
+  int64_t total = 0;
+  int logged = 0;
+  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e) {
+    Edge* edge = *e;
+    Want want = want_[edge->id_];
+    if (want == kNotPlanned || want == kWantNothing || edge->is_phony())
+      continue;
+    BuildLog::LogEntry* entry = NULL;
+    if (build_log_)
+      entry = build_log_->LookupByOutput(edge->outputs_[0]->path());
+    if (!entry) {
+      unlogged.push_back(edge);
+      continue;
+    }
+    int64_t duration = max(entry->end_time - entry->start_time, 1);
+    durations[edge->id_] = duration;
+    pair<int64_t, int>& rule_total = rule_totals[&edge->rule()];
+    rule_total.first += duration;
+    ++rule_total.second;
+    total += duration;
+    ++logged;
+  }
+  for (vector<Edge*>::iterator e = unlogged.begin(); e != unlogged.end();
+       ++e) {
+    map<const Rule*, pair<int64_t, int> >::iterator rule_total =
+        rule_totals.find(&(*e)->rule());
+    if (rule_total != rule_totals.end())
+      durations[(*e)->id_] = rule_total->second.first /
+          rule_total->second.second;
+    else
+      durations[(*e)->id_] = logged ? total / logged : 1;
+  }
+
+  // Count the planned edges that depend on each edge.
+  vector<int> dependents(want_.size());
+  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e) {
+    if (want_[(*e)->id_] == kNotPlanned)
+      continue;
+    for (vector<Node*>::iterator i = (*e)->inputs_.begin();
+         i != (*e)->inputs_.end(); ++i) {
+      Edge* in_edge = (*i)->in_edge();
+      if (in_edge && GetWant(in_edge) != kNotPlanned)
+        ++dependents[in_edge->id_];
+    }
+  }
+
+  // Going from the targets down, each edge's weight is final once all its
+  // dependents have passed theirs on.
+  vector<int64_t> weights(durations);
+  vector<Edge*> stack;
+  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e) {
+    if (want_[(*e)->id_] != kNotPlanned && !dependents[(*e)->id_])
+      stack.push_back(*e);
+  }
+  while (!stack.empty()) {
+    Edge* edge = stack.back();
+    stack.pop_back();
+    int64_t weight = weights[edge->id_];
+    for (vector<Node*>::iterator i = edge->inputs_.begin();
+         i != edge->inputs_.end(); ++i) {
+      Edge* in_edge = (*i)->in_edge();
+      if (!in_edge || GetWant(in_edge) == kNotPlanned)
+        continue;
+      int64_t& in_weight = weights[in_edge->id_];
+      in_weight = max(in_weight, durations[in_edge->id_] + weight);
+      if (--dependents[in_edge->id_] == 0)
+        stack.push_back(in_edge);
+    }
+    // The weights of queued edges are their keys in the queues.
+    if (want_[edge->id_] != kWantToFinish)
+      edge->set_critical_path_weight(weight);
+  }
+}
+
+void Plan::ScheduleWork(Edge* edge) {
+  Want& want = want_[edge->id_];
+  if (want == kWantToFinish) {
     // This edge has already been scheduled.  We can get here again if an edge
     // and one of its dependencies share an order-only input, or if a node
     // duplicates an out edge (see https://github.com/ninja-build/ninja/pull/519).
     // Avoid scheduling the work again.
     return;
   }
-  assert(want_e->second == kWantToStart);
-  want_e->second = kWantToFinish;
+  assert(want == kWantToStart);
+  want = kWantToFinish;
 
-  Edge* edge = want_e->first;
   Pool* pool = edge->pool();
   if (pool->ShouldDelayEdge()) {
     pool->DelayEdge(edge);
     pool->RetrieveReadyEdges(&ready_);
   } else {
     pool->EdgeScheduled(*edge);
-    ready_.insert(edge);
+    ready_.push(edge);
   }
 }
 
 void Plan::EdgeFinished(Edge* edge, EdgeResult result) {
-  map<Edge*, Want>::iterator e = want_.find(edge);
-  assert(e != want_.end());
-  bool directly_wanted = e->second != kWantNothing;
+  Want want = GetWant(edge);
+  assert(want != kNotPlanned);
+  bool directly_wanted = want != kWantNothing;
 
   // See if this job frees up any delayed jobs.
   if (directly_wanted)
     edge->pool()->EdgeFinished(*edge);
+  if (directly_wanted && memory_budget_ > 0)
+    memory_used_ -= GetMemory(edge);
   edge->pool()->RetrieveReadyEdges(&ready_);
 
   // The rest of this function only applies to successful commands.
@@ -392,7 +634,7 @@ void Plan::EdgeFinished(Edge* edge, EdgeResult result) {
 
   if (directly_wanted)
     --wanted_edges_;
-  want_.erase(e);
+  want_[edge->id_] = kNotPlanned;
   edge->outputs_ready_ = true;
 
   // Check off any nodes we were waiting for with this edge.
@@ -406,14 +648,14 @@ void Plan::NodeFinished(Node* node) {
   // See if we we want any edges from this node.
   for (vector<Edge*>::const_iterator oe = node->out_edges().begin();
        oe != node->out_edges().end(); ++oe) {
-    map<Edge*, Want>::iterator want_e = want_.find(*oe);
-    if (want_e == want_.end())
+    Want want = GetWant(*oe);
+    if (want == kNotPlanned)
       continue;
 
     // See if the edge is now ready.
-    if ((*oe)->AllInputsReady()) {
-      if (want_e->second != kWantNothing) {
-        ScheduleWork(want_e);
+    if (--pending_inputs_[(*oe)->id_] == 0) {
+      if (want != kWantNothing) {
+        ScheduleWork(*oe);
       } else {
         // We do not need to build this edge, but we might need to build one of
         // its dependents.
@@ -424,13 +666,19 @@ void Plan::NodeFinished(Node* node) {
 }
 
 bool Plan::CleanNode(DependencyScan* scan, Node* node, string* err) {
+  bool was_dirty = node->dirty();
   node->set_dirty(false);
 
   for (vector<Edge*>::const_iterator oe = node->out_edges().begin();
        oe != node->out_edges().end(); ++oe) {
+    Want want = GetWant(*oe);
+    if (want == kNotPlanned)
+      continue;
+    if (was_dirty)
+      --dirty_inputs_[(*oe)->id_];
+
     // Don't process edges that we don't actually want.
-    map<Edge*, Want>::iterator want_e = want_.find(*oe);
-    if (want_e == want_.end() || want_e->second == kWantNothing)
+    if (want == kWantNothing)
       continue;
 
     // Don't attempt to clean an edge if it failed to load deps.
@@ -438,16 +686,21 @@ bool Plan::CleanNode(DependencyScan* scan, Node* node, string* err) {
       continue;
 
     // If all non-order-only inputs for this edge are now clean,
-    // we might have changed the dirty state of the outputs.
+    // we might have changed the dirty state of the outputs.  Only the
+    // order-only inputs can be among the remaining dirty ones.
     vector<Node*>::iterator
         begin = (*oe)->inputs_.begin(),
         end = (*oe)->inputs_.end() - (*oe)->order_only_deps_;
+    int dirty_inputs = dirty_inputs_[(*oe)->id_];
+    if (dirty_inputs > (*oe)->order_only_deps_)
+      continue;
 #if __cplusplus < 201703L
 #define MEM_FN mem_fun
 #else
 #define MEM_FN mem_fn  // mem_fun was removed in C++17.
 #endif
-    if (find_if(begin, end, MEM_FN(&Node::dirty)) == end) {
+    if (dirty_inputs == 0 ||
+        find_if(begin, end, MEM_FN(&Node::dirty)) == end) {
       // Recompute most_recent_input.
       Node* most_recent_input = NULL;
       for (vector<Node*>::iterator i = begin; i != end; ++i) {
@@ -470,7 +723,7 @@ bool Plan::CleanNode(DependencyScan* scan, Node* node, string* err) {
             return false;
         }
 
-        want_e->second = kWantNothing;
+        want_[(*oe)->id_] = kWantNothing;
         --wanted_edges_;
         if (!(*oe)->is_phony())
           --command_edges_;
@@ -481,27 +734,47 @@ bool Plan::CleanNode(DependencyScan* scan, Node* node, string* err) {
 }
 
 void Plan::Dump() {
-  printf("pending: %d\n", (int)want_.size());
-  for (map<Edge*, Want>::iterator e = want_.begin(); e != want_.end(); ++e) {
-    if (e->second != kWantNothing)
+  int pending = 0;
+  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e)
+    pending += want_[(*e)->id_] != kNotPlanned;
+  printf("pending: %d\n", pending);
+  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e) {
+    Want want = want_[(*e)->id_];
+    if (want == kNotPlanned)
+      continue;
+    if (want != kWantNothing)
       printf("want ");
-    e->first->Dump();
+    (*e)->Dump();
   }
   printf("ready: %d\n", (int)ready_.size());
 }
 
 struct RealCommandRunner : public CommandRunner {
-  explicit RealCommandRunner(const BuildConfig& config) : config_(config) {}
-  virtual ~RealCommandRunner() {}
+  explicit RealCommandRunner(const BuildConfig& config)
+      : config_(config), subprocs_(config.async_spawn), tokens_(0) {}
+  virtual ~RealCommandRunner() { ReleaseTokens(0); }
   virtual bool CanRunMore();
   virtual bool StartCommand(Edge* edge);
+  virtual bool StartBatch(Edge* edge, const string& command);
   virtual bool WaitForCommand(Result* result);
+  virtual bool HasFinishedCommand() { return !subprocs_.finished_.empty(); }
   virtual vector<Edge*> GetActiveEdges();
   virtual void Abort();
 
+  /// Fill in |result| for |subproc|, which finished, and delete it.
+  void TakeResult(Subprocess* subproc, Result* result);
+
+  /// Return jobserver tokens until at most |keep| are held.
+  void ReleaseTokens(size_t keep);
+  /// Return the jobserver tokens that no running command needs.
+  void ReleaseSpareTokens();
+
   const BuildConfig& config_;
   SubprocessSet subprocs_;
   map<Subprocess*, Edge*> subproc_to_edge_;
+  /// The number of jobserver tokens held.  The first command runs without
+  /// one, as with make.
+  size_t tokens_;
 };
 
 vector<Edge*> RealCommandRunner::GetActiveEdges() {
@@ -514,19 +787,47 @@ vector<Edge*> RealCommandRunner::GetActiveEdges() {
 
 void RealCommandRunner::Abort() {
   subprocs_.Clear();
+  ReleaseTokens(0);
+}
+
+void RealCommandRunner::ReleaseTokens(size_t keep) {
+  for (; tokens_ > keep; --tokens_)
+    config_.jobserver->Release();
+}
+
+void RealCommandRunner::ReleaseSpareTokens() {
+  size_t subproc_number =
+      subprocs_.running_.size() + subprocs_.finished_.size();
+  ReleaseTokens(subproc_number > 0 ? subproc_number - 1 : 0);
 }
 
 bool RealCommandRunner::CanRunMore() {
   size_t subproc_number =
       subprocs_.running_.size() + subprocs_.finished_.size();
-  return (int)subproc_number < config_.parallelism
-    && ((subprocs_.running_.empty() || config_.max_load_average <= 0.0f)
-        || GetLoadAverage() < config_.max_load_average);
+  if (!((int)subproc_number < config_.parallelism
+        && ((subprocs_.running_.empty() || config_.max_load_average <= 0.0f)
+            || GetLoadAverage() < config_.max_load_average))) {
+    return false;
+  }
+  // The token is kept if the plan has no command to start now; it is
+  // returned when waiting for a command instead.
+  if (config_.jobserver && subproc_number > tokens_) {
+    if (!config_.jobserver->Acquire())
+      return false;
+    ++tokens_;
+  }
+  return true;
 }
 
 bool RealCommandRunner::StartCommand(Edge* edge) {
-  string command = edge->EvaluateCommand();
-  Subprocess* subproc = subprocs_.Add(command, edge->use_console());
+  return StartBatch(edge, edge->EvaluateCommand());
+}
+
+bool RealCommandRunner::StartBatch(Edge* edge, const string& command) {
+  string direct_exec = edge->GetBinding("direct_exec");
+  ExecMode exec = direct_exec == "0" ? kExecShell :
+      direct_exec == "1" ? kExecDirect : kExecAuto;
+  Subprocess* subproc = subprocs_.Add(command, edge->use_console(), exec);
   if (!subproc)
     return false;
   subproc_to_edge_.insert(make_pair(subproc, edge));
@@ -535,41 +836,299 @@ bool RealCommandRunner::StartCommand(Edge* edge) {
 }
 
 bool RealCommandRunner::WaitForCommand(Result* result) {
+  ReleaseSpareTokens();
   Subprocess* subproc;
   while ((subproc = subprocs_.NextFinished()) == NULL) {
     bool interrupted = subprocs_.DoWork();
     if (interrupted)
       return false;
   }
+  TakeResult(subproc, result);
+  return true;
+}
 
+void RealCommandRunner::TakeResult(Subprocess* subproc, Result* result) {
   result->status = subproc->Finish();
   result->output = subproc->GetOutput();
+  result->peak_rss = subproc->peak_rss();
 
   map<Subprocess*, Edge*>::iterator e = subproc_to_edge_.find(subproc);
   result->edge = e->second;
   subproc_to_edge_.erase(e);
 
   delete subproc;
+  ReleaseSpareTokens();
+}
+
+#ifndef _WIN32
+/// A CommandRunner that sends the commands of edges with remote = 1 to the
+/// worker at BuildConfig::remote, and runs the others here, as
+/// RealCommandRunner does, along with those of a worker that went away.
+struct RemoteCommandRunner : public RealCommandRunner {
+  RemoteCommandRunner(const BuildConfig& config, DependencyScan* scan,
+                      DiskInterface* disk_interface);
+  virtual bool CanRunMore();
+  virtual bool StartCommand(Edge* edge);
+  virtual bool WaitForCommand(Result* result);
+  virtual bool HasFinishedCommand() {
+    return !results_.empty() || RealCommandRunner::HasFinishedCommand();
+  }
+  virtual vector<Edge*> GetActiveEdges();
+  virtual void Abort();
+
+  /// Fill in |request| for |edge|, unless its command runs here.
+  bool MakeRequest(Edge* edge, RemoteRequest* request);
+  /// Write the outputs of |remote|, the result of |result->edge|.
+  void WriteOutputs(const RemoteResult& remote, Result* result);
+  /// Run the commands that the worker had here, once it went away.
+  void Disconnect();
+
+  DependencyScan* scan_;
+  DiskInterface* disk_interface_;
+  RemoteClient client_;
+  uint32_t next_id_;
+  /// The edges of the requests that weren't reported yet, by id.
+  map<uint32_t, Edge*> requests_;
+  /// The results that weren't reported yet.
+  vector<RemoteResult> results_;
+};
+
+RemoteCommandRunner::RemoteCommandRunner(const BuildConfig& config,
+                                         DependencyScan* scan,
+                                         DiskInterface* disk_interface)
+    : RealCommandRunner(config), scan_(scan),
+      disk_interface_(disk_interface), client_(disk_interface),
+      next_id_(1) {
+  string err;
+  if (client_.Connect(config.remote, &err))
+    subprocs_.WatchFd(client_.fd());
+  else
+    Warning("remote worker: %s; running commands here", err.c_str());
+}
+
+bool RemoteCommandRunner::CanRunMore() {
+  size_t running = subprocs_.running_.size() + subprocs_.finished_.size() +
+      requests_.size();
+  return (int)running < config_.parallelism &&
+      RealCommandRunner::CanRunMore();
+}
+
+bool RemoteCommandRunner::MakeRequest(Edge* edge, RemoteRequest* request) {
+  if (!edge->GetBindingBool("remote") || edge->use_console())
+    return false;
+  // The command may read more than the edge names until the dependencies
+  // of its last run are known.
+  string depfile = edge->GetUnescapedDepfile();
+  if (edge->deps_missing_ &&
+      (!depfile.empty() || !edge->GetBinding("deps").empty())) {
+    return false;
+  }
+
+  vector<string> paths;
+  for (vector<Node*>::iterator o = edge->outputs_.begin();
+       o != edge->outputs_.end(); ++o) {
+    request->outputs.push_back((*o)->path());
+  }
+  if (!depfile.empty())
+    request->outputs.push_back(depfile);
+  for (vector<string>::iterator o = request->outputs.begin();
+       o != request->outputs.end(); ++o) {
+    if ((*o)[0] == '/')
+      return false;
+    paths.push_back(*o);
+  }
+
+  for (vector<Node*>::iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end() - edge->order_only_deps_; ++i) {
+    // The worker has the files outside of the build, like system headers.
+    const string& path = (*i)->path();
+    if (path[0] == '/')
+      continue;
+    RemoteInput input;
+    input.path = path;
+    input.hash = scan_->HashContent(*i);
+    if (!input.hash)
+      return false;
+    input.executable = IsExecutable(path);
+    request->inputs.push_back(input);
+    paths.push_back(path);
+  }
+  string rspfile = edge->GetUnescapedRspfile();
+  if (!rspfile.empty()) {
+    string content, err;
+    if (disk_interface_->ReadFile(rspfile, &content, &err) !=
+        DiskInterface::Okay) {
+      return false;
+    }
+    RemoteInput input;
+    input.path = rspfile;
+    input.hash = HashInput(content);
+    request->inputs.push_back(input);
+    paths.push_back(rspfile);
+  }
+
+  for (vector<string>::iterator p = paths.begin(); p != paths.end(); ++p) {
+    uint32_t depth = 0;
+    while (p->compare(3 * depth, 3, "../") == 0)
+      ++depth;
+    request->depth = max(request->depth, depth);
+  }
+  request->command = edge->EvaluateCommand();
   return true;
 }
 
+bool RemoteCommandRunner::StartCommand(Edge* edge) {
+  RemoteRequest request;
+  if (client_.fd() < 0 || !MakeRequest(edge, &request))
+    return RealCommandRunner::StartCommand(edge);
+  request.id = next_id_++;
+  requests_[request.id] = edge;
+  if (!client_.Send(request))
+    Disconnect();
+  return true;
+}
+
+void RemoteCommandRunner::WriteOutputs(const RemoteResult& remote,
+                                       Result* result) {
+  result->status = remote.status;
+  result->output = remote.output;
+  bool restat = result->edge->GetBindingBool("restat");
+  for (vector<RemoteFile>::const_iterator f = remote.outputs.begin();
+       f != remote.outputs.end(); ++f) {
+    // An output that a restat rule's command left alone keeps its mtime.
+    string content, err;
+    if (restat &&
+        disk_interface_->ReadFile(f->path, &content, &err) ==
+            DiskInterface::Okay &&
+        content == f->content) {
+      continue;
+    }
+    if (!disk_interface_->WriteFile(f->path, f->content)) {
+      result->status = ExitFailure;
+      result->output += "ninja: can't write " + f->path + "\n";
+      continue;
+    }
+    if (f->executable)
+      MakeExecutable(f->path);
+  }
+}
+
+bool RemoteCommandRunner::WaitForCommand(Result* result) {
+  ReleaseSpareTokens();
+  for (;;) {
+    if (!results_.empty()) {
+      map<uint32_t, Edge*>::iterator r = requests_.find(results_[0].id);
+      result->edge = r->second;
+      requests_.erase(r);
+      WriteOutputs(results_[0], result);
+      results_.erase(results_.begin());
+      return true;
+    }
+    if (Subprocess* subproc = subprocs_.NextFinished()) {
+      TakeResult(subproc, result);
+      return true;
+    }
+    if (subprocs_.DoWork())
+      return false;
+    // Take all the results that arrived, for HasFinishedCommand().
+    if (subprocs_.watched_fd_ready()) {
+      do {
+        if (!client_.Receive(&results_)) {
+          Disconnect();
+          break;
+        }
+      } while (client_.Readable());
+    }
+  }
+}
+
+vector<Edge*> RemoteCommandRunner::GetActiveEdges() {
+  vector<Edge*> edges = RealCommandRunner::GetActiveEdges();
+  for (map<uint32_t, Edge*>::iterator r = requests_.begin();
+       r != requests_.end(); ++r) {
+    edges.push_back(r->second);
+  }
+  return edges;
+}
+
+void RemoteCommandRunner::Abort() {
+  RealCommandRunner::Abort();
+  client_.Close();
+  requests_.clear();
+  results_.clear();
+}
+
+void RemoteCommandRunner::Disconnect() {
+  Warning("remote worker went away; running its commands here");
+  subprocs_.WatchFd(-1);
+  client_.Close();
+  set<uint32_t> done;
+  for (vector<RemoteResult>::iterator r = results_.begin();
+       r != results_.end(); ++r) {
+    done.insert(r->id);
+  }
+  for (map<uint32_t, Edge*>::iterator r = requests_.begin();
+       r != requests_.end(); ) {
+    if (done.count(r->first)) {
+      ++r;
+    } else if (RealCommandRunner::StartCommand(r->second)) {
+      requests_.erase(r++);
+    } else {
+      RemoteResult failure;
+      failure.id = r->first;
+      failure.output = "ninja: can't start the command\n";
+      results_.push_back(failure);
+      ++r;
+    }
+  }
+}
+#endif  // !_WIN32
+
 Builder::Builder(State* state, const BuildConfig& config,
                  BuildLog* build_log, DepsLog* deps_log,
                  DiskInterface* disk_interface)
-    : state_(state), config_(config), disk_interface_(disk_interface),
+    : state_(state), config_(config), plan_(build_log),
+      disk_interface_(disk_interface),
       scan_(state, build_log, deps_log, disk_interface,
-            &config_.depfile_parser_options) {
+            &config_.depfile_parser_options),
+      action_cache_(config_.cache_dir, state, disk_interface),
+      deps_pool_(NULL) {
+  plan_.set_memory_budget(config.memory_budget);
   status_ = new BuildStatus(config);
 }
 
 Builder::~Builder() {
   Cleanup();
+  delete deps_pool_;
 }
 
 void Builder::Cleanup() {
+  // The commands that finished before the build stopped have updated their
+  // outputs; finish them, so that the logs record them.  Log and ignore
+  // their errors, as the build has failed already.
+  int failures_allowed = 0;
+  string err;
+  while (!completions_.empty()) {
+    if (!FinishCompletion(&failures_allowed, &err))
+      Error("%s", err.c_str());
+  }
+  while (!ready_results_.empty()) {
+    CommandRunner::Result result = ready_results_.front();
+    ready_results_.pop_front();
+    if (!FinishCommand(&result, &err))
+      Error("%s", err.c_str());
+  }
+
   if (command_runner_.get()) {
     vector<Edge*> active_edges = command_runner_->GetActiveEdges();
     command_runner_->Abort();
+    for (size_t i = 0, count = active_edges.size(); i < count; ++i) {
+      map<Edge*, vector<Edge*> >::iterator b = batches_.find(active_edges[i]);
+      if (b != batches_.end()) {
+        active_edges.insert(active_edges.end(), b->second.begin() + 1,
+                            b->second.end());
+      }
+    }
 
     for (vector<Edge*>::iterator e = active_edges.begin();
          e != active_edges.end(); ++e) {
@@ -583,7 +1142,6 @@ void Builder::Cleanup() {
         // need to rebuild an output because of a modified header file
         // mentioned in a depfile, and the command touches its depfile
         // but is interrupted before it touches its output file.)
-        string err;
         TimeStamp new_mtime = disk_interface_->Stat((*o)->path(), &err);
         if (new_mtime == -1)  // Log and ignore Stat() errors.
           Error("%s", err.c_str());
@@ -622,6 +1180,10 @@ bool Builder::AddTarget(Node* node, string* err) {
   return true;
 }
 
+void Builder::PrefetchStats(const vector<Node*>& targets) {
+  scan_.PrefetchStats(targets);
+}
+
 bool Builder::AlreadyUpToDate() const {
   return !plan_.more_to_do();
 }
@@ -637,9 +1199,16 @@ bool Builder::Build(string* err) {
   if (!command_runner_.get()) {
     if (config_.dry_run)
       command_runner_.reset(new DryRunCommandRunner);
+#ifndef _WIN32
+    else if (!config_.remote.empty())
+      command_runner_.reset(new RemoteCommandRunner(config_, &scan_,
+                                                    disk_interface_));
+#endif
     else
       command_runner_.reset(new RealCommandRunner(config_));
   }
+  if (config_.deps_threads > 1 && !deps_pool_)
+    deps_pool_ = new ThreadPool(config_.deps_threads);
 
   // We are about to start the build process.
   status_->BuildStarted();
@@ -653,7 +1222,10 @@ bool Builder::Build(string* err) {
     // See if we can start any more commands.
     if (failures_allowed && command_runner_->CanRunMore()) {
       if (Edge* edge = plan_.FindWork()) {
-        if (!StartEdge(edge, err)) {
+        vector<Edge*> batch;
+        plan_.FindBatch(edge, &batch);
+        if (batch.size() > 1 ? !StartBatch(batch, err) :
+                               !StartEdge(edge, err)) {
           Cleanup();
           status_->BuildFinished();
           return false;
@@ -670,11 +1242,33 @@ bool Builder::Build(string* err) {
       }
     }
 
+    // Finish the commands whose depfiles have been read, in the order in
+    // which they finished, so that the logs don't depend on the threads.
+    // Waiting for a depfile beats waiting for a command, unless another
+    // command has finished already.
+    if (!completions_.empty()) {
+      Completion completion = completions_.front();
+      if (!completion.reader || deps_pool_->IsDone(completion.reader) ||
+          !pending_commands ||
+          (ready_results_.empty() &&
+           !command_runner_->HasFinishedCommand())) {
+        if (!FinishCompletion(&failures_allowed, err)) {
+          Cleanup();
+          status_->BuildFinished();
+          return false;
+        }
+        continue;
+      }
+    }
+
     // See if we can reap any finished commands.
     if (pending_commands) {
       CommandRunner::Result result;
-      if (!command_runner_->WaitForCommand(&result) ||
-          result.status == ExitInterrupted) {
+      if (!ready_results_.empty()) {
+        result = ready_results_.front();
+        ready_results_.pop_front();
+      } else if (!command_runner_->WaitForCommand(&result) ||
+                 result.status == ExitInterrupted) {
         Cleanup();
         status_->BuildFinished();
         *err = "interrupted by user";
@@ -682,15 +1276,33 @@ bool Builder::Build(string* err) {
       }
 
       --pending_commands;
-      if (!FinishCommand(&result, err)) {
-        Cleanup();
-        status_->BuildFinished();
-        return false;
-      }
+      vector<CommandRunner::Result> results;
+      SplitBatch(result, &results);
+      for (vector<CommandRunner::Result>::iterator r = results.begin();
+           r != results.end(); ++r) {
+        if (deps_pool_ && r->success()) {
+          AddCompletion(*r);
+          continue;
+        }
+        // A failure stops the build before the next command starts, after
+        // the commands that finished before it.
+        while (!completions_.empty()) {
+          if (!FinishCompletion(&failures_allowed, err)) {
+            Cleanup();
+            status_->BuildFinished();
+            return false;
+          }
+        }
+        if (!FinishCommand(&*r, err)) {
+          Cleanup();
+          status_->BuildFinished();
+          return false;
+        }
 
-      if (!result.success()) {
-        if (failures_allowed)
-          failures_allowed--;
+        if (!r->success()) {
+          if (failures_allowed)
+            failures_allowed--;
+        }
       }
 
       // We made some progress; start the main loop over.
@@ -722,6 +1334,7 @@ bool Builder::StartEdge(Edge* edge, string* err) {
     return true;
 
   status_->BuildEdgeStarted(edge);
+  HashInputs(edge);
 
   // Create directories necessary for outputs.
   // XXX: this will block; do we care?
@@ -740,6 +1353,28 @@ bool Builder::StartEdge(Edge* edge, string* err) {
       return false;
   }
 
+  // Built-in commands and those whose outputs are in the action cache only
+  // pretend to run along with the others.
+  if (!config_.dry_run) {
+    CommandRunner::Result result;
+    if (RunBuiltin(edge, &result)) {
+      ready_results_.push_back(result);
+      return true;
+    }
+    string output;
+    if (action_cache_.Caches(edge)) {
+      if (action_cache_.Restore(edge, &output)) {
+        result.edge = edge;
+        result.status = ExitSuccess;
+        result.output = output;
+        ready_results_.push_back(result);
+        restored_edges_.insert(edge);
+        return true;
+      }
+      action_cache_.Start(edge);
+    }
+  }
+
   // start command computing and run it
   if (!command_runner_->StartCommand(edge)) {
     err->assign("command '" + edge->EvaluateCommand() + "' failed.");
@@ -749,11 +1384,165 @@ bool Builder::StartEdge(Edge* edge, string* err) {
   return true;
 }
 
-bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
+bool Builder::StartBatch(const vector<Edge*>& batch, string* err) {
+  METRIC_RECORD("StartEdge");
+  for (vector<Edge*>::const_iterator e = batch.begin(); e != batch.end();
+       ++e) {
+    status_->BuildEdgeStarted(*e);
+    HashInputs(*e);
+    for (vector<Node*>::iterator o = (*e)->outputs_.begin();
+         o != (*e)->outputs_.end(); ++o) {
+      if (!disk_interface_->MakeDirs((*o)->path()))
+        return false;
+    }
+  }
+
+  Edge* edge = batch[0];
+  string command = edge->EvaluateBatchCommand(batch);
+  if (!command_runner_->StartBatch(edge, command)) {
+    err->assign("command '" + command + "' failed.");
+    return false;
+  }
+  batches_[edge] = batch;
+  return true;
+}
+
+void Builder::HashInputs(Edge* edge) {
+  if (scan_.build_log() && !config_.dry_run &&
+      edge->GetBindingBool("content_hash")) {
+    inputs_hashes_[edge] = scan_.HashInputs(edge);
+  }
+}
+
+void Builder::SplitBatch(const CommandRunner::Result& result,
+                         vector<CommandRunner::Result>* results) {
+  map<Edge*, vector<Edge*> >::iterator b = batches_.find(result.edge);
+  if (b == batches_.end()) {
+    results->push_back(result);
+    return;
+  }
+  // An output that a failed command updated may still be incomplete, and
+  // the memory that the command took is what each edge needs to run.
+  const vector<Edge*>& batch = b->second;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    CommandRunner::Result edge_result;
+    edge_result.edge = batch[i];
+    edge_result.status = result.status;
+    edge_result.peak_rss = result.peak_rss;
+    results->push_back(edge_result);
+  }
+  (*results)[0].output = result.output;
+  batches_.erase(b);
+}
+
+bool Builder::RunBuiltin(Edge* edge, CommandRunner::Result* result) {
+  if (!edge->GetBindingBool("builtin"))
+    return false;
+  vector<string> args;
+  if (!SplitShellFreeCommand(edge->EvaluateCommand(), false, &args))
+    return false;
+  const string& program = args[0];
+  size_t first = 1;
+  if (program == "mkdir" && args.size() > 1 && args[1] == "-p")
+    first = 2;
+  if (args.size() <= first)
+    return false;
+  // Options are left to the real programs.
+  for (size_t i = first; i < args.size(); ++i) {
+    if (args[i][0] == '-')
+      return false;
+  }
+
+  result->edge = edge;
+  result->status = ExitSuccess;
+  string err;
+  if (program == "touch") {
+    for (size_t i = first; i < args.size(); ++i) {
+      if (!disk_interface_->Touch(args[i], &err)) {
+        result->output = "touch: " + err + "\n";
+        result->status = ExitFailure;
+        break;
+      }
+    }
+  } else if (program == "cp" && args.size() == 3) {
+    // cp copies into a directory, under the name of the file.
+    const string& to = args[2];
+    if (to[to.size() - 1] == '/' || disk_interface_->IsDir(to))
+      return false;
+    if (!disk_interface_->Copy(args[1], to, &err)) {
+      result->output = "cp: " + err + "\n";
+      result->status = ExitFailure;
+    }
+  } else if (program == "mkdir") {
+    for (size_t i = first; i < args.size(); ++i) {
+      const string& dir = args[i];
+      // mkdir -p only accepts a directory that exists already.
+      if (disk_interface_->Stat(dir, &err) > 0 &&
+          (first == 1 || !disk_interface_->IsDir(dir))) {
+        result->output = "mkdir: " + dir + ": File exists\n";
+        result->status = ExitFailure;
+        break;
+      }
+      if ((first == 2 && !disk_interface_->MakeDirs(dir)) ||
+          !disk_interface_->MakeDir(dir)) {
+        result->output = "mkdir: cannot create directory " + dir + "\n";
+        result->status = ExitFailure;
+        break;
+      }
+    }
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void Builder::AddCompletion(const CommandRunner::Result& result) {
+  Completion completion;
+  completion.result = result;
+  completion.reader = NULL;
+  string depfile = result.edge->GetUnescapedDepfile();
+  if (result.edge->GetBinding("deps") == "gcc" && !depfile.empty() &&
+      !config_.dry_run) {
+    completion.reader = new DepfileReader(depfile, disk_interface_,
+                                          config_.depfile_parser_options);
+    deps_pool_->Post(completion.reader);
+  }
+  completions_.push_back(completion);
+}
+
+bool Builder::FinishCompletion(int* failures_allowed, string* err) {
+  Completion completion = completions_.front();
+  completions_.pop_front();
+  if (completion.reader)
+    deps_pool_->Wait(completion.reader);
+  bool finished = FinishCommand(&completion.result, err, completion.reader);
+  delete completion.reader;
+  if (finished && !completion.result.success() && *failures_allowed)
+    --*failures_allowed;
+  return finished;
+}
+
+bool Builder::FinishCommand(CommandRunner::Result* result, string* err,
+                            DepfileReader* reader) {
   METRIC_RECORD("FinishCommand");
 
   Edge* edge = result->edge;
 
+  // Store the outputs of commands that ran in the action cache, with the
+  // output that ExtractDeps() may filter.
+  bool store = action_cache_.Caches(edge) && !config_.dry_run &&
+      !restored_edges_.erase(edge);
+  string raw_output;
+  if (store)
+    raw_output = result->output;
+
+  uint64_t inputs_hash = 0;
+  map<Edge*, uint64_t>::iterator hashed = inputs_hashes_.find(edge);
+  if (hashed != inputs_hashes_.end()) {
+    inputs_hash = hashed->second;
+    inputs_hashes_.erase(hashed);
+  }
+
   // First try to extract dependencies from the result, if any.
   // This must happen first as it filters the command output (we want
   // to filter /showIncludes output, even on compile failure) and
@@ -764,7 +1553,7 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
   const string deps_prefix = edge->GetBinding("msvc_deps_prefix");
   if (!deps_type.empty()) {
     string extract_err;
-    if (!ExtractDeps(result, deps_type, deps_prefix, &deps_nodes,
+    if (!ExtractDeps(result, deps_type, deps_prefix, reader, &deps_nodes,
                      &extract_err) &&
         result->success()) {
       if (!result->output.empty())
@@ -780,6 +1569,8 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
 
   // The rest of this function only applies to successful commands.
   if (!result->success()) {
+    if (store)
+      action_cache_.Forget(edge);
     plan_.EdgeFinished(edge, Plan::kEdgeFailed);
     return true;
   }
@@ -787,6 +1578,8 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
   // Restat the edge outputs
   TimeStamp output_mtime = 0;
   bool restat = edge->GetBindingBool("restat");
+  bool content_hash = inputs_hash != 0;
+  vector<uint64_t> output_hashes;
   if (!config_.dry_run) {
     bool node_cleaned = false;
 
@@ -797,7 +1590,17 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
         return false;
       if (new_mtime > output_mtime)
         output_mtime = new_mtime;
-      if ((*o)->mtime() == new_mtime && restat) {
+      scan_.ForgetContentHash(*o);
+      bool same_content = false;
+      if (content_hash) {
+        output_hashes.push_back(scan_.HashContent(*o));
+        BuildLog::LogEntry* entry =
+            scan_.build_log()->LookupByOutput((*o)->path());
+        same_content = entry && entry->content_hash &&
+            entry->content_hash == output_hashes.back() &&
+            DependentsHashContent(*o);
+      }
+      if (((*o)->mtime() == new_mtime || same_content) && restat) {
         // The rule command did not change the output.  Propagate the clean
         // state through the build graph.
         // Note that this also applies to nonexistent outputs (mtime == 0).
@@ -846,7 +1649,8 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
 
   if (scan_.build_log()) {
     if (!scan_.build_log()->RecordCommand(edge, start_time, end_time,
-                                          output_mtime)) {
+                                          output_mtime, result->peak_rss,
+                                          inputs_hash, output_hashes)) {
       *err = string("Error writing to build log: ") + strerror(errno);
       return false;
     }
@@ -863,12 +1667,45 @@ bool Builder::FinishCommand(CommandRunner::Result* result, string* err) {
       return false;
     }
   }
+
+  if (store)
+    action_cache_.Store(edge, deps_nodes, raw_output);
+  return true;
+}
+
+bool DepfileReader::Read(string* err) {
+  // Treat a missing depfile as empty.
+  switch (disk_interface_->ReadFile(depfile_, &content_, err)) {
+  case DiskInterface::Okay:
+    break;
+  case DiskInterface::NotFound:
+    err->clear();
+    break;
+  case DiskInterface::OtherError:
+    return false;
+  }
+  if (content_.empty())
+    return true;
+
+  if (!parser_.Parse(&content_, err))
+    return false;
+
+  // XXX check depfile matches expected output.
+  slash_bits_.resize(parser_.ins_.size());
+  for (size_t i = 0; i < parser_.ins_.size(); ++i) {
+    StringPiece* in = &parser_.ins_[i];
+    if (!CanonicalizePath(const_cast<char*>(in->str_), &in->len_,
+                          &slash_bits_[i], err)) {
+      return false;
+    }
+  }
   return true;
 }
 
 bool Builder::ExtractDeps(CommandRunner::Result* result,
                           const string& deps_type,
                           const string& deps_prefix,
+                          DepfileReader* reader,
                           vector<Node*>* deps_nodes,
                           string* err) {
   if (deps_type == "msvc") {
@@ -893,34 +1730,24 @@ bool Builder::ExtractDeps(CommandRunner::Result* result,
       return false;
     }
 
-    // Read depfile content.  Treat a missing depfile as empty.
-    string content;
-    switch (disk_interface_->ReadFile(depfile, &content, err)) {
-    case DiskInterface::Okay:
-      break;
-    case DiskInterface::NotFound:
-      err->clear();
-      break;
-    case DiskInterface::OtherError:
+    // Unless a deps thread read it already.
+    DepfileReader own_reader(depfile, disk_interface_,
+                             config_.depfile_parser_options);
+    if (!reader) {
+      reader = &own_reader;
+      reader->ok_ = reader->Read(&reader->err_);
+    }
+    if (!reader->ok_) {
+      *err = reader->err_;
       return false;
     }
-    if (content.empty())
+    if (reader->content_.empty())
       return true;
 
-    DepfileParser deps(config_.depfile_parser_options);
-    if (!deps.Parse(&content, err))
-      return false;
-
-    // XXX check depfile matches expected output.
-    deps_nodes->reserve(deps.ins_.size());
-    for (vector<StringPiece>::iterator i = deps.ins_.begin();
-         i != deps.ins_.end(); ++i) {
-      uint64_t slash_bits;
-      if (!CanonicalizePath(const_cast<char*>(i->str_), &i->len_, &slash_bits,
-                            err))
-        return false;
-      deps_nodes->push_back(state_->GetNode(*i, slash_bits));
-    }
+    const vector<StringPiece>& ins = reader->parser_.ins_;
+    deps_nodes->reserve(ins.size());
+    for (size_t i = 0; i < ins.size(); ++i)
+      deps_nodes->push_back(state_->GetNode(ins[i], reader->slash_bits_[i]));
 
     if (!g_keep_depfile) {
       if (disk_interface_->RemoveFile(depfile) < 0) {
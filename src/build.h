@@ -16,6 +16,7 @@
 #define NINJA_BUILD_H_
 
 #include <cstdio>
+#include <deque>
 #include <map>
 #include <memory>
 #include <queue>
@@ -23,34 +24,56 @@
 #include <string>
 #include <vector>
 
+#include "action_cache.h"
 #include "depfile_parser.h"
 #include "graph.h"  // XXX needed for DependencyScan; should rearrange.
 #include "exit_status.h"
 #include "line_printer.h"
 #include "metrics.h"
+#include "thread_pool.h"
 #include "util.h"  // int64_t
 
 struct BuildLog;
 struct BuildStatus;
 struct DiskInterface;
 struct Edge;
+struct JobserverClient;
 struct Node;
 struct State;
 
 /// Plan stores the state of a build plan: what we intend to build,
 /// which steps we're ready to execute.
 struct Plan {
-  Plan();
+  /// \a build_log, if given, has the durations that FindWork() uses to
+  /// prioritize edges.
+  explicit Plan(BuildLog* build_log = NULL);
 
   /// Add a target to our plan (including all its dependencies).
   /// Returns false if we don't need to build this target; may
   /// fill in |err| with an error message if there's a problem.
   bool AddTarget(Node* node, string* err);
 
-  // Pop a ready edge off the queue of edges to build.
+  // Pop a ready edge off the queue of edges to build, the one on the
+  // longest estimated path through the rest of the build first.  With a
+  // memory budget, edges that would exceed it are passed over, unless
+  // nothing else holds memory.
   // Returns NULL if there's no work to do.
   Edge* FindWork();
 
+  /// Take the ready edges that can run in one command with |edge|, which
+  /// FindWork() just returned, off the queue, and put them in |batch| after
+  /// |edge|.  These are the highest priority edges of the same rule and
+  /// pool whose commands differ only in $in and $out, up to the rule's
+  /// `batch` size in all.  Edges with a response file, msvc deps or
+  /// `cache = 1` aren't batched.
+  void FindBatch(Edge* edge, vector<Edge*>* batch);
+
+  /// Limit the memory that the edges handed out by FindWork() and not
+  /// finished yet are expected to use, in bytes; 0 means no limit.  Each
+  /// edge is expected to use the peak RSS in the build log, or else the
+  /// size in its `memory` binding, or else nothing.
+  void set_memory_budget(int64_t bytes) { memory_budget_ = bytes; }
+
   /// Returns true if there's more work to be done.
   bool more_to_do() const { return wanted_edges_ > 0 && command_edges_ > 0; }
 
@@ -79,9 +102,21 @@ private:
   bool AddSubTarget(Node* node, Node* dependent, string* err);
   void NodeFinished(Node* node);
 
+  /// Compute the critical path weights of the edges added since the last
+  /// call and schedule the ones that are ready.
+  void PrepareQueue();
+
+  /// Set the critical path weight of every wanted edge that isn't scheduled
+  /// yet: its estimated duration plus the largest weight of the edges that
+  /// depend on it.
+  void ComputeCriticalPath();
+
   /// Enumerate possible steps we want for an edge.
   enum Want
   {
+    /// The edge is not part of the plan: we want neither it nor its
+    /// dependents, or it is done.
+    kNotPlanned,
     /// We do not want to build the edge, but we might want to build one of
     /// its dependents.
     kWantNothing,
@@ -92,24 +127,59 @@ private:
     kWantToFinish
   };
 
+  Want GetWant(const Edge* edge) const {
+    return edge->id_ < want_.size() ? want_[edge->id_] : kNotPlanned;
+  }
+
+  /// Add \a edge to the plan, with nothing wanted yet.
+  void PlanEdge(Edge* edge);
+
+  /// The memory that \a edge is expected to use, in bytes.
+  int64_t GetMemory(Edge* edge);
+
+  /// The command of \a edge with empty $in and $out, which is the same for
+  /// the edges that can run in one command.
+  const string& GetBatchKey(Edge* edge);
+
   /// Submits a ready edge as a candidate for execution.
   /// The edge may be delayed from running, for example if it's a member of a
   /// currently-full pool.
-  void ScheduleWork(map<Edge*, Want>::iterator want_e);
-
-  /// Keep track of which edges we want to build in this plan.  If this map does
-  /// not contain an entry for an edge, we do not want to build the entry or its
-  /// dependents.  If it does contain an entry, the enumeration indicates what
-  /// we want for the edge.
-  map<Edge*, Want> want_;
-
-  set<Edge*> ready_;
+  void ScheduleWork(Edge* edge);
+
+  /// Keep track of which edges we want to build in this plan, indexed by
+  /// Edge::id_.
+  vector<Want> want_;
+  /// For each edge in the plan, the number of its inputs whose edges
+  /// haven't finished yet; the edge is ready when it drops to zero.  Each
+  /// input counts as often as it is listed.
+  vector<int> pending_inputs_;
+  /// For each edge in the plan, the number of its inputs that are dirty.
+  vector<int> dirty_inputs_;
+  /// The edges in the plan, in the order they were added.
+  vector<Edge*> edges_;
+  /// For each edge in the plan, the memory it is expected to use, or -1
+  /// if it isn't estimated yet.
+  vector<int64_t> memory_;
+  /// The results of GetBatchKey().
+  map<Edge*, string> batch_keys_;
+
+  EdgePriorityQueue ready_;
 
   /// Total number of edges that have commands (not phony).
   int command_edges_;
 
   /// Total remaining number of wanted edges.
   int wanted_edges_;
+
+  BuildLog* build_log_;
+
+  /// Whether the edges of all added targets are scheduled.
+  bool prepared_;
+
+  int64_t memory_budget_;
+  /// The memory expected to be used by the edges handed out by FindWork()
+  /// that haven't finished.
+  int64_t memory_used_;
 };
 
 /// CommandRunner is an interface that wraps running the build
@@ -120,17 +190,30 @@ struct CommandRunner {
   virtual bool CanRunMore() = 0;
   virtual bool StartCommand(Edge* edge) = 0;
 
+  /// Start |command|, which runs the batch of edges that starts with
+  /// |edge|; WaitForCommand() reports its result as |edge|'s.  The default
+  /// starts |edge| alone, which suits runners that run nothing.
+  virtual bool StartBatch(Edge* edge, const string& command) {
+    return StartCommand(edge);
+  }
+
   /// The result of waiting for a command.
   struct Result {
-    Result() : edge(NULL) {}
+    Result() : edge(NULL), peak_rss(0) {}
     Edge* edge;
     ExitStatus status;
     string output;
+    /// The peak resident set size of the command in bytes, or 0 if unknown.
+    int64_t peak_rss;
     bool success() const { return status == ExitSuccess; }
   };
   /// Wait for a command to complete, or return false if interrupted.
   virtual bool WaitForCommand(Result* result) = 0;
 
+  /// Whether WaitForCommand() would return at once.  Runners that can't
+  /// tell say no, which only makes Builder finish what it has first.
+  virtual bool HasFinishedCommand() { return false; }
+
   virtual vector<Edge*> GetActiveEdges() { return vector<Edge*>(); }
   virtual void Abort() {}
 };
@@ -138,7 +221,9 @@ struct CommandRunner {
 /// Options (e.g. verbosity, parallelism) passed to a build.
 struct BuildConfig {
   BuildConfig() : verbosity(NORMAL), dry_run(false), parallelism(1),
-                  failures_allowed(1), max_load_average(-0.0f) {}
+                  failures_allowed(1), max_load_average(-0.0f),
+                  memory_budget(0), jobserver(NULL), async_spawn(false),
+                  deps_threads(1) {}
 
   enum Verbosity {
     NORMAL,
@@ -152,9 +237,55 @@ struct BuildConfig {
   /// The maximum load average we must not exceed. A negative value
   /// means that we do not have any limit.
   double max_load_average;
+  /// The memory in bytes that the commands running at once are expected to
+  /// use together at most; 0 means no limit.
+  int64_t memory_budget;
+  /// The GNU make jobserver that limits the commands run in parallel along
+  /// with |parallelism|, if any.
+  JobserverClient* jobserver;
+  /// Start commands on a helper thread, so that the build goes on while
+  /// they are created.
+  bool async_spawn;
+  /// The directory of the action cache for edges with cache = 1, or empty.
+  string cache_dir;
+  /// The address of the worker that runs the commands of edges with
+  /// remote = 1, or empty to run them here.  See remote_exec.h.
+  string remote;
+  /// The number of threads that read the depfiles of the finished commands
+  /// with deps = gcc while the build goes on.  1 reads each on the main
+  /// thread as its command finishes.  When greater than 1 the
+  /// DiskInterface must be safe to use from several threads at once.
+  int deps_threads;
   DepfileParserOptions depfile_parser_options;
 };
 
+/// The dependencies of a command with deps = gcc, read from its depfile,
+/// which Builder::ExtractDeps() turns into nodes.  Reading doesn't touch
+/// the State, so that it can run on a deps thread.
+struct DepfileReader : public ThreadPool::Task {
+  DepfileReader(const string& depfile, DiskInterface* disk_interface,
+                const DepfileParserOptions& options)
+      : depfile_(depfile), disk_interface_(disk_interface), parser_(options),
+        ok_(false) {}
+
+  virtual void Run() { ok_ = Read(&err_); }
+
+  /// Read and parse the depfile, which is empty if it doesn't exist, and
+  /// canonicalize its inputs.
+  bool Read(string* err);
+
+  string depfile_;
+  DiskInterface* disk_interface_;
+  /// The contents of the depfile, which parser_.ins_ point into.
+  string content_;
+  DepfileParser parser_;
+  /// The slash bits of each of parser_.ins_.
+  vector<uint64_t> slash_bits_;
+  /// The result of Run().
+  bool ok_;
+  string err_;
+};
+
 /// Builder wraps the build process: starting commands, updating status.
 struct Builder {
   Builder(State* state, const BuildConfig& config,
@@ -162,7 +293,8 @@ struct Builder {
           DiskInterface* disk_interface);
   ~Builder();
 
-  /// Clean up after interrupted commands by deleting output files.
+  /// Clean up after interrupted commands by deleting output files, once
+  /// the commands that finished have been recorded.
   void Cleanup();
 
   Node* AddTarget(const string& name, string* err);
@@ -171,6 +303,10 @@ struct Builder {
   /// @return false on error.
   bool AddTarget(Node* target, string* err);
 
+  /// stat() the files that AddTarget() of |targets| will look at, in
+  /// parallel.  Optional.
+  void PrefetchStats(const vector<Node*>& targets);
+
   /// Returns true if the build targets are already up to date.
   bool AlreadyUpToDate() const;
 
@@ -180,9 +316,18 @@ struct Builder {
 
   bool StartEdge(Edge* edge, string* err);
 
-  /// Update status ninja logs following a command termination.
+  /// Start one command for the edges of |batch|, from Plan::FindBatch().
+  bool StartBatch(const vector<Edge*>& batch, string* err);
+
+  /// Hash the inputs of |edge| as its command starts, if it has
+  /// content_hash, for FinishCommand() to record.
+  void HashInputs(Edge* edge);
+
+  /// Update status ninja logs following a command termination.  |reader|
+  /// has read the depfile already, if given.
   /// @return false if the build can not proceed further due to a fatal error.
-  bool FinishCommand(CommandRunner::Result* result, string* err);
+  bool FinishCommand(CommandRunner::Result* result, string* err,
+                     DepfileReader* reader = NULL);
 
   /// Used for tests.
   void SetBuildLog(BuildLog* log) {
@@ -201,11 +346,50 @@ struct Builder {
 
  private:
    bool ExtractDeps(CommandRunner::Result* result, const string& deps_type,
-                    const string& deps_prefix, vector<Node*>* deps_nodes,
-                    string* err);
+                    const string& deps_prefix, DepfileReader* reader,
+                    vector<Node*>* deps_nodes, string* err);
+
+  /// Queue the |result| of a command for Build() to finish, reading its
+  /// depfile on a deps thread meanwhile.
+  void AddCompletion(const CommandRunner::Result& result);
+
+  /// FinishCommand() the first of |completions_|, once its depfile has
+  /// been read, counting a failure against |failures_allowed|.
+  bool FinishCompletion(int* failures_allowed, string* err);
+
+  /// Run the command of |edge| without starting a process, if its rule has
+  /// `builtin = 1` and it is one that Ninja knows: `touch FILE...`,
+  /// `cp FROM TO` to a file or `mkdir [-p] DIR...`.
+  /// @return false if the command must be run as usual.
+  bool RunBuiltin(Edge* edge, CommandRunner::Result* result);
+
+  /// Turn the |result| of a command into one for each edge that it ran,
+  /// with its status and peak RSS.  The output goes to the first edge.
+  void SplitBatch(const CommandRunner::Result& result,
+                  vector<CommandRunner::Result>* results);
 
   DiskInterface* disk_interface_;
   DependencyScan scan_;
+  ActionCache action_cache_;
+  /// The results of the built-in commands and of the edges restored from
+  /// the action cache, which Build() has yet to finish.
+  deque<CommandRunner::Result> ready_results_;
+  /// The edges in |ready_results_| that were restored from the cache.
+  set<Edge*> restored_edges_;
+  /// The edges of the running batches, by their first edge.
+  map<Edge*, vector<Edge*> > batches_;
+  /// The hashes of the inputs of the running edges with content_hash.
+  map<Edge*, uint64_t> inputs_hashes_;
+  /// The threads of BuildConfig::deps_threads, or NULL.
+  ThreadPool* deps_pool_;
+  /// A finished command, with the reader of its depfile if it has one.
+  struct Completion {
+    CommandRunner::Result result;
+    DepfileReader* reader;
+  };
+  /// The commands that finished, in order, for Build() to finish once
+  /// their depfiles have been read.
+  deque<Completion> completions_;
 
   // Unimplemented copy ctor and operator= ensure we don't copy the auto_ptr.
   Builder(const Builder &other);        // DO NOT IMPLEMENT
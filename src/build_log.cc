@@ -41,16 +41,69 @@
 
 // Implementation details:
 // Each run's log appends to the log file.
-// To load, we run through all log entries in series, throwing away
-// older runs.
-// Once the number of redundant entries exceeds a threshold, we write
-// out a new file and replace the existing one with it.
+// The log is binary: a header, the records of the last recompaction, an
+// open-addressing hash table of those records by output path, and the
+// records appended since.  To load, we map the file and run through the
+// appended records in series, throwing away older runs; records in the
+// hash table are read from the mapping when they are looked up.
+// Once the number of appended records exceeds a threshold, we write
+// out a new file with all records in the hash table and replace the
+// existing one with it.
+// Logs of versions up to 6 are text, a line per record; they are read
+// whole and rewritten as binary logs.
 
 namespace {
 
 const char kFileSignature[] = "# ninja log v%d\n";
+const char kBinarySignature[] = "# ninjalog\n";
 const int kOldestSupportedVersion = 4;
-const int kCurrentVersion = 5;
+const int kCurrentVersion = 8;
+/// The first version of the binary log, whose records lack the hashes of
+/// contents.
+const int kFirstBinaryVersion = 7;
+
+/// The start of a binary log.
+struct LogHeader {
+  char signature[12];
+  int32_t version;
+  /// The records in the index are between the header and the index.
+  uint64_t index_offset;
+  /// The number of index slots, a power of two, or 0.  Each slot is the
+  /// offset of a record or 0.
+  uint64_t bucket_count;
+  /// The number of records in the index.
+  uint64_t entry_count;
+  /// Where the records start that were appended after the index.
+  uint64_t tail_offset;
+};
+
+/// A record of a binary log, followed by its NUL-terminated output path
+/// padded to a multiple of 8 bytes.
+struct LogRecord {
+  /// The size of the record, with the path and padding.
+  uint32_t size;
+  uint32_t path_size;
+  int32_t start_time;
+  int32_t end_time;
+  int64_t mtime;
+  uint64_t command_hash;
+  int64_t peak_rss;
+  uint64_t inputs_hash;
+  uint64_t content_hash;
+  uint64_t path_hash;
+};
+
+/// A record of a version 7 log.
+struct LogRecordV7 {
+  uint32_t size;
+  uint32_t path_size;
+  int32_t start_time;
+  int32_t end_time;
+  int64_t mtime;
+  uint64_t command_hash;
+  int64_t peak_rss;
+  uint64_t path_hash;
+};
 
 // 64bit MurmurHash2, by Austin Appleby
 #if defined(_MSC_VER)
@@ -100,6 +153,47 @@ uint64_t MurmurHash64A(const void* key, size_t len) {
 }
 #undef BIG_CONSTANT
 
+size_t RecordSize(size_t path_size) {
+  return (sizeof(LogRecord) + path_size + 1 + 7) & ~(size_t)7;
+}
+
+/// The record at \a offset of \a data, if one fits before \a end.
+const LogRecord* RecordAt(const char* data, uint64_t offset, size_t end) {
+  if (offset % 8 != 0 || offset >= end ||
+      end - offset < sizeof(LogRecord)) {
+    return NULL;
+  }
+  const LogRecord* record = (const LogRecord*)(data + offset);
+  if (record->size > end - offset || record->path_size == 0 ||
+      record->size != RecordSize(record->path_size) ||
+      ((const char*)(record + 1))[record->path_size] != '\0') {
+    return NULL;
+  }
+  return record;
+}
+
+const char* RecordPath(const LogRecord* record) {
+  return (const char*)(record + 1);
+}
+
+/// The version 7 record at \a offset of \a data, if one fits before \a end.
+const LogRecordV7* RecordV7At(const char* data, uint64_t offset,
+                              size_t end) {
+  if (offset % 8 != 0 || offset >= end ||
+      end - offset < sizeof(LogRecordV7)) {
+    return NULL;
+  }
+  const LogRecordV7* record = (const LogRecordV7*)(data + offset);
+  const char* path = (const char*)(record + 1);
+  if (record->size > end - offset || record->path_size == 0 ||
+      record->size != ((sizeof(LogRecordV7) + record->path_size + 1 + 7) &
+                       ~(size_t)7) ||
+      path[record->path_size] != '\0' ||
+      MurmurHash64A(path, record->path_size) != record->path_hash) {
+    return NULL;
+  }
+  return record;
+}
 
 }  // namespace
 
@@ -108,17 +202,24 @@ uint64_t BuildLog::LogEntry::HashCommand(StringPiece command) {
   return MurmurHash64A(command.str_, command.len_);
 }
 
+// static
+uint64_t BuildLog::LogEntry::HashContent(StringPiece content) {
+  return MurmurHash64A(content.str_, content.len_);
+}
+
 BuildLog::LogEntry::LogEntry(const string& output)
-  : output(output) {}
+  : output(output), peak_rss(0), inputs_hash(0), content_hash(0) {}
 
 BuildLog::LogEntry::LogEntry(const string& output, uint64_t command_hash,
   int start_time, int end_time, TimeStamp restat_mtime)
   : output(output), command_hash(command_hash),
-    start_time(start_time), end_time(end_time), mtime(restat_mtime)
+    start_time(start_time), end_time(end_time), mtime(restat_mtime),
+    peak_rss(0), inputs_hash(0), content_hash(0)
 {}
 
 BuildLog::BuildLog()
-  : log_file_(NULL), needs_recompaction_(false) {}
+  : log_file_(NULL), needs_recompaction_(false), index_offset_(0),
+    bucket_count_(0) {}
 
 BuildLog::~BuildLog() {
   Close();
@@ -144,7 +245,14 @@ bool BuildLog::OpenForWrite(const string& path, const BuildLogUser& user,
   fseek(log_file_, 0, SEEK_END);
 
   if (ftell(log_file_) == 0) {
-    if (fprintf(log_file_, kFileSignature, kCurrentVersion) < 0) {
+    LogHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.signature, kBinarySignature, sizeof(kBinarySignature));
+    header.version = kCurrentVersion;
+    header.index_offset = sizeof(header);
+    header.tail_offset = sizeof(header);
+    if (fwrite(&header, sizeof(header), 1, log_file_) < 1 ||
+        fflush(log_file_) != 0) {
       *err = strerror(errno);
       return false;
     }
@@ -154,7 +262,9 @@ bool BuildLog::OpenForWrite(const string& path, const BuildLogUser& user,
 }
 
 bool BuildLog::RecordCommand(Edge* edge, int start_time, int end_time,
-                             TimeStamp mtime) {
+                             TimeStamp mtime, int64_t peak_rss,
+                             uint64_t inputs_hash,
+                             const vector<uint64_t>& output_hashes) {
   string command = edge->EvaluateCommand(true);
   uint64_t command_hash = LogEntry::HashCommand(command);
   for (vector<Node*>::iterator out = edge->outputs_.begin();
@@ -172,6 +282,11 @@ bool BuildLog::RecordCommand(Edge* edge, int start_time, int end_time,
     log_entry->start_time = start_time;
     log_entry->end_time = end_time;
     log_entry->mtime = mtime;
+    log_entry->peak_rss = peak_rss;
+    log_entry->inputs_hash = inputs_hash;
+    size_t index = out - edge->outputs_.begin();
+    log_entry->content_hash =
+        index < output_hashes.size() ? output_hashes[index] : 0;
 
     if (log_file_) {
       if (!WriteEntry(log_file_, *log_entry))
@@ -184,6 +299,17 @@ bool BuildLog::RecordCommand(Edge* edge, int start_time, int end_time,
   return true;
 }
 
+bool BuildLog::RecordMtime(LogEntry* entry, TimeStamp mtime) {
+  entry->mtime = mtime;
+  if (log_file_) {
+    if (!WriteEntry(log_file_, *entry))
+      return false;
+    if (fflush(log_file_) != 0)
+      return false;
+  }
+  return true;
+}
+
 void BuildLog::Close() {
   if (log_file_)
     fclose(log_file_);
@@ -243,6 +369,137 @@ struct LineReader {
 
 bool BuildLog::Load(const string& path, string* err) {
   METRIC_RECORD(".ninja_log load");
+  int ret = mapped_.Map(path, err);
+  if (ret == -ENOENT) {
+    err->clear();
+    return true;
+  }
+  if (ret < 0)
+    return false;
+  if (mapped_.size() >= sizeof(kBinarySignature) - 1 &&
+      memcmp(mapped_.data(), kBinarySignature,
+             sizeof(kBinarySignature) - 1) == 0) {
+    return LoadBinary(path, err);
+  }
+  mapped_.Unmap();
+  return LoadText(path, err);
+}
+
+bool BuildLog::LoadBinary(const string& path, string* err) {
+  LogHeader header;
+  bool valid = mapped_.size() >= sizeof(header);
+  if (valid) {
+    memcpy(&header, mapped_.data(), sizeof(header));
+    uint64_t size = mapped_.size();
+    valid = (header.version == kCurrentVersion ||
+             header.version == kFirstBinaryVersion) &&
+        header.index_offset >= sizeof(header) &&
+        header.index_offset % 8 == 0 &&
+        (header.bucket_count & (header.bucket_count - 1)) == 0 &&
+        header.tail_offset <= size &&
+        header.index_offset <= header.tail_offset &&
+        header.bucket_count <= (header.tail_offset - header.index_offset) / 8;
+  }
+  if (!valid) {
+    *err = "build log version invalid, perhaps due to being too old; "
+           "starting over";
+    mapped_.Unmap();
+    unlink(path.c_str());
+    // An empty build log will cause us to rebuild the outputs anyway.
+    return true;
+  }
+
+  if (header.version == kFirstBinaryVersion) {
+    // Read all records of the old layout now and rewrite the log; the
+    // indexed records come first, as the appended ones replace them.
+    LoadVersion7(sizeof(header), header.index_offset);
+    LoadVersion7(header.tail_offset, mapped_.size());
+    mapped_.Unmap();
+    needs_recompaction_ = true;
+    return true;
+  }
+
+  size_t offset = header.tail_offset;
+  int tail_count = 0;
+  const LogRecord* record;
+  while ((record = RecordAt(mapped_.data(), offset, mapped_.size())) &&
+         MurmurHash64A(RecordPath(record), record->path_size) ==
+             record->path_hash) {
+    LoadRecord(offset, true);
+    offset += record->size;
+    ++tail_count;
+  }
+  if (offset < mapped_.size()) {
+    // An interrupted write left a partial record.  Truncate the file to the
+    // last complete one, so that the next appends are readable.
+    *err = "premature end of file; recovering";
+    mapped_.Unmap();
+    string truncate_err;
+    if (!Truncate(path, offset, &truncate_err) ||
+        mapped_.Map(path, &truncate_err) < 0) {
+      *err = truncate_err;
+      return false;
+    }
+  }
+  index_offset_ = header.index_offset;
+  bucket_count_ = header.bucket_count;
+
+  // Rewrite the log once the records appended after the index are many
+  // compared to those in it.
+  int kMinCompactionEntryCount = 100;
+  int kCompactionRatio = 4;
+  if (tail_count > kMinCompactionEntryCount &&
+      (uint64_t)tail_count * kCompactionRatio > header.entry_count) {
+    needs_recompaction_ = true;
+  }
+  return true;
+}
+
+BuildLog::LogEntry* BuildLog::LoadRecord(size_t offset, bool replace) {
+  const LogRecord* record = (const LogRecord*)(mapped_.data() + offset);
+  StringPiece path(RecordPath(record), record->path_size);
+  LogEntry* entry;
+  Entries::iterator i = entries_.find(path);
+  if (i != entries_.end()) {
+    entry = i->second;
+    if (!replace)
+      return entry;
+  } else {
+    entry = new LogEntry(path.AsString());
+    entries_.insert(Entries::value_type(entry->output, entry));
+  }
+  entry->command_hash = record->command_hash;
+  entry->start_time = record->start_time;
+  entry->end_time = record->end_time;
+  entry->mtime = record->mtime;
+  entry->peak_rss = record->peak_rss;
+  entry->inputs_hash = record->inputs_hash;
+  entry->content_hash = record->content_hash;
+  return entry;
+}
+
+void BuildLog::LoadVersion7(size_t offset, size_t end) {
+  const LogRecordV7* record;
+  while ((record = RecordV7At(mapped_.data(), offset, end))) {
+    string path((const char*)(record + 1), record->path_size);
+    LogEntry* entry;
+    Entries::iterator i = entries_.find(path);
+    if (i != entries_.end()) {
+      entry = i->second;
+    } else {
+      entry = new LogEntry(path);
+      entries_.insert(Entries::value_type(entry->output, entry));
+    }
+    entry->command_hash = record->command_hash;
+    entry->start_time = record->start_time;
+    entry->end_time = record->end_time;
+    entry->mtime = record->mtime;
+    entry->peak_rss = record->peak_rss;
+    offset += record->size;
+  }
+}
+
+bool BuildLog::LoadText(const string& path, string* err) {
   FILE* file = fopen(path.c_str(), "r");
   if (!file) {
     if (errno == ENOENT)
@@ -327,9 +584,14 @@ bool BuildLog::Load(const string& path, string* err) {
     entry->start_time = start_time;
     entry->end_time = end_time;
     entry->mtime = restat_mtime;
+    entry->peak_rss = 0;
     if (log_version >= 5) {
       char c = *end; *end = '\0';
-      entry->command_hash = (uint64_t)strtoull(start, NULL, 16);
+      char* hash_end;
+      entry->command_hash = (uint64_t)strtoull(start, &hash_end, 16);
+      // Version 6 adds the peak RSS after the hash.
+      if (log_version >= 6 && *hash_end == kFieldSeparator)
+        entry->peak_rss = strtoll(hash_end + 1, NULL, 10);
       *end = c;
     } else {
       entry->command_hash = LogEntry::HashCommand(StringPiece(start,
@@ -361,13 +623,56 @@ BuildLog::LogEntry* BuildLog::LookupByOutput(const string& path) {
   Entries::iterator i = entries_.find(path);
   if (i != entries_.end())
     return i->second;
+  return LookupIndexed(path);
+}
+
+BuildLog::LogEntry* BuildLog::LookupIndexed(const string& path) {
+  if (!bucket_count_)
+    return NULL;
+  const char* data = mapped_.data();
+  const uint64_t* index = (const uint64_t*)(data + index_offset_);
+  uint64_t hash = MurmurHash64A(path.data(), path.size());
+  size_t mask = bucket_count_ - 1;
+  for (size_t bucket = hash & mask, probes = 0; probes < bucket_count_;
+       bucket = (bucket + 1) & mask, ++probes) {
+    const LogRecord* record = RecordAt(data, index[bucket], index_offset_);
+    if (!record)
+      return NULL;
+    if (record->path_hash == hash && record->path_size == path.size() &&
+        memcmp(RecordPath(record), path.data(), path.size()) == 0) {
+      return LoadRecord(index[bucket], false);
+    }
+  }
   return NULL;
 }
 
+void BuildLog::LoadIndexed() {
+  for (size_t offset = sizeof(LogHeader); offset < index_offset_;) {
+    const LogRecord* record = RecordAt(mapped_.data(), offset, index_offset_);
+    if (!record)
+      break;
+    LoadRecord(offset, false);
+    offset += record->size;
+  }
+}
+
 bool BuildLog::WriteEntry(FILE* f, const LogEntry& entry) {
-  return fprintf(f, "%d\t%d\t%" PRId64 "\t%s\t%" PRIx64 "\n",
-          entry.start_time, entry.end_time, entry.mtime,
-          entry.output.c_str(), entry.command_hash) > 0;
+  LogRecord record;
+  record.size = RecordSize(entry.output.size());
+  record.path_size = entry.output.size();
+  record.start_time = entry.start_time;
+  record.end_time = entry.end_time;
+  record.mtime = entry.mtime;
+  record.command_hash = entry.command_hash;
+  record.peak_rss = entry.peak_rss;
+  record.inputs_hash = entry.inputs_hash;
+  record.content_hash = entry.content_hash;
+  record.path_hash = MurmurHash64A(entry.output.data(), entry.output.size());
+  const char kPadding[8] = {};
+  return fwrite(&record, sizeof(record), 1, f) == 1 &&
+      fwrite(entry.output.c_str(), entry.output.size(), 1, f) == 1 &&
+      fwrite(kPadding, record.size - sizeof(record) - entry.output.size(), 1,
+             f) == 1;
 }
 
 bool BuildLog::Recompact(const string& path, const BuildLogUser& user,
@@ -375,6 +680,11 @@ bool BuildLog::Recompact(const string& path, const BuildLogUser& user,
   METRIC_RECORD(".ninja_log recompact");
 
   Close();
+  LoadIndexed();
+  mapped_.Unmap();
+  index_offset_ = 0;
+  bucket_count_ = 0;
+
   string temp_path = path + ".recompact";
   FILE* f = fopen(temp_path.c_str(), "wb");
   if (!f) {
@@ -382,13 +692,19 @@ bool BuildLog::Recompact(const string& path, const BuildLogUser& user,
     return false;
   }
 
-  if (fprintf(f, kFileSignature, kCurrentVersion) < 0) {
+  LogHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.signature, kBinarySignature, sizeof(kBinarySignature));
+  header.version = kCurrentVersion;
+  if (fwrite(&header, sizeof(header), 1, f) < 1) {
     *err = strerror(errno);
     fclose(f);
     return false;
   }
 
   vector<StringPiece> dead_outputs;
+  vector<pair<uint64_t, uint64_t> > records;  // Path hashes and offsets.
+  uint64_t offset = sizeof(header);
   for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i) {
     if (user.IsPathDead(i->first)) {
       dead_outputs.push_back(i->first);
@@ -400,11 +716,39 @@ bool BuildLog::Recompact(const string& path, const BuildLogUser& user,
       fclose(f);
       return false;
     }
+    const string& output = i->second->output;
+    records.push_back(make_pair(MurmurHash64A(output.data(), output.size()),
+                                offset));
+    offset += RecordSize(output.size());
   }
 
   for (size_t i = 0; i < dead_outputs.size(); ++i)
     entries_.erase(dead_outputs[i]);
 
+  // Keep the index at most half full, so that probes end soon.
+  uint64_t bucket_count = records.empty() ? 0 : 1;
+  while (bucket_count < 2 * records.size())
+    bucket_count *= 2;
+  vector<uint64_t> index(bucket_count);
+  for (size_t i = 0; i < records.size(); ++i) {
+    size_t bucket = records[i].first & (bucket_count - 1);
+    while (index[bucket])
+      bucket = (bucket + 1) & (bucket_count - 1);
+    index[bucket] = records[i].second;
+  }
+  header.index_offset = offset;
+  header.bucket_count = bucket_count;
+  header.entry_count = records.size();
+  header.tail_offset = offset + bucket_count * sizeof(uint64_t);
+  if ((!index.empty() &&
+       fwrite(&index[0], sizeof(uint64_t), index.size(), f) < index.size()) ||
+      fseek(f, 0, SEEK_SET) != 0 ||
+      fwrite(&header, sizeof(header), 1, f) < 1) {
+    *err = strerror(errno);
+    fclose(f);
+    return false;
+  }
+
   fclose(f);
   if (unlink(path.c_str()) < 0) {
     *err = strerror(errno);
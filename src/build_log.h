@@ -16,10 +16,12 @@
 #define NINJA_BUILD_LOG_H_
 
 #include <string>
+#include <vector>
 #include <stdio.h>
 using namespace std;
 
 #include "hash_map.h"
+#include "mapped_file.h"
 #include "timestamp.h"
 #include "util.h"  // uint64_t
 
@@ -27,6 +29,8 @@ struct Edge;
 
 /// Can answer questions about the manifest for the BuildLog.
 struct BuildLogUser {
+  virtual ~BuildLogUser() {}
+
   /// Return if a given output is no longer part of the build manifest.
   /// This is only called during recompaction and doesn't have to be fast.
   virtual bool IsPathDead(StringPiece s) const = 0;
@@ -39,16 +43,24 @@ struct BuildLogUser {
 ///    when we need to rebuild due to the command changing
 /// 2) timing information, perhaps for generating reports
 /// 3) restat information
+/// 4) the peak memory use of commands, for scheduling with a memory budget
+/// 5) the hashes of the contents of inputs and outputs, for content_hash
 struct BuildLog {
   BuildLog();
   ~BuildLog();
 
   bool OpenForWrite(const string& path, const BuildLogUser& user, string* err);
+  /// \a inputs_hash and \a output_hashes, one per output, are the content
+  /// hashes of an edge with content_hash, or 0 and empty.
   bool RecordCommand(Edge* edge, int start_time, int end_time,
-                     TimeStamp mtime = 0);
+                     TimeStamp mtime = 0, int64_t peak_rss = 0,
+                     uint64_t inputs_hash = 0,
+                     const vector<uint64_t>& output_hashes =
+                         vector<uint64_t>());
   void Close();
 
-  /// Load the on-disk log.
+  /// Load the on-disk log.  Entries of a binary log that are in its index
+  /// are only read from the mapped file as they are looked up.
   bool Load(const string& path, string* err);
 
   struct LogEntry {
@@ -57,14 +69,22 @@ struct BuildLog {
     int start_time;
     int end_time;
     TimeStamp mtime;
+    /// The peak resident set size of the command in bytes, or 0 if unknown.
+    int64_t peak_rss;
+    /// DependencyScan::HashInputs() of the edge when its command started,
+    /// and HashContent() of the output after it, or 0 if not recorded.
+    uint64_t inputs_hash;
+    uint64_t content_hash;
 
     static uint64_t HashCommand(StringPiece command);
+    static uint64_t HashContent(StringPiece content);
 
     // Used by tests.
     bool operator==(const LogEntry& o) {
       return output == o.output && command_hash == o.command_hash &&
           start_time == o.start_time && end_time == o.end_time &&
-          mtime == o.mtime;
+          mtime == o.mtime && peak_rss == o.peak_rss &&
+          inputs_hash == o.inputs_hash && content_hash == o.content_hash;
     }
 
     explicit LogEntry(const string& output);
@@ -75,19 +95,50 @@ struct BuildLog {
   /// Lookup a previously-run command by its output path.
   LogEntry* LookupByOutput(const string& path);
 
+  /// Record that the output of \a entry is up to date with inputs as new
+  /// as \a mtime, like a restat of its command does.
+  bool RecordMtime(LogEntry* entry, TimeStamp mtime);
+
   /// Serialize an entry into a log file.
   bool WriteEntry(FILE* f, const LogEntry& entry);
 
-  /// Rewrite the known log entries, throwing away old data.
+  /// Rewrite the known log entries, throwing away old data, with an index
+  /// of them.
   bool Recompact(const string& path, const BuildLogUser& user, string* err);
 
   typedef ExternalStringHashMap<LogEntry*>::Type Entries;
+  /// The entries loaded so far: those of a text log, and those of a binary
+  /// log that were appended after its index or looked up.
   const Entries& entries() const { return entries_; }
 
  private:
+  bool LoadText(const string& path, string* err);
+  bool LoadBinary(const string& path, string* err);
+
+  /// Load the records of a version 7 log between \a offset and \a end.
+  void LoadVersion7(size_t offset, size_t end);
+
+  /// Find \a path in the index of the mapped log, and load its entry.
+  LogEntry* LookupIndexed(const string& path);
+
+  /// Load all entries of the mapped log that aren't loaded yet.
+  void LoadIndexed();
+
+  /// Load the entry of the record at \a offset of the mapped log, unless
+  /// one is loaded already and \a replace is false.
+  /// @return the loaded entry.
+  LogEntry* LoadRecord(size_t offset, bool replace);
+
   Entries entries_;
   FILE* log_file_;
   bool needs_recompaction_;
+
+  /// The binary log, while its index is in use.
+  MappedFile mapped_;
+  /// The records in the index end where the index starts.
+  size_t index_offset_;
+  /// The number of index slots, a power of two; 0 if there is no index.
+  size_t bucket_count_;
 };
 
 #endif // NINJA_BUILD_LOG_H_
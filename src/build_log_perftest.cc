@@ -12,8 +12,10 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "build_log.h"
 #include "graph.h"
@@ -27,12 +29,15 @@
 #endif
 
 const char kTestFilename[] = "BuildLogPerfTest-tempfile";
+const char kTextFilename[] = "BuildLogPerfTest-textfile";
 
 struct NoDeadPaths : public BuildLogUser {
   virtual bool IsPathDead(StringPiece) const { return false; }
 };
 
-bool WriteTestData(string* err) {
+/// Write the same log in the binary format to kTestFilename, and in the
+/// text format of version 6 to kTextFilename.
+bool WriteTestData(vector<string>* outputs, string* err) {
   BuildLog log;
 
   NoDeadPaths no_dead_paths;
@@ -94,38 +99,56 @@ bool WriteTestData(string* err) {
                       /*end_time=*/100 * i + 1,
                       /*mtime=*/0);
   }
+  log.Close();
+
+  FILE* text = fopen(kTextFilename, "wb");
+  if (!text) {
+    *err = strerror(errno);
+    return false;
+  }
+  fprintf(text, "# ninja log v6\n");
+  for (int i = 0; i < kNumCommands; ++i) {
+    const string& output = state.edges_[i]->outputs_[0]->path();
+    BuildLog::LogEntry* entry = log.LookupByOutput(output);
+    fprintf(text, "%d\t%d\t0\t%s\t%llx\t0\n", entry->start_time,
+            entry->end_time, output.c_str(),
+            (unsigned long long)entry->command_hash);
+    outputs->push_back(output);
+  }
+  fclose(text);
 
   return true;
 }
 
-int main() {
-  vector<int> times;
+/// Time loading the log at |path| and looking up the first |lookups| of
+/// |outputs| in it.
+bool Measure(const char* name, const char* path,
+             const vector<string>& outputs, size_t lookups) {
   string err;
-
-  if (!WriteTestData(&err)) {
-    fprintf(stderr, "Failed to write test data: %s\n", err.c_str());
-    return 1;
-  }
-
   {
     // Read once to warm up disk cache.
     BuildLog log;
-    if (!log.Load(kTestFilename, &err)) {
+    if (!log.Load(path, &err)) {
       fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
-      return 1;
+      return false;
     }
   }
+  vector<int> times;
   const int kNumRepetitions = 5;
   for (int i = 0; i < kNumRepetitions; ++i) {
     int64_t start = GetTimeMillis();
     BuildLog log;
-    if (!log.Load(kTestFilename, &err)) {
+    if (!log.Load(path, &err)) {
       fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
-      return 1;
+      return false;
     }
-    int delta = (int)(GetTimeMillis() - start);
-    printf("%dms\n", delta);
-    times.push_back(delta);
+    for (size_t j = 0; j < lookups; ++j) {
+      if (!log.LookupByOutput(outputs[j])) {
+        fprintf(stderr, "%s missing from the log\n", outputs[j].c_str());
+        return false;
+      }
+    }
+    times.push_back((int)(GetTimeMillis() - start));
   }
 
   int min = times[0];
@@ -139,11 +162,49 @@ int main() {
       max = times[i];
   }
 
-  printf("min %dms  max %dms  avg %.1fms\n",
-         min, max, total / times.size());
+  printf("%-40s min %4dms  max %4dms  avg %6.1fms\n",
+         name, min, max, total / times.size());
+  return true;
+}
+
+int main() {
+  vector<string> outputs;
+  string err;
+
+  if (!WriteTestData(&outputs, &err)) {
+    fprintf(stderr, "Failed to write test data: %s\n", err.c_str());
+    return 1;
+  }
+
+  size_t all = outputs.size();
+  size_t few = all / 100;
+  if (!Measure("text: load", kTextFilename, outputs, 0) ||
+      !Measure("text: load, look up all", kTextFilename, outputs, all) ||
+      !Measure("binary, appended: load", kTestFilename, outputs, 0) ||
+      !Measure("binary, appended: load, look up all", kTestFilename,
+               outputs, all)) {
+    return 1;
+  }
+
+  {
+    BuildLog log;
+    NoDeadPaths no_dead_paths;
+    if (!log.Load(kTestFilename, &err) ||
+        !log.Recompact(kTestFilename, no_dead_paths, &err)) {
+      fprintf(stderr, "Failed to recompact test data: %s\n", err.c_str());
+      return 1;
+    }
+  }
+  if (!Measure("binary, indexed: load", kTestFilename, outputs, 0) ||
+      !Measure("binary, indexed: load, look up 1%", kTestFilename,
+               outputs, few) ||
+      !Measure("binary, indexed: load, look up all", kTestFilename,
+               outputs, all)) {
+    return 1;
+  }
 
   unlink(kTestFilename);
+  unlink(kTextFilename);
 
   return 0;
 }
-
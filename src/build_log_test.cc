@@ -51,7 +51,7 @@ TEST_F(BuildLogTest, WriteRead) {
   EXPECT_TRUE(log1.OpenForWrite(kTestFilename, *this, &err));
   ASSERT_EQ("", err);
   log1.RecordCommand(state_.edges_[0], 15, 18);
-  log1.RecordCommand(state_.edges_[1], 20, 25);
+  log1.RecordCommand(state_.edges_[1], 20, 25, 0, 3LL << 32);
   log1.Close();
 
   BuildLog log2;
@@ -67,11 +67,14 @@ TEST_F(BuildLogTest, WriteRead) {
   ASSERT_TRUE(*e1 == *e2);
   ASSERT_EQ(15, e1->start_time);
   ASSERT_EQ("out", e1->output);
+  ASSERT_EQ(0, e2->peak_rss);
+  e2 = log2.LookupByOutput("mid");
+  ASSERT_TRUE(e2);
+  ASSERT_EQ(3LL << 32, e2->peak_rss);
 }
 
 TEST_F(BuildLogTest, FirstWriteAddsSignature) {
-  const char kExpectedVersion[] = "# ninja log vX\n";
-  const size_t kVersionPos = strlen(kExpectedVersion) - 2;  // Points at 'X'.
+  const char kExpectedSignature[] = "# ninjalog\n";
 
   BuildLog log;
   string contents, err;
@@ -82,11 +85,10 @@ TEST_F(BuildLogTest, FirstWriteAddsSignature) {
 
   ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
   ASSERT_EQ("", err);
-  if (contents.size() >= kVersionPos)
-    contents[kVersionPos] = 'X';
-  EXPECT_EQ(kExpectedVersion, contents);
+  EXPECT_EQ(kExpectedSignature, contents.substr(0, strlen(kExpectedSignature)));
+  size_t header_size = contents.size();
 
-  // Opening the file anew shouldn't add a second version string.
+  // Opening the file anew shouldn't add a second header.
   EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
   ASSERT_EQ("", err);
   log.Close();
@@ -94,9 +96,7 @@ TEST_F(BuildLogTest, FirstWriteAddsSignature) {
   contents.clear();
   ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
   ASSERT_EQ("", err);
-  if (contents.size() >= kVersionPos)
-    contents[kVersionPos] = 'X';
-  EXPECT_EQ(kExpectedVersion, contents);
+  EXPECT_EQ(header_size, contents.size());
 }
 
 TEST_F(BuildLogTest, DoubleEntry) {
@@ -304,4 +304,201 @@ TEST_F(BuildLogRecompactTest, Recompact) {
   ASSERT_FALSE(log2.LookupByOutput("out2"));
 }
 
+TEST_F(BuildLogTest, LookupIndexed) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n"
+"build other: cat in\n");
+
+  string err;
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+    log.RecordCommand(state_.edges_[0], 15, 18, 0, 100);
+    log.RecordCommand(state_.edges_[1], 20, 25);
+    log.Close();
+    ASSERT_TRUE(log.Recompact(kTestFilename, *this, &err));
+  }
+  {
+    // Append to the recompacted log.
+    BuildLog log;
+    EXPECT_TRUE(log.Load(kTestFilename, &err));
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+    log.RecordCommand(state_.edges_[1], 30, 35);
+    log.Close();
+  }
+
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  // Only the appended entry is loaded up front.
+  EXPECT_EQ(1u, log.entries().size());
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(15, e->start_time);
+  EXPECT_EQ(18, e->end_time);
+  EXPECT_EQ(100, e->peak_rss);
+  EXPECT_EQ(e, log.LookupByOutput("out"));
+  e = log.LookupByOutput("mid");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(30, e->start_time);
+  EXPECT_FALSE(log.LookupByOutput("other"));
+  EXPECT_EQ(2u, log.entries().size());
+
+  // Recompaction keeps the entries that weren't looked up.
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_TRUE(log2.Recompact(kTestFilename, *this, &err));
+  BuildLog log3;
+  EXPECT_TRUE(log3.Load(kTestFilename, &err));
+  EXPECT_EQ(0u, log3.entries().size());
+  ASSERT_TRUE(log3.LookupByOutput("out"));
+  e = log3.LookupByOutput("mid");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(30, e->start_time);
+}
+
+TEST_F(BuildLogTest, UpgradeTextLog) {
+  FILE* f = fopen(kTestFilename, "wb");
+  fprintf(f, "# ninja log v6\n");
+  fprintf(f, "123\t456\t789\tout\t12345678\t4096\n");
+  fclose(f);
+
+  string err;
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.Load(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+    log.Close();
+  }
+
+  string contents;
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+  EXPECT_EQ(0u, contents.find("# ninjalog\n"));
+
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(123, e->start_time);
+  EXPECT_EQ(456, e->end_time);
+  EXPECT_EQ(789, e->mtime);
+  EXPECT_EQ(0x12345678u, e->command_hash);
+  EXPECT_EQ(4096, e->peak_rss);
+}
+
+TEST_F(BuildLogTest, ContentHashes) {
+  AssertParse(&state_,
+"build out1 out2: cat in\n");
+
+  string err;
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+    vector<uint64_t> output_hashes;
+    output_hashes.push_back(0x1111);
+    output_hashes.push_back(0x2222);
+    log.RecordCommand(state_.edges_[0], 15, 18, 0, 0, 0x3333, output_hashes);
+    log.Close();
+  }
+
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log.LookupByOutput("out1");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(0x3333u, e->inputs_hash);
+  EXPECT_EQ(0x1111u, e->content_hash);
+  e = log.LookupByOutput("out2");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(0x3333u, e->inputs_hash);
+  EXPECT_EQ(0x2222u, e->content_hash);
+}
+
+TEST_F(BuildLogTest, UpgradeVersion7) {
+  // A version 7 log with one record and no index.
+  struct {
+    char signature[12];
+    int32_t version;
+    uint64_t index_offset, bucket_count, entry_count, tail_offset;
+  } header = { "# ninjalog\n", 7, 48, 0, 0, 48 };
+  struct {
+    uint32_t size, path_size;
+    int32_t start_time, end_time;
+    int64_t mtime;
+    uint64_t command_hash;
+    int64_t peak_rss;
+    uint64_t path_hash;
+    char path[8];
+  } record = { 56, 3, 123, 456, 789, 0x12345678, 4096,
+               BuildLog::LogEntry::HashContent("out"), "out" };
+  ASSERT_EQ(48u, sizeof(header));
+  ASSERT_EQ(56u, sizeof(record));
+  FILE* f = fopen(kTestFilename, "wb");
+  fwrite(&header, sizeof(header), 1, f);
+  fwrite(&record, sizeof(record), 1, f);
+  fclose(f);
+
+  string err;
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.Load(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+    log.Close();
+  }
+
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(123, e->start_time);
+  EXPECT_EQ(456, e->end_time);
+  EXPECT_EQ(789, e->mtime);
+  EXPECT_EQ(0x12345678u, e->command_hash);
+  EXPECT_EQ(4096, e->peak_rss);
+  EXPECT_EQ(0u, e->inputs_hash);
+}
+
+TEST_F(BuildLogTest, RecoverPartialRecord) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  string err;
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+    log.RecordCommand(state_.edges_[0], 15, 18);
+    log.RecordCommand(state_.edges_[1], 20, 25);
+    log.Close();
+  }
+  struct stat statbuf;
+  ASSERT_EQ(0, stat(kTestFilename, &statbuf));
+  ASSERT_TRUE(Truncate(kTestFilename, statbuf.st_size - 5, &err));
+
+  {
+    BuildLog log;
+    EXPECT_TRUE(log.Load(kTestFilename, &err));
+    EXPECT_EQ("premature end of file; recovering", err);
+    err.clear();
+    EXPECT_TRUE(log.LookupByOutput("out"));
+    EXPECT_FALSE(log.LookupByOutput("mid"));
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, *this, &err));
+    log.RecordCommand(state_.edges_[1], 30, 35);
+    log.Close();
+  }
+
+  BuildLog log;
+  EXPECT_TRUE(log.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log.LookupByOutput("out"));
+  BuildLog::LogEntry* e = log.LookupByOutput("mid");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(30, e->start_time);
+}
+
 }  // anonymous namespace
@@ -0,0 +1,450 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "build_server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+extern char** environ;
+
+#include "util.h"
+#include "version.h"
+
+namespace {
+
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;
+#endif
+
+/// Fill in |addr| for the socket |path|.
+bool MakeAddress(const string& path, sockaddr_un* addr, string* err) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr->sun_path)) {
+    *err = "socket path too long: " + path;
+    return false;
+  }
+  strcpy(addr->sun_path, path.c_str());
+  return true;
+}
+
+/// Don't let a client that went away kill the server with SIGPIPE.
+void SetNoSigPipe(int fd) {
+#ifdef SO_NOSIGPIPE
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#else
+  (void)fd;
+#endif
+}
+
+/// Whether the peer of the socket |fd| runs as this process' user.
+bool PeerIsSameUser(int fd) {
+#ifdef __linux__
+  ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+    return false;
+  return cred.uid == getuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(fd, &uid, &gid) < 0)
+    return false;
+  return uid == getuid();
+#endif
+}
+
+bool WriteAll(int fd, const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t len = send(fd, p, size, kSendFlags);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return false;
+    p += len;
+    size -= len;
+  }
+  return true;
+}
+
+bool ReadAll(int fd, void* data, size_t size) {
+  char* p = static_cast<char*>(data);
+  while (size > 0) {
+    ssize_t len = read(fd, p, size);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return false;
+    p += len;
+    size -= len;
+  }
+  return true;
+}
+
+void AppendUint32(string* out, uint32_t value) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void AppendStrings(string* out, const vector<string>& strings) {
+  for (vector<string>::const_iterator i = strings.begin();
+       i != strings.end(); ++i) {
+    out->append(*i);
+    out->push_back('\0');
+  }
+}
+
+/// Reads a request written by BuildClient::Send().
+struct RequestReader {
+  RequestReader(const string& data) : data_(data), pos_(0), ok_(true) {}
+
+  uint32_t ReadUint32() {
+    uint32_t value = 0;
+    if (pos_ + sizeof(value) > data_.size()) {
+      ok_ = false;
+      return 0;
+    }
+    memcpy(&value, data_.data() + pos_, sizeof(value));
+    pos_ += sizeof(value);
+    return value;
+  }
+
+  string ReadString() {
+    size_t end = data_.find('\0', pos_);
+    if (end == string::npos) {
+      ok_ = false;
+      return string();
+    }
+    string value = data_.substr(pos_, end - pos_);
+    pos_ = end + 1;
+    return value;
+  }
+
+  void ReadStrings(vector<string>* strings) {
+    uint32_t count = ReadUint32();
+    for (uint32_t i = 0; i < count && ok_; ++i)
+      strings->push_back(ReadString());
+  }
+
+  const string& data_;
+  size_t pos_;
+  bool ok_;
+};
+
+/// Requests are not expected to come anywhere close to this.
+const uint32_t kMaxRequestSize = 64 << 20;
+
+volatile sig_atomic_t g_server_pid;
+
+void ForwardSignal(int signum) {
+  if (g_server_pid > 0)
+    kill(g_server_pid, signum);
+}
+
+void IgnoreSignal(int) {}
+
+}  // namespace
+
+BuildRequest::BuildRequest() {
+  fds[0] = fds[1] = fds[2] = -1;
+}
+
+BuildRequest::~BuildRequest() {
+  CloseFds();
+}
+
+void BuildRequest::CloseFds() {
+  for (int i = 0; i < 3; ++i) {
+    if (fds[i] >= 0)
+      close(fds[i]);
+    fds[i] = -1;
+  }
+}
+
+BuildServer::BuildServer() : listen_fd_(-1), client_fd_(-1) {}
+
+BuildServer::~BuildServer() {
+  if (client_fd_ >= 0)
+    close(client_fd_);
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    unlink(path_.c_str());
+    sigaction(SIGINT, &old_int_act_, NULL);
+    sigaction(SIGTERM, &old_term_act_, NULL);
+    sigaction(SIGHUP, &old_hup_act_, NULL);
+  }
+}
+
+bool BuildServer::Listen(const string& path, string* err) {
+  sockaddr_un addr;
+  if (!MakeAddress(path, &addr, err))
+    return false;
+
+  // A socket without a server is left over from one that died.
+  BuildClient client;
+  if (client.Connect(path)) {
+    *err = "another build server is listening on " + path;
+    return false;
+  }
+  unlink(path.c_str());
+
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd_ < 0) {
+    *err = string("socket: ") + strerror(errno);
+    return false;
+  }
+  SetCloseOnExec(listen_fd_);
+  // Only this user may connect, as the server runs the builds of its
+  // clients with the environment that they send.
+  mode_t old_umask = umask(0077);
+  bool bound = bind(listen_fd_, (sockaddr*)&addr, sizeof(addr)) == 0;
+  umask(old_umask);
+  if (!bound || chmod(path.c_str(), 0600) < 0 ||
+      listen(listen_fd_, 16) < 0) {
+    *err = path + ": " + strerror(errno);
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  path_ = path;
+
+  // Without SA_RESTART, these signals make accept() fail with EINTR.
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = IgnoreSignal;
+  sigaction(SIGINT, &act, &old_int_act_);
+  sigaction(SIGTERM, &act, &old_term_act_);
+  sigaction(SIGHUP, &act, &old_hup_act_);
+  return true;
+}
+
+bool BuildServer::Accept(BuildRequest* request, string* err) {
+  for (;;) {
+    int fd = accept(listen_fd_, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR)
+        return false;
+      *err = string("accept: ") + strerror(errno);
+      return false;
+    }
+    SetCloseOnExec(fd);
+    SetNoSigPipe(fd);
+
+    // Decline the clients of other users without reading their requests.
+    if (!PeerIsSameUser(fd)) {
+      int32_t pid = 0;
+      WriteAll(fd, &pid, sizeof(pid));
+      close(fd);
+      continue;
+    }
+
+    // The size of the request comes with the client's file descriptors.
+    uint32_t size = 0;
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    iovec iov = { &size, sizeof(size) };
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t len;
+    do {
+      len = recvmsg(fd, &msg, 0);
+    } while (len < 0 && errno == EINTR);
+
+    request->CloseFds();
+    cmsghdr* cmsg = len > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(3 * sizeof(int))) {
+      memcpy(request->fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+      for (int i = 0; i < 3; ++i)
+        SetCloseOnExec(request->fds[i]);
+    }
+
+    string data;
+    bool ok = len == (ssize_t)sizeof(size) && request->fds[0] >= 0 &&
+              size <= kMaxRequestSize;
+    if (ok) {
+      data.resize(size);
+      ok = ReadAll(fd, &data[0], size);
+    }
+    RequestReader reader(data);
+    request->args.clear();
+    request->env.clear();
+    if (ok) {
+      ok = reader.ReadString() == kNinjaVersion;
+      reader.ReadStrings(&request->args);
+      reader.ReadStrings(&request->env);
+      ok = ok && reader.ok_ && !request->args.empty();
+    }
+
+    int32_t pid = ok ? getpid() : 0;
+    if (ok && WriteAll(fd, &pid, sizeof(pid))) {
+      client_fd_ = fd;
+      return true;
+    }
+    // Decline; the client builds on its own.
+    WriteAll(fd, &pid, sizeof(pid));
+    close(fd);
+    request->CloseFds();
+  }
+}
+
+void BuildServer::Finish(int exit_code) {
+  if (client_fd_ < 0)
+    return;
+  int32_t code = exit_code;
+  WriteAll(client_fd_, &code, sizeof(code));
+  close(client_fd_);
+  client_fd_ = -1;
+}
+
+BuildClient::BuildClient() : fd_(-1), server_pid_(0) {}
+
+BuildClient::~BuildClient() {
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+bool BuildClient::Connect(const string& path) {
+  sockaddr_un addr;
+  string err;
+  if (!MakeAddress(path, &addr, &err))
+    return false;
+  fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd_ < 0)
+    return false;
+  SetCloseOnExec(fd_);
+  SetNoSigPipe(fd_);
+  if (connect(fd_, (sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+  return true;
+}
+
+bool BuildClient::Send(const vector<string>& args, const vector<string>& env,
+                       const int fds[3]) {
+  string data = kNinjaVersion;
+  data.push_back('\0');
+  AppendUint32(&data, args.size());
+  AppendStrings(&data, args);
+  AppendUint32(&data, env.size());
+  AppendStrings(&data, env);
+
+  uint32_t size = data.size();
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  memset(control, 0, sizeof(control));
+  iovec iov = { &size, sizeof(size) };
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, 3 * sizeof(int));
+
+  ssize_t len;
+  do {
+    len = sendmsg(fd_, &msg, kSendFlags);
+  } while (len < 0 && errno == EINTR);
+  return len == (ssize_t)sizeof(size) && WriteAll(fd_, data.data(), size);
+}
+
+bool BuildClient::WaitForStart() {
+  int32_t pid = 0;
+  if (!ReadAll(fd_, &pid, sizeof(pid)) || pid <= 0)
+    return false;
+  server_pid_ = pid;
+  return true;
+}
+
+bool BuildClient::WaitForExit(int* exit_code) {
+  int32_t code;
+  if (!ReadAll(fd_, &code, sizeof(code)))
+    return false;
+  *exit_code = code;
+  return true;
+}
+
+bool RunOnBuildServer(const string& path, const vector<string>& args,
+                      int* exit_code) {
+  BuildClient client;
+  if (!client.Connect(path))
+    return false;
+
+  vector<string> env;
+  for (char** e = environ; *e; ++e)
+    env.push_back(*e);
+  const int fds[3] = { 0, 1, 2 };
+  fflush(stdout);
+  if (!client.Send(args, env, fds) || !client.WaitForStart())
+    return false;
+
+  // The server runs the build; interrupt it rather than this process.
+  g_server_pid = client.server_pid();
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = ForwardSignal;
+  act.sa_flags = SA_RESTART;
+  sigaction(SIGINT, &act, NULL);
+  sigaction(SIGTERM, &act, NULL);
+  sigaction(SIGHUP, &act, NULL);
+
+  if (!client.WaitForExit(exit_code)) {
+    Error("build server (pid %d) exited during the build",
+          client.server_pid());
+    *exit_code = 1;
+  }
+  return true;
+}
+
+void BuildLock::Acquire(const string& path, bool create) {
+  Release();
+  fd_ = open(path.c_str(), create ? O_RDWR | O_CREAT : O_RDWR, 0666);
+  if (fd_ < 0)
+    return;
+  SetCloseOnExec(fd_);
+  if (flock(fd_, LOCK_EX | LOCK_NB) == 0 || errno != EWOULDBLOCK)
+    return;
+  printf("ninja: waiting for another build in this directory to finish\n");
+  fflush(stdout);
+  while (flock(fd_, LOCK_EX) < 0 && errno == EINTR) {}
+}
+
+void BuildLock::Release() {
+  if (fd_ >= 0)
+    close(fd_);
+  fd_ = -1;
+}
@@ -0,0 +1,136 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_BUILD_SERVER_H_
+#define NINJA_BUILD_SERVER_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include <signal.h>
+
+/// The build server ("ninja -t server") keeps the build graph of a
+/// directory loaded between builds.  A ninja started in that directory
+/// connects to the server's Unix socket and forwards its command line, its
+/// environment and its stdin, stdout and stderr; the server runs the build
+/// on these and sends back the exit code.  This file has the transport;
+/// ninja.cc runs the builds.
+///
+/// The protocol, over a stream socket: the client sends the length of the
+/// request as 32 bits, together with its three file descriptors, followed
+/// by the request: the ninja version, the argument and environment counts
+/// (32 bits each) and the arguments and environment strings, each
+/// terminated by a NUL.  The server answers with its pid once it starts
+/// on the request, or 0 if it declines it, and with the exit code of the
+/// build once it's done.  All integers are in native byte order.
+
+/// A build forwarded by a client.
+struct BuildRequest {
+  BuildRequest();
+  ~BuildRequest();
+
+  /// Close the client's file descriptors.
+  void CloseFds();
+
+  vector<string> args;
+  vector<string> env;
+  /// The client's stdin, stdout and stderr.
+  int fds[3];
+};
+
+/// The listening side of the build server.
+struct BuildServer {
+  BuildServer();
+  /// Removes the socket and restores the signal handlers.
+  ~BuildServer();
+
+  /// Listen on the Unix socket |path|, which must not have another server.
+  /// Only this user may use the socket.  Also makes SIGINT, SIGTERM and
+  /// SIGHUP interrupt Accept().
+  bool Listen(const string& path, string* err);
+
+  /// Wait for the next request and accept it.  Returns false with an empty
+  /// |err| when interrupted by a signal.  Requests from clients of another
+  /// ninja version are declined, so that they build on their own, and so
+  /// are those of other users.
+  bool Accept(BuildRequest* request, string* err);
+
+  /// Send |exit_code| to the client of the accepted request and close the
+  /// connection.
+  void Finish(int exit_code);
+
+ private:
+  string path_;
+  int listen_fd_;
+  int client_fd_;
+  struct sigaction old_int_act_;
+  struct sigaction old_term_act_;
+  struct sigaction old_hup_act_;
+};
+
+/// The client side of the build server.
+struct BuildClient {
+  BuildClient();
+  ~BuildClient();
+
+  /// Connect to the server listening on |path|.  Returns false if there is
+  /// none.
+  bool Connect(const string& path);
+
+  /// Send a request to run |args| with |env| and the file descriptors
+  /// |fds| (stdin, stdout and stderr).
+  bool Send(const vector<string>& args, const vector<string>& env,
+            const int fds[3]);
+
+  /// Wait for the server to accept the request.  Returns false if it
+  /// declined it or went away.
+  bool WaitForStart();
+
+  /// The pid of the server, once it accepted the request.
+  int server_pid() const { return server_pid_; }
+
+  /// Wait for the build to finish.  Returns false if the server went away.
+  bool WaitForExit(int* exit_code);
+
+ private:
+  int fd_;
+  int server_pid_;
+};
+
+/// Run a build on the build server listening on |path|, forwarding this
+/// process' stdio and environment, and with SIGINT, SIGTERM and SIGHUP
+/// forwarded to the server.  Returns false if there is no server to run
+/// it, or fills in |exit_code|.
+bool RunOnBuildServer(const string& path, const vector<string>& args,
+                      int* exit_code);
+
+/// An exclusive lock on a file, so that only one build at a time runs in
+/// a build directory, with or without the build server.
+struct BuildLock {
+  BuildLock() : fd_(-1) {}
+  /// Releases the lock.
+  ~BuildLock() { Release(); }
+
+  /// Take the lock on the file |path|, which is created if |create| is
+  /// set.  Blocks while another process holds it, after printing a note.
+  /// If the file can't be opened, the build goes without the lock.
+  void Acquire(const string& path, bool create);
+  void Release();
+
+ private:
+  int fd_;
+};
+
+#endif  // NINJA_BUILD_SERVER_H_
@@ -0,0 +1,182 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "build_server.h"
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "test.h"
+
+namespace {
+
+const char kSocketPath[] = "server.sock";
+
+struct BuildServerTest : public testing::Test {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("Ninja-BuildServerTest");
+  }
+
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  ScopedTempDir temp_dir_;
+};
+
+}  // anonymous namespace
+
+TEST_F(BuildServerTest, NoServer) {
+  BuildClient client;
+  EXPECT_FALSE(client.Connect(kSocketPath));
+
+  vector<string> args(1, "ninja");
+  int exit_code = -1;
+  EXPECT_FALSE(RunOnBuildServer(kSocketPath, args, &exit_code));
+  EXPECT_EQ(-1, exit_code);
+}
+
+TEST_F(BuildServerTest, Request) {
+  BuildServer server;
+  string err;
+  ASSERT_TRUE(server.Listen(kSocketPath, &err));
+  ASSERT_EQ("", err);
+
+  // The client's stdout is a pipe, which the server writes to.
+  int output[2];
+  ASSERT_EQ(0, pipe(output));
+  int fds[3] = { 0, output[1], 2 };
+
+  vector<string> args;
+  args.push_back("ninja");
+  args.push_back("");
+  args.push_back("all");
+  vector<string> env;
+  env.push_back("PATH=/bin");
+  env.push_back("EMPTY=");
+
+  BuildClient client;
+  ASSERT_TRUE(client.Connect(kSocketPath));
+  ASSERT_TRUE(client.Send(args, env, fds));
+  close(output[1]);
+
+  BuildRequest request;
+  ASSERT_TRUE(server.Accept(&request, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(args, request.args);
+  EXPECT_EQ(env, request.env);
+  ASSERT_GE(request.fds[1], 0);
+  ASSERT_EQ(6, write(request.fds[1], "output", 6));
+  request.CloseFds();
+
+  char buf[16];
+  ASSERT_EQ(6, read(output[0], buf, sizeof(buf)));
+  EXPECT_EQ("output", string(buf, 6));
+  close(output[0]);
+
+  ASSERT_TRUE(client.WaitForStart());
+  EXPECT_EQ(getpid(), client.server_pid());
+  server.Finish(3);
+  int exit_code = 0;
+  ASSERT_TRUE(client.WaitForExit(&exit_code));
+  EXPECT_EQ(3, exit_code);
+}
+
+TEST_F(BuildServerTest, SkipBadRequest) {
+  BuildServer server;
+  string err;
+  ASSERT_TRUE(server.Listen(kSocketPath, &err));
+
+  // A client that hangs up without a request doesn't stop the server.
+  {
+    BuildClient client;
+    ASSERT_TRUE(client.Connect(kSocketPath));
+  }
+
+  BuildClient client;
+  ASSERT_TRUE(client.Connect(kSocketPath));
+  int fds[3] = { 0, 1, 2 };
+  ASSERT_TRUE(client.Send(vector<string>(1, "ninja"), vector<string>(), fds));
+
+  BuildRequest request;
+  ASSERT_TRUE(server.Accept(&request, &err));
+  EXPECT_EQ(vector<string>(1, "ninja"), request.args);
+  EXPECT_TRUE(request.env.empty());
+  ASSERT_TRUE(client.WaitForStart());
+  server.Finish(0);
+  int exit_code = 1;
+  ASSERT_TRUE(client.WaitForExit(&exit_code));
+  EXPECT_EQ(0, exit_code);
+}
+
+TEST_F(BuildServerTest, OneServerPerSocket) {
+  BuildServer server;
+  string err;
+  ASSERT_TRUE(server.Listen(kSocketPath, &err));
+
+  BuildServer second_server;
+  EXPECT_FALSE(second_server.Listen(kSocketPath, &err));
+  EXPECT_EQ("another build server is listening on server.sock", err);
+}
+
+TEST_F(BuildServerTest, OnlyThisUser) {
+  BuildServer server;
+  string err;
+  ASSERT_TRUE(server.Listen(kSocketPath, &err));
+  struct stat st;
+  ASSERT_EQ(0, stat(kSocketPath, &st));
+  EXPECT_EQ(0600, (int)(st.st_mode & 0777));
+
+  // Only root can act as another user, to check that the server declines
+  // the requests of other users even when they can reach the socket.
+  if (getuid() != 0)
+    return;
+  ASSERT_EQ(0, chmod(".", 0755));
+  ASSERT_EQ(0, chmod(kSocketPath, 0666));
+  int sent[2];
+  ASSERT_EQ(0, pipe(sent));
+  pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0) {
+    close(sent[0]);
+    if (setuid(65534) < 0)
+      _exit(2);
+    BuildClient client;
+    int fds[3] = { 0, 1, 2 };
+    if (!client.Connect(kSocketPath) ||
+        !client.Send(vector<string>(1, "ninja"), vector<string>(), fds))
+      _exit(3);
+    close(sent[1]);
+    _exit(client.WaitForStart() ? 1 : 0);
+  }
+  close(sent[1]);
+  char c;
+  ASSERT_EQ(0, read(sent[0], &c, 1));
+  close(sent[0]);
+
+  // The server takes the request of this user, after declining the other.
+  BuildClient client;
+  ASSERT_TRUE(client.Connect(kSocketPath));
+  int fds[3] = { 0, 1, 2 };
+  ASSERT_TRUE(client.Send(vector<string>(1, "ninja"), vector<string>(), fds));
+  BuildRequest request;
+  ASSERT_TRUE(server.Accept(&request, &err));
+  int status;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(0, WEXITSTATUS(status));
+  ASSERT_TRUE(client.WaitForStart());
+  server.Finish(0);
+}
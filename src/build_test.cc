@@ -17,6 +17,7 @@
 #include <assert.h>
 
 #include "build_log.h"
+#include "debug_flags.h"
 #include "deps_log.h"
 #include "graph.h"
 #include "test.h"
@@ -438,6 +439,193 @@ TEST_F(PlanTest, PoolWithFailingEdge) {
   ASSERT_EQ(0, edge);
 }
 
+TEST_F(PlanTest, RepeatedInputs) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build mid1 mid2: cat in\n"
+"build out: cat mid1 mid1 mid2 || mid2\n"));
+  GetNode("mid1")->MarkDirty();
+  GetNode("mid2")->MarkDirty();
+  GetNode("out")->MarkDirty();
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("mid1", edge->outputs_[0]->path());
+  EXPECT_FALSE(plan_.FindWork());
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+
+  // out waits for each of its inputs only once.
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("out", edge->outputs_[0]->path());
+  EXPECT_FALSE(plan_.FindWork());
+  plan_.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  EXPECT_FALSE(plan_.more_to_do());
+}
+
+TEST_F(PlanTest, CriticalPathFirst) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule gen\n"
+"  command = gen $in > $out\n"
+"rule touch\n"
+"  command = touch $out\n"
+"build gen: gen in\n"
+"build gen.o: cat gen\n"
+"build short.o: cat in\n"
+"build other.o: cat in\n"
+"build stamp: touch in\n"
+"build all: phony gen.o short.o other.o stamp\n"));
+  BuildLog log;
+  log.RecordCommand(GetNode("gen")->in_edge(), 0, 100);
+  log.RecordCommand(GetNode("gen.o")->in_edge(), 100, 200);
+  log.RecordCommand(GetNode("short.o")->in_edge(), 0, 10);
+  Plan plan(&log);
+
+  const char* kOutputs[] = { "gen", "gen.o", "short.o", "other.o", "stamp",
+                             "all" };
+  for (size_t i = 0; i < sizeof(kOutputs) / sizeof(kOutputs[0]); ++i)
+    GetNode(kOutputs[i])->MarkDirty();
+  string err;
+  EXPECT_TRUE(plan.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+
+  // gen is on the longest path.  other.o is estimated like the logged cat
+  // edges (55ms), and stamp like all logged edges (70ms).
+  Edge* edge = plan.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("gen", edge->outputs_[0]->path());
+  EXPECT_EQ(200, edge->critical_path_weight());
+  edge = plan.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("stamp", edge->outputs_[0]->path());
+  EXPECT_EQ(70, edge->critical_path_weight());
+  edge = plan.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("other.o", edge->outputs_[0]->path());
+  EXPECT_EQ(55, edge->critical_path_weight());
+  edge = plan.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("short.o", edge->outputs_[0]->path());
+  EXPECT_FALSE(plan.FindWork());
+}
+
+TEST_F(PlanTest, CriticalPathFirstInPool) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"pool link\n"
+"  depth = 1\n"
+"rule link\n"
+"  command = cat $in > $out\n"
+"  pool = link\n"
+"build fast: link in\n"
+"build slow: link in\n"
+"build all: phony fast slow\n"));
+  BuildLog log;
+  log.RecordCommand(GetNode("fast")->in_edge(), 0, 10);
+  log.RecordCommand(GetNode("slow")->in_edge(), 0, 1000);
+  Plan plan(&log);
+
+  GetNode("fast")->MarkDirty();
+  GetNode("slow")->MarkDirty();
+  GetNode("all")->MarkDirty();
+  string err;
+  EXPECT_TRUE(plan.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+
+  Edge* edge = plan.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("slow", edge->outputs_[0]->path());
+  EXPECT_FALSE(plan.FindWork());
+  plan.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  edge = plan.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("fast", edge->outputs_[0]->path());
+}
+
+TEST_F(PlanTest, MemoryBudget) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule link\n"
+"  command = cat $in > $out\n"
+"  memory = 6G\n"
+"build big: link in\n"
+"build small: link in\n"
+"  memory = 1G\n"
+"build huge: link in\n"
+"  memory = 100G\n"
+"build none: cat in\n"
+"build all: phony big small huge none\n"));
+  // The logged peak RSS wins over the declaration.
+  BuildLog log;
+  log.RecordCommand(GetNode("small")->in_edge(), 0, 10, 0, 5LL << 30);
+  Plan plan(&log);
+  plan.set_memory_budget(10LL << 30);
+
+  const char* kOutputs[] = { "big", "small", "huge", "none", "all" };
+  for (size_t i = 0; i < sizeof(kOutputs) / sizeof(kOutputs[0]); ++i)
+    GetNode(kOutputs[i])->MarkDirty();
+  string err;
+  EXPECT_TRUE(plan.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+
+  // The edges weigh the same, so they come in the order of their ids.
+  // Neither small, at its logged 5G, nor huge fits beside big.
+  Edge* big = plan.FindWork();
+  ASSERT_TRUE(big);
+  EXPECT_EQ("big", big->outputs_[0]->path());
+  Edge* edge = plan.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("none", edge->outputs_[0]->path());
+  plan.EdgeFinished(edge, Plan::kEdgeSucceeded);
+  EXPECT_FALSE(plan.FindWork());
+
+  // huge runs alone, once the others finished.
+  plan.EdgeFinished(big, Plan::kEdgeSucceeded);
+  Edge* small = plan.FindWork();
+  ASSERT_TRUE(small);
+  EXPECT_EQ("small", small->outputs_[0]->path());
+  EXPECT_FALSE(plan.FindWork());
+  plan.EdgeFinished(small, Plan::kEdgeSucceeded);
+  edge = plan.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("huge", edge->outputs_[0]->path());
+  EXPECT_FALSE(plan.FindWork());
+}
+
+TEST_F(PlanTest, BatchMemory) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $in -o $out\n"
+"  batch = 3\n"
+"  memory = 6G\n"
+"build a: cc in\n"
+"build b: cc in\n"
+"build c: cc in\n"
+"rule link\n"
+"  command = cat $in > $out\n"
+"  memory = 4G\n"
+"build l: link in\n"
+"build all: phony a b c l\n"));
+  Plan plan;
+  plan.set_memory_budget(10LL << 30);
+  const char* kOutputs[] = { "a", "b", "c", "l", "all" };
+  for (size_t i = 0; i < sizeof(kOutputs) / sizeof(kOutputs[0]); ++i)
+    GetNode(kOutputs[i])->MarkDirty();
+  string err;
+  EXPECT_TRUE(plan.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+
+  // A batch takes the memory of its largest edge, not that of all of them.
+  Edge* edge = plan.FindWork();
+  ASSERT_TRUE(edge);
+  vector<Edge*> batch;
+  plan.FindBatch(edge, &batch);
+  ASSERT_EQ(3u, batch.size());
+  Edge* link = plan.FindWork();
+  ASSERT_TRUE(link);
+  EXPECT_EQ("l", link->outputs_[0]->path());
+}
+
 /// Fake implementation of CommandRunner, useful for tests.
 struct FakeCommandRunner : public CommandRunner {
   explicit FakeCommandRunner(VirtualFileSystem* fs) :
@@ -446,6 +634,7 @@ struct FakeCommandRunner : public CommandRunner {
   // CommandRunner impl
   virtual bool CanRunMore();
   virtual bool StartCommand(Edge* edge);
+  virtual bool StartBatch(Edge* edge, const string& command);
   virtual bool WaitForCommand(Result* result);
   virtual vector<Edge*> GetActiveEdges();
   virtual void Abort();
@@ -575,6 +764,13 @@ bool FakeCommandRunner::StartCommand(Edge* edge) {
   return true;
 }
 
+bool FakeCommandRunner::StartBatch(Edge* edge, const string& command) {
+  if (!StartCommand(edge))
+    return false;
+  commands_ran_.back() = command;
+  return true;
+}
+
 bool FakeCommandRunner::WaitForCommand(Result* result) {
   if (!last_command_)
     return false;
@@ -1496,12 +1692,335 @@ TEST_F(BuildWithLogTest, RestatMissingInput) {
   ASSERT_EQ(restat_mtime, log_entry->mtime);
 }
 
+TEST_F(BuildWithLogTest, Builtin) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule stamp\n"
+"  command = touch $out\n"
+"  builtin = 1\n"
+"rule copy\n"
+"  command = cp $in $out\n"
+"  builtin = 1\n"
+"rule dir\n"
+"  command = mkdir -p $out\n"
+"  builtin = 1\n"
+"rule touch\n"
+"  command = touch -c $out\n"
+"  builtin = 1\n"
+"build gen/out.stamp: stamp in1\n"
+"build inc/in.h: copy in1\n"
+"build some/dir: dir\n"
+"build odd: touch\n"
+"build all: phony gen/out.stamp inc/in.h some/dir odd\n"));
+  fs_.Create("in1", "contents");
+  fs_.Tick();
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("all", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+
+  // Only the command with an option was run as usual.
+  ASSERT_EQ(1u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("touch -c odd", command_runner_.commands_ran_[0]);
+  EXPECT_EQ(2, fs_.Stat("gen/out.stamp", &err));
+  EXPECT_EQ("contents", fs_.files_["inc/in.h"].contents);
+  ASSERT_FALSE(fs_.directories_made_.empty());
+  EXPECT_EQ("some/dir", fs_.directories_made_.back());
+  EXPECT_TRUE(build_log_.LookupByOutput("gen/out.stamp"));
+  EXPECT_TRUE(build_log_.LookupByOutput("inc/in.h"));
+}
+
+TEST_F(BuildTest, BuiltinFailure) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule copy\n"
+"  command = cp missing $out\n"
+"  builtin = 1\n"
+"build out: copy in1\n"));
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(builder_.Build(&err));
+  EXPECT_EQ("subcommand failed", err);
+  EXPECT_TRUE(command_runner_.commands_ran_.empty());
+}
+
+TEST_F(BuildTest, BuiltinCopyToDirectory) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = cp in1 $dest\n"
+"  builtin = 1\n"
+"build inc/in1: touch in1\n"
+"  dest = inc\n"
+"build lib/in1: touch in1\n"
+"  dest = lib/\n"
+"build all: phony inc/in1 lib/in1\n"));
+  fs_.MakeDir("inc");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("all", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+
+  // Copies into a directory are left to the real cp.
+  ASSERT_EQ(2u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("cp in1 inc", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("cp in1 lib/", command_runner_.commands_ran_[1]);
+}
+
+TEST_F(BuildTest, BuiltinMakeDirsOverFile) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule dir\n"
+"  command = mkdir -p $out\n"
+"  builtin = 1\n"
+"build out: dir in1\n"));
+  fs_.Create("out", "");
+  fs_.Tick();
+  fs_.Create("in1", "");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(builder_.Build(&err));
+  EXPECT_EQ("subcommand failed", err);
+  EXPECT_TRUE(command_runner_.commands_ran_.empty());
+  EXPECT_TRUE(fs_.directories_made_.empty());
+}
+
+TEST_F(BuildTest, Batch) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"flags = -c\n"
+"rule touch\n"
+"  command = touch $flags $out\n"
+"  batch = 2\n"
+"build out1: touch in1\n"
+"build out2: touch in1\n"
+"build out3: touch in1\n"
+"build out4: touch in1\n"
+"  flags = -m\n"
+"build all: phony out1 out2 out3 out4\n"));
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("all", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+
+  // At most two edges share a command, and only if their commands differ
+  // in $in and $out alone.
+  ASSERT_EQ(3u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("touch -c out1 out2", command_runner_.commands_ran_[0]);
+  EXPECT_EQ("touch -c out3", command_runner_.commands_ran_[1]);
+  EXPECT_EQ("touch -m out4", command_runner_.commands_ran_[2]);
+}
+
+TEST_F(BuildWithLogTest, BatchFailure) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule fail\n"
+"  command = fail $out\n"
+"  batch = 3\n"
+"build out1: fail in1\n"
+"build out2: fail in1\n"
+"build out3: fail in1\n"
+"build all: phony out1 out2 out3\n"));
+  // Each edge that failed counts.
+  config_.failures_allowed = 2;
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("all", &err));
+  ASSERT_EQ("", err);
+  // The command fails, but writes one of the outputs, which may be
+  // incomplete.
+  fs_.Create("out2", "");
+  EXPECT_FALSE(builder_.Build(&err));
+  EXPECT_EQ("subcommands failed", err);
+
+  ASSERT_EQ(1u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("fail out1 out2 out3", command_runner_.commands_ran_[0]);
+  EXPECT_FALSE(build_log_.LookupByOutput("out1"));
+  EXPECT_FALSE(build_log_.LookupByOutput("out2"));
+  EXPECT_FALSE(build_log_.LookupByOutput("out3"));
+}
+
+TEST_F(BuildTest, ActionCache) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $in\n"
+"  cache = 1\n"
+"build out: cc in1\n"));
+  config_.cache_dir = "cache";
+  fs_.Create("in1", "one");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(1u, command_runner_.commands_ran_.size());
+
+  // The output comes from the cache, as in another build directory.
+  fs_.RemoveFile("out");
+  command_runner_.commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(command_runner_.commands_ran_.empty());
+  EXPECT_GT(fs_.Stat("out", &err), 0);
+
+  // Until the input changes.
+  fs_.Tick();
+  fs_.Create("in1", "two");
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(1u, command_runner_.commands_ran_.size());
+}
+
+TEST_F(BuildWithLogTest, ContentHash) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"content_hash = 1\n"
+"rule cc\n"
+"  command = cc $in\n"
+"build out: cc in1 in2\n"));
+  fs_.Create("in1", "one");
+  fs_.Create("in2", "two");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, command_runner_.commands_ran_.size());
+  BuildLog::LogEntry* entry = build_log_.LookupByOutput("out");
+  ASSERT_TRUE(entry);
+  EXPECT_NE(0u, entry->inputs_hash);
+  EXPECT_NE(0u, entry->content_hash);
+
+  // Rewriting an input with the same contents keeps the output clean, and
+  // logs its mtime, so that the next build doesn't hash it again.
+  fs_.Tick();
+  fs_.Create("in1", "one");
+  command_runner_.commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.AlreadyUpToDate());
+  EXPECT_EQ(fs_.Stat("in1", &err), entry->mtime);
+
+  // Other contents don't.
+  fs_.Tick();
+  fs_.Create("in2", "three");
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(1u, command_runner_.commands_ran_.size());
+}
+
+TEST_F(BuildWithLogTest, ContentHashRestat) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"content_hash = 1\n"
+"rule touch\n"
+"  command = touch $out\n"
+"  restat = 1\n"
+"rule cc\n"
+"  command = cc $in\n"
+"build mid: touch in\n"
+"build out: cc mid\n"));
+  fs_.Create("in", "one");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2u, command_runner_.commands_ran_.size());
+
+  // "touch" writes mid again, with the same contents, so out is cleaned.
+  fs_.Tick();
+  fs_.Create("in", "two");
+  command_runner_.commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, command_runner_.commands_ran_.size());
+  EXPECT_EQ("touch mid", command_runner_.commands_ran_[0]);
+
+  // mid is newer than out now, but has the contents out was built from.
+  command_runner_.commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.AlreadyUpToDate());
+}
+
+TEST_F(BuildWithLogTest, ContentHashRestatPlainDependent) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out\n"
+"  restat = 1\n"
+"  content_hash = 1\n"
+"rule cc\n"
+"  command = cc $in\n"
+"build mid: touch in\n"
+"build out: cc mid\n"));
+  fs_.Create("in", "one");
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2u, command_runner_.commands_ran_.size());
+
+  // out doesn't hash its inputs, so a newer mid with the same contents
+  // still rebuilds it, in this build rather than the next one.
+  fs_.Tick();
+  fs_.Create("in", "two");
+  command_runner_.commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(2u, command_runner_.commands_ran_.size());
+
+  command_runner_.commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.AlreadyUpToDate());
+}
+
 struct BuildDryRun : public BuildWithLogTest {
   BuildDryRun() {
     config_.dry_run = true;
   }
 };
 
+TEST_F(BuildDryRun, Builtin) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out\n"
+"  builtin = 1\n"
+"build out.stamp: touch in1\n"));
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out.stamp", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ(1u, command_runner_.commands_ran_.size());
+}
+
 TEST_F(BuildDryRun, AllCommandsShown) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
 "rule true\n"
@@ -1882,6 +2401,222 @@ TEST_F(BuildWithDepsLogTest, Straightforward) {
   }
 }
 
+/// Verify that depfiles read on deps threads are recorded in the order in
+/// which their commands finished.
+TEST_F(BuildWithDepsLogTest, DepsThreads) {
+  string err;
+  const char* manifest =
+      "rule cc\n  command = cc $in\n  depfile = $out.d\n  deps = gcc\n"
+      "build out1: cc in1\n"
+      "build out2: cc in1\n"
+      "build out3: cc in1\n"
+      "build all: phony out1 out2 out3\n";
+  config_.deps_threads = 3;
+
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state, manifest));
+
+  DepsLog deps_log;
+  ASSERT_TRUE(deps_log.OpenForWrite("ninja_deps", &err));
+  ASSERT_EQ("", err);
+
+  Builder builder(&state, config_, NULL, &deps_log, &fs_);
+  builder.command_runner_.reset(&command_runner_);
+  EXPECT_TRUE(builder.AddTarget("all", &err));
+  ASSERT_EQ("", err);
+  fs_.Create("out1.d", "out1: a/./b c/../c/d");
+  fs_.Create("out2.d", "out2: e");
+  fs_.Create("out3.d", "out3: c/d a/b");
+  EXPECT_TRUE(builder.Build(&err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(3u, command_runner_.commands_ran_.size());
+
+  // The deps log names the nodes in the order in which they were recorded.
+  const char* expected[] = { "out1", "a/b", "c/d", "out2", "e", "out3" };
+  ASSERT_EQ(6u, deps_log.nodes().size());
+  for (size_t i = 0; i < 6; ++i)
+    EXPECT_EQ(expected[i], deps_log.nodes()[i]->path());
+  DepsLog::Deps* deps = deps_log.GetDeps(state.LookupNode("out3"));
+  ASSERT_TRUE(deps);
+  ASSERT_EQ(2, deps->node_count);
+  EXPECT_EQ("c/d", deps_log.NodeForId(deps->id(0))->path());
+  EXPECT_EQ("a/b", deps_log.NodeForId(deps->id(1))->path());
+
+  // The depfiles were removed.
+  EXPECT_EQ(0, fs_.Stat("out1.d", &err));
+  EXPECT_EQ(0, fs_.Stat("out3.d", &err));
+
+  deps_log.Close();
+  builder.command_runner_.release();
+}
+
+/// Verify that a bad depfile read on a deps thread fails its command.
+TEST_F(BuildWithDepsLogTest, DepsThreadsBadDepfile) {
+  string err;
+  const char* manifest =
+      "rule cc\n  command = cc $in\n  depfile = $out.d\n  deps = gcc\n"
+      "build out1: cc in1\n";
+  config_.deps_threads = 2;
+
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state, manifest));
+
+  DepsLog deps_log;
+  ASSERT_TRUE(deps_log.OpenForWrite("ninja_deps", &err));
+  ASSERT_EQ("", err);
+
+  Builder builder(&state, config_, NULL, &deps_log, &fs_);
+  builder.command_runner_.reset(&command_runner_);
+  EXPECT_TRUE(builder.AddTarget("out1", &err));
+  ASSERT_EQ("", err);
+  fs_.Create("out1.d", "out1 out2: a\n");
+  EXPECT_FALSE(builder.Build(&err));
+  EXPECT_EQ("subcommand failed", err);
+  EXPECT_EQ(0u, deps_log.nodes().size());
+
+  deps_log.Close();
+  builder.command_runner_.release();
+}
+
+/// A VirtualFileSystem whose reads of |gated_path_| wait for |gate_|.
+struct GatedFileSystem : public VirtualFileSystem {
+  virtual Status ReadFile(const string& path, string* contents,
+                          string* err) {
+    if (path == gated_path_) {
+      ScopedLock lock(&gate_);
+    }
+    return VirtualFileSystem::ReadFile(path, contents, err);
+  }
+
+  string gated_path_;
+  Mutex gate_;
+};
+
+/// A FakeCommandRunner whose commands finish as they start, which opens
+/// the gate of its GatedFileSystem when a command is interrupted.
+struct GateOpeningCommandRunner : public FakeCommandRunner {
+  explicit GateOpeningCommandRunner(GatedFileSystem* fs)
+      : FakeCommandRunner(fs), gated_fs_(fs) {}
+
+  virtual bool HasFinishedCommand() { return last_command_ != NULL; }
+
+  virtual bool WaitForCommand(Result* result) {
+    if (!FakeCommandRunner::WaitForCommand(result))
+      return false;
+    if (result->status == ExitInterrupted)
+      gated_fs_->gate_.Unlock();
+    return true;
+  }
+
+  GatedFileSystem* gated_fs_;
+};
+
+/// Verify that a command whose depfile is being read when the build is
+/// interrupted is still recorded in the logs.
+TEST_F(BuildWithDepsLogTest, DepsThreadsInterrupted) {
+  string err;
+  const char* manifest =
+      "rule cc\n  command = cc $in\n  depfile = $out.d\n  deps = gcc\n"
+      "rule interrupt\n  command = interrupt\n"
+      "build out1: cc in1\n"
+      "build out2: interrupt in1\n"
+      "build all: phony out1 out2\n";
+  config_.deps_threads = 2;
+
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state, manifest));
+
+  GatedFileSystem fs;
+  fs.Create("in1", "");
+  fs.Create("out1.d", "out1: in2");
+  fs.gated_path_ = "out1.d";
+  fs.gate_.Lock();
+  GateOpeningCommandRunner command_runner(&fs);
+
+  BuildLog build_log;
+  DepsLog deps_log;
+  ASSERT_TRUE(deps_log.OpenForWrite("ninja_deps", &err));
+  ASSERT_EQ("", err);
+
+  {
+    Builder builder(&state, config_, &build_log, &deps_log, &fs);
+    builder.command_runner_.reset(&command_runner);
+    EXPECT_TRUE(builder.AddTarget("all", &err));
+    ASSERT_EQ("", err);
+    EXPECT_FALSE(builder.Build(&err));
+    EXPECT_EQ("interrupted by user", err);
+    builder.command_runner_.release();
+  }
+  ASSERT_EQ(2u, command_runner.commands_ran_.size());
+
+  // out1 finished before the interrupt, so both logs record it.
+  EXPECT_TRUE(build_log.LookupByOutput("out1"));
+  DepsLog::Deps* deps = deps_log.GetDeps(state.LookupNode("out1"));
+  ASSERT_TRUE(deps);
+  ASSERT_EQ(1, deps->node_count);
+  EXPECT_EQ("in2", deps_log.NodeForId(deps->id(0))->path());
+
+  deps_log.Close();
+}
+
+/// Verify that -d noimmutable runs the commands whose deps left out
+/// immutable files once, to record them, and not on every build.
+TEST_F(BuildWithDepsLogTest, NoImmutableRerunsOnce) {
+  string err;
+  const char* manifest =
+      "immutable_prefixes = /usr/include\n"
+      "build out: cat in1\n"
+      "  deps = gcc\n"
+      "  depfile = in1.d\n";
+  fs_.Create("/usr/include/stdio.h", "");
+  fs_.Tick();
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AddCatRule(&state));
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, manifest));
+    state.SetImmutablePrefixes(vector<string>(1, "/usr/include"));
+
+    DepsLog deps_log;
+    ASSERT_TRUE(deps_log.OpenForWrite("ninja_deps", &err));
+    Builder builder(&state, config_, NULL, &deps_log, &fs_);
+    builder.command_runner_.reset(&command_runner_);
+    EXPECT_TRUE(builder.AddTarget("out", &err));
+    fs_.Create("in1.d", "out: /usr/include/stdio.h in2");
+    EXPECT_TRUE(builder.Build(&err));
+    EXPECT_EQ("", err);
+    deps_log.Close();
+    builder.command_runner_.release();
+  }
+
+  g_use_immutable_prefixes = false;
+  for (int run = 0; run < 2; ++run) {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AddCatRule(&state));
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, manifest));
+
+    DepsLog deps_log;
+    ASSERT_TRUE(deps_log.Load("ninja_deps", &state, &err));
+    ASSERT_TRUE(deps_log.OpenForWrite("ninja_deps", &err));
+    Builder builder(&state, config_, NULL, &deps_log, &fs_);
+    builder.command_runner_.reset(&command_runner_);
+    command_runner_.commands_ran_.clear();
+    EXPECT_TRUE(builder.AddTarget("out", &err));
+    ASSERT_EQ("", err);
+    if (run == 0) {
+      // The deps lack stdio.h; the command runs to record it.
+      fs_.Create("in1.d", "out: /usr/include/stdio.h in2");
+      EXPECT_TRUE(builder.Build(&err));
+      EXPECT_EQ("", err);
+      EXPECT_EQ(1u, command_runner_.commands_ran_.size());
+    } else {
+      EXPECT_TRUE(builder.AlreadyUpToDate());
+    }
+    deps_log.Close();
+    builder.command_runner_.release();
+  }
+  g_use_immutable_prefixes = true;
+}
+
 /// Verify that obsolete dependency info causes a rebuild.
 /// 1) Run a successful build where everything has time t, record deps.
 /// 2) Move input/output to time t+1 -- despite files in alignment,
@@ -0,0 +1,211 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "change_journal.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "graph.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+#ifdef __linux__
+
+namespace {
+
+// A watch on a symbolic link to a directory would stay on its old target
+// when the link changes, so IN_DONT_FOLLOW makes watching those fail.
+const uint32_t kWatchMask = IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE |
+    IN_DELETE | IN_DELETE_SELF | IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM |
+    IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+/// The directory holding |path|: "." for a file in the current directory
+/// and "" for the root.
+string DirName(const string& path) {
+  string::size_type slash = path.rfind('/');
+  if (slash == string::npos)
+    return ".";
+  return path.substr(0, slash);
+}
+
+string JoinPath(const string& dir, const char* name) {
+  if (dir == ".")
+    return name;
+  return dir + "/" + name;
+}
+
+}  // namespace
+
+ChangeJournal::ChangeJournal() : fd_(-1), warned_(false), kept_(0) {}
+
+ChangeJournal::~ChangeJournal() {
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+bool ChangeJournal::Start(string* err) {
+  fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd_ < 0) {
+    *err = string("inotify_init1: ") + strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+void ChangeJournal::ResetState(State* state) {
+  if (fd_ < 0) {
+    state->Reset();
+    return;
+  }
+
+  METRIC_RECORD("change journal");
+  bool valid = ReadEvents(state);
+  if (!valid)
+    RemoveWatches();
+  kept_ = 0;
+  for (State::Paths::iterator i = state->paths_.begin();
+       i != state->paths_.end(); ++i) {
+    Node* node = i->second;
+    if (valid && node->watched()) {
+      node->ResetStateKeepingMtime();
+      if (node->status_known())
+        ++kept_;
+      continue;
+    }
+    node->ResetState();
+    node->set_watched(false);
+    if (fd_ >= 0)
+      Watch(node);
+  }
+  state->ResetEdges();
+}
+
+bool ChangeJournal::ReadEvents(State* state) {
+  union {
+    struct inotify_event event;
+    char data[64 * 1024];
+  } buf;
+  bool valid = true;
+  for (;;) {
+    ssize_t len = read(fd_, buf.data, sizeof(buf.data));
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+        return valid;
+      Warning("reading inotify events: %s", strerror(errno));
+      return false;
+    }
+    for (ssize_t pos = 0; pos < len; ) {
+      struct inotify_event* event = (struct inotify_event*)(buf.data + pos);
+      if (valid && !HandleEvent(state, event->wd, event->mask,
+                                event->len ? event->name : NULL)) {
+        valid = false;
+      }
+      pos += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+bool ChangeJournal::HandleEvent(State* state, int wd, unsigned mask,
+                                const char* name) {
+  if (mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF |
+              IN_UNMOUNT)) {
+    return false;
+  }
+  map<int, vector<string> >::iterator dirs = dirs_.find(wd);
+  if (!name || dirs == dirs_.end())
+    return true;
+  for (vector<string>::iterator dir = dirs->second.begin();
+       dir != dirs->second.end(); ++dir) {
+    string path = JoinPath(*dir, name);
+    // The paths of the watches below a renamed or replaced directory are
+    // stale.  Don't rely on IN_ISDIR, which isn't set for what replaced it.
+    if (watches_.count(path))
+      return false;
+    if (Node* node = state->LookupNode(path))
+      node->ResetState();
+  }
+  return true;
+}
+
+void ChangeJournal::Watch(Node* node) {
+  // Watch first, so that changes after the lstat() are seen.
+  if (!WatchDir(DirName(node->path())))
+    return;
+  struct stat st;
+  if (lstat(node->path().c_str(), &st) < 0) {
+    if (errno != ENOENT)
+      return;
+  } else if (!S_ISREG(st.st_mode) || st.st_nlink > 1) {
+    return;
+  }
+  node->set_watched(true);
+}
+
+bool ChangeJournal::WatchDir(const string& dir) {
+  if (watches_.count(dir))
+    return true;
+  // Renaming a parent changes the directory at |dir|, so watch them all.
+  if (!dir.empty() && dir != "." && !WatchDir(DirName(dir)))
+    return false;
+  const char* path = dir.empty() ? "/" : dir.c_str();
+  int wd = inotify_add_watch(fd_, path, kWatchMask);
+  if (wd < 0) {
+    if (errno == ENOSPC && !warned_) {
+      Warning("out of inotify watches; "
+              "raise /proc/sys/fs/inotify/max_user_watches");
+      warned_ = true;
+    }
+    return false;
+  }
+  watches_[dir] = wd;
+  dirs_[wd].push_back(dir);
+  return true;
+}
+
+void ChangeJournal::RemoveWatches() {
+  // Removing the watches one by one would queue an event for each, so
+  // start over with a new inotify instance.
+  close(fd_);
+  watches_.clear();
+  dirs_.clear();
+  string err;
+  if (!Start(&err))
+    Warning("%s", err.c_str());
+}
+
+#else  // !__linux__
+
+ChangeJournal::ChangeJournal() : fd_(-1), warned_(false), kept_(0) {}
+
+ChangeJournal::~ChangeJournal() {}
+
+bool ChangeJournal::Start(string* err) {
+  *err = "watching for changes needs inotify, which is only on Linux";
+  return false;
+}
+
+void ChangeJournal::ResetState(State* state) {
+  state->Reset();
+}
+
+#endif  // __linux__
@@ -0,0 +1,86 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_CHANGE_JOURNAL_H_
+#define NINJA_CHANGE_JOURNAL_H_
+
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+struct Node;
+struct State;
+
+/// Watches the directories of the nodes of a graph that stays loaded
+/// between builds, so that a build only needs to stat() the files that
+/// changed since the previous one.  Uses inotify, so it only works on
+/// Linux; elsewhere Start() fails.
+///
+/// A node is watched once the directory holding it and all the directories
+/// above it are; changes to its file, or renames of those directories, are
+/// then seen.  Directories, symbolic links and files with more than one
+/// link are never watched, because their mtimes can change without an
+/// event in the directory holding them, and neither are the nodes under a
+/// symbolic link to a directory, which can change to another one.  When
+/// the kernel drops events or removes a watch, nothing is trusted and the
+/// next build stat()s everything.
+struct ChangeJournal {
+  ChangeJournal();
+  ~ChangeJournal();
+
+  /// Start watching.
+  /// @return false on error.
+  bool Start(string* err);
+
+  bool started() const { return fd_ >= 0; }
+
+  /// Restore \a state to the state before a build, like State::Reset(),
+  /// but keep the mtimes of the watched nodes that didn't change.  Starts
+  /// watching the nodes that aren't yet, so that the next build can keep
+  /// theirs.
+  void ResetState(State* state);
+
+  /// The number of mtimes kept by the last ResetState().
+  size_t kept() const { return kept_; }
+
+ private:
+  /// Read the pending events and reset the nodes that changed.
+  /// @return false if events were lost.
+  bool ReadEvents(State* state);
+
+  /// Handle the event for |name| in the directory watched as |wd|.
+  /// @return false if it invalidates the watches.
+  bool HandleEvent(State* state, int wd, unsigned mask, const char* name);
+
+  /// Start watching \a node.
+  void Watch(Node* node);
+
+  /// Add a watch on |dir| and its parents.
+  /// @return false if that failed.
+  bool WatchDir(const string& dir);
+
+  /// Drop all watches.
+  void RemoveWatches();
+
+  int fd_;
+  /// The watched directories, and the paths they were watched as.  A
+  /// directory can be watched as more than one path.
+  map<string, int> watches_;
+  map<int, vector<string> > dirs_;
+  bool warned_;
+  size_t kept_;
+};
+
+#endif  // NINJA_CHANGE_JOURNAL_H_
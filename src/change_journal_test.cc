@@ -0,0 +1,170 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "change_journal.h"
+
+#include <stdio.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "disk_interface.h"
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+struct ChangeJournalTest : public testing::Test {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("Ninja-ChangeJournalTest");
+  }
+
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  /// stat() all nodes whose mtime isn't known, like a build does.
+  void StatAll() {
+    for (State::Paths::iterator i = state_.paths_.begin();
+         i != state_.paths_.end(); ++i) {
+      string err;
+      EXPECT_TRUE(i->second->StatIfNecessary(&disk_interface_, &err));
+    }
+  }
+
+  bool Known(const char* path) {
+    return state_.LookupNode(path)->status_known();
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_interface_;
+  State state_;
+  ChangeJournal journal_;
+};
+
+}  // anonymous namespace
+
+#ifdef __linux__
+
+TEST_F(ChangeJournalTest, KeepUnchanged) {
+  string err;
+  ASSERT_TRUE(disk_interface_.MakeDir("sub"));
+  ASSERT_TRUE(disk_interface_.WriteFile("a", ""));
+  ASSERT_TRUE(disk_interface_.WriteFile("sub/b", ""));
+  ASSERT_EQ(0, symlink("a", "link"));
+  state_.GetNode("a", 0);
+  state_.GetNode("sub/b", 0);
+  state_.GetNode("missing", 0);
+  state_.GetNode("link", 0);
+
+  ASSERT_TRUE(journal_.Start(&err));
+  journal_.ResetState(&state_);
+  EXPECT_EQ(0u, journal_.kept());
+  StatAll();
+
+  // Nothing changed, but symbolic links are always stat()ed again.
+  journal_.ResetState(&state_);
+  EXPECT_EQ(3u, journal_.kept());
+  EXPECT_TRUE(Known("a"));
+  EXPECT_TRUE(state_.LookupNode("a")->stat_prefetched());
+  EXPECT_TRUE(Known("sub/b"));
+  EXPECT_TRUE(Known("missing"));
+  EXPECT_FALSE(state_.LookupNode("missing")->exists());
+  EXPECT_FALSE(Known("link"));
+  StatAll();
+
+  ASSERT_TRUE(disk_interface_.WriteFile("a", "changed"));
+  ASSERT_TRUE(disk_interface_.WriteFile("missing", ""));
+  journal_.ResetState(&state_);
+  EXPECT_EQ(1u, journal_.kept());
+  EXPECT_FALSE(Known("a"));
+  EXPECT_TRUE(Known("sub/b"));
+  EXPECT_FALSE(Known("missing"));
+  EXPECT_FALSE(Known("link"));
+}
+
+TEST_F(ChangeJournalTest, RenamedDirectory) {
+  string err;
+  ASSERT_TRUE(disk_interface_.MakeDir("sub"));
+  ASSERT_TRUE(disk_interface_.MakeDir("sub/dir"));
+  ASSERT_TRUE(disk_interface_.WriteFile("a", ""));
+  ASSERT_TRUE(disk_interface_.WriteFile("sub/dir/b", ""));
+  state_.GetNode("a", 0);
+  state_.GetNode("sub/dir/b", 0);
+
+  ASSERT_TRUE(journal_.Start(&err));
+  journal_.ResetState(&state_);
+  StatAll();
+  journal_.ResetState(&state_);
+  EXPECT_EQ(2u, journal_.kept());
+  StatAll();
+
+  // Renaming a parent of a watched directory drops all mtimes.
+  ASSERT_EQ(0, rename("sub", "other"));
+  journal_.ResetState(&state_);
+  EXPECT_EQ(0u, journal_.kept());
+  EXPECT_FALSE(Known("a"));
+  EXPECT_FALSE(Known("sub/dir/b"));
+  StatAll();
+  EXPECT_FALSE(state_.LookupNode("sub/dir/b")->exists());
+
+  // The watches are back for the next build, except for the directory that
+  // is gone.
+  journal_.ResetState(&state_);
+  EXPECT_EQ(1u, journal_.kept());
+  EXPECT_TRUE(Known("a"));
+  EXPECT_FALSE(Known("sub/dir/b"));
+}
+
+TEST_F(ChangeJournalTest, SymlinkedDirectory) {
+  string err;
+  ASSERT_TRUE(disk_interface_.MakeDir("one"));
+  ASSERT_TRUE(disk_interface_.MakeDir("two"));
+  ASSERT_TRUE(disk_interface_.WriteFile("one/a", ""));
+  ASSERT_TRUE(disk_interface_.WriteFile("two/a", "other"));
+  ASSERT_EQ(0, symlink("one", "link"));
+  state_.GetNode("one/a", 0);
+  state_.GetNode("link/a", 0);
+
+  ASSERT_TRUE(journal_.Start(&err));
+  journal_.ResetState(&state_);
+  StatAll();
+
+  // Files under a symbolic link to a directory are always stat()ed again,
+  // as the link can change without an event for them.
+  journal_.ResetState(&state_);
+  EXPECT_EQ(1u, journal_.kept());
+  EXPECT_TRUE(Known("one/a"));
+  EXPECT_FALSE(Known("link/a"));
+  StatAll();
+
+  ASSERT_EQ(0, unlink("link"));
+  ASSERT_EQ(0, symlink("two", "link"));
+  journal_.ResetState(&state_);
+  EXPECT_FALSE(Known("link/a"));
+  StatAll();
+  EXPECT_EQ(state_.LookupNode("link/a")->mtime(),
+            disk_interface_.Stat("two/a", &err));
+}
+
+#else  // !__linux__
+
+TEST_F(ChangeJournalTest, NotSupported) {
+  string err;
+  EXPECT_FALSE(journal_.Start(&err));
+  EXPECT_FALSE(journal_.started());
+}
+
+#endif  // __linux__
@@ -19,3 +19,9 @@ bool g_keep_depfile = false;
 bool g_keep_rsp = false;
 
 bool g_experimental_statcache = true;
+
+bool g_experimental_manifest_cache = false;
+
+bool g_use_build_server = true;
+
+bool g_use_immutable_prefixes = true;
@@ -30,4 +30,10 @@ extern bool g_keep_rsp;
 
 extern bool g_experimental_statcache;
 
+extern bool g_experimental_manifest_cache;
+
+extern bool g_use_build_server;
+
+extern bool g_use_immutable_prefixes;
+
 #endif // NINJA_EXPLAIN_H_
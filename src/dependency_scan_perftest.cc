@@ -0,0 +1,118 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests the performance of the dirty scan of a no-op build, with and
+// without stat prefetching.  Expects to be run in ninja's root directory,
+// after manifest_parser_perftest has created the fake manifests.
+
+#include <algorithm>
+#include <numeric>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include "getopt.h"
+#include <direct.h>
+#else
+#include <getopt.h>
+#include <unistd.h>
+#endif
+
+#include "disk_interface.h"
+#include "graph.h"
+#include "manifest_parser.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+/// Load the manifest, then time the scan of all its root nodes.
+int ScanManifest(bool prefetch, int* optimization_guard) {
+  string err;
+  RealDiskInterface disk_interface;
+  State state;
+  ManifestParser parser(&state, &disk_interface, ManifestParserOptions());
+  if (!parser.Load("build.ninja", &err)) {
+    fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
+    exit(1);
+  }
+  vector<Node*> roots = state.RootNodes(&err);
+  if (!err.empty()) {
+    fprintf(stderr, "%s\n", err.c_str());
+    exit(1);
+  }
+
+  int64_t start = GetTimeMillis();
+  DependencyScan scan(&state, NULL, NULL, &disk_interface, NULL);
+  if (prefetch)
+    scan.PrefetchStats(roots);
+  for (vector<Node*>::iterator i = roots.begin(); i != roots.end(); ++i) {
+    if (!scan.RecomputeDirty(*i, &err)) {
+      fprintf(stderr, "%s\n", err.c_str());
+      exit(1);
+    }
+    *optimization_guard += (*i)->dirty();
+  }
+  return (int)(GetTimeMillis() - start);
+}
+
+void Measure(const char* name, bool prefetch) {
+  const int kNumRepetitions = 5;
+  vector<int> times;
+  for (int i = 0; i < kNumRepetitions; ++i) {
+    int optimization_guard = 0;
+    int delta = ScanManifest(prefetch, &optimization_guard);
+    printf("%s%dms (dirty: %d)\n", name, delta, optimization_guard);
+    times.push_back(delta);
+  }
+
+  int min = *min_element(times.begin(), times.end());
+  int max = *max_element(times.begin(), times.end());
+  float total = accumulate(times.begin(), times.end(), 0.0f);
+  printf("%smin %dms  max %dms  avg %.1fms\n", name, min, max,
+         total / times.size());
+}
+
+int main(int argc, char* argv[]) {
+  bool measure_serial = true;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("ph"))) != -1) {
+    switch (opt) {
+    case 'p':
+      measure_serial = false;
+      break;
+    case 'h':
+    default:
+      printf("usage: dependency_scan_perftest\n"
+"\n"
+"options:\n"
+"  -p     only measure the scan with stat prefetching\n"
+             );
+    return 1;
+    }
+  }
+
+  const char kManifestDir[] = "build/manifest_perftest";
+  if (chdir(kManifestDir) < 0) {
+    fprintf(stderr, "chdir %s: %s (run manifest_parser_perftest first)\n",
+            kManifestDir, strerror(errno));
+    return 1;
+  }
+
+  if (measure_serial)
+    Measure("serial:   ", false);
+  Measure("prefetch: ", true);
+}
@@ -47,6 +47,10 @@ struct DepfileParser {
   StringPiece out_;
   vector<StringPiece> ins_;
   DepfileParserOptions options_;
+  /// Whether Parse() takes plain text 16 or 32 bytes at a time where SSE2
+  /// or AVX2 is available, rather than only with its re2c grammar.  Used
+  /// for tests and benchmarks.
+  bool vectorized_;
 };
 
 #endif // NINJA_DEPFILE_PARSER_H_
@@ -19,43 +19,91 @@
 #include "util.h"
 #include "metrics.h"
 
-int main(int argc, char* argv[]) {
-  if (argc < 2) {
-    printf("usage: %s <file1> <file2...>\n", argv[0]);
-    return 1;
+/// A depfile like those of large C++ compiles: |count| long include paths,
+/// a few with escaped spaces, two to a line.
+string MakeDepfile(int count) {
+  string depfile = "out/obj/third_party/blink/renderer/core/layout/"
+                   "layout_block_flow.o: \\\n";
+  char buf[200];
+  for (int i = 0; i < count; ++i) {
+    if (i % 50 == 49) {
+      snprintf(buf, sizeof(buf),
+               "/opt/Vendor\\ SDK/include/vendor_%d/api.h", i);
+    } else if (i % 3 == 0) {
+      snprintf(buf, sizeof(buf),
+               "/usr/lib/gcc/x86_64-linux-gnu/12/../../../../include/c++/12/"
+               "bits/stl_header_%d.h", i);
+    } else {
+      snprintf(buf, sizeof(buf),
+               "../../third_party/blink/renderer/platform/graphics/"
+               "paint/generated_module_%d/display_item_list.h", i);
+    }
+    depfile += " ";
+    depfile += buf;
+    if (i % 2 == 1 && i + 1 < count)
+      depfile += " \\\n";
   }
+  depfile += "\n";
+  return depfile;
+}
 
-  vector<float> times;
-  for (int i = 1; i < argc; ++i) {
-    const char* filename = argv[i];
-
-    for (int limit = 1 << 10; limit < (1<<20); limit *= 2) {
-      int64_t start = GetTimeMillis();
-      for (int rep = 0; rep < limit; ++rep) {
-        string buf;
-        string err;
-        if (ReadFile(filename, &buf, &err) < 0) {
-          printf("%s: %s\n", filename, err.c_str());
-          return 1;
-        }
-
-        DepfileParser parser;
-        if (!parser.Parse(&buf, &err)) {
-          printf("%s: %s\n", filename, err.c_str());
-          return 1;
-        }
+/// Parse |content| until it takes over 100ms, and return the time of one
+/// parse in microseconds, or -1 on error.
+float TimeParse(const string& name, const string& content, bool vectorized) {
+  for (int limit = 1 << 4; limit < (1<<20); limit *= 2) {
+    int64_t start = GetTimeMillis();
+    for (int rep = 0; rep < limit; ++rep) {
+      string buf = content;
+      string err;
+      DepfileParser parser;
+      parser.vectorized_ = vectorized;
+      if (!parser.Parse(&buf, &err)) {
+        printf("%s: %s\n", name.c_str(), err.c_str());
+        return -1;
       }
-      int64_t end = GetTimeMillis();
+    }
+    int64_t end = GetTimeMillis();
 
-      if (end - start > 100) {
-        int delta = (int)(end - start);
-        float time = delta*1000 / (float)limit;
-        printf("%s: %.1fus\n", filename, time);
-        times.push_back(time);
-        break;
-      }
+    if (end - start > 100) {
+      int delta = (int)(end - start);
+      return delta*1000 / (float)limit;
+    }
+  }
+  return -1;
+}
+
+int main(int argc, char* argv[]) {
+  // Time the files given, or else generated depfiles of 90 to 270 KB.
+  vector<pair<string, string> > depfiles;
+  if (argc < 2) {
+    for (int count = 1000; count <= 3000; count += 1000) {
+      char name[50];
+      snprintf(name, sizeof(name), "<%d inputs>", count);
+      depfiles.push_back(make_pair(string(name), MakeDepfile(count)));
     }
   }
+  for (int i = 1; i < argc; ++i) {
+    string buf;
+    string err;
+    if (ReadFile(argv[i], &buf, &err) < 0) {
+      printf("%s: %s\n", argv[i], err.c_str());
+      return 1;
+    }
+    depfiles.push_back(make_pair(string(argv[i]), buf));
+  }
+
+  vector<float> times;
+  for (size_t i = 0; i < depfiles.size(); ++i) {
+    const string& name = depfiles[i].first;
+    float grammar = TimeParse(name, depfiles[i].second, false);
+    float vectorized = TimeParse(name, depfiles[i].second, true);
+    if (grammar < 0 || vectorized < 0)
+      return 1;
+    printf("%s (%dKB): %.1fus, %.1fus with the grammar only\n",
+           name.c_str(), (int)(depfiles[i].second.size() / 1024),
+           vectorized, grammar);
+    times.push_back(vectorized);
+  }
 
   if (!times.empty()) {
     float min = times[0];
@@ -288,3 +288,48 @@ TEST_F(DepfileParserTest, MultipleRulesRejectDifferentOutputs) {
   ASSERT_EQ("depfile has multiple output paths (on separate lines)"
             " [-w depfilemulti=err]", err);
 }
+
+TEST_F(DepfileParserTest, VectorizedMatchesGrammar) {
+  // Parse random depfiles, made of long runs of plain text and of the
+  // characters that end them, with and without taking plain text a block
+  // at a time, which must not change the result.
+  const char kPlain[] = "abcxyzABCXYZ0189+-./:_\x80\xff";
+  const char kOther[] = "    \\\\\\\n\n\t\r$$#*[]|%(){}=!@,~\"'`;<>?&^\x7f";
+  DepfileParserOptions options;
+  options.depfile_distinct_target_lines_action_ =
+      kDepfileDistinctTargetLinesActionError;
+  unsigned int seed = 1;
+  for (int i = 0; i < 5000; ++i) {
+    string input = i % 4 ? "out: " : "";
+    int pieces = 1 + i % 40;
+    for (int j = 0; j < pieces; ++j) {
+      seed = seed * 1103515245 + 12345;
+      int n = (seed >> 16) % 50;
+      bool plain = (seed >> 8) % 3 != 0;
+      for (int k = 0; k < (plain ? n : 1 + n % 3); ++k) {
+        seed = seed * 1103515245 + 12345;
+        if (plain)
+          input += kPlain[(seed >> 16) % (sizeof(kPlain) - 1)];
+        else
+          input += kOther[(seed >> 16) % (sizeof(kOther) - 1)];
+      }
+    }
+
+    DepfileParser grammar(options);
+    grammar.vectorized_ = false;
+    string grammar_input = input;
+    string grammar_err;
+    bool grammar_ok = grammar.Parse(&grammar_input, &grammar_err);
+
+    DepfileParser vectorized(options);
+    string vectorized_input = input;
+    string vectorized_err;
+    EXPECT_EQ(grammar_ok, vectorized.Parse(&vectorized_input,
+                                           &vectorized_err));
+    EXPECT_EQ(grammar_err, vectorized_err);
+    EXPECT_EQ(grammar.out_.AsString(), vectorized.out_.AsString());
+    ASSERT_EQ(grammar.ins_.size(), vectorized.ins_.size());
+    for (size_t j = 0; j < grammar.ins_.size(); ++j)
+      EXPECT_EQ(grammar.ins_[j].AsString(), vectorized.ins_[j].AsString());
+  }
+}
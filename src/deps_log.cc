@@ -14,6 +14,8 @@
 
 #include "deps_log.h"
 
+#include <algorithm>
+
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
@@ -33,12 +35,49 @@ typedef unsigned __int32 uint32_t;
 // The version is stored as 4 bytes after the signature and also serves as a
 // byte order mark. Signature and version combined are 16 bytes long.
 const char kFileSignature[] = "# ninjadeps\n";
-const int kCurrentVersion = 4;
+const int kCurrentVersion = 6;
+// Version 4 lacks the list records, and versions 4 and 5 the flag of the
+// records without immutable files; they are rewritten on the next build.
+const int kOldestSupportedVersion = 4;
+const size_t kHeaderSize = sizeof(kFileSignature) - 1 + 4;
 
 // Record size is currently limited to less than the full 32 bit, due to
 // internal buffers having to have this size.
 const unsigned kMaxRecordSize = (1 << 19) - 1;
 
+// The high bits of a record's length give its type; paths have neither.
+const unsigned kDepsRecord = 0x80000000;
+const unsigned kListRecord = 0x40000000;
+const unsigned kSharedDepsRecord = kDepsRecord | kListRecord;
+// Flags deps records that left out immutable files.
+const unsigned kLacksImmutableFlag = 0x20000000;
+
+// Recompact() only shares lists of at least this many inputs.
+const int kMinSharedCount = 8;
+
+namespace {
+
+typedef vector<vector<int> > IdLists;
+
+/// Orders indices into IdLists by their lists.
+struct ListOrder {
+  explicit ListOrder(const IdLists* lists) : lists_(lists) {}
+  bool operator()(int a, int b) const {
+    return (*lists_)[a] < (*lists_)[b];
+  }
+  const IdLists* lists_;
+};
+
+/// The number of ids that |a| and |b| start with in common.
+int CommonPrefix(const vector<int>& a, const vector<int>& b) {
+  size_t i = 0;
+  while (i < a.size() && i < b.size() && a[i] == b[i])
+    ++i;
+  return i;
+}
+
+}  // anonymous namespace
+
 DepsLog::~DepsLog() {
   Close();
 }
@@ -88,10 +127,35 @@ bool DepsLog::RecordDeps(Node* node, TimeStamp mtime,
 
 bool DepsLog::RecordDeps(Node* node, TimeStamp mtime,
                          int node_count, Node** nodes) {
+  // Immutable files can't make the output dirty; leave them out.
+  for (int i = 0; i < node_count; ++i) {
+    if (nodes[i]->immutable()) {
+      vector<Node*> mutable_nodes;
+      for (int j = 0; j < node_count; ++j) {
+        if (!nodes[j]->immutable())
+          mutable_nodes.push_back(nodes[j]);
+      }
+      return RecordDeps(node, mtime, mutable_nodes.size(),
+                        mutable_nodes.empty() ? NULL : &mutable_nodes[0],
+                        true);
+    }
+  }
+  return RecordDeps(node, mtime, node_count, nodes, false);
+}
+
+bool DepsLog::RecordDeps(Node* node, TimeStamp mtime, int node_count,
+                         Node** nodes, bool lacks_immutable) {
   // Track whether there's any new data to be recorded.
   bool made_change = false;
 
-  // Assign ids to all nodes that are missing one.
+  // Assign ids to all nodes that are missing one.  A path that is in the
+  // loaded log may not have its Node yet; create those first so that the
+  // path keeps its id.
+  bool missing_id = node->id() < 0;
+  for (int i = 0; i < node_count; ++i)
+    missing_id = missing_id || nodes[i]->id() < 0;
+  if (missing_id)
+    ResolveAllNodes();
   if (node->id() < 0) {
     if (!RecordId(node))
       return false;
@@ -110,11 +174,12 @@ bool DepsLog::RecordDeps(Node* node, TimeStamp mtime,
     Deps* deps = GetDeps(node);
     if (!deps ||
         deps->mtime != mtime ||
-        deps->node_count != node_count) {
+        deps->node_count != node_count ||
+        deps->lacks_immutable != lacks_immutable) {
       made_change = true;
     } else {
       for (int i = 0; i < node_count; ++i) {
-        if (deps->nodes[i] != nodes[i]) {
+        if (deps->id(i) != nodes[i]->id()) {
           made_change = true;
           break;
         }
@@ -126,41 +191,69 @@ bool DepsLog::RecordDeps(Node* node, TimeStamp mtime,
   if (!made_change)
     return true;
 
+  int* ids = static_cast<int*>(arena_.Alloc(node_count * sizeof(int)));
+  for (int i = 0; i < node_count; ++i)
+    ids[i] = nodes[i]->id();
+  Deps deps;
+  deps.mtime = mtime;
+  deps.node_count = node_count;
+  deps.ids = ids;
+  deps.lacks_immutable = lacks_immutable;
+  return WriteDeps(node->id(), -1, deps);
+}
+
+bool DepsLog::WriteDeps(int out_id, int list_id, const Deps& deps) {
   // Update on-disk representation.
-  unsigned size = 4 * (1 + 2 + node_count);
+  int count = deps.node_count - deps.shared_count;
+  unsigned size = 4 * (1 + 2 + (list_id >= 0) + count);
   if (size > kMaxRecordSize) {
     errno = ERANGE;
     return false;
   }
-  size |= 0x80000000;  // Deps record: set high bit.
+  size |= list_id >= 0 ? kSharedDepsRecord : kDepsRecord;
+  if (deps.lacks_immutable)
+    size |= kLacksImmutableFlag;
   if (fwrite(&size, 4, 1, file_) < 1)
     return false;
-  int id = node->id();
-  if (fwrite(&id, 4, 1, file_) < 1)
+  if (fwrite(&out_id, 4, 1, file_) < 1)
     return false;
-  uint32_t mtime_part = static_cast<uint32_t>(mtime & 0xffffffff);
+  uint32_t mtime_part = static_cast<uint32_t>(deps.mtime & 0xffffffff);
   if (fwrite(&mtime_part, 4, 1, file_) < 1)
     return false;
-  mtime_part = static_cast<uint32_t>((mtime >> 32) & 0xffffffff);
+  mtime_part = static_cast<uint32_t>((deps.mtime >> 32) & 0xffffffff);
   if (fwrite(&mtime_part, 4, 1, file_) < 1)
     return false;
-  for (int i = 0; i < node_count; ++i) {
-    id = nodes[i]->id();
-    if (fwrite(&id, 4, 1, file_) < 1)
-      return false;
-  }
+  if (list_id >= 0 && fwrite(&list_id, 4, 1, file_) < 1)
+    return false;
+  if (count && fwrite(deps.ids, 4 * count, 1, file_) < 1)
+    return false;
   if (fflush(file_) != 0)
     return false;
 
   // Update in-memory representation.
-  Deps* deps = new Deps(mtime, node_count);
-  for (int i = 0; i < node_count; ++i)
-    deps->nodes[i] = nodes[i];
-  UpdateDeps(node->id(), deps);
-
+  UpdateDeps(out_id, deps);
   return true;
 }
 
+const int* DepsLog::RecordList(const int* ids, int count) {
+  unsigned size = 4 * count;
+  if (size > kMaxRecordSize) {
+    errno = ERANGE;
+    return NULL;
+  }
+  size |= kListRecord;
+  if (fwrite(&size, 4, 1, file_) < 1 ||
+      fwrite(ids, 4 * count, 1, file_) < 1 ||
+      fflush(file_) != 0) {
+    return NULL;
+  }
+  ++list_count_;
+
+  int* copy = static_cast<int*>(arena_.Alloc(count * sizeof(int)));
+  memcpy(copy, ids, count * sizeof(int));
+  return copy;
+}
+
 void DepsLog::Close() {
   if (file_)
     fclose(file_);
@@ -169,136 +262,172 @@ void DepsLog::Close() {
 
 bool DepsLog::Load(const string& path, State* state, string* err) {
   METRIC_RECORD(".ninja_deps load");
-  char buf[kMaxRecordSize + 1];
-  FILE* f = fopen(path.c_str(), "rb");
-  if (!f) {
-    if (errno == ENOENT)
-      return true;
-    *err = strerror(errno);
-    return false;
+  state_ = state;
+  int ret = mapped_.Map(path, err);
+  if (ret == -ENOENT) {
+    err->clear();
+    return true;
   }
+  if (ret < 0)
+    return false;
 
-  bool valid_header = true;
+  const char* data = mapped_.data();
+  size_t size = mapped_.size();
   int version = 0;
-  if (!fgets(buf, sizeof(buf), f) || fread(&version, 4, 1, f) < 1)
-    valid_header = false;
+  bool valid_header = size >= kHeaderSize;
+  if (valid_header)
+    memcpy(&version, data + kHeaderSize - 4, 4);
   // Note: For version differences, this should migrate to the new format.
   // But the v1 format could sometimes (rarely) end up with invalid data, so
   // don't migrate v1 to v3 to force a rebuild. (v2 only existed for a few days,
   // and there was no release with it, so pretend that it never happened.)
-  if (!valid_header || strcmp(buf, kFileSignature) != 0 ||
-      version != kCurrentVersion) {
+  if (!valid_header ||
+      memcmp(data, kFileSignature, sizeof(kFileSignature) - 1) != 0 ||
+      version < kOldestSupportedVersion || version > kCurrentVersion) {
     if (version == 1)
       *err = "deps log version change; rebuilding";
     else
       *err = "bad deps log signature or version; starting over";
-    fclose(f);
+    mapped_.Unmap();
     unlink(path.c_str());
     // Don't report this as a failure.  An empty deps log will cause
     // us to rebuild the outputs anyway.
     return true;
   }
 
-  long offset;
+  // Find the records first, and only point into the mapping once it is
+  // known which of them survive.  Maps id -> offset of its last deps record.
+  vector<unsigned> deps_offsets;
+  // Maps list id -> offset of the list record.
+  vector<unsigned> list_offsets;
+  size_t offset = kHeaderSize;
   bool read_failed = false;
   int unique_dep_record_count = 0;
   int total_dep_record_count = 0;
-  for (;;) {
-    offset = ftell(f);
-
-    unsigned size;
-    if (fread(&size, 4, 1, f) < 1) {
-      if (!feof(f))
-        read_failed = true;
+  while (offset < size) {
+    unsigned record_size;
+    if (size - offset < 4) {
+      read_failed = true;
       break;
     }
-    bool is_deps = (size >> 31) != 0;
-    size = size & 0x7FFFFFFF;
-
-    if (size > kMaxRecordSize || fread(buf, size, 1, f) < 1) {
+    memcpy(&record_size, data + offset, 4);
+    unsigned type = record_size & kSharedDepsRecord;
+    record_size = record_size & ~(kSharedDepsRecord | kLacksImmutableFlag);
+    // Records are padded to 4 bytes, which keeps the ids aligned.
+    if (record_size > kMaxRecordSize || record_size % 4 != 0 ||
+        size - offset - 4 < record_size) {
       read_failed = true;
       break;
     }
-
-    if (is_deps) {
-      assert(size % 4 == 0);
-      int* deps_data = reinterpret_cast<int*>(buf);
-      int out_id = deps_data[0];
-      TimeStamp mtime;
-      mtime = (TimeStamp)(((uint64_t)(unsigned int)deps_data[2] << 32) |
-                          (uint64_t)(unsigned int)deps_data[1]);
-      deps_data += 3;
-      int deps_count = (size / 4) - 3;
-
-      Deps* deps = new Deps(mtime, deps_count);
-      for (int i = 0; i < deps_count; ++i) {
-        assert(deps_data[i] < (int)nodes_.size());
-        assert(nodes_[deps_data[i]]);
-        deps->nodes[i] = nodes_[deps_data[i]];
+    const int* record = reinterpret_cast<const int*>(data + offset + 4);
+
+    int id_count = path_offsets_.size();
+    if (type == kListRecord) {
+      bool valid = record_size > 0;
+      for (int i = 0; valid && i < (int)(record_size / 4); ++i)
+        valid = record[i] >= 0 && record[i] < id_count;
+      if (!valid) {
+        read_failed = true;
+        break;
       }
-
-      total_dep_record_count++;
-      if (!UpdateDeps(out_id, deps))
+      list_offsets.push_back(offset);
+    } else if (type != 0) {
+      int start = type == kSharedDepsRecord ? 4 : 3;
+      int out_id = record[0];
+      int deps_count = (int)(record_size / 4) - start;
+      bool valid = deps_count >= 0 && out_id >= 0 && out_id < id_count;
+      if (valid && type == kSharedDepsRecord)
+        valid = record[3] >= 0 && record[3] < (int)list_offsets.size();
+      for (int i = 0; valid && i < deps_count; ++i)
+        valid = record[start + i] >= 0 && record[start + i] < id_count;
+      if (!valid) {
+        read_failed = true;
+        break;
+      }
+      if (out_id >= (int)deps_offsets.size())
+        deps_offsets.resize(out_id + 1);
+      if (!deps_offsets[out_id])
         ++unique_dep_record_count;
+      deps_offsets[out_id] = offset;
+      ++total_dep_record_count;
     } else {
-      int path_size = size - 4;
-      assert(path_size > 0);  // CanonicalizePath() rejects empty paths.
-      // There can be up to 3 bytes of padding.
-      if (buf[path_size - 1] == '\0') --path_size;
-      if (buf[path_size - 1] == '\0') --path_size;
-      if (buf[path_size - 1] == '\0') --path_size;
-      StringPiece subpath(buf, path_size);
-      // It is not necessary to pass in a correct slash_bits here. It will
-      // either be a Node that's in the manifest (in which case it will already
-      // have a correct slash_bits that GetNode will look up), or it is an
-      // implicit dependency from a .d which does not affect the build command
-      // (and so need not have its slashes maintained).
-      Node* node = state->GetNode(subpath, 0);
-
+      // CanonicalizePath() rejects empty paths, so there is at least one
+      // padded word of path before the checksum.
+      if (record_size < 8) {
+        read_failed = true;
+        break;
+      }
       // Check that the expected index matches the actual index. This can only
       // happen if two ninja processes write to the same deps log concurrently.
       // (This uses unary complement to make the checksum look less like a
       // dependency record entry.)
-      unsigned checksum = *reinterpret_cast<unsigned*>(buf + size - 4);
+      unsigned checksum = record[record_size / 4 - 1];
       int expected_id = ~checksum;
-      int id = nodes_.size();
-      if (id != expected_id) {
+      if ((int)path_offsets_.size() != expected_id) {
         read_failed = true;
         break;
       }
-
-      assert(node->id() < 0);
-      node->set_id(id);
-      nodes_.push_back(node);
+      path_offsets_.push_back(offset);
     }
+    offset += 4 + record_size;
   }
 
   if (read_failed) {
     // An error occurred while loading; try to recover by truncating the
     // file to the last fully-read record.
-    if (ferror(f)) {
-      *err = strerror(ferror(f));
-    } else {
-      *err = "premature end of file";
-    }
-    fclose(f);
-
-    if (!Truncate(path, offset, err))
+    mapped_.Unmap();
+    if (!Truncate(path, offset, err) || mapped_.Map(path, err) < 0)
       return false;
 
     // The truncate succeeded; we'll just report the load error as a
     // warning because the build can proceed.
-    *err += "; recovering";
-    return true;
+    *err = "premature end of file; recovering";
   }
 
-  fclose(f);
+  data = mapped_.data();
+  nodes_.resize(path_offsets_.size());
+  unresolved_count_ = nodes_.size();
+  list_count_ = list_offsets.size();
+  deps_.resize(deps_offsets.size());
+  for (int id = 0; id < (int)deps_offsets.size(); ++id) {
+    if (!deps_offsets[id])
+      continue;
+    unsigned record_size;
+    memcpy(&record_size, data + deps_offsets[id], 4);
+    bool shared = (record_size & kSharedDepsRecord) == kSharedDepsRecord;
+    // Older logs don't say whether they left immutable files out.
+    bool lacks_immutable = (record_size & kLacksImmutableFlag) ||
+                           version < kCurrentVersion;
+    record_size = record_size & ~(kSharedDepsRecord | kLacksImmutableFlag);
+    const int* record =
+        reinterpret_cast<const int*>(data + deps_offsets[id] + 4);
+    Deps& deps = deps_[id];
+    deps.mtime = (TimeStamp)(((uint64_t)(unsigned int)record[2] << 32) |
+                             (uint64_t)(unsigned int)record[1]);
+    deps.lacks_immutable = lacks_immutable;
+    if (shared) {
+      unsigned list_offset = list_offsets[record[3]];
+      unsigned list_size;
+      memcpy(&list_size, data + list_offset, 4);
+      deps.shared_count = (list_size & ~kSharedDepsRecord) / 4;
+      deps.shared_ids = reinterpret_cast<const int*>(data + list_offset + 4);
+      deps.node_count = deps.shared_count + (record_size / 4) - 4;
+      deps.ids = record + 4;
+    } else {
+      deps.node_count = (record_size / 4) - 3;
+      deps.ids = record + 3;
+    }
+    // GetDeps() looks outputs up by their ids, so they need their Nodes now.
+    NodeForId(id);
+  }
 
-  // Rebuild the log if there are too many dead records.
+  // Rebuild the log if there are too many dead records, or to share the
+  // lists of an old log.
   int kMinCompactionEntryCount = 1000;
   int kCompactionRatio = 3;
-  if (total_dep_record_count > kMinCompactionEntryCount &&
-      total_dep_record_count > unique_dep_record_count * kCompactionRatio) {
+  if ((total_dep_record_count > kMinCompactionEntryCount &&
+       total_dep_record_count > unique_dep_record_count * kCompactionRatio) ||
+      version < kCurrentVersion) {
     needs_recompaction_ = true;
   }
 
@@ -310,12 +439,47 @@ DepsLog::Deps* DepsLog::GetDeps(Node* node) {
   // there's no deps recorded for the node.
   if (node->id() < 0 || node->id() >= (int)deps_.size())
     return NULL;
-  return deps_[node->id()];
+  Deps* deps = &deps_[node->id()];
+  return deps->node_count < 0 ? NULL : deps;
+}
+
+Node* DepsLog::NodeForId(int id) {
+  Node* node = nodes_[id];
+  if (node)
+    return node;
+
+  const char* record = mapped_.data() + path_offsets_[id];
+  unsigned size;
+  memcpy(&size, record, 4);
+  const char* path = record + 4;
+  int path_size = size - 4;
+  // There can be up to 3 bytes of padding.
+  if (path[path_size - 1] == '\0') --path_size;
+  if (path[path_size - 1] == '\0') --path_size;
+  if (path[path_size - 1] == '\0') --path_size;
+  // It is not necessary to pass in a correct slash_bits here. It will
+  // either be a Node that's in the manifest (in which case it will already
+  // have a correct slash_bits that GetNode will look up), or it is an
+  // implicit dependency from a .d which does not affect the build command
+  // (and so need not have its slashes maintained).
+  node = state_->GetNode(StringPiece(path, path_size), 0);
+
+  assert(node->id() < 0);
+  node->set_id(id);
+  nodes_[id] = node;
+  --unresolved_count_;
+  return node;
+}
+
+void DepsLog::ResolveAllNodes() {
+  for (int id = 0; unresolved_count_ > 0 && id < (int)nodes_.size(); ++id)
+    NodeForId(id);
 }
 
 bool DepsLog::Recompact(const string& path, string* err) {
   METRIC_RECORD(".ninja_deps recompact");
 
+  ResolveAllNodes();
   Close();
   string temp_path = path + ".recompact";
 
@@ -332,16 +496,105 @@ bool DepsLog::Recompact(const string& path, string* err) {
   for (vector<Node*>::iterator i = nodes_.begin(); i != nodes_.end(); ++i)
     (*i)->set_id(-1);
   
-  // Write out all deps again.
+  // Give the live outputs and their inputs ids in new_log, and collect
+  // their deps in terms of the new ids.
+  vector<int> outputs;
+  IdLists lists;
   for (int old_id = 0; old_id < (int)deps_.size(); ++old_id) {
-    Deps* deps = deps_[old_id];
-    if (!deps) continue;  // If nodes_[old_id] is a leaf, it has no deps.
+    const Deps& deps = deps_[old_id];
+    // If nodes_[old_id] is a leaf, it has no deps.
+    if (deps.node_count < 0)
+      continue;
 
     if (!IsDepsEntryLiveFor(nodes_[old_id]))
       continue;
 
-    if (!new_log.RecordDeps(nodes_[old_id], deps->mtime,
-                            deps->node_count, deps->nodes)) {
+    Node* out = nodes_[old_id];
+    if (out->id() < 0 && !new_log.RecordId(out)) {
+      new_log.Close();
+      return false;
+    }
+    outputs.push_back(old_id);
+    lists.push_back(vector<int>());
+    vector<int>& ids = lists.back();
+    ids.reserve(deps.node_count);
+    for (int i = 0; i < deps.node_count; ++i) {
+      Node* node = nodes_[deps.id(i)];
+      if (node->immutable()) {
+        deps_[old_id].lacks_immutable = true;
+        continue;
+      }
+      if (node->id() < 0 && !new_log.RecordId(node)) {
+        new_log.Close();
+        return false;
+      }
+      ids.push_back(node->id());
+    }
+  }
+
+  // Sorting the lists puts those with long common prefixes next to each
+  // other.  Write the longest prefix that a list has in common with its
+  // neighbors as a list record, if the lists that start with it save more
+  // than it costs, and let all of them share it.
+  int count = outputs.size();
+  vector<int> order(count);
+  for (int i = 0; i < count; ++i)
+    order[i] = i;
+  sort(order.begin(), order.end(), ListOrder(&lists));
+  // common[k] is the common prefix of the lists at order[k] and order[k + 1].
+  vector<int> common(count, 0);
+  for (int k = 0; k + 1 < count; ++k)
+    common[k] = CommonPrefix(lists[order[k]], lists[order[k + 1]]);
+
+  vector<Deps> shared(count);
+  vector<int> list_ids(count, -1);
+  int list_id = -1;
+  int list_size = 0;
+  const int* list = NULL;
+  for (int k = 0; k < count; ++k) {
+    int prev = k > 0 ? common[k - 1] : 0;
+    if (prev < list_size) {
+      // The current list isn't a prefix of this one.
+      list_id = -1;
+      list_size = 0;
+    }
+    int best = max(prev, common[k]);
+    if (best >= kMinSharedCount && best > list_size) {
+      // Count the lists that would use a new list until it pays off.
+      int users = 1;
+      for (int j = k; j + 1 < count && common[j] >= best &&
+           users * (best - list_size) <= best; ++j) {
+        ++users;
+      }
+      if (users * (best - list_size) > best) {
+        list = new_log.RecordList(&lists[order[k]][0], best);
+        if (!list) {
+          new_log.Close();
+          return false;
+        }
+        list_id = new_log.list_count_ - 1;
+        list_size = best;
+      }
+    }
+    if (list_id >= 0) {
+      list_ids[order[k]] = list_id;
+      shared[order[k]].shared_count = list_size;
+      shared[order[k]].shared_ids = list;
+    }
+  }
+
+  // Write out all deps again.
+  for (int i = 0; i < count; ++i) {
+    Deps deps = shared[i];
+    deps.mtime = deps_[outputs[i]].mtime;
+    deps.lacks_immutable = deps_[outputs[i]].lacks_immutable;
+    deps.node_count = lists[i].size();
+    int rest = deps.node_count - deps.shared_count;
+    int* ids = static_cast<int*>(new_log.arena_.Alloc(rest * sizeof(int)));
+    for (int j = 0; j < rest; ++j)
+      ids[j] = lists[i][deps.shared_count + j];
+    deps.ids = ids;
+    if (!new_log.WriteDeps(nodes_[outputs[i]]->id(), list_ids[i], deps)) {
       new_log.Close();
       return false;
     }
@@ -349,9 +602,14 @@ bool DepsLog::Recompact(const string& path, string* err) {
 
   new_log.Close();
 
-  // All nodes now have ids that refer to new_log, so steal its data.
+  // All nodes now have ids that refer to new_log, so steal its data.  The
+  // old file's mapping is no longer referenced.
   deps_.swap(new_log.deps_);
   nodes_.swap(new_log.nodes_);
+  path_offsets_.swap(new_log.path_offsets_);
+  list_count_ = new_log.list_count_;
+  arena_.Absorb(&new_log.arena_);
+  mapped_.Unmap();
 
   if (unlink(path.c_str()) < 0) {
     *err = strerror(errno);
@@ -376,15 +634,13 @@ bool DepsLog::IsDepsEntryLiveFor(Node* node) {
   return node->in_edge() && !node->in_edge()->GetBinding("deps").empty();
 }
 
-bool DepsLog::UpdateDeps(int out_id, Deps* deps) {
+bool DepsLog::UpdateDeps(int out_id, const Deps& deps) {
   if (out_id >= (int)deps_.size())
     deps_.resize(out_id + 1);
 
-  bool delete_old = deps_[out_id] != NULL;
-  if (delete_old)
-    delete deps_[out_id];
+  bool replace_old = deps_[out_id].node_count >= 0;
   deps_[out_id] = deps;
-  return delete_old;
+  return replace_old;
 }
 
 bool DepsLog::RecordId(Node* node) {
@@ -413,6 +669,8 @@ bool DepsLog::RecordId(Node* node) {
 
   node->set_id(id);
   nodes_.push_back(node);
+  // Only paths of the loaded file need their offset.
+  path_offsets_.push_back(0);
 
   return true;
 }
@@ -21,6 +21,8 @@ using namespace std;
 
 #include <stdio.h>
 
+#include "arena.h"
+#include "mapped_file.h"
 #include "timestamp.h"
 
 struct Node;
@@ -36,7 +38,8 @@ struct State;
 /// - it can be read all at once on startup.  (Alternative designs, where
 ///   it contains indexing information, were considered and discarded as
 ///   too complicated to implement; if the file is small than reading it
-///   fully on startup is acceptable.)
+///   fully on startup is acceptable.)  The file is mapped rather than read,
+///   and dependency lists are used in place, so loading doesn't copy them.
 /// Here are some stats from the Windows Chrome dependency files, to
 /// help guide the design space.  The total text in the files sums to
 /// 90mb so some compression is warranted to keep load-time fast.
@@ -50,7 +53,7 @@ struct State;
 /// A dependency list maps an output id to a list of input ids.
 ///
 /// Concretely, a record is:
-///    four bytes record length, high bit indicates record type
+///    four bytes record length, high two bits indicate record type
 ///      (but max record sizes are capped at 512kB)
 ///    path records contain the string name of the path, followed by up to 3
 ///      padding bytes to align on 4 byte boundaries, followed by the
@@ -62,11 +65,24 @@ struct State;
 ///       input path id, input path id...]
 ///      (The mtime is compared against the on-disk output path mtime
 ///      to verify the stored data is up-to-date.)
+///    list records are an array of input path ids that several dependency
+///      lists start with; numbering them in file order gives list ids.
+///    shared dependency records are dependency records with a list id
+///      after the mtime; the inputs are those of the list followed by the
+///      input path ids of the record.
+///    the third highest bit of the length of either kind of dependency
+///      record flags the lists that left out immutable files.
 /// If two records reference the same output the latter one in the file
 /// wins, allowing updates to just be appended to the file.  A separate
-/// repacking step can run occasionally to remove dead records.
+/// repacking step can run occasionally to remove dead records, and to
+/// move the inputs that outputs have in common to list records.  (Most
+/// compiles of a project include mostly the same headers.)
+///
+/// Loading only creates Nodes for the outputs that have deps; the Nodes of
+/// their inputs are created when NodeForId() first asks for them.
 struct DepsLog {
-  DepsLog() : needs_recompaction_(false), file_(NULL) {}
+  DepsLog() : needs_recompaction_(false), file_(NULL), state_(NULL),
+              unresolved_count_(0), list_count_(0) {}
   ~DepsLog();
 
   // Writing (build-time) interface.
@@ -76,16 +92,33 @@ struct DepsLog {
   void Close();
 
   // Reading (startup-time) interface.
+  /// A view of a dependency list, either in the mapped file or, for lists
+  /// recorded since it was loaded, in the log's arena.
   struct Deps {
-    Deps(int64_t mtime, int node_count)
-        : mtime(mtime), node_count(node_count), nodes(new Node*[node_count]) {}
-    ~Deps() { delete [] nodes; }
+    Deps()
+        : mtime(0), node_count(-1), shared_count(0), shared_ids(NULL),
+          ids(NULL), lacks_immutable(false) {}
+    /// The id of the |i|th dependency; see NodeForId().
+    int id(int i) const {
+      return i < shared_count ? shared_ids[i] : ids[i - shared_count];
+    }
     TimeStamp mtime;
+    /// -1 if there is no list.
     int node_count;
-    Node** nodes;
+    /// The first dependencies, from a list that other outputs share.
+    int shared_count;
+    const int* shared_ids;
+    /// The remaining node_count - shared_count dependencies.
+    const int* ids;
+    /// Whether immutable files were left out of the list, which
+    /// -d noimmutable then has to record again.
+    bool lacks_immutable;
   };
   bool Load(const string& path, State* state, string* err);
+  /// The deps of |node|, valid until the next RecordDeps(), or NULL.
   Deps* GetDeps(Node* node);
+  /// The Node with id |id|, created on first use.
+  Node* NodeForId(int id);
 
   /// Rewrite the known log entries, throwing away old data.
   bool Recompact(const string& path, string* err);
@@ -98,24 +131,49 @@ struct DepsLog {
   /// it from code that runs on every build.
   bool IsDepsEntryLiveFor(Node* node);
 
-  /// Used for tests.
+  /// Used for tests.  Nodes that NodeForId() hasn't created yet are NULL.
   const vector<Node*>& nodes() const { return nodes_; }
-  const vector<Deps*>& deps() const { return deps_; }
+  const vector<Deps>& deps() const { return deps_; }
 
  private:
-  // Updates the in-memory representation.  Takes ownership of |deps|.
-  // Returns true if a prior deps record was deleted.
-  bool UpdateDeps(int out_id, Deps* deps);
+  // Updates the in-memory representation.
+  // Returns true if a prior deps record was replaced.
+  bool UpdateDeps(int out_id, const Deps& deps);
+  // Record |nodes| as they are, flagged with |lacks_immutable|.
+  bool RecordDeps(Node* node, TimeStamp mtime, int node_count, Node** nodes,
+                  bool lacks_immutable);
   // Write a node name record, assigning it an id.
   bool RecordId(Node* node);
+  // Write a list record, assigning it the next list id.  Returns the
+  // log's copy of the ids, or NULL on error.
+  const int* RecordList(const int* ids, int count);
+  // Write a deps record for |out_id|, sharing the list |list_id| if it
+  // isn't -1, and make |deps| its deps.  The ids of |deps| must live as
+  // long as the log.
+  bool WriteDeps(int out_id, int list_id, const Deps& deps);
+  // Create the Nodes of all ids, so that no path gets a second id.
+  void ResolveAllNodes();
 
   bool needs_recompaction_;
   FILE* file_;
 
-  /// Maps id -> Node.
+  /// The loaded file, which the ids of loaded Deps point into.
+  MappedFile mapped_;
+  /// The ids of Deps recorded since loading.
+  Arena arena_;
+  /// Where NodeForId() creates Nodes.
+  State* state_;
+
+  /// Maps id -> Node, or NULL if it hasn't been created yet.
   vector<Node*> nodes_;
+  /// Maps id -> offset of its path record in |mapped_|.
+  vector<unsigned> path_offsets_;
+  /// The number of NULLs in |nodes_|.
+  int unresolved_count_;
+  /// The number of list records.
+  int list_count_;
   /// Maps id -> deps of that id.
-  vector<Deps*> deps_;
+  vector<Deps> deps_;
 
   friend struct DepsLogTest;
 };
@@ -0,0 +1,238 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Times loading a deps log of the size of Chrome's, as appended to by
+// builds and after recompaction has shared the lists of headers that most
+// compiles have in common, and reports the memory that loading takes.  The
+// memory is measured in a fresh process, started with -r, so that writing
+// the log doesn't count.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "deps_log.h"
+#include "graph.h"
+#include "manifest_parser.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+const char kTestFilename[] = "DepsLogPerfTest-tempfile";
+
+/// The stats from the Windows Chrome dependency files in deps_log.h: 10k
+/// outputs whose dependencies reference 40k paths.  Every compile includes
+/// the same system headers, those of its component and a few others.
+const int kNumOutputs = 10000;
+const int kSystemHeaders = 1000;
+const int kNumComponents = 100;
+const int kComponentHeaders = 300;
+const int kOtherHeaders = 10000;
+const int kOtherHeadersPerOutput = 20;
+
+string OutputName(int i) {
+  char buf[80];
+  sprintf(buf, "obj/component%d/output%d.o", i % kNumComponents, i);
+  return buf;
+}
+
+/// Declare the outputs in |state|, so that recompaction keeps their deps.
+bool AddManifest(State* state, string* err) {
+  string manifest = "rule cc\n  command = cc\n  deps = gcc\n";
+  for (int i = 0; i < kNumOutputs; ++i)
+    manifest += "build " + OutputName(i) + ": cc\n";
+  ManifestParser parser(state, NULL);
+  return parser.ParseTest(manifest, err);
+}
+
+bool WriteTestData(string* err) {
+  unlink(kTestFilename);
+  State state;
+  DepsLog log;
+  if (!log.OpenForWrite(kTestFilename, err))
+    return false;
+
+  vector<Node*> system, others;
+  vector<vector<Node*> > components(kNumComponents);
+  for (int i = 0; i < kSystemHeaders; ++i) {
+    char buf[80];
+    sprintf(buf, "/usr/include/some/system/header%d.h", i);
+    system.push_back(state.GetNode(buf, 0));
+  }
+  for (int c = 0; c < kNumComponents; ++c) {
+    for (int i = 0; i < kComponentHeaders; ++i) {
+      char buf[80];
+      sprintf(buf, "../../component%d/include/header%d.h", c, i);
+      components[c].push_back(state.GetNode(buf, 0));
+    }
+  }
+  for (int i = 0; i < kOtherHeaders; ++i) {
+    char buf[80];
+    sprintf(buf, "../../third_party/some/other/header%d.h", i);
+    others.push_back(state.GetNode(buf, 0));
+  }
+
+  srand(1);
+  for (int i = 0; i < kNumOutputs; ++i) {
+    vector<Node*> deps = system;
+    const vector<Node*>& component = components[i % kNumComponents];
+    deps.insert(deps.end(), component.begin(), component.end());
+    for (int j = 0; j < kOtherHeadersPerOutput; ++j)
+      deps.push_back(others[rand() % kOtherHeaders]);
+    if (!log.RecordDeps(state.GetNode(OutputName(i), 0), 1, deps)) {
+      *err = "failed to record deps";
+      return false;
+    }
+  }
+  log.Close();
+  return true;
+}
+
+bool Recompact(string* err) {
+  State state;
+  DepsLog log;
+  return AddManifest(&state, err) &&
+      log.Load(kTestFilename, &state, err) &&
+      log.Recompact(kTestFilename, err);
+}
+
+int64_t FileSize() {
+  FILE* f = fopen(kTestFilename, "rb");
+  if (!f)
+    return -1;
+  fseek(f, 0, SEEK_END);
+  int64_t size = ftell(f);
+  fclose(f);
+  return size;
+}
+
+/// Load the log and, if |resolve| is set, look at every dependency like
+/// the scan of a no-op build does.
+bool Load(State* state, DepsLog* log, bool resolve) {
+  string err;
+  if (!log->Load(kTestFilename, state, &err) || !err.empty()) {
+    fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
+    return false;
+  }
+  if (!resolve)
+    return true;
+  for (int id = 0; id < (int)log->deps().size(); ++id) {
+    const DepsLog::Deps& deps = log->deps()[id];
+    for (int i = 0; i < deps.node_count; ++i)
+      log->NodeForId(deps.id(i));
+  }
+  return true;
+}
+
+bool Measure(const char* name, bool resolve) {
+  {
+    // Read once to warm up disk cache.
+    State state;
+    DepsLog log;
+    if (!Load(&state, &log, resolve))
+      return false;
+  }
+  vector<int> times;
+  const int kNumRepetitions = 5;
+  for (int i = 0; i < kNumRepetitions; ++i) {
+    int64_t start = GetTimeMillis();
+    State state;
+    DepsLog log;
+    if (!Load(&state, &log, resolve))
+      return false;
+    times.push_back((int)(GetTimeMillis() - start));
+  }
+
+  int min = times[0];
+  int max = times[0];
+  float total = 0;
+  for (size_t i = 0; i < times.size(); ++i) {
+    total += times[i];
+    if (times[i] < min)
+      min = times[i];
+    else if (times[i] > max)
+      max = times[i];
+  }
+
+  printf("%-32s min %4dms  max %4dms  avg %6.1fms\n",
+         name, min, max, total / times.size());
+  return true;
+}
+
+/// Print the peak memory of loading the log, for the parent process.
+int ReportMemory() {
+  int64_t before = GetPeakMemoryUsage();
+  {
+    State state;
+    DepsLog log;
+    if (!Load(&state, &log, false))
+      return 1;
+  }
+  int64_t loaded = GetPeakMemoryUsage();
+  {
+    State state;
+    DepsLog log;
+    if (!Load(&state, &log, true))
+      return 1;
+  }
+  int64_t resolved = GetPeakMemoryUsage();
+  if (before < 0) {
+    printf("peak memory usage is unknown on this platform\n");
+    return 0;
+  }
+  printf("%-32s %6.1fMB\n", "peak rss, load:",
+         (loaded - before) / (1024.0 * 1024.0));
+  printf("%-32s %6.1fMB\n", "peak rss, load and resolve all:",
+         (resolved - before) / (1024.0 * 1024.0));
+  return 0;
+}
+
+/// Time loading the log, and report its size and the memory it takes.
+bool Report(const char* argv0, const char* name) {
+  printf("%s: %.1fMB\n", name, FileSize() / (1024.0 * 1024.0));
+  if (!Measure("load:", false) ||
+      !Measure("load, resolve all:", true)) {
+    return false;
+  }
+  fflush(stdout);
+  string command = string(argv0) + " -r";
+  return system(command.c_str()) == 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc == 2 && strcmp(argv[1], "-r") == 0)
+    return ReportMemory();
+
+  string err;
+  if (!WriteTestData(&err)) {
+    fprintf(stderr, "Failed to write test data: %s\n", err.c_str());
+    return 1;
+  }
+  if (!Report(argv[0], "appended"))
+    return 1;
+
+  if (!Recompact(&err)) {
+    fprintf(stderr, "Failed to recompact test data: %s\n", err.c_str());
+    return 1;
+  }
+  if (!Report(argv[0], "recompacted"))
+    return 1;
+
+  unlink(kTestFilename);
+  return 0;
+}
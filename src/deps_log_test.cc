@@ -59,8 +59,8 @@ TEST_F(DepsLogTest, WriteRead) {
     ASSERT_TRUE(log_deps);
     ASSERT_EQ(1, log_deps->mtime);
     ASSERT_EQ(2, log_deps->node_count);
-    ASSERT_EQ("foo.h", log_deps->nodes[0]->path());
-    ASSERT_EQ("bar.h", log_deps->nodes[1]->path());
+    ASSERT_EQ("foo.h", log1.NodeForId(log_deps->id(0))->path());
+    ASSERT_EQ("bar.h", log1.NodeForId(log_deps->id(1))->path());
   }
 
   log1.Close();
@@ -73,7 +73,7 @@ TEST_F(DepsLogTest, WriteRead) {
   ASSERT_EQ(log1.nodes().size(), log2.nodes().size());
   for (int i = 0; i < (int)log1.nodes().size(); ++i) {
     Node* node1 = log1.nodes()[i];
-    Node* node2 = log2.nodes()[i];
+    Node* node2 = log2.NodeForId(i);
     ASSERT_EQ(i, node1->id());
     ASSERT_EQ(node1->id(), node2->id());
   }
@@ -83,8 +83,8 @@ TEST_F(DepsLogTest, WriteRead) {
   ASSERT_TRUE(log_deps);
   ASSERT_EQ(2, log_deps->mtime);
   ASSERT_EQ(2, log_deps->node_count);
-  ASSERT_EQ("foo.h", log_deps->nodes[0]->path());
-  ASSERT_EQ("bar2.h", log_deps->nodes[1]->path());
+  ASSERT_EQ("foo.h", log2.NodeForId(log_deps->id(0))->path());
+  ASSERT_EQ("bar2.h", log2.NodeForId(log_deps->id(1))->path());
 }
 
 TEST_F(DepsLogTest, LotsOfDeps) {
@@ -120,6 +120,147 @@ TEST_F(DepsLogTest, LotsOfDeps) {
   ASSERT_EQ(kNumDeps, log_deps->node_count);
 }
 
+// Verify that loading only creates the Nodes of outputs, and that paths of
+// the loaded file keep their ids when new deps are recorded.
+TEST_F(DepsLogTest, LazyNodes) {
+  {
+    State state;
+    DepsLog log;
+    string err;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h", 0));
+    deps.push_back(state.GetNode("bar.h", 0));
+    log.RecordDeps(state.GetNode("out.o", 0), 1, deps);
+    log.Close();
+  }
+
+  State state;
+  DepsLog log;
+  string err;
+  EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(state.LookupNode("out.o"));
+  EXPECT_FALSE(state.LookupNode("foo.h"));
+  EXPECT_FALSE(state.LookupNode("bar.h"));
+
+  DepsLog::Deps* deps = log.GetDeps(state.LookupNode("out.o"));
+  ASSERT_TRUE(deps);
+  ASSERT_EQ(2, deps->node_count);
+  EXPECT_EQ("foo.h", log.NodeForId(deps->id(0))->path());
+  EXPECT_EQ(state.LookupNode("foo.h"), log.NodeForId(deps->id(0)));
+  EXPECT_FALSE(state.LookupNode("bar.h"));
+
+  // bar.h has no Node yet, but must not be recorded a second time.
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  vector<Node*> new_deps;
+  new_deps.push_back(state.GetNode("bar.h", 0));
+  new_deps.push_back(state.GetNode("baz.h", 0));
+  log.RecordDeps(state.GetNode("out2.o", 0), 2, new_deps);
+  log.Close();
+  EXPECT_EQ(2, state.LookupNode("bar.h")->id());
+  EXPECT_EQ(5, (int)log.nodes().size());
+
+  State state2;
+  DepsLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &state2, &err));
+  ASSERT_EQ("", err);
+  deps = log2.GetDeps(state2.LookupNode("out2.o"));
+  ASSERT_TRUE(deps);
+  ASSERT_EQ(2, deps->node_count);
+  EXPECT_EQ("bar.h", log2.NodeForId(deps->id(0))->path());
+  EXPECT_EQ("baz.h", log2.NodeForId(deps->id(1))->path());
+}
+
+// Verify that immutable files are left out of the deps.
+TEST_F(DepsLogTest, SkipImmutable) {
+  State state;
+  vector<string> prefixes;
+  prefixes.push_back("/usr/include");
+  state.SetImmutablePrefixes(prefixes);
+  DepsLog log;
+  string err;
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  vector<Node*> deps;
+  deps.push_back(state.GetNode("/usr/include/stdio.h", 0));
+  deps.push_back(state.GetNode("foo.h", 0));
+  log.RecordDeps(state.GetNode("out.o", 0), 1, deps);
+  log.Close();
+
+  DepsLog::Deps* log_deps = log.GetDeps(state.GetNode("out.o", 0));
+  ASSERT_TRUE(log_deps);
+  ASSERT_EQ(1, log_deps->node_count);
+  EXPECT_EQ("foo.h", log.NodeForId(log_deps->id(0))->path());
+  EXPECT_EQ(-1, state.GetNode("/usr/include/stdio.h", 0)->id());
+  EXPECT_TRUE(log_deps->lacks_immutable);
+}
+
+// Verify that the records that left out immutable files say so, also once
+// loaded and recompacted.
+TEST_F(DepsLogTest, LacksImmutable) {
+  const char kManifest[] =
+"rule cc\n"
+"  command = cc\n"
+"  deps = gcc\n"
+"build complete.o: cc\n"
+"build stripped.o: cc\n";
+
+  {
+    State state;
+    vector<string> prefixes;
+    prefixes.push_back("/usr/include");
+    state.SetImmutablePrefixes(prefixes);
+    DepsLog log;
+    string err;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h", 0));
+    log.RecordDeps(state.GetNode("complete.o", 0), 1, deps);
+    deps.push_back(state.GetNode("/usr/include/stdio.h", 0));
+    log.RecordDeps(state.GetNode("stripped.o", 0), 1, deps);
+    log.Close();
+  }
+
+  for (int pass = 0; pass < 2; ++pass) {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+    DepsLog log;
+    string err;
+    EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_EQ("", err);
+    DepsLog::Deps* deps = log.GetDeps(state.GetNode("complete.o", 0));
+    ASSERT_TRUE(deps);
+    EXPECT_FALSE(deps->lacks_immutable);
+    deps = log.GetDeps(state.GetNode("stripped.o", 0));
+    ASSERT_TRUE(deps);
+    EXPECT_TRUE(deps->lacks_immutable);
+    ASSERT_EQ(1, deps->node_count);
+
+    // Recording the complete list clears the flag.
+    if (pass == 0) {
+      ASSERT_TRUE(log.Recompact(kTestFilename, &err));
+      continue;
+    }
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    vector<Node*> nodes;
+    nodes.push_back(state.GetNode("foo.h", 0));
+    nodes.push_back(state.GetNode("/usr/include/stdio.h", 0));
+    log.RecordDeps(state.GetNode("stripped.o", 0), 1, nodes);
+    log.Close();
+    deps = log.GetDeps(state.GetNode("stripped.o", 0));
+    ASSERT_TRUE(deps);
+    EXPECT_FALSE(deps->lacks_immutable);
+    EXPECT_EQ(2, deps->node_count);
+  }
+}
+
 // Verify that adding the same deps twice doesn't grow the file.
 TEST_F(DepsLogTest, DoubleEntry) {
   // Write some deps to the file and grab its size.
@@ -242,15 +383,15 @@ TEST_F(DepsLogTest, Recompact) {
     ASSERT_TRUE(deps);
     ASSERT_EQ(1, deps->mtime);
     ASSERT_EQ(1, deps->node_count);
-    ASSERT_EQ("foo.h", deps->nodes[0]->path());
+    ASSERT_EQ("foo.h", log.NodeForId(deps->id(0))->path());
 
     Node* other_out = state.GetNode("other_out.o", 0);
     deps = log.GetDeps(other_out);
     ASSERT_TRUE(deps);
     ASSERT_EQ(1, deps->mtime);
     ASSERT_EQ(2, deps->node_count);
-    ASSERT_EQ("foo.h", deps->nodes[0]->path());
-    ASSERT_EQ("baz.h", deps->nodes[1]->path());
+    ASSERT_EQ("foo.h", log.NodeForId(deps->id(0))->path());
+    ASSERT_EQ("baz.h", log.NodeForId(deps->id(1))->path());
 
     ASSERT_TRUE(log.Recompact(kTestFilename, &err));
 
@@ -259,15 +400,15 @@ TEST_F(DepsLogTest, Recompact) {
     ASSERT_TRUE(deps);
     ASSERT_EQ(1, deps->mtime);
     ASSERT_EQ(1, deps->node_count);
-    ASSERT_EQ("foo.h", deps->nodes[0]->path());
+    ASSERT_EQ("foo.h", log.NodeForId(deps->id(0))->path());
     ASSERT_EQ(out, log.nodes()[out->id()]);
 
     deps = log.GetDeps(other_out);
     ASSERT_TRUE(deps);
     ASSERT_EQ(1, deps->mtime);
     ASSERT_EQ(2, deps->node_count);
-    ASSERT_EQ("foo.h", deps->nodes[0]->path());
-    ASSERT_EQ("baz.h", deps->nodes[1]->path());
+    ASSERT_EQ("foo.h", log.NodeForId(deps->id(0))->path());
+    ASSERT_EQ("baz.h", log.NodeForId(deps->id(1))->path());
     ASSERT_EQ(other_out, log.nodes()[other_out->id()]);
 
     // The file should have shrunk a bit for the smaller deps.
@@ -291,15 +432,15 @@ TEST_F(DepsLogTest, Recompact) {
     ASSERT_TRUE(deps);
     ASSERT_EQ(1, deps->mtime);
     ASSERT_EQ(1, deps->node_count);
-    ASSERT_EQ("foo.h", deps->nodes[0]->path());
+    ASSERT_EQ("foo.h", log.NodeForId(deps->id(0))->path());
 
     Node* other_out = state.GetNode("other_out.o", 0);
     deps = log.GetDeps(other_out);
     ASSERT_TRUE(deps);
     ASSERT_EQ(1, deps->mtime);
     ASSERT_EQ(2, deps->node_count);
-    ASSERT_EQ("foo.h", deps->nodes[0]->path());
-    ASSERT_EQ("baz.h", deps->nodes[1]->path());
+    ASSERT_EQ("foo.h", log.NodeForId(deps->id(0))->path());
+    ASSERT_EQ("baz.h", log.NodeForId(deps->id(1))->path());
 
     ASSERT_TRUE(log.Recompact(kTestFilename, &err));
 
@@ -322,6 +463,129 @@ TEST_F(DepsLogTest, Recompact) {
   }
 }
 
+// Verify that recompaction lets outputs share the inputs they start with.
+TEST_F(DepsLogTest, RecompactSharesLists) {
+  const char kManifest[] =
+"rule cc\n"
+"  command = cc\n"
+"  deps = gcc\n"
+"build a.o: cc\n"
+"build b.o: cc\n"
+"build c.o: cc\n"
+"build d.o: cc\n";
+  const int kNumHeaders = 20;
+
+  int file_size;
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    for (int i = 0; i < kNumHeaders; ++i) {
+      char buf[32];
+      sprintf(buf, "header%d.h", i);
+      deps.push_back(state.GetNode(buf, 0));
+    }
+    // a.o and b.o have the same deps, c.o has one more at the end and d.o
+    // has few in common with them.
+    log.RecordDeps(state.GetNode("a.o", 0), 1, deps);
+    log.RecordDeps(state.GetNode("b.o", 0), 2, deps);
+    deps.push_back(state.GetNode("c.h", 0));
+    log.RecordDeps(state.GetNode("c.o", 0), 3, deps);
+    deps.erase(deps.begin() + 2, deps.end());
+    deps.push_back(state.GetNode("d.h", 0));
+    log.RecordDeps(state.GetNode("d.o", 0), 4, deps);
+
+    ASSERT_TRUE(log.Recompact(kTestFilename, &err));
+    EXPECT_EQ(kNumHeaders, log.GetDeps(state.LookupNode("a.o"))->shared_count);
+    log.Close();
+
+    struct stat st;
+    ASSERT_EQ(0, stat(kTestFilename, &st));
+    file_size = (int)st.st_size;
+  }
+
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+  DepsLog log;
+  string err;
+  ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+
+  const char* kOutputs[] = { "a.o", "b.o", "c.o" };
+  for (int i = 0; i < 3; ++i) {
+    DepsLog::Deps* deps = log.GetDeps(state.LookupNode(kOutputs[i]));
+    ASSERT_TRUE(deps);
+    EXPECT_EQ(i + 1, deps->mtime);
+    ASSERT_EQ(kNumHeaders + (i == 2), deps->node_count);
+    EXPECT_EQ(kNumHeaders, deps->shared_count);
+    EXPECT_EQ("header0.h", log.NodeForId(deps->id(0))->path());
+    EXPECT_EQ("header19.h", log.NodeForId(deps->id(19))->path());
+  }
+  EXPECT_EQ(log.GetDeps(state.LookupNode("a.o"))->shared_ids,
+            log.GetDeps(state.LookupNode("c.o"))->shared_ids);
+  EXPECT_EQ("c.h", log.NodeForId(
+      log.GetDeps(state.LookupNode("c.o"))->id(kNumHeaders))->path());
+
+  DepsLog::Deps* deps = log.GetDeps(state.LookupNode("d.o"));
+  ASSERT_TRUE(deps);
+  EXPECT_EQ(0, deps->shared_count);
+  ASSERT_EQ(3, deps->node_count);
+  EXPECT_EQ("d.h", log.NodeForId(deps->id(2))->path());
+
+  // The header, 6 short and 20 long paths, the list, three shared deps
+  // records (c.o's with one more input) and d.o's plain one.
+  EXPECT_EQ(16 + 6 * 12 + kNumHeaders * 20 + (4 + kNumHeaders * 4) +
+            3 * 20 + 4 + (16 + 3 * 4), file_size);
+}
+
+// Verify that a log of the previous version loads and gets rewritten.
+TEST_F(DepsLogTest, UpgradeVersion4) {
+  {
+    State state;
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h", 0));
+    log.RecordDeps(state.GetNode("out.o", 0), 1, deps);
+    log.Close();
+  }
+  // Versions 5 and 6 only added record types and a flag; rewrite the
+  // version.
+  FILE* f = fopen(kTestFilename, "r+b");
+  ASSERT_TRUE(f != NULL);
+  int version = 4;
+  fseek(f, 12, SEEK_SET);
+  ASSERT_EQ(1u, fwrite(&version, 4, 1, f));
+  fclose(f);
+
+  State state;
+  DepsLog log;
+  string err;
+  ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+  DepsLog::Deps* deps = log.GetDeps(state.LookupNode("out.o"));
+  ASSERT_TRUE(deps);
+  EXPECT_EQ("foo.h", log.NodeForId(deps->id(0))->path());
+  // The old log doesn't say whether immutable files were left out.
+  EXPECT_TRUE(deps->lacks_immutable);
+
+  // The next build rewrites the log with the current version.
+  ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+  log.Close();
+  f = fopen(kTestFilename, "rb");
+  ASSERT_TRUE(f != NULL);
+  fseek(f, 12, SEEK_SET);
+  ASSERT_EQ(1u, fread(&version, 4, 1, f));
+  fclose(f);
+  EXPECT_EQ(6, version);
+}
+
 // Verify that invalid file headers cause a new build.
 TEST_F(DepsLogTest, InvalidHeader) {
   const char *kInvalidHeaders[] = {
@@ -397,9 +661,9 @@ TEST_F(DepsLogTest, Truncated) {
 
     // Count how many non-NULL deps entries there are.
     int new_deps_count = 0;
-    for (vector<DepsLog::Deps*>::const_iterator i = log.deps().begin();
+    for (vector<DepsLog::Deps>::const_iterator i = log.deps().begin();
          i != log.deps().end(); ++i) {
-      if (*i)
+      if (i->node_count >= 0)
         ++new_deps_count;
     }
     ASSERT_GE(deps_count, new_deps_count);
@@ -15,6 +15,7 @@
 #include "disk_interface.h"
 
 #include <algorithm>
+#include <set>
 
 #include <errno.h>
 #include <stdio.h>
@@ -26,13 +27,40 @@
 #include <sstream>
 #include <windows.h>
 #include <direct.h>  // _mkdir
+#include <sys/utime.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+#ifdef __linux__
+#include <limits.h>
+#include <linux/fs.h>  // FICLONE
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
 #endif
 
 #include "metrics.h"
+#include "thread_pool.h"
 #include "util.h"
 
 namespace {
 
+/// The mtimes of the files in a directory, sorted by name.
+typedef vector<pair<string, TimeStamp> > DirStamps;
+
+struct DirStampLess {
+  bool operator()(const pair<string, TimeStamp>& a,
+                  const pair<string, TimeStamp>& b) const {
+    return a.first < b.first;
+  }
+  bool operator()(const pair<string, TimeStamp>& a, const string& b) const {
+    return a.first < b;
+  }
+};
+
 string DirName(const string& path) {
 #ifdef _WIN32
   static const char kPathSeparators[] = "\\/";
@@ -69,7 +97,7 @@ TimeStamp TimeStampFromFileTime(const FILETIME& filetime) {
   return (TimeStamp)mtime - 12622770400LL * (1000000000LL / 100);
 }
 
-TimeStamp StatSingleFile(const string& path, string* err) {
+TimeStamp StatSingleFile(const string& path, int64_t* size, string* err) {
   WIN32_FILE_ATTRIBUTE_DATA attrs;
   if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attrs)) {
     DWORD win_err = GetLastError();
@@ -78,6 +106,8 @@ TimeStamp StatSingleFile(const string& path, string* err) {
     *err = "GetFileAttributesEx(" + path + "): " + GetLastErrorString();
     return -1;
   }
+  if (size)
+    *size = ((int64_t)attrs.nFileSizeHigh << 32) | attrs.nFileSizeLow;
   return TimeStampFromFileTime(attrs.ftLastWriteTime);
 }
 
@@ -91,8 +121,7 @@ bool IsWindows7OrLater() {
       &version_info, VER_MAJORVERSION | VER_MINORVERSION, comparison);
 }
 
-bool StatAllFilesInDir(const string& dir, map<string, TimeStamp>* stamps,
-                       string* err) {
+bool StatAllFilesInDir(const string& dir, DirStamps* stamps, string* err) {
   // FindExInfoBasic is 30% faster than FindExInfoStandard.
   static bool can_use_basic_info = IsWindows7OrLater();
   // This is not in earlier SDKs.
@@ -119,18 +148,191 @@ bool StatAllFilesInDir(const string& dir, map<string, TimeStamp>* stamps,
       continue;
     }
     transform(lowername.begin(), lowername.end(), lowername.begin(), ::tolower);
-    stamps->insert(make_pair(lowername,
-                             TimeStampFromFileTime(ffd.ftLastWriteTime)));
+    stamps->push_back(make_pair(lowername,
+                                TimeStampFromFileTime(ffd.ftLastWriteTime)));
   } while (FindNextFileA(find_handle, &ffd));
   FindClose(find_handle);
+  // Keep the first of names that only differ in case.
+  stable_sort(stamps->begin(), stamps->end(), DirStampLess());
   return true;
 }
+#else  // _WIN32
+TimeStamp TimeStampFromStat(const struct stat& st) {
+  // Some users (Flatpak) set mtime to 0, this should be harmless
+  // and avoids conflicting with our return value of 0 meaning
+  // that it doesn't exist.
+  if (st.st_mtime == 0)
+    return 1;
+#if defined(__APPLE__) && !defined(_POSIX_C_SOURCE)
+  return ((int64_t)st.st_mtimespec.tv_sec * 1000000000LL +
+          st.st_mtimespec.tv_nsec);
+#elif (_POSIX_C_SOURCE >= 200809L || _XOPEN_SOURCE >= 700 || defined(_BSD_SOURCE) || defined(_SVID_SOURCE) || \
+       defined(__BIONIC__) || (defined (__SVR4) && defined (__sun)) || defined(__FreeBSD__))
+  // For glibc, see "Timestamp files" in the Notes of http://www.kernel.org/doc/man-pages/online/pages/man2/stat.2.html
+  // newlib, uClibc and musl follow the kernel (or Cygwin) headers and define the right macro values above.
+  // For bsd, see https://github.com/freebsd/freebsd/blob/master/sys/sys/stat.h and similar
+  // For bionic, C and POSIX API is always enabled.
+  // For solaris, see https://docs.oracle.com/cd/E88353_01/html/E37841/stat-2.html.
+  return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#elif defined(_AIX)
+  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtime_n;
+#else
+  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtimensec;
+#endif
+}
+
+TimeStamp StatSingleFile(const string& path, int64_t* size, string* err) {
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0) {
+    if (errno == ENOENT || errno == ENOTDIR)
+      return 0;
+    *err = "stat(" + path + "): " + strerror(errno);
+    return -1;
+  }
+  if (size)
+    *size = st.st_size;
+  return TimeStampFromStat(st);
+}
+
+#ifdef __linux__
+/// The layout of the records returned by getdents64(2), which glibc only
+/// wraps since 2.30.
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+};
+
+/// Read the entries of |dir| with getdents64(2) and stat() each of them
+/// relative to the open directory, which saves the kernel from walking
+/// the path again for every file.  Entries that fail to stat() for other
+/// reasons than not existing get an mtime of -1.
+bool StatAllFilesInDir(const string& dir, DirStamps* stamps, string* err) {
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT || errno == ENOTDIR)
+      return true;
+    *err = "open(" + dir + "): " + strerror(errno);
+    return false;
+  }
+  uint64_t buf[4096];
+  for (;;) {
+    long len = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+    if (len < 0) {
+      *err = "getdents64(" + dir + "): " + strerror(errno);
+      close(fd);
+      return false;
+    }
+    if (len == 0)
+      break;
+    for (long pos = 0; pos < len; ) {
+      const LinuxDirent64* entry =
+          reinterpret_cast<const LinuxDirent64*>((char*)buf + pos);
+      pos += entry->d_reclen;
+      struct stat st;
+      if (fstatat(fd, entry->d_name, &st, 0) < 0) {
+        // Dangling symlinks are missing, like they are for stat().
+        if (errno != ENOENT)
+          stamps->push_back(make_pair(string(entry->d_name), (TimeStamp)-1));
+        continue;
+      }
+      stamps->push_back(make_pair(string(entry->d_name), TimeStampFromStat(st)));
+    }
+  }
+  close(fd);
+  sort(stamps->begin(), stamps->end(), DirStampLess());
+  return true;
+}
+#endif  // __linux__
 #endif  // _WIN32
 
+#if defined(_WIN32) || defined(__linux__)
+/// Split |path| into the keys of its directory and of its name in the stat
+/// cache.  Returns false if the stat cache can't answer for |path|.
+bool SplitStatCachePath(const string& path, string* dir, string* base) {
+  *dir = DirName(path);
+#ifdef _WIN32
+  *base = path.substr(dir->size() ? dir->size() + 1 : 0);
+  if (*base == "..") {
+    // StatAllFilesInDir does not report any information for base = "..".
+    *base = ".";
+    *dir = path;
+  }
+
+  transform(dir->begin(), dir->end(), dir->begin(), ::tolower);
+  transform(base->begin(), base->end(), base->begin(), ::tolower);
+  return true;
+#else
+  *base = path.substr(path.rfind('/') + 1);
+  // DirName() of "/foo" is empty, which is not the current directory.
+  // Names too long to exist make stat() fail instead of report them missing.
+  return !base->empty() && base->size() <= NAME_MAX &&
+         !(dir->empty() && path[0] == '/');
+#endif
+}
+
+/// Reads a directory for the stat cache on a ThreadPool thread.
+struct StatDirTask : public ThreadPool::Task {
+  explicit StatDirTask(const string& dir) : dir_(dir), ok_(false) {}
+
+  virtual void Run() {
+    string err;
+    ok_ = StatAllFilesInDir(dir_.empty() ? "." : dir_, &stamps_, &err);
+  }
+
+  string dir_;
+  DirStamps stamps_;
+  bool ok_;
+};
+#endif
+
+/// stat()s a slice of a batch on a ThreadPool thread.
+struct StatTask : public ThreadPool::Task {
+  StatTask(const vector<string>& paths, vector<TimeStamp>* mtimes,
+           size_t begin, size_t end)
+      : paths_(&paths), mtimes_(mtimes), begin_(begin), end_(end) {}
+
+  virtual void Run() {
+    string err;
+    for (size_t i = begin_; i < end_; ++i) {
+#ifdef _WIN32
+      // Leave the error about overlong paths to Stat().
+      const string& path = (*paths_)[i];
+      if (!path.empty() && path[0] != '\\' && path.size() > MAX_PATH) {
+        (*mtimes_)[i] = -1;
+        continue;
+      }
+#endif
+      (*mtimes_)[i] = StatSingleFile((*paths_)[i], NULL, &err);
+    }
+  }
+
+  const vector<string>* paths_;
+  vector<TimeStamp>* mtimes_;
+  size_t begin_;
+  size_t end_;
+};
+
+/// Number of paths a StatTask handles.
+const size_t kStatTaskSize = 64;
+/// stat() mostly waits for the file system, so use more threads than
+/// there are processors.
+const int kStatThreads = 16;
+
 }  // namespace
 
 // DiskInterface ---------------------------------------------------------------
 
+void DiskInterface::StatBatch(const vector<string>& paths,
+                              vector<TimeStamp>* mtimes) const {
+  mtimes->resize(paths.size());
+  string err;
+  for (size_t i = 0; i < paths.size(); ++i)
+    (*mtimes)[i] = Stat(paths[i], &err);
+}
+
 bool DiskInterface::MakeDirs(const string& path) {
   string dir = DirName(path);
   if (dir.empty())
@@ -153,6 +355,12 @@ bool DiskInterface::MakeDirs(const string& path) {
 
 // RealDiskInterface -----------------------------------------------------------
 
+#ifdef _WIN32
+const int RealDiskInterface::kStatCacheLookups = 1;
+#else
+const int RealDiskInterface::kStatCacheLookups = 8;
+#endif
+
 TimeStamp RealDiskInterface::Stat(const string& path, string* err) const {
   METRIC_RECORD("node stat");
 #ifdef _WIN32
@@ -165,60 +373,111 @@ TimeStamp RealDiskInterface::Stat(const string& path, string* err) const {
     *err = err_stream.str();
     return -1;
   }
-  if (!use_cache_)
-    return StatSingleFile(path, err);
-
-  string dir = DirName(path);
-  string base(path.substr(dir.size() ? dir.size() + 1 : 0));
-  if (base == "..") {
-    // StatAllFilesInDir does not report any information for base = "..".
-    base = ".";
-    dir = path;
-  }
-
-  transform(dir.begin(), dir.end(), dir.begin(), ::tolower);
-  transform(base.begin(), base.end(), base.begin(), ::tolower);
+#endif
+#if defined(_WIN32) || defined(__linux__)
+  string dir, base;
+  if (!use_cache_ || !SplitStatCachePath(path, &dir, &base))
+    return StatSingleFile(path, NULL, err);
 
-  Cache::iterator ci = cache_.find(dir);
-  if (ci == cache_.end()) {
-    ci = cache_.insert(make_pair(dir, DirCache())).first;
-    if (!StatAllFilesInDir(dir.empty() ? "." : dir, &ci->second, err)) {
-      cache_.erase(ci);
+  DirCache& cache = cache_[dir];
+  if (!cache.read) {
+    if (++cache.lookups < kStatCacheLookups)
+      return StatSingleFile(path, NULL, err);
+    if (!StatAllFilesInDir(dir.empty() ? "." : dir, &cache.stamps, err)) {
+      cache_.erase(dir);
+#ifdef _WIN32
       return -1;
-    }
-  }
-  DirCache::iterator di = ci->second.find(base);
-  return di != ci->second.end() ? di->second : 0;
 #else
-  struct stat st;
-  if (stat(path.c_str(), &st) < 0) {
-    if (errno == ENOENT || errno == ENOTDIR)
-      return 0;
-    *err = "stat(" + path + "): " + strerror(errno);
-    return -1;
+      // Directories can be searchable without being readable.
+      err->clear();
+      return StatSingleFile(path, NULL, err);
+#endif
+    }
+    cache.read = true;
   }
-  // Some users (Flatpak) set mtime to 0, this should be harmless
-  // and avoids conflicting with our return value of 0 meaning
-  // that it doesn't exist.
-  if (st.st_mtime == 0)
-    return 1;
-#if defined(__APPLE__) && !defined(_POSIX_C_SOURCE)
-  return ((int64_t)st.st_mtimespec.tv_sec * 1000000000LL +
-          st.st_mtimespec.tv_nsec);
-#elif (_POSIX_C_SOURCE >= 200809L || _XOPEN_SOURCE >= 700 || defined(_BSD_SOURCE) || defined(_SVID_SOURCE) || \
-       defined(__BIONIC__) || (defined (__SVR4) && defined (__sun)) || defined(__FreeBSD__))
-  // For glibc, see "Timestamp files" in the Notes of http://www.kernel.org/doc/man-pages/online/pages/man2/stat.2.html
-  // newlib, uClibc and musl follow the kernel (or Cygwin) headers and define the right macro values above.
-  // For bsd, see https://github.com/freebsd/freebsd/blob/master/sys/sys/stat.h and similar
-  // For bionic, C and POSIX API is always enabled.
-  // For solaris, see https://docs.oracle.com/cd/E88353_01/html/E37841/stat-2.html.
-  return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
-#elif defined(_AIX)
-  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtime_n;
+  DirStamps::iterator di = lower_bound(cache.stamps.begin(),
+                                       cache.stamps.end(), base,
+                                       DirStampLess());
+  if (di == cache.stamps.end() || di->first != base)
+    return 0;
+#ifndef _WIN32
+  // stat() the file again to get the error message.
+  if (di->second == -1)
+    return StatSingleFile(path, NULL, err);
+#endif
+  return di->second;
 #else
-  return (int64_t)st.st_mtime * 1000000000LL + st.st_mtimensec;
+  return StatSingleFile(path, NULL, err);
 #endif
+}
+
+void RealDiskInterface::StatBatch(const vector<string>& paths,
+                                  vector<TimeStamp>* mtimes) const {
+#if defined(_WIN32) || defined(__linux__)
+  if (use_cache_) {
+    // Read the directories that the batch looks up often enough and are
+    // not cached yet concurrently, then answer from the cache.
+    vector<StatDirTask> tasks;
+    map<string, int> lookups;
+    string dir, base;
+    for (size_t i = 0; i < paths.size(); ++i) {
+      if (!SplitStatCachePath(paths[i], &dir, &base))
+        continue;
+      map<string, int>::iterator l = lookups.find(dir);
+      if (l == lookups.end()) {
+        Cache::iterator ci = cache_.find(dir);
+        if (ci != cache_.end() && ci->second.read)
+          continue;
+        l = lookups.insert(make_pair(
+            dir, ci == cache_.end() ? 0 : ci->second.lookups)).first;
+      }
+      if (++l->second == kStatCacheLookups)
+        tasks.push_back(StatDirTask(dir));
+    }
+    if (tasks.size() > 1) {
+      METRIC_RECORD("node stat batch");
+      vector<ThreadPool::Task*> task_ptrs;
+      for (size_t i = 0; i < tasks.size(); ++i)
+        task_ptrs.push_back(&tasks[i]);
+      ThreadPool pool(min((int)tasks.size(), kStatThreads));
+      pool.RunAll(task_ptrs);
+      // Leave directories that failed to Stat(), which reports the error.
+      for (size_t i = 0; i < tasks.size(); ++i) {
+        if (tasks[i].ok_) {
+          DirCache& cache = cache_[tasks[i].dir_];
+          cache.stamps.swap(tasks[i].stamps_);
+          cache.read = true;
+        }
+      }
+    }
+    DiskInterface::StatBatch(paths, mtimes);
+    return;
+  }
 #endif
+  if (paths.size() < 2 * kStatTaskSize) {
+    DiskInterface::StatBatch(paths, mtimes);
+    return;
+  }
+
+  METRIC_RECORD("node stat batch");
+  mtimes->resize(paths.size());
+  vector<StatTask> tasks;
+  tasks.reserve((paths.size() + kStatTaskSize - 1) / kStatTaskSize);
+  for (size_t i = 0; i < paths.size(); i += kStatTaskSize) {
+    tasks.push_back(StatTask(paths, mtimes, i,
+                             min(i + kStatTaskSize, paths.size())));
+  }
+  vector<ThreadPool::Task*> task_ptrs;
+  for (size_t i = 0; i < tasks.size(); ++i)
+    task_ptrs.push_back(&tasks[i]);
+  ThreadPool pool(min((int)tasks.size(), kStatThreads));
+  pool.RunAll(task_ptrs);
+}
+
+TimeStamp RealDiskInterface::StatWithSize(const string& path, int64_t* size,
+                                          string* err) const {
+  METRIC_RECORD("node stat");
+  return StatSingleFile(path, size, err);
 }
 
 bool RealDiskInterface::WriteFile(const string& path, const string& contents) {
@@ -245,6 +504,17 @@ bool RealDiskInterface::WriteFile(const string& path, const string& contents) {
   return true;
 }
 
+bool RealDiskInterface::IsDir(const string& path) const {
+#ifdef _WIN32
+  DWORD attributes = GetFileAttributesA(path.c_str());
+  return attributes != INVALID_FILE_ATTRIBUTES &&
+      (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
 bool RealDiskInterface::MakeDir(const string& path) {
   if (::MakeDir(path) < 0) {
     if (errno == EEXIST) {
@@ -266,6 +536,95 @@ FileReader::Status RealDiskInterface::ReadFile(const string& path,
   }
 }
 
+bool RealDiskInterface::Touch(const string& path, string* err) {
+  FILE* fp = fopen(path.c_str(), "ab");
+  if (!fp) {
+    *err = "open " + path + ": " + strerror(errno);
+    return false;
+  }
+  fclose(fp);
+#ifdef _WIN32
+  if (_utime(path.c_str(), NULL) < 0) {
+#else
+  if (utime(path.c_str(), NULL) < 0) {
+#endif
+    *err = "utime " + path + ": " + strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool RealDiskInterface::Copy(const string& from, const string& to,
+                             string* err) {
+  FILE* in = fopen(from.c_str(), "rb");
+  if (!in) {
+    *err = "open " + from + ": " + strerror(errno);
+    return false;
+  }
+#ifdef _WIN32
+  FILE* out = fopen(to.c_str(), "wb");
+#else
+  // A new file gets the permissions of |from|, less the umask.
+  struct stat st;
+  FILE* out = NULL;
+  if (fstat(fileno(in), &st) == 0) {
+    int fd = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+    if (fd >= 0 && !(out = fdopen(fd, "wb")))
+      close(fd);
+  }
+#endif
+  if (!out) {
+    *err = "open " + to + ": " + strerror(errno);
+    fclose(in);
+    return false;
+  }
+
+#ifdef FICLONE
+  // Share the blocks of |from| on file systems that can, like btrfs and
+  // XFS, instead of copying them.
+  if (ioctl(fileno(out), FICLONE, fileno(in)) == 0) {
+    fclose(in);
+    if (fclose(out) == 0)
+      return true;
+    *err = "write " + to + ": " + strerror(errno);
+    return false;
+  }
+#endif
+  char buf[64 << 10];
+  size_t len;
+  bool ok = true;
+  while (ok && (len = fread(buf, 1, sizeof(buf), in)) > 0)
+    ok = fwrite(buf, 1, len, out) == len;
+  if (ok && ferror(in)) {
+    *err = "read " + from + ": " + strerror(errno);
+    ok = false;
+  } else if (!ok) {
+    *err = "write " + to + ": " + strerror(errno);
+  }
+  fclose(in);
+  if (fclose(out) == EOF && ok) {
+    *err = "write " + to + ": " + strerror(errno);
+    ok = false;
+  }
+  return ok;
+}
+
+bool RealDiskInterface::Rename(const string& from, const string& to,
+                               string* err) {
+#ifdef _WIN32
+  if (!MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+    *err = "MoveFileExA(" + from + ", " + to + "): " + GetLastErrorString();
+    return false;
+  }
+#else
+  if (rename(from.c_str(), to.c_str()) < 0) {
+    *err = "rename " + from + " " + to + ": " + strerror(errno);
+    return false;
+  }
+#endif
+  return true;
+}
+
 int RealDiskInterface::RemoveFile(const string& path) {
   if (remove(path.c_str()) < 0) {
     switch (errno) {
@@ -281,7 +640,7 @@ int RealDiskInterface::RemoveFile(const string& path) {
 }
 
 void RealDiskInterface::AllowStatCache(bool allow) {
-#ifdef _WIN32
+#if defined(_WIN32) || defined(__linux__)
   use_cache_ = allow;
   if (!use_cache_)
     cache_.clear();
@@ -17,6 +17,7 @@
 
 #include <map>
 #include <string>
+#include <vector>
 using namespace std;
 
 #include "timestamp.h"
@@ -48,6 +49,15 @@ struct DiskInterface: public FileReader {
   /// other errors.
   virtual TimeStamp Stat(const string& path, string* err) const = 0;
 
+  /// stat() all of |paths|, storing in |mtimes| what Stat() would return
+  /// for each.  Errors are not reported; Stat() the paths with an mtime of
+  /// -1 again to get the message.  The default calls Stat() in order.
+  virtual void StatBatch(const vector<string>& paths,
+                         vector<TimeStamp>* mtimes) const;
+
+  /// Return true if @a path is a directory, or a symbolic link to one.
+  virtual bool IsDir(const string& path) const = 0;
+
   /// Create a directory, returning false on failure.
   virtual bool MakeDir(const string& path) = 0;
 
@@ -55,6 +65,21 @@ struct DiskInterface: public FileReader {
   /// Returns true on success, false on failure
   virtual bool WriteFile(const string& path, const string& contents) = 0;
 
+  /// Set the mtime of @a path to now, creating it empty if it doesn't
+  /// exist, like 'touch path'.
+  /// @return false and fill in @a err on error.
+  virtual bool Touch(const string& path, string* err) = 0;
+
+  /// Copy the contents of @a from to @a to, like 'cp from to': @a to keeps
+  /// its permissions if it exists and gets those of @a from otherwise.
+  /// @return false and fill in @a err on error.
+  virtual bool Copy(const string& from, const string& to, string* err) = 0;
+
+  /// Rename the file or directory @a from to @a to, replacing @a to if it
+  /// is a file or an empty directory, like rename(2).
+  /// @return false and fill in @a err on error.
+  virtual bool Rename(const string& from, const string& to, string* err) = 0;
+
   /// Remove the file named @a path. It behaves like 'rm -f path' so no errors
   /// are reported if it does not exists.
   /// @returns 0 if the file has been removed,
@@ -70,28 +95,55 @@ struct DiskInterface: public FileReader {
 /// Implementation of DiskInterface that actually hits the disk.
 struct RealDiskInterface : public DiskInterface {
   RealDiskInterface()
-#ifdef _WIN32
+#if defined(_WIN32) || defined(__linux__)
                       : use_cache_(false)
 #endif
                       {}
   virtual ~RealDiskInterface() {}
   virtual TimeStamp Stat(const string& path, string* err) const;
+  /// Uses several threads for large batches.  With the stat cache, the
+  /// directories of the batch are read concurrently instead.
+  virtual void StatBatch(const vector<string>& paths,
+                         vector<TimeStamp>* mtimes) const;
+  virtual bool IsDir(const string& path) const;
   virtual bool MakeDir(const string& path);
   virtual bool WriteFile(const string& path, const string& contents);
   virtual Status ReadFile(const string& path, string* contents, string* err);
+  virtual bool Touch(const string& path, string* err);
+  virtual bool Copy(const string& from, const string& to, string* err);
+  virtual bool Rename(const string& from, const string& to, string* err);
   virtual int RemoveFile(const string& path);
 
-  /// Whether stat information can be cached.  Only has an effect on Windows.
+  /// Like Stat(), but also fills in the size of the file in bytes.  Never
+  /// uses the stat cache.
+  TimeStamp StatWithSize(const string& path, int64_t* size, string* err) const;
+
+  /// Whether stat information can be cached.  If so, the
+  /// kStatCacheLookups-th Stat() of a path in a directory reads the whole
+  /// directory, and later Stat()s of paths in it are answered from memory.
+  /// Only has an effect on Windows and Linux.
   void AllowStatCache(bool allow);
 
+  /// On Windows, listing a directory gives the mtimes of its files, so the
+  /// first Stat() in a directory reads it.  On Linux, every file of the
+  /// directory must be stat()ed, which only pays off once several are
+  /// looked up.
+  static const int kStatCacheLookups;
+
  private:
-#ifdef _WIN32
+#if defined(_WIN32) || defined(__linux__)
   /// Whether stat information can be cached.
   bool use_cache_;
 
-  typedef map<string, TimeStamp> DirCache;
-  // TODO: Neither a map nor a hashmap seems ideal here.  If the statcache
-  // works out, come up with a better data structure.
+  /// A directory of the stat cache.
+  struct DirCache {
+    DirCache() : lookups(0), read(false) {}
+    /// The number of Stat()s of paths in the directory so far.
+    int lookups;
+    bool read;
+    /// Once read, the mtimes of the files in the directory, sorted by name.
+    vector<pair<string, TimeStamp> > stamps;
+  };
   typedef map<string, DirCache> Cache;
   mutable Cache cache_;
 #endif
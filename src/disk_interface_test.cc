@@ -17,6 +17,8 @@
 #ifdef _WIN32
 #include <io.h>
 #include <windows.h>
+#else
+#include <unistd.h>
 #endif
 
 #include "disk_interface.h"
@@ -166,6 +168,83 @@ TEST_F(DiskInterfaceTest, StatCache) {
 }
 #endif
 
+#ifdef __linux__
+TEST_F(DiskInterfaceTest, StatCache) {
+  string err;
+
+  ASSERT_TRUE(Touch("file1"));
+  ASSERT_TRUE(disk_.MakeDir("subdir"));
+  ASSERT_TRUE(disk_.MakeDir("subdir/subsubdir"));
+  ASSERT_TRUE(Touch("subdir/subfile1"));
+  ASSERT_EQ(0, symlink("subfile1", "subdir/link"));
+  ASSERT_EQ(0, symlink("nosuchfile", "subdir/danglinglink"));
+
+  vector<string> paths;
+  paths.push_back("file1");
+  paths.push_back("FILE1");
+  paths.push_back("subdir");
+  paths.push_back("subdir/subfile1");
+  paths.push_back("subdir/link");
+  paths.push_back("subdir/danglinglink");
+  paths.push_back("subdir/subsubdir");
+  paths.push_back("subdir/subsubdir/.");
+  paths.push_back("subdir/subsubdir/..");
+  paths.push_back(".");
+  paths.push_back("..");
+  paths.push_back("nosuchfile");
+  paths.push_back("nosuchdir/nosuchfile");
+  paths.push_back("file1/nosuchfile");
+  char cwd[4096];
+  ASSERT_TRUE(getcwd(cwd, sizeof(cwd)));
+  paths.push_back(string(cwd) + "/file1");
+  paths.push_back("/");
+
+  vector<TimeStamp> uncached;
+  disk_.AllowStatCache(false);
+  for (size_t i = 0; i < paths.size(); ++i) {
+    uncached.push_back(disk_.Stat(paths[i], &err));
+    EXPECT_EQ("", err);
+  }
+  EXPECT_EQ(0, uncached[1]);
+  EXPECT_EQ(uncached[3], uncached[4]);
+  EXPECT_EQ(0, uncached[5]);
+
+  disk_.AllowStatCache(true);
+  for (size_t i = 0; i < paths.size(); ++i) {
+    EXPECT_EQ(uncached[i], disk_.Stat(paths[i], &err));
+    EXPECT_EQ("", err);
+  }
+
+  disk_.AllowStatCache(false);
+  disk_.AllowStatCache(true);
+  vector<TimeStamp> batch;
+  disk_.StatBatch(paths, &batch);
+  EXPECT_EQ(uncached, batch);
+
+  // A directory is only read once enough of its files were looked up.
+  disk_.AllowStatCache(false);
+  disk_.AllowStatCache(true);
+  EXPECT_GT(disk_.Stat("subdir/subfile1", &err), 1);
+  ASSERT_TRUE(Touch("subdir/subfile2"));
+  EXPECT_GT(disk_.Stat("subdir/subfile2", &err), 1);
+  for (int i = 0; i < RealDiskInterface::kStatCacheLookups; ++i)
+    EXPECT_GT(disk_.Stat("subdir/subfile1", &err), 1);
+
+  // The cache doesn't see files created after their directory was read.
+  ASSERT_TRUE(Touch("subdir/subfile3"));
+  EXPECT_EQ(0, disk_.Stat("subdir/subfile3", &err));
+  disk_.AllowStatCache(false);
+  EXPECT_GT(disk_.Stat("subdir/subfile3", &err), 1);
+  EXPECT_EQ("", err);
+
+  // Errors are reported like without the cache.
+  disk_.AllowStatCache(true);
+  string too_long_name("subdir/" + string(512, 'x'));
+  EXPECT_EQ(-1, disk_.Stat(too_long_name, &err));
+  EXPECT_NE("", err);
+}
+#endif
+
 TEST_F(DiskInterfaceTest, ReadFile) {
   string err;
   std::string content;
@@ -217,6 +296,10 @@ struct StatTest : public StateTestWithBuiltinRules,
 
   // DiskInterface implementation.
   virtual TimeStamp Stat(const string& path, string* err) const;
+  virtual bool IsDir(const string& path) const {
+    assert(false);
+    return false;
+  }
   virtual bool WriteFile(const string& path, const string& contents) {
     assert(false);
     return true;
@@ -229,6 +312,18 @@ struct StatTest : public StateTestWithBuiltinRules,
     assert(false);
     return NotFound;
   }
+  virtual bool Touch(const string& path, string* err) {
+    assert(false);
+    return false;
+  }
+  virtual bool Copy(const string& from, const string& to, string* err) {
+    assert(false);
+    return false;
+  }
+  virtual bool Rename(const string& from, const string& to, string* err) {
+    assert(false);
+    return false;
+  }
   virtual int RemoveFile(const string& path) {
     assert(false);
     return 0;
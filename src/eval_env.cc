@@ -63,12 +63,19 @@ const EvalString* Rule::GetBinding(const string& key) const {
 
 // static
 bool Rule::IsReservedBinding(const string& var) {
-  return var == "command" ||
+  return var == "batch" ||
+      var == "builtin" ||
+      var == "cache" ||
+      var == "command" ||
+      var == "content_hash" ||
       var == "depfile" ||
       var == "description" ||
       var == "deps" ||
+      var == "direct_exec" ||
       var == "generator" ||
+      var == "memory" ||
       var == "pool" ||
+      var == "remote" ||
       var == "restat" ||
       var == "rspfile" ||
       var == "rspfile_content" ||
@@ -46,6 +46,9 @@ struct EvalString {
   string Serialize() const;
 
 private:
+  // The manifest cache serializes the token list directly.
+  friend struct ManifestCache;
+
   enum TokenType { RAW, SPECIAL };
   typedef vector<pair<string, TokenType> > TokenList;
   TokenList parsed_;
@@ -66,6 +69,7 @@ struct Rule {
  private:
   // Allow the parsers to reach into this object and fill out its fields.
   friend struct ManifestParser;
+  friend struct ManifestCache;
 
   string name_;
   typedef map<string, EvalString> Bindings;
@@ -97,6 +101,8 @@ struct BindingEnv : public Env {
                             Env* env);
 
 private:
+  friend struct ManifestCache;
+
   map<string, string> bindings_;
   map<string, const Rule*> rules_;
   BindingEnv* parent_;
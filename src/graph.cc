@@ -14,6 +14,7 @@
 
 #include "graph.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <stdio.h>
 
@@ -27,7 +28,13 @@
 #include "state.h"
 #include "util.h"
 
+const TimeStamp Node::kImmutableMtime;
+
 bool Node::Stat(DiskInterface* disk_interface, string* err) {
+  if (immutable()) {
+    mtime_ = kImmutableMtime;
+    return true;
+  }
   return (mtime_ = disk_interface->Stat(path_, err)) != -1;
 }
 
@@ -40,9 +47,11 @@ bool DependencyScan::RecomputeDirty(Node* node, vector<Node*>* stack,
                                     string* err) {
   Edge* edge = node->in_edge();
   if (!edge) {
-    // If we already visited this leaf node then we are done.
-    if (node->status_known())
+    // If we already visited this leaf node then we are done.  A prefetched
+    // mtime alone does not count as a visit.
+    if (node->status_known() && !node->stat_prefetched())
       return true;
+    node->set_stat_prefetched(false);
     // This node has no in-edge; it is dirty if it is missing.
     if (!node->StatIfNecessary(disk_interface_, err))
       return false;
@@ -141,6 +150,89 @@ bool DependencyScan::RecomputeDirty(Node* node, vector<Node*>* stack,
   return true;
 }
 
+namespace {
+
+/// Queue |node| for stat() unless its mtime is known or it is queued.
+void AddPrefetchNode(Node* node, vector<Node*>* nodes,
+                     vector<string>* paths) {
+  if (node->status_known() || node->stat_prefetched() || node->immutable())
+    return;
+  node->set_stat_prefetched(true);
+  nodes->push_back(node);
+  paths->push_back(node->path());
+}
+
+/// stat() all queued nodes.
+void StatPrefetchNodes(DiskInterface* disk_interface, vector<Node*>* nodes,
+                       vector<string>* paths) {
+  vector<TimeStamp> mtimes;
+  disk_interface->StatBatch(*paths, &mtimes);
+  for (size_t i = 0; i < nodes->size(); ++i) {
+    Node* node = (*nodes)[i];
+    // On errors leave the node for RecomputeDirty() to stat() again, which
+    // reports the error.
+    if (mtimes[i] == -1) {
+      node->set_stat_prefetched(false);
+      continue;
+    }
+    node->SetPrefetchedMtime(mtimes[i]);
+    // Only leaves need to remember that they haven't been visited yet.
+    if (node->in_edge())
+      node->set_stat_prefetched(false);
+  }
+  nodes->clear();
+  paths->clear();
+}
+
+}  // namespace
+
+void DependencyScan::PrefetchStats(const vector<Node*>& targets) {
+  METRIC_RECORD("stat prefetch");
+  vector<Node*> nodes;
+  vector<string> paths;
+  vector<Edge*> edges;
+
+  // Walk the graph like RecomputeDirty() does, marking edges as in the
+  // stack, and queue every node it would stat().
+  vector<Node*> stack(targets.begin(), targets.end());
+  while (!stack.empty()) {
+    Node* node = stack.back();
+    stack.pop_back();
+    Edge* edge = node->in_edge();
+    if (!edge) {
+      AddPrefetchNode(node, &nodes, &paths);
+      continue;
+    }
+    if (edge->mark_ != Edge::VisitNone)
+      continue;
+    edge->mark_ = Edge::VisitInStack;
+    edges.push_back(edge);
+    for (vector<Node*>::iterator o = edge->outputs_.begin();
+         o != edge->outputs_.end(); ++o) {
+      AddPrefetchNode(*o, &nodes, &paths);
+    }
+    stack.insert(stack.end(), edge->inputs_.begin(), edge->inputs_.end());
+  }
+  StatPrefetchNodes(disk_interface_, &nodes, &paths);
+
+  // Now that the outputs' mtimes are known, add the dependencies from the
+  // deps log that LoadDepsFromLog() will accept.
+  DepsLog* deps_log = dep_loader_.deps_log();
+  for (vector<Edge*>::iterator e = edges.begin(); e != edges.end(); ++e) {
+    Edge* edge = *e;
+    edge->mark_ = Edge::VisitNone;
+    if (!deps_log || edge->GetBinding("deps").empty())
+      continue;
+    Node* output = edge->outputs_[0];
+    DepsLog::Deps* deps = deps_log->GetDeps(output);
+    if (!deps || !output->status_known() || output->mtime() > deps->mtime)
+      continue;
+    for (int i = 0; i < deps->node_count; ++i)
+      AddPrefetchNode(deps_log->NodeForId(deps->id(i)), &nodes, &paths);
+  }
+  StatPrefetchNodes(disk_interface_, &nodes, &paths);
+}
+
 bool DependencyScan::VerifyDAG(Node* node, vector<Node*>* stack, string* err) {
   Edge* edge = node->in_edge();
   assert(edge != NULL);
@@ -224,14 +316,17 @@ bool DependencyScan::RecomputeOutputDirty(Edge* edge,
     // rule in a previous run and stored the most recent input mtime in the
     // build log.  Use that mtime instead, so that the file will only be
     // considered dirty if an input was modified since the previous run.
+    // InputsUnchanged() stores it for content_hash the same way.
     bool used_restat = false;
-    if (edge->GetBindingBool("restat") && build_log() &&
+    if ((edge->GetBindingBool("restat") ||
+         edge->GetBindingBool("content_hash")) && build_log() &&
         (entry = build_log()->LookupByOutput(output->path()))) {
       output_mtime = entry->mtime;
       used_restat = true;
     }
 
-    if (output_mtime < most_recent_input->mtime()) {
+    if (output_mtime < most_recent_input->mtime() &&
+        !InputsUnchanged(edge, most_recent_input, output)) {
       EXPLAIN("%soutput %s older than most recent input %s "
               "(%" PRId64 " vs %" PRId64 ")",
               used_restat ? "restat of " : "", output->path().c_str(),
@@ -252,7 +347,8 @@ bool DependencyScan::RecomputeOutputDirty(Edge* edge,
         EXPLAIN("command line changed for %s", output->path().c_str());
         return true;
       }
-      if (most_recent_input && entry->mtime < most_recent_input->mtime()) {
+      if (most_recent_input && entry->mtime < most_recent_input->mtime() &&
+          !InputsUnchanged(edge, most_recent_input, output)) {
         // May also be dirty due to the mtime in the log being older than the
         // mtime of the most recent input.  This can occur even when the mtime
         // on disk is newer if a previous run wrote to the output file but
@@ -272,23 +368,74 @@ bool DependencyScan::RecomputeOutputDirty(Edge* edge,
   return false;
 }
 
-bool Edge::AllInputsReady() const {
-  for (vector<Node*>::const_iterator i = inputs_.begin();
-       i != inputs_.end(); ++i) {
-    if ((*i)->in_edge() && !(*i)->in_edge()->outputs_ready())
-      return false;
-  }
+bool DependencyScan::InputsUnchanged(Edge* edge, Node* most_recent_input,
+                                     Node* output) {
+  if (!build_log() || !edge->GetBindingBool("content_hash"))
+    return false;
+  BuildLog::LogEntry* entry = build_log()->LookupByOutput(output->path());
+  if (!entry || !entry->inputs_hash || HashInputs(edge) != entry->inputs_hash)
+    return false;
+  // Like a restat, so that later builds compare mtimes instead of hashing
+  // the inputs again.  If that fails, they only hash them again.
+  if (entry->mtime < most_recent_input->mtime())
+    build_log()->RecordMtime(entry, most_recent_input->mtime());
   return true;
 }
 
+uint64_t DependencyScan::HashInputs(Edge* edge) {
+  // Hash the paths with the contents, and sort the hashes, so that the
+  // order of the inputs, which the deps log may change, doesn't matter.
+  vector<uint64_t> hashes;
+  for (vector<Node*>::iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end() - edge->order_only_deps_; ++i) {
+    if ((*i)->immutable())
+      continue;
+    uint64_t content_hash = HashContent(*i);
+    if (!content_hash)
+      return 0;
+    string key = (*i)->path();
+    key.append((const char*)&content_hash, sizeof(content_hash));
+    hashes.push_back(BuildLog::LogEntry::HashContent(key));
+  }
+  sort(hashes.begin(), hashes.end());
+  hashes.erase(unique(hashes.begin(), hashes.end()), hashes.end());
+  string all;
+  for (vector<uint64_t>::iterator h = hashes.begin(); h != hashes.end(); ++h)
+    all.append((const char*)&*h, sizeof(*h));
+  uint64_t hash = BuildLog::LogEntry::HashContent(all);
+  return hash ? hash : 1;
+}
+
+uint64_t DependencyScan::HashContent(Node* node) {
+  map<Node*, pair<TimeStamp, uint64_t> >::iterator i =
+      content_hashes_.find(node);
+  if (i != content_hashes_.end() && i->second.first == node->mtime())
+    return i->second.second;
+  METRIC_RECORD("hash content");
+  string content, err;
+  uint64_t hash = 0;
+  if (disk_interface_->ReadFile(node->path(), &content, &err) ==
+      DiskInterface::Okay) {
+    hash = BuildLog::LogEntry::HashContent(content);
+    if (!hash)
+      hash = 1;
+  }
+  content_hashes_[node] = make_pair(node->mtime(), hash);
+  return hash;
+}
+
 /// An Env for an Edge, providing $in and $out.
 struct EdgeEnv : public Env {
   enum EscapeKind { kShellEscape, kDoNotEscape };
 
-  EdgeEnv(Edge* edge, EscapeKind escape)
-      : edge_(edge), escape_in_out_(escape), recursive_(false) {}
+  EdgeEnv(Edge* edge, EscapeKind escape, const vector<Edge*>* batch = NULL)
+      : edge_(edge), batch_(batch), escape_in_out_(escape),
+        recursive_(false) {}
   virtual string LookupVariable(const string& var);
 
+  /// The value of $in, $in_newline or $out for |edge|.
+  string InOutList(Edge* edge, const string& var);
+
   /// Given a span of Nodes, construct a list of paths suitable for a command
   /// line.
   string MakePathList(vector<Node*>::iterator begin,
@@ -298,22 +445,27 @@ struct EdgeEnv : public Env {
  private:
   vector<string> lookups_;
   Edge* edge_;
+  /// The edges whose inputs and outputs $in and $out list instead, if any.
+  const vector<Edge*>* batch_;
   EscapeKind escape_in_out_;
   bool recursive_;
 };
 
 string EdgeEnv::LookupVariable(const string& var) {
-  if (var == "in" || var == "in_newline") {
-    int explicit_deps_count = edge_->inputs_.size() - edge_->implicit_deps_ -
-      edge_->order_only_deps_;
-    return MakePathList(edge_->inputs_.begin(),
-                        edge_->inputs_.begin() + explicit_deps_count,
-                        var == "in" ? ' ' : '\n');
-  } else if (var == "out") {
-    int explicit_outs_count = edge_->outputs_.size() - edge_->implicit_outs_;
-    return MakePathList(edge_->outputs_.begin(),
-                        edge_->outputs_.begin() + explicit_outs_count,
-                        ' ');
+  if (var == "in" || var == "in_newline" || var == "out") {
+    if (!batch_)
+      return InOutList(edge_, var);
+    string result;
+    for (vector<Edge*>::const_iterator e = batch_->begin();
+         e != batch_->end(); ++e) {
+      string list = InOutList(*e, var);
+      if (list.empty())
+        continue;
+      if (!result.empty())
+        result.push_back(var == "in_newline" ? '\n' : ' ');
+      result.append(list);
+    }
+    return result;
   }
 
   if (recursive_) {
@@ -338,6 +490,20 @@ string EdgeEnv::LookupVariable(const string& var) {
   return edge_->env_->LookupWithFallback(var, eval, this);
 }
 
+string EdgeEnv::InOutList(Edge* edge, const string& var) {
+  if (var == "out") {
+    int explicit_outs_count = edge->outputs_.size() - edge->implicit_outs_;
+    return MakePathList(edge->outputs_.begin(),
+                        edge->outputs_.begin() + explicit_outs_count,
+                        ' ');
+  }
+  int explicit_deps_count = edge->inputs_.size() - edge->implicit_deps_ -
+    edge->order_only_deps_;
+  return MakePathList(edge->inputs_.begin(),
+                      edge->inputs_.begin() + explicit_deps_count,
+                      var == "in" ? ' ' : '\n');
+}
+
 string EdgeEnv::MakePathList(vector<Node*>::iterator begin,
                              vector<Node*>::iterator end,
                              char sep) {
@@ -369,6 +535,11 @@ string Edge::EvaluateCommand(bool incl_rsp_file) {
   return command;
 }
 
+string Edge::EvaluateBatchCommand(const vector<Edge*>& batch) {
+  EdgeEnv env(this, EdgeEnv::kShellEscape, &batch);
+  return env.LookupVariable("command");
+}
+
 string Edge::GetBinding(const string& key) {
   EdgeEnv env(this, EdgeEnv::kShellEscape);
   return env.LookupVariable(key);
@@ -425,6 +596,24 @@ bool Edge::maybe_phonycycle_diagnostic() const {
       implicit_deps_ == 0;
 }
 
+namespace {
+
+/// Whether an edge is in a list sorted by address.
+struct IsListed {
+  explicit IsListed(const vector<Edge*>& edges) : edges_(edges) {}
+  bool operator()(Edge* edge) const {
+    return binary_search(edges_.begin(), edges_.end(), edge);
+  }
+  const vector<Edge*>& edges_;
+};
+
+}  // anonymous namespace
+
+void EdgePriorityQueue::Remove(const vector<Edge*>& edges) {
+  c.erase(remove_if(c.begin(), c.end(), IsListed(edges)), c.end());
+  make_heap(c.begin(), c.end(), comp);
+}
+
 // static
 string Node::PathDecanonicalized(const string& path, uint64_t slash_bits) {
   string result = path;
@@ -521,19 +710,27 @@ bool ImplicitDepLoader::LoadDepFile(Edge* edge, const string& path,
   vector<Node*>::iterator implicit_dep =
       PreallocateSpace(edge, depfile.ins_.size());
 
-  // Add all its in-edges.
+  // Add all its in-edges, except for immutable files, which can't make the
+  // output dirty.
+  int skipped = 0;
   for (vector<StringPiece>::iterator i = depfile.ins_.begin();
-       i != depfile.ins_.end(); ++i, ++implicit_dep) {
+       i != depfile.ins_.end(); ++i) {
     uint64_t slash_bits;
     if (!CanonicalizePath(const_cast<char*>(i->str_), &i->len_, &slash_bits,
                           err))
       return false;
 
     Node* node = state_->GetNode(*i, slash_bits);
-    *implicit_dep = node;
+    if (node->immutable()) {
+      ++skipped;
+      continue;
+    }
+    *implicit_dep++ = node;
     node->AddOutEdge(edge);
     CreatePhonyInEdge(node);
   }
+  if (skipped)
+    ReleaseSpace(edge, implicit_dep, skipped);
 
   return true;
 }
@@ -547,6 +744,13 @@ bool ImplicitDepLoader::LoadDepsFromLog(Edge* edge, string* err) {
     return false;
   }
 
+  // The record lacks the files under the immutable_prefixes that
+  // -d noimmutable stats; run the command again to record them.
+  if (!g_use_immutable_prefixes && deps->lacks_immutable) {
+    EXPLAIN("deps for '%s' may lack immutable files", output->path().c_str());
+    return false;
+  }
+
   // Deps are invalid if the output is newer than the deps.
   if (output->mtime() > deps->mtime) {
     EXPLAIN("stored deps info out of date for '%s' (%" PRId64 " vs %" PRId64 ")",
@@ -556,12 +760,20 @@ bool ImplicitDepLoader::LoadDepsFromLog(Edge* edge, string* err) {
 
   vector<Node*>::iterator implicit_dep =
       PreallocateSpace(edge, deps->node_count);
-  for (int i = 0; i < deps->node_count; ++i, ++implicit_dep) {
-    Node* node = deps->nodes[i];
-    *implicit_dep = node;
+  int skipped = 0;
+  for (int i = 0; i < deps->node_count; ++i) {
+    // Only logs written with -d noimmutable have immutable files.
+    Node* node = deps_log_->NodeForId(deps->id(i));
+    if (node->immutable()) {
+      ++skipped;
+      continue;
+    }
+    *implicit_dep++ = node;
     node->AddOutEdge(edge);
     CreatePhonyInEdge(node);
   }
+  if (skipped)
+    ReleaseSpace(edge, implicit_dep, skipped);
   return true;
 }
 
@@ -573,6 +785,13 @@ vector<Node*>::iterator ImplicitDepLoader::PreallocateSpace(Edge* edge,
   return edge->inputs_.end() - edge->order_only_deps_ - count;
 }
 
+void ImplicitDepLoader::ReleaseSpace(Edge* edge,
+                                     vector<Node*>::iterator unused,
+                                     int count) {
+  edge->inputs_.erase(unused, unused + count);
+  edge->implicit_deps_ -= count;
+}
+
 void ImplicitDepLoader::CreatePhonyInEdge(Node* node) {
   if (node->in_edge())
     return;
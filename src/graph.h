@@ -15,6 +15,8 @@
 #ifndef NINJA_GRAPH_H_
 #define NINJA_GRAPH_H_
 
+#include <map>
+#include <queue>
 #include <string>
 #include <vector>
 using namespace std;
@@ -40,12 +42,18 @@ struct Node {
         slash_bits_(slash_bits),
         mtime_(-1),
         dirty_(false),
+        stat_prefetched_(false),
+        watched_(false),
+        immutable_(false),
         in_edge_(NULL),
         id_(-1) {}
 
   /// Return false on error.
   bool Stat(DiskInterface* disk_interface, string* err);
 
+  /// The mtime of immutable nodes, older than anything a build writes.
+  static const TimeStamp kImmutableMtime = 1;
+
   /// Return false on error.
   bool StatIfNecessary(DiskInterface* disk_interface, string* err) {
     if (status_known())
@@ -57,8 +65,36 @@ struct Node {
   void ResetState() {
     mtime_ = -1;
     dirty_ = false;
+    stat_prefetched_ = false;
   }
 
+  /// Like ResetState(), but keep the mtime, which is known not to have
+  /// changed since it was stat()ed.
+  void ResetStateKeepingMtime() {
+    dirty_ = false;
+    stat_prefetched_ = status_known() && !in_edge_;
+  }
+
+  /// Use an mtime stat()ed ahead of the DependencyScan.
+  void SetPrefetchedMtime(TimeStamp mtime) {
+    mtime_ = mtime;
+    stat_prefetched_ = true;
+  }
+  /// Whether the mtime was prefetched and the node not yet visited by the
+  /// DependencyScan.
+  bool stat_prefetched() const { return stat_prefetched_; }
+  void set_stat_prefetched(bool prefetched) { stat_prefetched_ = prefetched; }
+
+  /// Whether a ChangeJournal reports changes to the node's file.
+  bool watched() const { return watched_; }
+  void set_watched(bool watched) { watched_ = watched; }
+
+  /// Whether the file is under one of the manifest's immutable_prefixes and
+  /// isn't built.  Such a file is taken to exist with kImmutableMtime
+  /// without a stat(), and is left out of the dependencies of outputs.
+  bool immutable() const { return immutable_ && !in_edge_; }
+  void set_immutable(bool immutable) { immutable_ = immutable; }
+
   /// Mark the Node as already-stat()ed and missing.
   void MarkMissing() {
     mtime_ = 0;
@@ -96,6 +132,12 @@ struct Node {
   const vector<Edge*>& out_edges() const { return out_edges_; }
   void AddOutEdge(Edge* edge) { out_edges_.push_back(edge); }
 
+  /// Disconnect from all edges.
+  void ResetEdges() {
+    in_edge_ = NULL;
+    out_edges_.clear();
+  }
+
   void Dump(const char* prefix="") const;
 
 private:
@@ -116,6 +158,15 @@ private:
   /// edges to build.
   bool dirty_;
 
+  /// See stat_prefetched().
+  bool stat_prefetched_;
+
+  /// See watched().
+  bool watched_;
+
+  /// See immutable().
+  bool immutable_;
+
   /// The Edge that produces this Node, or NULL when there is no
   /// known edge to produce it.
   Edge* in_edge_;
@@ -137,16 +188,18 @@ struct Edge {
 
   Edge() : rule_(NULL), pool_(NULL), env_(NULL), mark_(VisitNone),
            outputs_ready_(false), deps_missing_(false),
-           implicit_deps_(0), order_only_deps_(0), implicit_outs_(0) {}
-
-  /// Return true if all inputs' in-edges are ready.
-  bool AllInputsReady() const;
+           critical_path_weight_(0), id_(0), implicit_deps_(0),
+           order_only_deps_(0), implicit_outs_(0) {}
 
   /// Expand all variables in a command and return it as a string.
   /// If incl_rsp_file is enabled, the string will also contain the
   /// full contents of a response file (if applicable)
   string EvaluateCommand(bool incl_rsp_file = false);
 
+  /// Expand the command to run all of |batch|, which starts with this edge:
+  /// $in and $out list the inputs and outputs of all of them.
+  string EvaluateBatchCommand(const vector<Edge*>& batch);
+
   /// Returns the shell-escaped value of |key|.
   string GetBinding(const string& key);
   bool GetBindingBool(const string& key);
@@ -166,11 +219,21 @@ struct Edge {
   VisitMark mark_;
   bool outputs_ready_;
   bool deps_missing_;
+  /// The estimated time, in milliseconds, to run this edge and the longest
+  /// chain of edges in the build that depend on it.  See
+  /// Plan::ComputeCriticalPath().
+  int64_t critical_path_weight_;
+  /// The index of the edge in State::edges_.
+  size_t id_;
 
   const Rule& rule() const { return *rule_; }
   Pool* pool() const { return pool_; }
   int weight() const { return 1; }
   bool outputs_ready() const { return outputs_ready_; }
+  int64_t critical_path_weight() const { return critical_path_weight_; }
+  void set_critical_path_weight(int64_t weight) {
+    critical_path_weight_ = weight;
+  }
 
   // There are three types of inputs.
   // 1) explicit deps, which show up as $in on the command line;
@@ -205,6 +268,34 @@ struct Edge {
   bool maybe_phonycycle_diagnostic() const;
 };
 
+/// Orders edges by their critical path weight, so that the edges that hold
+/// up the most work come first.  Ties go to the edge created first.
+struct EdgePriorityLess {
+  bool operator()(const Edge* e1, const Edge* e2) const {
+    if (e1->critical_path_weight() != e2->critical_path_weight())
+      return e1->critical_path_weight() < e2->critical_path_weight();
+    return e1->id_ > e2->id_;
+  }
+};
+
+struct EdgePriorityGreater {
+  bool operator()(const Edge* e1, const Edge* e2) const {
+    return EdgePriorityLess()(e2, e1);
+  }
+};
+
+/// The edges that are ready to run, highest priority on top.
+struct EdgePriorityQueue
+    : public priority_queue<Edge*, vector<Edge*>, EdgePriorityLess> {
+  void clear() { c.clear(); }
+
+  /// The edges in the queue, in no particular order.
+  const vector<Edge*>& edges() const { return c; }
+
+  /// Remove |edges|, which are in the queue and sorted by address.
+  void Remove(const vector<Edge*>& edges);
+};
+
 
 /// ImplicitDepLoader loads implicit dependencies, as referenced via the
 /// "depfile" attribute in build files.
@@ -237,6 +328,10 @@ struct ImplicitDepLoader {
   /// an iterator pointing at the first new space.
   vector<Node*>::iterator PreallocateSpace(Edge* edge, int count);
 
+  /// Give back the last \a count spaces that PreallocateSpace() added,
+  /// starting at \a unused, for dependencies that were skipped.
+  void ReleaseSpace(Edge* edge, vector<Node*>::iterator unused, int count);
+
   /// If we don't have a edge that generates this input already,
   /// create one; this makes us not abort if the input is missing,
   /// but instead will rebuild in that circumstance.
@@ -266,6 +361,12 @@ struct DependencyScan {
   /// Returns false on failure.
   bool RecomputeDirty(Node* node, string* err);
 
+  /// stat() all nodes that RecomputeDirty() of |targets| is going to stat
+  /// (the nodes of the graph below them and the dependencies recorded in
+  /// the deps log) in one DiskInterface::StatBatch() call, so that the
+  /// scan itself only uses known mtimes.
+  void PrefetchStats(const vector<Node*>& targets);
+
   /// Recompute whether any output of the edge is dirty, if so sets |*dirty|.
   /// Returns false on failure.
   bool RecomputeOutputsDirty(Edge* edge, Node* most_recent_input,
@@ -282,6 +383,20 @@ struct DependencyScan {
     return dep_loader_.deps_log();
   }
 
+  /// The hash of the contents of |edge|'s inputs, except for order-only
+  /// and immutable ones, for edges with content_hash; 0 if one can't be
+  /// read.
+  uint64_t HashInputs(Edge* edge);
+
+  /// The hash of the contents of |node|, which is only read again once its
+  /// mtime changes or ForgetContentHash() is called; 0 if it can't be read.
+  uint64_t HashContent(Node* node);
+
+  /// Read |node| again on the next HashContent(), after a command wrote it.
+  void ForgetContentHash(Node* node) {
+    content_hashes_.erase(node);
+  }
+
  private:
   bool RecomputeDirty(Node* node, vector<Node*>* stack, string* err);
   bool VerifyDAG(Node* node, vector<Node*>* stack, string* err);
@@ -291,9 +406,16 @@ struct DependencyScan {
   bool RecomputeOutputDirty(Edge* edge, Node* most_recent_input,
                             const string& command, Node* output);
 
+  /// Whether |edge| has content_hash and its inputs have the contents that
+  /// the build log recorded for |output| when the command last ran.  If
+  /// so, the log entry of |output| gets the mtime of |most_recent_input|.
+  bool InputsUnchanged(Edge* edge, Node* most_recent_input, Node* output);
+
   BuildLog* build_log_;
   DiskInterface* disk_interface_;
   ImplicitDepLoader dep_loader_;
+  /// The hashes of HashContent(), with the mtimes of the nodes then.
+  map<Node*, pair<TimeStamp, uint64_t> > content_hashes_;
 };
 
 #endif  // NINJA_GRAPH_H_
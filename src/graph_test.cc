@@ -77,6 +77,51 @@ TEST_F(GraphTest, FunkyMakefilePath) {
   EXPECT_TRUE(GetNode("out.o")->dirty());
 }
 
+TEST_F(GraphTest, ImmutablePrefixes) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule catdep\n"
+"  depfile = $out.d\n"
+"  command = cat $in > $out\n"
+"build sysroot/gen.h: cat gen.in\n"
+"build out.o: catdep foo.cc | /usr/include/explicit.h\n"));
+  vector<string> prefixes;
+  prefixes.push_back("/usr/include");
+  prefixes.push_back("sysroot/");
+  state_.SetImmutablePrefixes(prefixes);
+  fs_.Create("foo.cc", "");
+  fs_.Create("gen.in", "");
+  fs_.Create("sysroot/gen.h", "");
+  fs_.Create("out.o.d",
+             "out.o: /usr/include/stdio.h sysroot/lib.h sysroot/gen.h "
+             "/usr/include2/a.h\n");
+  fs_.Tick();
+  fs_.Create("out.o", "");
+
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("out.o"), &err));
+  ASSERT_EQ("", err);
+
+  // The immutable files are missing, but exist for the build.  Only those
+  // that aren't built are immutable, and only whole directories are.
+  Node* node = state_.LookupNode("/usr/include/explicit.h");
+  EXPECT_TRUE(node->immutable());
+  EXPECT_EQ(Node::kImmutableMtime, node->mtime());
+  EXPECT_TRUE(state_.LookupNode("sysroot/lib.h")->immutable());
+  EXPECT_FALSE(state_.LookupNode("sysroot/gen.h")->immutable());
+  EXPECT_FALSE(state_.LookupNode("/usr/include2/a.h")->immutable());
+  EXPECT_TRUE(GetNode("out.o")->dirty());
+
+  // The depfile's immutable files aren't dependencies.
+  Edge* edge = GetNode("out.o")->in_edge();
+  ASSERT_EQ(4u, edge->inputs_.size());
+  EXPECT_EQ("foo.cc", edge->inputs_[0]->path());
+  EXPECT_EQ("/usr/include/explicit.h", edge->inputs_[1]->path());
+  EXPECT_EQ("sysroot/gen.h", edge->inputs_[2]->path());
+  EXPECT_EQ("/usr/include2/a.h", edge->inputs_[3]->path());
+  EXPECT_EQ(3, edge->implicit_deps_);
+  EXPECT_TRUE(state_.LookupNode("sysroot/lib.h")->out_edges().empty());
+}
+
 TEST_F(GraphTest, ExplicitImplicit) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
 "rule catdep\n"
@@ -270,6 +315,21 @@ TEST_F(GraphTest, DepfileRemoved) {
   EXPECT_TRUE(GetNode("out.o")->dirty());
 }
 
+TEST_F(GraphTest, EvaluateBatchCommand) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule r\n"
+"  command = r -o $out $in && echo $in_newline\n"
+"build out1: r in1 in2\n"
+"build out2: r\n"
+"build out3: r in3\n"));
+  vector<Edge*> batch;
+  batch.push_back(GetNode("out1")->in_edge());
+  batch.push_back(GetNode("out2")->in_edge());
+  batch.push_back(GetNode("out3")->in_edge());
+  EXPECT_EQ("r -o out1 out2 out3 in1 in2 in3 && echo in1\nin2\nin3",
+            batch[0]->EvaluateBatchCommand(batch));
+}
+
 // Check that rule-level variables are in scope for eval.
 TEST_F(GraphTest, RuleVariablesInScope) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
@@ -479,3 +539,89 @@ TEST_F(GraphTest, Decanonicalize) {
   EXPECT_EQ(root_nodes[3]->PathDecanonicalized(), "out4\\foo");
 }
 #endif
+
+namespace {
+
+/// Counts the stat() calls of a VirtualFileSystem.
+struct StatCountingFileSystem : public VirtualFileSystem {
+  StatCountingFileSystem() : stats_(0) {}
+  virtual TimeStamp Stat(const string& path, string* err) const {
+    ++stats_;
+    return VirtualFileSystem::Stat(path, err);
+  }
+  mutable int stats_;
+};
+
+const char kPrefetchManifest[] =
+"build out: cat in1 mid | implicit || order\n"
+"build mid: cat src1 src2\n"
+"build order: cat src2\n"
+"build other: cat src3\n";
+
+}  // namespace
+
+TEST_F(GraphTest, PrefetchStats) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_, kPrefetchManifest));
+  State serial_state;
+  AddCatRule(&serial_state);
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&serial_state, kPrefetchManifest));
+
+  StatCountingFileSystem fs;
+  fs.Create("out", "");
+  fs.Create("mid", "");
+  fs.Create("src1", "");
+  fs.Tick();
+  fs.Create("in1", "");
+  fs.Create("src2", "");
+
+  string err;
+  DependencyScan serial_scan(&serial_state, NULL, NULL, &fs, NULL);
+  EXPECT_TRUE(serial_scan.RecomputeDirty(serial_state.LookupNode("out"),
+                                         &err));
+  ASSERT_EQ("", err);
+  int serial_stats = fs.stats_;
+
+  fs.stats_ = 0;
+  DependencyScan scan(&state_, NULL, NULL, &fs, NULL);
+  vector<Node*> targets;
+  targets.push_back(GetNode("out"));
+  scan.PrefetchStats(targets);
+  EXPECT_EQ(serial_stats, fs.stats_);
+  EXPECT_TRUE(scan.RecomputeDirty(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(serial_stats, fs.stats_);
+
+  // The missing leaf "implicit" must be dirty even though its mtime was
+  // prefetched, and nothing outside of the targets is touched.
+  EXPECT_TRUE(GetNode("implicit")->dirty());
+  EXPECT_FALSE(GetNode("src3")->status_known());
+  for (State::Paths::iterator i = serial_state.paths_.begin();
+       i != serial_state.paths_.end(); ++i) {
+    Node* node = GetNode(i->first.AsString());
+    EXPECT_EQ(i->second->mtime(), node->mtime());
+    EXPECT_EQ(i->second->dirty(), node->dirty());
+    EXPECT_FALSE(node->stat_prefetched());
+  }
+  for (size_t i = 0; i < state_.edges_.size(); ++i) {
+    EXPECT_EQ(serial_state.edges_[i]->outputs_ready(),
+              state_.edges_[i]->outputs_ready());
+  }
+}
+
+TEST_F(GraphTest, PrefetchStatsError) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out: cat in\n"));
+  fs_.Create("in", "");
+  fs_.files_["in"].mtime = -1;
+  fs_.files_["in"].stat_error = "stat failed";
+
+  vector<Node*> targets;
+  targets.push_back(GetNode("out"));
+  scan_.PrefetchStats(targets);
+  EXPECT_FALSE(GetNode("in")->status_known());
+
+  // The scan reports the error.
+  string err;
+  EXPECT_FALSE(scan_.RecomputeDirty(GetNode("out"), &err));
+  EXPECT_EQ("stat failed", err);
+}
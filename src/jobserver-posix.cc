@@ -0,0 +1,219 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jobserver.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+/// The most jobs a pool takes; the tokens must fit in the pipe's buffer.
+const int kMaxPoolJobs = 4096;
+
+bool WriteTokens(int fd, int count, string* err) {
+  string tokens(count, '+');
+  size_t written = 0;
+  while (written < tokens.size()) {
+    ssize_t n = write(fd, tokens.data() + written, tokens.size() - written);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      *err = string("write jobserver tokens: ") + strerror(errno);
+      return false;
+    }
+    written += n;
+  }
+  return true;
+}
+
+}  // namespace
+
+JobserverClient::JobserverClient() : read_fd_(-1), write_fd_(-1) {}
+
+JobserverClient::~JobserverClient() {
+  while (!tokens_.empty())
+    Release();
+  if (read_fd_ >= 0)
+    close(read_fd_);
+  if (write_fd_ >= 0 && write_fd_ != read_fd_)
+    close(write_fd_);
+}
+
+bool JobserverClient::Connect(const JobserverConfig& config, string* err) {
+  if (config.mode == JobserverConfig::kFifo) {
+    read_fd_ = open(config.path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (read_fd_ < 0) {
+      *err = "open jobserver fifo " + config.path + ": " + strerror(errno);
+      return false;
+    }
+    write_fd_ = read_fd_;
+    return true;
+  }
+
+  if (config.mode != JobserverConfig::kPipe) {
+    *err = "unsupported jobserver";
+    return false;
+  }
+  // make closes the pipe for commands that it doesn't consider recursive.
+  if (fcntl(config.read_fd, F_GETFD) < 0 ||
+      fcntl(config.write_fd, F_GETFD) < 0) {
+    *err = "the jobserver's pipe isn't open; prefix the command that runs "
+           "ninja with '+' in the Makefile";
+    return false;
+  }
+  // The pipe's file description is shared with make, which expects reads to
+  // block, so open our own nonblocking one of the same pipe.  Only Linux
+  // can, through /proc.
+#ifdef __linux__
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", config.read_fd);
+  read_fd_ = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (read_fd_ < 0) {
+    *err = string("reopen the jobserver's pipe: ") + strerror(errno);
+    return false;
+  }
+#else
+  *err = "joining a jobserver pipe needs Linux; have make 4.4 or later use "
+         "a fifo with --jobserver-style=fifo";
+  return false;
+#endif
+  write_fd_ = fcntl(config.write_fd, F_DUPFD_CLOEXEC, 0);
+  if (write_fd_ < 0) {
+    *err = string("dup the jobserver's pipe: ") + strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool JobserverClient::Connect(const JobserverPool& pool, string* err) {
+  read_fd_ = fcntl(pool.fifo_fd_, F_DUPFD_CLOEXEC, 0);
+  if (read_fd_ < 0) {
+    *err = string("dup the jobserver's fifo: ") + strerror(errno);
+    return false;
+  }
+  write_fd_ = read_fd_;
+  return true;
+}
+
+bool JobserverClient::connected() const {
+  return read_fd_ >= 0;
+}
+
+bool JobserverClient::Acquire() {
+  char token;
+  ssize_t n;
+  do {
+    n = read(read_fd_, &token, 1);
+  } while (n < 0 && errno == EINTR);
+  if (n != 1)
+    return false;
+  tokens_.push_back(token);
+  return true;
+}
+
+void JobserverClient::Release() {
+  if (tokens_.empty())
+    return;
+  char token = tokens_[tokens_.size() - 1];
+  tokens_.resize(tokens_.size() - 1);
+  while (write(write_fd_, &token, 1) < 0 && errno == EINTR) {}
+}
+
+JobserverPool::JobserverPool() : fifo_fd_(-1), had_makeflags_(false) {}
+
+JobserverPool::~JobserverPool() {
+  if (config_.mode == JobserverConfig::kNone)
+    return;
+  if (had_makeflags_)
+    setenv("MAKEFLAGS", old_makeflags_.c_str(), 1);
+  else
+    unsetenv("MAKEFLAGS");
+  if (config_.mode == JobserverConfig::kPipe) {
+    close(config_.read_fd);
+    close(config_.write_fd);
+  } else {
+    unlink(config_.path.c_str());
+    rmdir(dir_.c_str());
+  }
+  close(fifo_fd_);
+}
+
+bool JobserverPool::Create(int jobs, JobserverConfig::Mode mode,
+                           string* err) {
+  if (jobs < 1 || jobs > kMaxPoolJobs) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "a jobserver needs 1 to %d jobs",
+             kMaxPoolJobs);
+    *err = buf;
+    return false;
+  }
+
+  const char* tmp = getenv("TMPDIR");
+  string dir = string(tmp && *tmp ? tmp : "/tmp") + "/ninja-jobserver-XXXXXX";
+  if (!mkdtemp(&dir[0])) {
+    *err = "mkdtemp " + dir + ": " + strerror(errno);
+    return false;
+  }
+  JobserverConfig config;
+  config.mode = mode;
+  config.path = dir + "/fifo";
+  if (mkfifo(config.path.c_str(), 0600) < 0) {
+    *err = "mkfifo " + config.path + ": " + strerror(errno);
+    rmdir(dir.c_str());
+    return false;
+  }
+  int fd = open(config.path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0 || !WriteTokens(fd, jobs - 1, err)) {
+    if (fd < 0)
+      *err = "open " + config.path + ": " + strerror(errno);
+    else
+      close(fd);
+    unlink(config.path.c_str());
+    rmdir(dir.c_str());
+    return false;
+  }
+  if (mode == JobserverConfig::kPipe) {
+    // The commands inherit the ends of the "pipe", so they aren't
+    // close-on-exec.  The fifo has a reader and a writer in |fd|, so
+    // opening them doesn't block.
+    config.read_fd = open(config.path.c_str(), O_RDONLY);
+    config.write_fd = open(config.path.c_str(), O_WRONLY);
+    unlink(config.path.c_str());
+    rmdir(dir.c_str());
+    if (config.read_fd < 0 || config.write_fd < 0) {
+      *err = "open " + config.path + ": " + strerror(errno);
+      if (config.read_fd >= 0)
+        close(config.read_fd);
+      close(fd);
+      return false;
+    }
+    config.path.clear();
+  } else {
+    dir_ = dir;
+  }
+  fifo_fd_ = fd;
+  config_ = config;
+
+  const char* makeflags = getenv("MAKEFLAGS");
+  had_makeflags_ = makeflags != NULL;
+  old_makeflags_ = makeflags ? makeflags : "";
+  setenv("MAKEFLAGS", MakeflagsFor(old_makeflags_, config_, jobs).c_str(), 1);
+  return true;
+}
@@ -0,0 +1,95 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jobserver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+
+#include "util.h"
+
+JobserverClient::JobserverClient() : semaphore_(NULL) {}
+
+JobserverClient::~JobserverClient() {
+  if (semaphore_)
+    CloseHandle(semaphore_);
+}
+
+bool JobserverClient::Connect(const JobserverConfig& config, string* err) {
+  if (config.mode != JobserverConfig::kSemaphore) {
+    *err = "unsupported jobserver";
+    return false;
+  }
+  semaphore_ = OpenSemaphoreA(SYNCHRONIZE | SEMAPHORE_MODIFY_STATE, FALSE,
+                              config.path.c_str());
+  if (!semaphore_) {
+    *err = "open jobserver semaphore " + config.path + ": " +
+        GetLastErrorString();
+    return false;
+  }
+  return true;
+}
+
+bool JobserverClient::Connect(const JobserverPool& pool, string* err) {
+  return Connect(pool.config(), err);
+}
+
+bool JobserverClient::connected() const {
+  return semaphore_ != NULL;
+}
+
+bool JobserverClient::Acquire() {
+  return WaitForSingleObject(semaphore_, 0) == WAIT_OBJECT_0;
+}
+
+void JobserverClient::Release() {
+  ReleaseSemaphore(semaphore_, 1, NULL);
+}
+
+JobserverPool::JobserverPool() : semaphore_(NULL), had_makeflags_(false) {}
+
+JobserverPool::~JobserverPool() {
+  if (!semaphore_)
+    return;
+  SetEnvironmentVariableA("MAKEFLAGS",
+                          had_makeflags_ ? old_makeflags_.c_str() : NULL);
+  CloseHandle(semaphore_);
+}
+
+bool JobserverPool::Create(int jobs, JobserverConfig::Mode mode,
+                           string* err) {
+  if (jobs < 1) {
+    *err = "a jobserver needs at least 1 job";
+    return false;
+  }
+  char name[64];
+  snprintf(name, sizeof(name), "ninja_jobserver_%lu",
+           GetCurrentProcessId());
+  semaphore_ = CreateSemaphoreA(NULL, jobs - 1, jobs - 1, name);
+  if (!semaphore_) {
+    *err = string("CreateSemaphore: ") + GetLastErrorString();
+    return false;
+  }
+  config_.mode = JobserverConfig::kSemaphore;
+  config_.path = name;
+
+  char buf[32767];
+  DWORD len = GetEnvironmentVariableA("MAKEFLAGS", buf, sizeof(buf));
+  had_makeflags_ = len > 0 && len < sizeof(buf);
+  old_makeflags_ = had_makeflags_ ? buf : "";
+  SetEnvironmentVariableA(
+      "MAKEFLAGS", MakeflagsFor(old_makeflags_, config_, jobs).c_str());
+  return true;
+}
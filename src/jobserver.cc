@@ -0,0 +1,116 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jobserver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace {
+
+/// The value of the last \a flag in \a makeflags, which wins in make.
+/// @return false if there is none.
+bool FindFlag(const string& makeflags, const string& flag, size_t* start,
+              string* value) {
+  size_t pos = makeflags.size();
+  while (pos > 0) {
+    pos = makeflags.rfind(flag, pos - 1);
+    if (pos == string::npos)
+      return false;
+    if (pos == 0 || makeflags[pos - 1] == ' ')
+      break;
+  }
+  if (pos == 0 && makeflags.compare(0, flag.size(), flag) != 0)
+    return false;
+  *start = pos;
+  size_t begin = pos + flag.size();
+  size_t end = makeflags.find(' ', begin);
+  if (end == string::npos)
+    end = makeflags.size();
+  *value = makeflags.substr(begin, end - begin);
+  return true;
+}
+
+}  // namespace
+
+bool ParseMakeflags(const string& makeflags, JobserverConfig* config,
+                    string* err) {
+  *config = JobserverConfig();
+
+  // make 4.2 renamed --jobserver-fds to --jobserver-auth.
+  size_t auth_start = 0, fds_start = 0;
+  string auth, fds;
+  bool has_auth = FindFlag(makeflags, "--jobserver-auth=", &auth_start, &auth);
+  bool has_fds = FindFlag(makeflags, "--jobserver-fds=", &fds_start, &fds);
+  if (!has_auth && !has_fds)
+    return true;
+  string value = has_auth && (!has_fds || auth_start > fds_start) ? auth : fds;
+
+  if (value.compare(0, 5, "fifo:") == 0) {
+    config->mode = JobserverConfig::kFifo;
+    config->path = value.substr(5);
+    if (config->path.empty()) {
+      *err = "MAKEFLAGS names a jobserver fifo without a path";
+      return false;
+    }
+    return true;
+  }
+
+  int read_fd, write_fd;
+  char end;
+  if (sscanf(value.c_str(), "%d,%d%c", &read_fd, &write_fd, &end) == 2) {
+    if (read_fd < 0 || write_fd < 0) {
+      // make passes negative descriptors to commands that don't get the
+      // jobserver.
+      return true;
+    }
+    config->mode = JobserverConfig::kPipe;
+    config->read_fd = read_fd;
+    config->write_fd = write_fd;
+    return true;
+  }
+
+#ifdef _WIN32
+  if (!value.empty()) {
+    config->mode = JobserverConfig::kSemaphore;
+    config->path = value;
+    return true;
+  }
+#endif
+  *err = "invalid jobserver in MAKEFLAGS: '" + value + "'";
+  return false;
+}
+
+string MakeflagsFor(const string& makeflags, const JobserverConfig& config,
+                    int jobs) {
+  string result = makeflags;
+  if (!result.empty())
+    result += " ";
+  char buf[64];
+  snprintf(buf, sizeof(buf), "-j%d --jobserver-auth=", jobs);
+  result += buf;
+  switch (config.mode) {
+  case JobserverConfig::kPipe:
+    snprintf(buf, sizeof(buf), "%d,%d", config.read_fd, config.write_fd);
+    result += buf;
+    break;
+  case JobserverConfig::kFifo:
+    result += "fifo:" + config.path;
+    break;
+  default:
+    result += config.path;
+    break;
+  }
+  return result;
+}
@@ -0,0 +1,131 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_JOBSERVER_H_
+#define NINJA_JOBSERVER_H_
+
+#include <string>
+using namespace std;
+
+/// GNU make's jobserver limits the number of jobs that a make and all the
+/// makes, ninjas and other tools below it run at once.  It is a pool of
+/// tokens, one less than the number of jobs; every tool runs its first job
+/// for free and takes a token from the pool for each further job.  The
+/// pool is announced to the commands in MAKEFLAGS, as a pipe whose file
+/// descriptors they inherit, a named fifo (make 4.4) or, on Windows, a
+/// named semaphore.
+
+/// Where a jobserver's tokens are.
+struct JobserverConfig {
+  JobserverConfig() : mode(kNone), read_fd(-1), write_fd(-1) {}
+
+  enum Mode {
+    kNone,
+    kPipe,
+    kFifo,
+    kSemaphore
+  };
+  Mode mode;
+  /// The ends of the pipe, in kPipe mode.
+  int read_fd;
+  int write_fd;
+  /// The path of the fifo, or the name of the semaphore.
+  string path;
+};
+
+/// Find the jobserver announced in a MAKEFLAGS value.  Leaves \a config at
+/// kNone if there is none.
+/// @return false if the announcement is malformed.
+bool ParseMakeflags(const string& makeflags, JobserverConfig* config,
+                    string* err);
+
+/// The MAKEFLAGS that announce the jobserver at \a config with \a jobs jobs
+/// in total, in addition to the flags of \a makeflags.
+string MakeflagsFor(const string& makeflags, const JobserverConfig& config,
+                    int jobs);
+
+struct JobserverPool;
+
+/// Takes and returns the tokens of a jobserver.
+struct JobserverClient {
+  JobserverClient();
+  ~JobserverClient();
+
+  /// Connect to the jobserver at \a config.  Only Linux can join a pipe
+  /// that another process created.
+  /// @return false on error.
+  bool Connect(const JobserverConfig& config, string* err);
+
+  /// Connect to \a pool, which this process created.
+  /// @return false on error.
+  bool Connect(const JobserverPool& pool, string* err);
+
+  bool connected() const;
+
+  /// Take a token, without blocking.
+  /// @return false if there is none left.
+  bool Acquire();
+
+  /// Return a token taken by Acquire().
+  void Release();
+
+ private:
+#ifdef _WIN32
+  void* semaphore_;
+#else
+  int read_fd_;
+  int write_fd_;
+  /// The tokens taken, to return the same bytes.
+  string tokens_;
+#endif
+
+  JobserverClient(const JobserverClient&);
+  void operator=(const JobserverClient&);
+};
+
+/// A jobserver run by ninja for the commands of a build.
+struct JobserverPool {
+  JobserverPool();
+  /// Removes the pool and restores MAKEFLAGS.
+  ~JobserverPool();
+
+  /// Create a pool for \a jobs jobs in \a mode (kPipe or kFifo; Windows
+  /// always uses a semaphore) and announce it in MAKEFLAGS.  The pipe is
+  /// a fifo whose path is removed once it is open, so that the commands
+  /// share a blocking end of it, as make expects, while this process
+  /// reads a nonblocking one.
+  /// @return false on error.
+  bool Create(int jobs, JobserverConfig::Mode mode, string* err);
+
+  const JobserverConfig& config() const { return config_; }
+
+ private:
+  JobserverConfig config_;
+#ifdef _WIN32
+  void* semaphore_;
+#else
+  friend struct JobserverClient;
+  /// The fifo's directory, in kFifo mode.
+  string dir_;
+  /// Keeps the fifo, and the tokens in it, open; it is nonblocking.
+  int fifo_fd_;
+#endif
+  bool had_makeflags_;
+  string old_makeflags_;
+
+  JobserverPool(const JobserverPool&);
+  void operator=(const JobserverPool&);
+};
+
+#endif  // NINJA_JOBSERVER_H_
@@ -0,0 +1,150 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jobserver.h"
+
+#include <stdlib.h>
+
+#include "test.h"
+
+TEST(JobserverTest, ParseMakeflags) {
+  JobserverConfig config;
+  string err;
+
+  EXPECT_TRUE(ParseMakeflags("", &config, &err));
+  EXPECT_EQ(JobserverConfig::kNone, config.mode);
+  EXPECT_TRUE(ParseMakeflags("s -j4", &config, &err));
+  EXPECT_EQ(JobserverConfig::kNone, config.mode);
+
+  EXPECT_TRUE(ParseMakeflags(" -j4 --jobserver-auth=3,4", &config, &err));
+  EXPECT_EQ(JobserverConfig::kPipe, config.mode);
+  EXPECT_EQ(3, config.read_fd);
+  EXPECT_EQ(4, config.write_fd);
+
+  // make before 4.2.
+  EXPECT_TRUE(ParseMakeflags(" -j4 --jobserver-fds=5,6", &config, &err));
+  EXPECT_EQ(JobserverConfig::kPipe, config.mode);
+  EXPECT_EQ(5, config.read_fd);
+  EXPECT_EQ(6, config.write_fd);
+
+  // The last one counts.
+  EXPECT_TRUE(ParseMakeflags(
+      "-j4 --jobserver-auth=3,4 -j2 --jobserver-auth=fifo:/tmp/GMfifo1 -- "
+      "X=1", &config, &err));
+  EXPECT_EQ(JobserverConfig::kFifo, config.mode);
+  EXPECT_EQ("/tmp/GMfifo1", config.path);
+
+  // Commands that make doesn't give the jobserver to.
+  EXPECT_TRUE(ParseMakeflags("-j4 --jobserver-fds=-2,-2", &config, &err));
+  EXPECT_EQ(JobserverConfig::kNone, config.mode);
+
+  // Not a flag.
+  EXPECT_TRUE(ParseMakeflags("-- X=--jobserver-auth=3", &config, &err));
+  EXPECT_TRUE(ParseMakeflags("-- X--jobserver-auth=3,4", &config, &err));
+  EXPECT_EQ(JobserverConfig::kNone, config.mode);
+
+  EXPECT_FALSE(ParseMakeflags("--jobserver-auth=fifo:", &config, &err));
+#ifdef _WIN32
+  EXPECT_TRUE(ParseMakeflags("--jobserver-auth=gmake_semaphore_1", &config,
+                             &err));
+  EXPECT_EQ(JobserverConfig::kSemaphore, config.mode);
+  EXPECT_EQ("gmake_semaphore_1", config.path);
+#else
+  EXPECT_FALSE(ParseMakeflags("--jobserver-auth=3", &config, &err));
+  EXPECT_EQ("invalid jobserver in MAKEFLAGS: '3'", err);
+#endif
+}
+
+TEST(JobserverTest, MakeflagsFor) {
+  JobserverConfig config;
+  config.mode = JobserverConfig::kPipe;
+  config.read_fd = 3;
+  config.write_fd = 4;
+  EXPECT_EQ("-j8 --jobserver-auth=3,4", MakeflagsFor("", config, 8));
+
+  config.mode = JobserverConfig::kFifo;
+  config.path = "/tmp/fifo";
+  EXPECT_EQ("s -j2 --jobserver-auth=fifo:/tmp/fifo",
+            MakeflagsFor("s", config, 2));
+}
+
+#ifndef _WIN32
+
+namespace {
+
+void TestPool(JobserverConfig::Mode mode) {
+  setenv("MAKEFLAGS", "s", 1);
+  {
+    JobserverPool pool;
+    string err;
+    ASSERT_TRUE(pool.Create(3, mode, &err));
+    EXPECT_EQ(mode, pool.config().mode);
+
+    JobserverConfig config;
+    ASSERT_TRUE(ParseMakeflags(getenv("MAKEFLAGS"), &config, &err));
+    EXPECT_EQ(mode, config.mode);
+
+    JobserverClient client;
+    ASSERT_TRUE(client.Connect(pool, &err));
+    EXPECT_TRUE(client.connected());
+
+    // A job is free, so 3 jobs make 2 tokens.
+    EXPECT_TRUE(client.Acquire());
+    EXPECT_TRUE(client.Acquire());
+    EXPECT_FALSE(client.Acquire());
+    client.Release();
+    EXPECT_TRUE(client.Acquire());
+    EXPECT_FALSE(client.Acquire());
+
+    // A second client, like the makes that the commands run, shares the
+    // tokens.  Only Linux can join a pipe that another process created.
+    JobserverClient other;
+#ifndef __linux__
+    if (mode == JobserverConfig::kPipe) {
+      EXPECT_FALSE(other.Connect(config, &err));
+    } else
+#endif
+    {
+      ASSERT_TRUE(other.Connect(config, &err));
+      EXPECT_FALSE(other.Acquire());
+      client.Release();
+      EXPECT_TRUE(other.Acquire());
+    }
+  }
+  EXPECT_EQ(string("s"), getenv("MAKEFLAGS"));
+  unsetenv("MAKEFLAGS");
+}
+
+}  // anonymous namespace
+
+TEST(JobserverTest, Pipe) {
+  TestPool(JobserverConfig::kPipe);
+}
+
+TEST(JobserverTest, Fifo) {
+  TestPool(JobserverConfig::kFifo);
+}
+
+TEST(JobserverTest, ClosedPipe) {
+  JobserverConfig config;
+  config.mode = JobserverConfig::kPipe;
+  config.read_fd = 1000;
+  config.write_fd = 1001;
+  JobserverClient client;
+  string err;
+  EXPECT_FALSE(client.Connect(config, &err));
+  EXPECT_FALSE(client.connected());
+}
+
+#endif  // !_WIN32
@@ -0,0 +1,559 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "manifest_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <map>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "eval_env.h"
+#include "graph.h"
+#include "manifest_parser.h"
+#include "mapped_file.h"
+#include "metrics.h"
+#include "state.h"
+#include "version.h"
+
+namespace {
+
+const char kFileSignature[] = "# ninjamanifest\n";
+const uint32_t kCurrentVersion = 1;
+
+/// Files modified less than this long before the cache is written might be
+/// modified again without their mtime changing, so they are not trusted.
+#ifdef _WIN32
+const TimeStamp kMtimeGranularity = 10000000LL;  // 1s in 100ns units.
+#else
+const TimeStamp kMtimeGranularity = 1000000000LL;  // 1s in ns.
+#endif
+
+/// Stands for "no pool/scope/rule/edge" in the serialized graph.
+const uint32_t kNoIndex = 0xffffffff;
+
+uint32_t OptionBits(const ManifestParserOptions& options) {
+  return options.dupe_edge_action_ | (options.phony_cycle_action_ << 1);
+}
+
+/// Appends integers and length-prefixed strings to a buffer.
+struct Writer {
+  void Write32(uint32_t value) {
+    buf_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+  void Write64(uint64_t value) {
+    buf_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+  void WriteString(const string& str) {
+    Write32(str.size());
+    buf_.append(str);
+  }
+
+  string buf_;
+};
+
+/// Reads back what Writer wrote.  Any read past the end of the input puts
+/// the Reader into a failed state in which all reads return zero.
+struct Reader {
+  Reader(const char* begin, const char* end)
+      : pos_(begin), end_(end), ok_(true) {}
+
+  uint32_t Read32() {
+    uint32_t value = 0;
+    Read(&value, sizeof(value));
+    return value;
+  }
+  uint64_t Read64() {
+    uint64_t value = 0;
+    Read(&value, sizeof(value));
+    return value;
+  }
+  StringPiece ReadString() {
+    uint32_t len = Read32();
+    if (!Check(len))
+      return StringPiece();
+    StringPiece str(pos_, len);
+    pos_ += len;
+    return str;
+  }
+
+  /// Read the size of a list of items that are at least 4 bytes each, so
+  /// that a corrupt count can't make us allocate unbounded memory.
+  uint32_t ReadCount() {
+    uint32_t count = Read32();
+    if (!Check((size_t)count * 4))
+      return 0;
+    return count;
+  }
+
+  /// Read an index that must be less than |limit|, or kNoIndex if
+  /// |allow_none|.
+  uint32_t ReadIndex(size_t limit, bool allow_none) {
+    uint32_t index = Read32();
+    if (index == kNoIndex && allow_none)
+      return index;
+    if (index >= limit)
+      ok_ = false;
+    return ok_ ? index : 0;
+  }
+
+  bool ok() const { return ok_; }
+
+ private:
+  bool Check(size_t len) {
+    if (ok_ && (size_t)(end_ - pos_) < len)
+      ok_ = false;
+    return ok_;
+  }
+  void Read(void* out, size_t len) {
+    if (!Check(len))
+      return;
+    memcpy(out, pos_, len);
+    pos_ += len;
+  }
+
+  const char* pos_;
+  const char* end_;
+  bool ok_;
+};
+
+/// Read an index into |items| and return the item, or NULL on error.
+template<typename T>
+T* ReadRef(Reader* in, const vector<T*>& items) {
+  uint32_t index = in->ReadIndex(items.size(), false);
+  return in->ok() ? items[index] : NULL;
+}
+
+}  // anonymous namespace
+
+FileReader::Status ManifestCache::Recorder::ReadFile(const string& path,
+                                                     string* contents,
+                                                     string* err) {
+  // Stat before reading, so that a concurrent modification leaves us with
+  // a stale stamp (forcing a reparse next time) rather than stale contents.
+  File file;
+  file.path = path;
+  string stat_err;
+  file.mtime = disk_interface_->StatWithSize(path, &file.size, &stat_err);
+  Status status = disk_interface_->ReadFile(path, contents, err);
+  if (status == Okay) {
+    ScopedLock lock(&mutex_);
+    files_.push_back(file);
+  }
+  return status;
+}
+
+// static
+bool ManifestCache::Save(const string& path, const string& input_file,
+                         const ManifestParserOptions& options,
+                         const vector<File>& files,
+                         RealDiskInterface* disk_interface, const State& state,
+                         string* err) {
+  METRIC_RECORD(".ninja_manifest save");
+
+  Writer out;
+  out.buf_.append(kFileSignature, sizeof(kFileSignature) - 1);
+  out.Write32(kCurrentVersion);
+  out.WriteString(kNinjaVersion);
+  out.Write32(OptionBits(options));
+  out.WriteString(input_file);
+  out.Write32(files.size());
+  for (vector<File>::const_iterator i = files.begin(); i != files.end(); ++i) {
+    if (i->mtime <= 0)
+      return true;  // Can't validate this file later; don't cache.
+    out.WriteString(i->path);
+    out.Write64(i->mtime);
+    out.Write64(i->size);
+  }
+
+  // Pools.
+  map<const Pool*, uint32_t> pool_ids;
+  out.Write32(state.pools_.size());
+  for (map<string, Pool*>::const_iterator i = state.pools_.begin();
+       i != state.pools_.end(); ++i) {
+    uint32_t id = pool_ids.size();
+    pool_ids[i->second] = id;
+    out.WriteString(i->first);
+    out.Write32(i->second->depth());
+  }
+
+  // Scopes, parents before children, starting with the root scope.
+  map<const BindingEnv*, uint32_t> env_ids;
+  vector<const BindingEnv*> envs;
+  env_ids[&state.bindings_] = 0;
+  envs.push_back(&state.bindings_);
+  for (vector<Edge*>::const_iterator e = state.edges_.begin();
+       e != state.edges_.end(); ++e) {
+    vector<const BindingEnv*> chain;
+    for (const BindingEnv* env = (*e)->env_;
+         env && env_ids.find(env) == env_ids.end(); env = env->parent_)
+      chain.push_back(env);
+    for (vector<const BindingEnv*>::reverse_iterator i = chain.rbegin();
+         i != chain.rend(); ++i) {
+      env_ids[*i] = envs.size();
+      envs.push_back(*i);
+    }
+  }
+  out.Write32(envs.size());
+  for (vector<const BindingEnv*>::iterator i = envs.begin();
+       i != envs.end(); ++i) {
+    const BindingEnv* env = *i;
+    out.Write32(env->parent_ && i != envs.begin() ? env_ids[env->parent_]
+                                                  : kNoIndex);
+    out.Write32(env->bindings_.size());
+    for (map<string, string>::const_iterator b = env->bindings_.begin();
+         b != env->bindings_.end(); ++b) {
+      out.WriteString(b->first);
+      out.WriteString(b->second);
+    }
+  }
+
+  // Rules, in the scope that declared them.  The phony rule is built in.
+  map<const Rule*, uint32_t> rule_ids;
+  Writer rules;
+  for (size_t env_id = 0; env_id < envs.size(); ++env_id) {
+    const map<string, const Rule*>& env_rules = envs[env_id]->rules_;
+    for (map<string, const Rule*>::const_iterator r = env_rules.begin();
+         r != env_rules.end(); ++r) {
+      const Rule* rule = r->second;
+      if (rule == &State::kPhonyRule)
+        continue;
+      uint32_t id = rule_ids.size();
+      rule_ids[rule] = id;
+      rules.Write32(env_id);
+      rules.WriteString(rule->name());
+      rules.Write32(rule->bindings_.size());
+      for (Rule::Bindings::const_iterator b = rule->bindings_.begin();
+           b != rule->bindings_.end(); ++b) {
+        rules.WriteString(b->first);
+        const EvalString::TokenList& tokens = b->second.parsed_;
+        rules.Write32(tokens.size());
+        for (EvalString::TokenList::const_iterator t = tokens.begin();
+             t != tokens.end(); ++t) {
+          rules.Write32(t->second);
+          rules.WriteString(t->first);
+        }
+      }
+    }
+  }
+  out.Write32(rule_ids.size());
+  out.buf_.append(rules.buf_);
+
+  // Nodes.
+  map<const Node*, uint32_t> node_ids;
+  vector<const Node*> nodes;
+  out.Write32(state.paths_.size());
+  for (State::Paths::const_iterator i = state.paths_.begin();
+       i != state.paths_.end(); ++i) {
+    node_ids[i->second] = nodes.size();
+    nodes.push_back(i->second);
+    out.WriteString(i->second->path());
+    out.Write64(i->second->slash_bits());
+  }
+
+  // Edges.
+  map<const Edge*, uint32_t> edge_ids;
+  out.Write32(state.edges_.size());
+  for (vector<Edge*>::const_iterator i = state.edges_.begin();
+       i != state.edges_.end(); ++i) {
+    const Edge* edge = *i;
+    uint32_t id = edge_ids.size();
+    edge_ids[edge] = id;
+    out.Write32(edge->rule_ == &State::kPhonyRule ? kNoIndex
+                                                  : rule_ids[edge->rule_]);
+    out.Write32(pool_ids[edge->pool_]);
+    out.Write32(edge->env_ ? env_ids[edge->env_] : kNoIndex);
+    out.Write32(edge->implicit_deps_);
+    out.Write32(edge->order_only_deps_);
+    out.Write32(edge->implicit_outs_);
+    out.Write32(edge->inputs_.size());
+    for (vector<Node*>::const_iterator n = edge->inputs_.begin();
+         n != edge->inputs_.end(); ++n)
+      out.Write32(node_ids[*n]);
+    out.Write32(edge->outputs_.size());
+    for (vector<Node*>::const_iterator n = edge->outputs_.begin();
+         n != edge->outputs_.end(); ++n)
+      out.Write32(node_ids[*n]);
+  }
+
+  // Links from nodes to edges.  Out-edges are stored explicitly, rather than
+  // derived from edge inputs, to preserve their order and any entries the
+  // parser left behind when dropping phony self-references.
+  for (vector<const Node*>::iterator i = nodes.begin(); i != nodes.end(); ++i) {
+    const Node* node = *i;
+    out.Write32(node->in_edge() ? edge_ids[node->in_edge()] : kNoIndex);
+    out.Write32(node->out_edges().size());
+    for (vector<Edge*>::const_iterator e = node->out_edges().begin();
+         e != node->out_edges().end(); ++e)
+      out.Write32(edge_ids[*e]);
+  }
+
+  // Defaults.
+  out.Write32(state.defaults_.size());
+  for (vector<Node*>::const_iterator i = state.defaults_.begin();
+       i != state.defaults_.end(); ++i)
+    out.Write32(node_ids[*i]);
+
+  string temp_path = path + ".tmp";
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+  if (fwrite(out.buf_.data(), 1, out.buf_.size(), f) != out.buf_.size()) {
+    *err = strerror(errno);
+    fclose(f);
+    unlink(temp_path.c_str());
+    return false;
+  }
+  if (fclose(f) != 0) {
+    *err = strerror(errno);
+    unlink(temp_path.c_str());
+    return false;
+  }
+
+  // A manifest file written within the mtime granularity of the cache might
+  // still change without its stamp changing; don't cache it yet.
+  TimeStamp now = disk_interface->Stat(temp_path, err);
+  if (now <= 0) {
+    unlink(temp_path.c_str());
+    return now == 0;
+  }
+  for (vector<File>::const_iterator i = files.begin(); i != files.end(); ++i) {
+    if (i->mtime > now - kMtimeGranularity) {
+      unlink(temp_path.c_str());
+      return true;
+    }
+  }
+
+  unlink(path.c_str());
+  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+// static
+bool ManifestCache::FindBuildDir(StringPiece manifest, string* build_dir) {
+  static const char kName[] = "builddir";
+  const size_t kNameSize = sizeof(kName) - 1;
+  build_dir->clear();
+  const char* end = manifest.str_ + manifest.len_;
+  for (const char* line = manifest.str_; line < end; ) {
+    const char* eol = (const char*)memchr(line, '\n', end - line);
+    if (!eol)
+      eol = end;
+    // Only unindented lines are top-level, and a later binding wins.
+    const char* p = line + kNameSize;
+    if (p <= eol && memcmp(line, kName, kNameSize) == 0) {
+      while (p < eol && *p == ' ')
+        ++p;
+      if (p < eol && *p == '=') {
+        ++p;
+        while (p < eol && *p == ' ')
+          ++p;
+        const char* value_end = eol;
+        while (value_end > p && (value_end[-1] == ' ' ||
+                                 value_end[-1] == '\r')) {
+          --value_end;
+        }
+        if (memchr(p, '$', value_end - p))
+          return false;
+        build_dir->assign(p, value_end - p);
+      }
+    }
+    line = eol + 1;
+  }
+  return true;
+}
+
+// static
+bool ManifestCache::FilesChanged(const vector<File>& files,
+                                 RealDiskInterface* disk_interface) {
+  for (vector<File>::const_iterator i = files.begin(); i != files.end(); ++i) {
+    int64_t size = -1;
+    string err;
+    if (disk_interface->StatWithSize(i->path, &size, &err) != i->mtime ||
+        size != i->size)
+      return true;
+  }
+  return false;
+}
+
+ManifestCache::LoadStatus ManifestCache::Load(
+    const string& path, const string& input_file,
+    const ManifestParserOptions& options, RealDiskInterface* disk_interface,
+    State* state, string* err, vector<File>* files) {
+  METRIC_RECORD(".ninja_manifest load");
+
+  MappedFile file;
+  if (file.Map(path, err) < 0) {
+    err->clear();
+    return LOAD_STALE;
+  }
+  const size_t kSignatureLength = sizeof(kFileSignature) - 1;
+  if (file.size() < kSignatureLength ||
+      memcmp(file.data(), kFileSignature, kSignatureLength) != 0)
+    return LOAD_STALE;
+  Reader in(file.data() + kSignatureLength, file.data() + file.size());
+  if (in.Read32() != kCurrentVersion ||
+      in.ReadString() != StringPiece(kNinjaVersion) ||
+      in.Read32() != OptionBits(options) ||
+      in.ReadString() != StringPiece(input_file) || !in.ok())
+    return LOAD_STALE;
+
+  uint32_t file_count = in.ReadCount();
+  vector<File> manifest_files(file_count);
+  for (uint32_t i = 0; i < file_count && in.ok(); ++i) {
+    manifest_files[i].path = in.ReadString().AsString();
+    manifest_files[i].mtime = in.Read64();
+    manifest_files[i].size = in.Read64();
+  }
+  if (!in.ok() || file_count == 0 ||
+      FilesChanged(manifest_files, disk_interface))
+    return LOAD_STALE;
+
+  // The cache is up to date; from here on, any failure leaves |state|
+  // partially filled in.
+  *err = "manifest cache '" + path + "' is corrupt";
+
+  uint32_t pool_count = in.ReadCount();
+  vector<Pool*> pools;
+  pools.reserve(pool_count);
+  for (uint32_t i = 0; i < pool_count && in.ok(); ++i) {
+    string name = in.ReadString().AsString();
+    int depth = (int)in.Read32();
+    Pool* pool = state->LookupPool(name);
+    if (!pool) {
+      pool = new Pool(name, depth);
+      state->AddPool(pool);
+    }
+    pools.push_back(pool);
+  }
+
+  uint32_t env_count = in.ReadCount();
+  vector<BindingEnv*> envs;
+  envs.reserve(env_count);
+  for (uint32_t i = 0; i < env_count && in.ok(); ++i) {
+    uint32_t parent = in.ReadIndex(i, true);
+    BindingEnv* env;
+    if (i == 0) {
+      env = &state->bindings_;
+    } else {
+      env = new BindingEnv(parent == kNoIndex ? NULL : envs[parent]);
+    }
+    uint32_t binding_count = in.ReadCount();
+    for (uint32_t b = 0; b < binding_count && in.ok(); ++b) {
+      string key = in.ReadString().AsString();
+      env->bindings_[key] = in.ReadString().AsString();
+    }
+    envs.push_back(env);
+  }
+  if (envs.empty())
+    return LOAD_CORRUPT;
+
+  uint32_t rule_count = in.ReadCount();
+  vector<const Rule*> rules;
+  rules.reserve(rule_count);
+  for (uint32_t i = 0; i < rule_count && in.ok(); ++i) {
+    BindingEnv* env = ReadRef(&in, envs);
+    if (!env)
+      return LOAD_CORRUPT;
+    Rule* rule = new Rule(in.ReadString().AsString());
+    uint32_t binding_count = in.ReadCount();
+    for (uint32_t b = 0; b < binding_count && in.ok(); ++b) {
+      EvalString& value = rule->bindings_[in.ReadString().AsString()];
+      uint32_t token_count = in.ReadCount();
+      for (uint32_t t = 0; t < token_count && in.ok(); ++t) {
+        EvalString::TokenType type =
+            in.Read32() ? EvalString::SPECIAL : EvalString::RAW;
+        value.parsed_.push_back(make_pair(in.ReadString().AsString(), type));
+      }
+    }
+    if (!in.ok() || env->LookupRuleCurrentScope(rule->name()))
+      return LOAD_CORRUPT;
+    env->AddRule(rule);
+    rules.push_back(rule);
+  }
+
+  uint32_t node_count = in.ReadCount();
+  vector<Node*> nodes;
+  nodes.reserve(node_count);
+#if (__cplusplus >= 201103L) || (_MSC_VER >= 1900)
+  state->paths_.reserve(state->paths_.size() + node_count);
+#endif
+  for (uint32_t i = 0; i < node_count && in.ok(); ++i) {
+    StringPiece node_path = in.ReadString();
+    uint64_t slash_bits = in.Read64();
+    nodes.push_back(state->GetNode(node_path, slash_bits));
+  }
+
+  uint32_t edge_count = in.ReadCount();
+  state->edges_.reserve(edge_count);
+  for (uint32_t i = 0; i < edge_count && in.ok(); ++i) {
+    uint32_t rule = in.ReadIndex(rules.size(), true);
+    uint32_t pool = in.ReadIndex(pools.size(), false);
+    uint32_t env = in.ReadIndex(envs.size(), true);
+    if (!in.ok())
+      return LOAD_CORRUPT;
+    Edge* edge =
+        state->AddEdge(rule == kNoIndex ? &State::kPhonyRule : rules[rule]);
+    edge->pool_ = pools[pool];
+    edge->env_ = env == kNoIndex ? NULL : envs[env];
+    edge->implicit_deps_ = in.Read32();
+    edge->order_only_deps_ = in.Read32();
+    edge->implicit_outs_ = in.Read32();
+    uint32_t input_count = in.ReadCount();
+    edge->inputs_.reserve(input_count);
+    for (uint32_t n = 0; n < input_count && in.ok(); ++n)
+      edge->inputs_.push_back(ReadRef(&in, nodes));
+    uint32_t output_count = in.ReadCount();
+    edge->outputs_.reserve(output_count);
+    for (uint32_t n = 0; n < output_count && in.ok(); ++n)
+      edge->outputs_.push_back(ReadRef(&in, nodes));
+    if (edge->implicit_deps_ < 0 || edge->order_only_deps_ < 0 ||
+        (size_t)(edge->implicit_deps_ + edge->order_only_deps_) >
+            edge->inputs_.size() ||
+        edge->implicit_outs_ < 0 ||
+        (size_t)edge->implicit_outs_ > edge->outputs_.size())
+      return LOAD_CORRUPT;
+  }
+
+  for (vector<Node*>::iterator i = nodes.begin(); i != nodes.end() && in.ok();
+       ++i) {
+    uint32_t in_edge = in.ReadIndex(state->edges_.size(), true);
+    if (in_edge != kNoIndex)
+      (*i)->set_in_edge(state->edges_[in_edge]);
+    uint32_t out_count = in.ReadCount();
+    for (uint32_t e = 0; e < out_count && in.ok(); ++e)
+      (*i)->AddOutEdge(ReadRef(&in, state->edges_));
+  }
+
+  uint32_t default_count = in.ReadCount();
+  for (uint32_t i = 0; i < default_count && in.ok(); ++i)
+    state->defaults_.push_back(ReadRef(&in, nodes));
+
+  if (!in.ok())
+    return LOAD_CORRUPT;
+  err->clear();
+  if (files)
+    files->swap(manifest_files);
+  return LOAD_SUCCESS;
+}
@@ -0,0 +1,112 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_MANIFEST_CACHE_H_
+#define NINJA_MANIFEST_CACHE_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "disk_interface.h"
+#include "string_piece.h"
+#include "thread_pool.h"
+#include "timestamp.h"
+#include "util.h"  // int64_t
+
+struct ManifestParserOptions;
+struct RealDiskInterface;
+struct State;
+
+/// ManifestCache stores a fully parsed State in a binary file, so that a
+/// later run can skip parsing (and evaluating) the manifest as long as none
+/// of the files it was loaded from changed.
+///
+/// The file starts with a header: signature, format version, the ninja
+/// version and parser options that produced it, the name of the top-level
+/// manifest, and the path, mtime and size of every manifest file that was
+/// read.  The header is followed by the serialized graph: pools, scopes
+/// (BindingEnvs) with their bindings and rules, nodes, edges, the out-edge
+/// list of every node and the default targets.  All integers are stored in
+/// native byte order; the cache is never shared between machines.
+///
+/// The cache is always written to a temporary file and renamed into place,
+/// so readers see either the old or the new version.  A cache that fails
+/// any check is ignored and the manifest is parsed as usual.
+struct ManifestCache {
+  /// The stamp of one manifest file the cached State was loaded from.
+  struct File {
+    File() : mtime(-1), size(0) {}
+    string path;
+    TimeStamp mtime;
+    int64_t size;
+  };
+
+  /// A FileReader that records the stamp of every file it reads, to be
+  /// passed to the ManifestParser when the result will be cached.
+  /// Safe to use from several threads at once.
+  struct Recorder : public FileReader {
+    explicit Recorder(RealDiskInterface* disk_interface)
+        : disk_interface_(disk_interface) {}
+    virtual Status ReadFile(const string& path, string* contents,
+                            string* err);
+
+    const vector<File>& files() const { return files_; }
+
+   private:
+    RealDiskInterface* disk_interface_;
+    Mutex mutex_;
+    vector<File> files_;
+  };
+
+  enum LoadStatus {
+    /// |state| was filled in from the cache.
+    LOAD_SUCCESS,
+    /// The cache is missing or out of date; |state| was not modified.
+    LOAD_STALE,
+    /// The cache is unreadable after |state| was partially filled in;
+    /// the caller must start over with a fresh State.
+    LOAD_CORRUPT,
+  };
+
+  /// Load the cache at |path| into the (empty) |state| if it was written
+  /// for |input_file| with the same |options| and all the files it lists
+  /// are unchanged.  On success, |files| (if not NULL) receives that list.
+  static LoadStatus Load(const string& path, const string& input_file,
+                         const ManifestParserOptions& options,
+                         RealDiskInterface* disk_interface, State* state,
+                         string* err, vector<File>* files = NULL);
+
+  /// Find the value of a top-level `builddir` binding in |manifest|, the
+  /// contents of the top-level manifest file, so that the cache can be
+  /// kept next to the logs before the manifest is parsed.  |build_dir| is
+  /// left empty if there is none.
+  /// @return false if the value needs evaluating, as it has a '$'.
+  static bool FindBuildDir(StringPiece manifest, string* build_dir);
+
+  /// Return true if any of |files| was modified since it was recorded.
+  static bool FilesChanged(const vector<File>& files,
+                           RealDiskInterface* disk_interface);
+
+  /// Write |state|, loaded from |files|, to the cache at |path|.
+  /// Returns false and fills in |err| on error.  Nothing is written if any
+  /// of |files| was modified too recently for its mtime to be trusted.
+  static bool Save(const string& path, const string& input_file,
+                   const ManifestParserOptions& options,
+                   const vector<File>& files,
+                   RealDiskInterface* disk_interface, const State& state,
+                   string* err);
+};
+
+#endif  // NINJA_MANIFEST_CACHE_H_
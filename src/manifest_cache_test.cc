@@ -0,0 +1,244 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "manifest_cache.h"
+
+#include <stdio.h>
+#include <sys/types.h>
+#ifdef _WIN32
+#include <sys/utime.h>
+#else
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+#include "graph.h"
+#include "manifest_parser.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+const char kCachePath[] = "manifest_cache";
+
+struct ManifestCacheTest : public testing::Test {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("ninja_manifest_cache_test");
+  }
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  /// Write a manifest file with an mtime far enough in the past for the
+  /// cache to trust it.
+  void WriteManifest(const string& path, const string& contents) {
+    ASSERT_TRUE(disk_.WriteFile(path, contents));
+    struct utimbuf times;
+    times.actime = times.modtime = 1000000000;  // 2001.
+    ASSERT_EQ(0, utime(path.c_str(), &times));
+  }
+
+  /// Parse build.ninja into |state| and write it to the cache.
+  void ParseAndSave(State* state) {
+    ManifestCache::Recorder recorder(&disk_);
+    ManifestParser parser(state, &recorder, options_);
+    string err;
+    ASSERT_TRUE(parser.Load("build.ninja", &err));
+    ASSERT_EQ("", err);
+    ASSERT_TRUE(ManifestCache::Save(kCachePath, "build.ninja", options_,
+                                    recorder.files(), &disk_, *state, &err));
+    ASSERT_EQ("", err);
+  }
+
+  ManifestCache::LoadStatus Load(State* state) {
+    string err;
+    ManifestCache::LoadStatus status = ManifestCache::Load(
+        kCachePath, "build.ninja", options_, &disk_, state, &err);
+    if (status != ManifestCache::LOAD_CORRUPT)
+      EXPECT_EQ("", err);
+    return status;
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_;
+  ManifestParserOptions options_;
+};
+
+const char kManifest[] =
+"pool link_pool\n"
+"  depth = 3\n"
+"cflags = -O2\n"
+"rule cc\n"
+"  command = cc $cflags -c $in -o $out\n"
+"  depfile = $out.d\n"
+"  deps = gcc\n"
+"rule link\n"
+"  command = ld $in -o $out\n"
+"  pool = link_pool\n"
+"build a.o: cc a.c | a.h || gen\n"
+"  cflags = -O0\n"
+"build gen: phony\n"
+"subninja sub.ninja\n"
+"build app | app.map: link a.o b.o\n"
+"default app\n";
+
+const char kSubManifest[] =
+"cflags = -g\n"
+"rule cc\n"
+"  command = subcc $cflags $in > $out\n"
+"build b.o: cc b.c\n";
+
+TEST_F(ManifestCacheTest, RoundTrip) {
+  WriteManifest("build.ninja", kManifest);
+  WriteManifest("sub.ninja", kSubManifest);
+
+  State state1;
+  ParseAndSave(&state1);
+
+  State state2;
+  ASSERT_EQ(ManifestCache::LOAD_SUCCESS, Load(&state2));
+  VerifyGraph(state2);
+
+  ASSERT_EQ(state1.edges_.size(), state2.edges_.size());
+  ASSERT_EQ(state1.paths_.size(), state2.paths_.size());
+  for (size_t i = 0; i < state1.edges_.size(); ++i) {
+    Edge* edge1 = state1.edges_[i];
+    Edge* edge2 = state2.edges_[i];
+    EXPECT_EQ(edge1->rule().name(), edge2->rule().name());
+    EXPECT_EQ(edge1->pool()->name(), edge2->pool()->name());
+    EXPECT_EQ(edge1->EvaluateCommand(), edge2->EvaluateCommand());
+    EXPECT_EQ(edge1->GetBinding("depfile"), edge2->GetBinding("depfile"));
+    EXPECT_EQ(edge1->implicit_deps_, edge2->implicit_deps_);
+    EXPECT_EQ(edge1->order_only_deps_, edge2->order_only_deps_);
+    EXPECT_EQ(edge1->implicit_outs_, edge2->implicit_outs_);
+    ASSERT_EQ(edge1->inputs_.size(), edge2->inputs_.size());
+    for (size_t j = 0; j < edge1->inputs_.size(); ++j)
+      EXPECT_EQ(edge1->inputs_[j]->path(), edge2->inputs_[j]->path());
+    ASSERT_EQ(edge1->outputs_.size(), edge2->outputs_.size());
+    for (size_t j = 0; j < edge1->outputs_.size(); ++j)
+      EXPECT_EQ(edge1->outputs_[j]->path(), edge2->outputs_[j]->path());
+  }
+
+  EXPECT_EQ("cc -O0 -c a.c -o a.o", state2.edges_[0]->EvaluateCommand());
+  EXPECT_EQ("subcc -g b.c > b.o", state2.edges_[2]->EvaluateCommand());
+  EXPECT_TRUE(state2.edges_[1]->is_phony());
+  EXPECT_EQ(3, state2.LookupPool("link_pool")->depth());
+  EXPECT_EQ("-O2", state2.bindings_.LookupVariable("cflags"));
+  EXPECT_EQ(3u, state2.bindings_.GetRules().size());
+
+  Node* a_o = state2.LookupNode("a.o");
+  ASSERT_TRUE(a_o);
+  EXPECT_EQ(state2.edges_[0], a_o->in_edge());
+  ASSERT_EQ(1u, a_o->out_edges().size());
+  EXPECT_EQ(state2.edges_[3], a_o->out_edges()[0]);
+
+  ASSERT_EQ(1u, state2.defaults_.size());
+  EXPECT_EQ("app", state2.defaults_[0]->path());
+}
+
+TEST_F(ManifestCacheTest, StaleWhenManifestChanges) {
+  WriteManifest("build.ninja", kManifest);
+  WriteManifest("sub.ninja", kSubManifest);
+
+  State state1;
+  ParseAndSave(&state1);
+
+  // A change in size alone is noticed.
+  WriteManifest("sub.ninja", string(kSubManifest) + "build c.o: cc c.c\n");
+  State state2;
+  EXPECT_EQ(ManifestCache::LOAD_STALE, Load(&state2));
+  EXPECT_EQ(0u, state2.edges_.size());
+
+  // So is a change in mtime alone.
+  WriteManifest("sub.ninja", kSubManifest);
+  struct utimbuf times;
+  times.actime = times.modtime = 1000000001;
+  ASSERT_EQ(0, utime("sub.ninja", &times));
+  State state3;
+  EXPECT_EQ(ManifestCache::LOAD_STALE, Load(&state3));
+}
+
+TEST_F(ManifestCacheTest, StaleForOtherOptions) {
+  WriteManifest("build.ninja", kManifest);
+  WriteManifest("sub.ninja", kSubManifest);
+
+  State state1;
+  ParseAndSave(&state1);
+
+  options_.dupe_edge_action_ = kDupeEdgeActionError;
+  State state2;
+  EXPECT_EQ(ManifestCache::LOAD_STALE, Load(&state2));
+
+  string err;
+  options_ = ManifestParserOptions();
+  State state3;
+  EXPECT_EQ(ManifestCache::LOAD_STALE,
+            ManifestCache::Load(kCachePath, "other.ninja", options_, &disk_,
+                                &state3, &err));
+}
+
+TEST_F(ManifestCacheTest, RecentlyModifiedManifestIsNotCached) {
+  ASSERT_TRUE(disk_.WriteFile("build.ninja", kManifest));
+  WriteManifest("sub.ninja", kSubManifest);
+
+  State state1;
+  ParseAndSave(&state1);
+
+  // build.ninja might still change within its mtime granularity.
+  string err;
+  EXPECT_EQ(0, disk_.Stat(kCachePath, &err));
+}
+
+TEST_F(ManifestCacheTest, Truncated) {
+  WriteManifest("build.ninja", kManifest);
+  WriteManifest("sub.ninja", kSubManifest);
+
+  State state1;
+  ParseAndSave(&state1);
+
+  string contents;
+  string err;
+  ASSERT_EQ(FileReader::Okay, disk_.ReadFile(kCachePath, &contents, &err));
+
+  // Truncating the cache anywhere must be detected; before the end of the
+  // header the cache is merely stale, after it corrupt.
+  for (size_t size = contents.size() - 1; size > 0; size -= 7) {
+    ASSERT_TRUE(disk_.WriteFile(kCachePath, contents.substr(0, size)));
+    State state2;
+    EXPECT_NE(ManifestCache::LOAD_SUCCESS, Load(&state2));
+    if (size < 7)
+      break;
+  }
+}
+
+TEST(ManifestCacheBuildDirTest, FindBuildDir) {
+  string build_dir = "stale";
+  EXPECT_TRUE(ManifestCache::FindBuildDir("rule cc\n  command = cc\n",
+                                          &build_dir));
+  EXPECT_EQ("", build_dir);
+
+  // A later binding wins, and indented ones are not top-level.
+  EXPECT_TRUE(ManifestCache::FindBuildDir(
+      "builddir = first\n"
+      "builddir=out \r\n"
+      "build x: phony\n"
+      "  builddir = edge\n"
+      "builddirs = other\n", &build_dir));
+  EXPECT_EQ("out", build_dir);
+
+  EXPECT_FALSE(ManifestCache::FindBuildDir("root = out\nbuilddir = $root\n",
+                                           &build_dir));
+}
+
+}  // anonymous namespace
@@ -22,16 +22,85 @@
 #include "graph.h"
 #include "metrics.h"
 #include "state.h"
+#include "thread_pool.h"
 #include "util.h"
 #include "version.h"
 
+/// A subninja file being parsed on the thread pool into a private State.
+/// Nothing it touches outside of that State is modified until all
+/// pending subninja files are merged, so the parse only needs the
+/// statements of the file itself.
+struct ManifestParser::SubninjaTask : public ThreadPool::Task {
+  SubninjaTask(const ManifestParser& parent, const string& path)
+      : path_(path), lexer_(parent.lexer_),
+        env_(new BindingEnv(parent.env_)), file_reader_(parent.file_reader_),
+        options_(parent.options_), quiet_(parent.quiet_), ok_(false) {
+    options_.subninja_threads_ = 1;
+  }
+
+  virtual void Run() {
+    ManifestParser parser(&staging_, file_reader_, options_);
+    parser.env_ = env_;
+    parser.quiet_ = quiet_;
+    parser.external_pools_ = &external_pools_;
+    parser.deferred_warnings_ = &warnings_;
+    string err;
+    ok_ = parser.Load(path_, &err);
+  }
+
+  /// Free whatever was not moved into the shared State by MergeSubninja().
+  ~SubninjaTask() {
+    for (map<string, Pool*>::iterator i = staging_.pools_.begin();
+         i != staging_.pools_.end(); ++i) {
+      if (IsStagedPool(i->second))
+        delete i->second;
+    }
+    for (map<string, Pool*>::iterator i = external_pools_.begin();
+         i != external_pools_.end(); ++i) {
+      delete i->second;
+    }
+  }
+
+  static bool IsStagedPool(Pool* pool) {
+    return pool != &State::kDefaultPool && pool != &State::kConsolePool;
+  }
+
+  /// Map a pool of a staged edge to the shared State.
+  Pool* ResolvePool(Pool* pool, State* state) {
+    map<string, Pool*>::iterator i = external_pools_.find(pool->name());
+    if (i != external_pools_.end() && i->second == pool)
+      return state->LookupPool(pool->name());
+    return pool;
+  }
+
+  string path_;
+  /// The including file's lexer, positioned after the path, for errors.
+  Lexer lexer_;
+  BindingEnv* env_;
+  FileReader* file_reader_;
+  ManifestParserOptions options_;
+  bool quiet_;
+  State staging_;
+  map<string, Pool*> external_pools_;
+  vector<pair<size_t, string> > warnings_;
+  bool ok_;
+};
+
 ManifestParser::ManifestParser(State* state, FileReader* file_reader,
                                ManifestParserOptions options)
     : state_(state), file_reader_(file_reader),
-      options_(options), quiet_(false) {
+      options_(options), quiet_(false), thread_pool_(NULL),
+      owns_thread_pool_(false), external_pools_(NULL),
+      deferred_warnings_(NULL) {
   env_ = &state->bindings_;
 }
 
+ManifestParser::~ManifestParser() {
+  DiscardSubninjas();
+  if (owns_thread_pool_)
+    delete thread_pool_;
+}
+
 bool ManifestParser::Load(const string& filename, string* err, Lexer* parent) {
   METRIC_RECORD(".ninja parse");
   string contents;
@@ -59,6 +128,10 @@ bool ManifestParser::Parse(const string& filename, const string& input,
 
   for (;;) {
     Lexer::Token token = lexer_.ReadToken();
+    if (token != Lexer::SUBNINJA && token != Lexer::NEWLINE &&
+        !FlushSubninjas(err)) {
+      return false;
+    }
     switch (token) {
     case Lexer::POOL:
       if (!ParsePool(err))
@@ -85,8 +158,12 @@ bool ManifestParser::Parse(const string& filename, const string& input,
       string value = let_value.Evaluate(env_);
       // Check ninja_required_version immediately so we can exit
       // before encountering any syntactic surprises.
-      if (name == "ninja_required_version")
+      if (name == "ninja_required_version") {
+        // Leave the check (and its output) to the main thread.
+        if (external_pools_)
+          return lexer_.Error("ninja_required_version in subninja", err);
         CheckNinjaVersion(value);
+      }
       env_->AddBinding(name, value);
       break;
     }
@@ -95,8 +172,13 @@ bool ManifestParser::Parse(const string& filename, const string& input,
         return false;
       break;
     case Lexer::SUBNINJA:
-      if (!ParseFileInclude(true, err))
-        return false;
+      if (options_.subninja_threads_ > 1) {
+        if (!ParseSubninjaAsync(err))
+          return false;
+      } else {
+        if (!ParseFileInclude(true, err))
+          return false;
+      }
       break;
     case Lexer::ERROR: {
       return lexer_.Error(lexer_.DescribeLastError(), err);
@@ -332,12 +414,17 @@ bool ManifestParser::ParseEdge(string* err) {
 
   string pool_name = edge->GetBinding("pool");
   if (!pool_name.empty()) {
-    Pool* pool = state_->LookupPool(pool_name);
+    Pool* pool = LookupPool(pool_name);
     if (pool == NULL)
       return lexer_.Error("unknown pool name '" + pool_name + "'", err);
     edge->pool_ = pool;
   }
 
+  string memory = edge->GetBinding("memory");
+  int64_t memory_bytes;
+  if (!memory.empty() && !ParseMemorySize(memory, &memory_bytes))
+    return lexer_.Error("invalid memory '" + memory + "'", err);
+
   edge->outputs_.reserve(outs.size());
   for (size_t i = 0, e = outs.size(); i != e; ++i) {
     string path = outs[i].Evaluate(env);
@@ -352,10 +439,9 @@ bool ManifestParser::ParseEdge(string* err) {
         return false;
       } else {
         if (!quiet_) {
-          Warning("multiple rules generate %s. "
-                  "builds involving this target will not be correct; "
-                  "continuing anyway [-w dupbuild=warn]",
-                  path.c_str());
+          EmitWarning("multiple rules generate " + path + ". "
+                      "builds involving this target will not be correct; "
+                      "continuing anyway [-w dupbuild=warn]");
         }
         if (e - i <= static_cast<size_t>(implicit_outs))
           --implicit_outs;
@@ -365,8 +451,7 @@ bool ManifestParser::ParseEdge(string* err) {
   if (edge->outputs_.empty()) {
     // All outputs of the edge are already created by other edges. Don't add
     // this edge.  Do this check before input nodes are connected to the edge.
-    state_->edges_.pop_back();
-    delete edge;
+    state_->PopEdge();
     return true;
   }
   edge->implicit_outs_ = implicit_outs;
@@ -395,9 +480,8 @@ bool ManifestParser::ParseEdge(string* err) {
     if (new_end != edge->inputs_.end()) {
       edge->inputs_.erase(new_end, edge->inputs_.end());
       if (!quiet_) {
-        Warning("phony target '%s' names itself as an input; "
-                "ignoring [-w phonycycle=warn]",
-                out->path().c_str());
+        EmitWarning("phony target '" + out->path() + "' names itself as an "
+                    "input; ignoring [-w phonycycle=warn]");
       }
     }
   }
@@ -420,6 +504,10 @@ bool ManifestParser::ParseFileInclude(bool new_scope, string* err) {
   string path = eval.Evaluate(env_);
 
   ManifestParser subparser(state_, file_reader_, options_);
+  subparser.quiet_ = quiet_;
+  subparser.thread_pool_ = thread_pool_;
+  subparser.external_pools_ = external_pools_;
+  subparser.deferred_warnings_ = deferred_warnings_;
   if (new_scope) {
     subparser.env_ = new BindingEnv(env_);
   } else {
@@ -435,6 +523,201 @@ bool ManifestParser::ParseFileInclude(bool new_scope, string* err) {
   return true;
 }
 
+bool ManifestParser::ParseSubninjaAsync(string* err) {
+  EvalString eval;
+  if (!lexer_.ReadPath(&eval, err)) {
+    string flush_err;
+    if (!FlushSubninjas(&flush_err))
+      *err = flush_err;
+    return false;
+  }
+
+  if (!thread_pool_) {
+    thread_pool_ = new ThreadPool(options_.subninja_threads_);
+    owns_thread_pool_ = true;
+  }
+  SubninjaTask* task = new SubninjaTask(*this, eval.Evaluate(env_));
+  pending_subninjas_.push_back(task);
+  thread_pool_->Post(task);
+
+  // Report errors in the subninja before anything that follows it.
+  if (!ExpectToken(Lexer::NEWLINE, err)) {
+    string flush_err;
+    if (!FlushSubninjas(&flush_err))
+      *err = flush_err;
+    return false;
+  }
+
+  // Merge whatever is already done, to bound the memory held by staged
+  // results.
+  while (!pending_subninjas_.empty() &&
+         thread_pool_->IsDone(pending_subninjas_.front())) {
+    if (!MergeSubninja(err))
+      return false;
+  }
+  return true;
+}
+
+bool ManifestParser::FlushSubninjas(string* err) {
+  while (!pending_subninjas_.empty()) {
+    if (!MergeSubninja(err))
+      return false;
+  }
+  return true;
+}
+
+bool ManifestParser::MergeSubninja(string* err) {
+  SubninjaTask* task = pending_subninjas_.front();
+  pending_subninjas_.pop_front();
+  thread_pool_->Wait(task);
+
+  // The staged result can be used only if adding it cannot fail.  Anything
+  // else, like a syntax error, a duplicate or unknown pool or a duplicate
+  // edge with -w dupbuild=err, gets parsed again in place, which produces
+  // exactly the same result and errors as the serial parse.
+  State* staging = &task->staging_;
+  bool usable = task->ok_;
+  for (map<string, Pool*>::iterator i = staging->pools_.begin();
+       usable && i != staging->pools_.end(); ++i) {
+    if (SubninjaTask::IsStagedPool(i->second) &&
+        state_->LookupPool(i->first) != NULL) {
+      usable = false;
+    }
+  }
+  for (map<string, Pool*>::iterator i = task->external_pools_.begin();
+       usable && i != task->external_pools_.end(); ++i) {
+    if (state_->LookupPool(i->first) == NULL)
+      usable = false;
+  }
+  if (usable && options_.dupe_edge_action_ == kDupeEdgeActionError) {
+    for (vector<Edge*>::iterator e = staging->edges_.begin();
+         usable && e != staging->edges_.end(); ++e) {
+      for (vector<Node*>::iterator o = (*e)->outputs_.begin();
+           o != (*e)->outputs_.end(); ++o) {
+        Node* node = state_->LookupNode((*o)->path());
+        if (node && node->in_edge()) {
+          usable = false;
+          break;
+        }
+      }
+    }
+  }
+
+  if (!usable) {
+    ManifestParser subparser(state_, file_reader_, options_);
+    subparser.quiet_ = quiet_;
+    subparser.thread_pool_ = thread_pool_;
+    subparser.env_ = new BindingEnv(env_);
+    bool ok = subparser.Load(task->path_, err, &task->lexer_);
+    delete task;
+    if (!ok)
+      DiscardSubninjas();
+    return ok;
+  }
+
+  for (map<string, Pool*>::iterator i = staging->pools_.begin();
+       i != staging->pools_.end(); ++i) {
+    if (SubninjaTask::IsStagedPool(i->second))
+      state_->AddPool(i->second);
+  }
+  staging->pools_.clear();
+
+  vector<Edge*> dropped_edges;
+  vector<pair<size_t, string> >::iterator warning = task->warnings_.begin();
+  for (size_t e = 0; e < staging->edges_.size(); ++e) {
+    for (; warning != task->warnings_.end() && warning->first <= e + 1;
+         ++warning) {
+      Warning("%s", warning->second.c_str());
+    }
+
+    // Same as the end of ParseEdge(), but moving the staged edge and any
+    // nodes new to state_ instead of copying them.
+    Edge* edge = staging->edges_[e];
+    edge->pool_ = task->ResolvePool(edge->pool_, state_);
+    size_t num_outputs = 0;
+    for (size_t i = 0, n = edge->outputs_.size(); i != n; ++i) {
+      Node* out = MergeNode(edge->outputs_[i], staging);
+      if (out->in_edge()) {
+        if (!quiet_) {
+          Warning("multiple rules generate %s. "
+                  "builds involving this target will not be correct; "
+                  "continuing anyway [-w dupbuild=warn]",
+                  out->path().c_str());
+        }
+        if (n - i <= static_cast<size_t>(edge->implicit_outs_))
+          --edge->implicit_outs_;
+        continue;
+      }
+      out->set_in_edge(edge);
+      edge->outputs_[num_outputs++] = out;
+    }
+    edge->outputs_.resize(num_outputs);
+    if (edge->outputs_.empty()) {
+      dropped_edges.push_back(edge);
+      continue;
+    }
+    edge->id_ = state_->edges_.size();
+    state_->edges_.push_back(edge);
+
+    for (vector<Node*>::iterator i = edge->inputs_.begin();
+         i != edge->inputs_.end(); ++i) {
+      *i = MergeNode(*i, staging);
+      (*i)->AddOutEdge(edge);
+    }
+  }
+  for (; warning != task->warnings_.end(); ++warning)
+    Warning("%s", warning->second.c_str());
+
+  for (vector<Node*>::iterator i = staging->defaults_.begin();
+       i != staging->defaults_.end(); ++i) {
+    state_->defaults_.push_back(MergeNode(*i, staging));
+  }
+
+  // Dropped edges are destroyed with the staging State, but all memory now
+  // belongs to state_.
+  staging->edges_.swap(dropped_edges);
+  state_->arena_.Absorb(&staging->arena_);
+  delete task;
+  return true;
+}
+
+void ManifestParser::DiscardSubninjas() {
+  while (!pending_subninjas_.empty()) {
+    SubninjaTask* task = pending_subninjas_.front();
+    pending_subninjas_.pop_front();
+    thread_pool_->Wait(task);
+    delete task;
+  }
+}
+
+Node* ManifestParser::MergeNode(Node* node, State* staging) {
+  Node* merged = state_->LookupNode(node->path());
+  if (merged)
+    return merged;
+  // The node is new: move it over, without the staged edges.
+  node->ResetEdges();
+  staging->paths_.erase(node->path());
+  state_->paths_[node->path()] = node;
+  return node;
+}
+
+Pool* ManifestParser::LookupPool(const string& name) {
+  Pool* pool = state_->LookupPool(name);
+  if (pool || !external_pools_)
+    return pool;
+  Pool*& placeholder = (*external_pools_)[name];
+  if (!placeholder)
+    placeholder = new Pool(name, 0);
+  return placeholder;
+}
+
+void ManifestParser::EmitWarning(const string& message) {
+  if (deferred_warnings_)
+    deferred_warnings_->push_back(make_pair(state_->edges_.size(), message));
+  else
+    Warning("%s", message.c_str());
+}
+
 bool ManifestParser::ExpectToken(Lexer::Token expected, string* err) {
   Lexer::Token token = lexer_.ReadToken();
   if (token != expected) {
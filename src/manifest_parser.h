@@ -15,7 +15,11 @@
 #ifndef NINJA_MANIFEST_PARSER_H_
 #define NINJA_MANIFEST_PARSER_H_
 
+#include <deque>
+#include <map>
 #include <string>
+#include <utility>
+#include <vector>
 
 using namespace std;
 
@@ -24,7 +28,10 @@ using namespace std;
 struct BindingEnv;
 struct EvalString;
 struct FileReader;
+struct Node;
+struct Pool;
 struct State;
+struct ThreadPool;
 
 enum DupeEdgeAction {
   kDupeEdgeActionWarn,
@@ -39,15 +46,22 @@ enum PhonyCycleAction {
 struct ManifestParserOptions {
   ManifestParserOptions()
       : dupe_edge_action_(kDupeEdgeActionWarn),
-        phony_cycle_action_(kPhonyCycleActionWarn) {}
+        phony_cycle_action_(kPhonyCycleActionWarn),
+        subninja_threads_(1) {}
   DupeEdgeAction dupe_edge_action_;
   PhonyCycleAction phony_cycle_action_;
+  /// Number of threads that parse runs of consecutive 'subninja' files
+  /// concurrently.  1 parses everything on the calling thread.  When
+  /// greater than 1 the FileReader must be safe to use from several
+  /// threads at once.
+  int subninja_threads_;
 };
 
 /// Parses .ninja files.
 struct ManifestParser {
   ManifestParser(State* state, FileReader* file_reader,
                  ManifestParserOptions options = ManifestParserOptions());
+  ~ManifestParser();
 
   /// Load and parse a file.
   bool Load(const string& filename, string* err, Lexer* parent = NULL);
@@ -59,6 +73,8 @@ struct ManifestParser {
   }
 
 private:
+  struct SubninjaTask;
+
   /// Parse a file, given its contents as a string.
   bool Parse(const string& filename, const string& input, string* err);
 
@@ -72,6 +88,28 @@ private:
   /// Parse either a 'subninja' or 'include' line.
   bool ParseFileInclude(bool new_scope, string* err);
 
+  /// Parse a 'subninja' line, starting to parse the file on the thread pool.
+  /// Its result is added to state_ by FlushSubninjas(), which must run
+  /// before anything else in this file is parsed.
+  bool ParseSubninjaAsync(string* err);
+  /// Add the results of all pending subninja files to state_, in order.
+  bool FlushSubninjas(string* err);
+  /// Add the result of the first pending subninja file to state_.
+  bool MergeSubninja(string* err);
+  /// Wait for and drop all pending subninja files after an error.
+  void DiscardSubninjas();
+  /// Return the node in state_ for a node of the |staging| State, moving
+  /// it over if state_ has none.
+  Node* MergeNode(Node* node, State* staging);
+
+  /// Look up a pool for an edge.  On a pool thread, pools not defined in
+  /// state_ get a placeholder in external_pools_.
+  Pool* LookupPool(const string& name);
+
+  /// Print a warning, or defer it until the result is merged on the
+  /// main thread.
+  void EmitWarning(const string& message);
+
   /// If the next token is not \a expected, produce an error string
   /// saying "expectd foo, got bar".
   bool ExpectToken(Lexer::Token expected, string* err);
@@ -82,6 +120,18 @@ private:
   Lexer lexer_;
   ManifestParserOptions options_;
   bool quiet_;
+
+  ThreadPool* thread_pool_;
+  bool owns_thread_pool_;
+  /// Subninja files started by ParseSubninjaAsync(), in file order.
+  deque<SubninjaTask*> pending_subninjas_;
+  /// When parsing a subninja file on a pool thread, state_ is a private
+  /// staging State, and pools used but not defined by the file map to
+  /// placeholders in here until the result is merged.  NULL otherwise.
+  map<string, Pool*>* external_pools_;
+  /// Warnings from a pool thread, with the number of staged edges at the
+  /// time, printed when the result is merged.
+  vector<pair<size_t, string> >* deferred_warnings_;
 };
 
 #endif  // NINJA_MANIFEST_PARSER_H_
@@ -32,6 +32,7 @@
 
 #include "disk_interface.h"
 #include "graph.h"
+#include "manifest_cache.h"
 #include "manifest_parser.h"
 #include "metrics.h"
 #include "state.h"
@@ -52,14 +53,27 @@ bool WriteFakeManifests(const string& dir, string* err) {
   return exit_code == 0;
 }
 
-int LoadManifests(bool measure_command_evaluation) {
+const char kCachePath[] = ".ninja_manifest";
+
+int LoadManifests(bool measure_command_evaluation, bool use_cache,
+                  int subninja_threads) {
   string err;
   RealDiskInterface disk_interface;
   State state;
-  ManifestParser parser(&state, &disk_interface);
-  if (!parser.Load("build.ninja", &err)) {
-    fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
-    exit(1);
+  ManifestParserOptions options;
+  options.subninja_threads_ = subninja_threads;
+  if (!use_cache ||
+      ManifestCache::Load(kCachePath, "build.ninja", options, &disk_interface,
+                          &state, &err) != ManifestCache::LOAD_SUCCESS) {
+    if (use_cache) {
+      fprintf(stderr, "Failed to load manifest cache %s\n", err.c_str());
+      exit(1);
+    }
+    ManifestParser parser(&state, &disk_interface, options);
+    if (!parser.Load("build.ninja", &err)) {
+      fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
+      exit(1);
+    }
   }
   // Doing an empty build involves reading the manifest and evaluating all
   // commands required for the requested targets. So include command
@@ -71,11 +85,58 @@ int LoadManifests(bool measure_command_evaluation) {
   return optimization_guard;
 }
 
+/// Parse the manifests once and write them to the manifest cache.
+bool WriteManifestCache(string* err) {
+  RealDiskInterface disk_interface;
+  State state;
+  ManifestParserOptions options;
+  ManifestCache::Recorder recorder(&disk_interface);
+  ManifestParser parser(&state, &recorder, options);
+  if (!parser.Load("build.ninja", err))
+    return false;
+  if (!ManifestCache::Save(kCachePath, "build.ninja", options,
+                           recorder.files(), &disk_interface, state, err))
+    return false;
+  if (disk_interface.Stat(kCachePath, err) <= 0) {
+    *err = "manifests are too new to be cached, try again in a second";
+    return false;
+  }
+  return true;
+}
+
+void Measure(const char* name, bool measure_command_evaluation,
+             bool use_cache, int subninja_threads) {
+  const int kNumRepetitions = 5;
+  vector<int> times;
+  for (int i = 0; i < kNumRepetitions; ++i) {
+    int64_t start = GetTimeMillis();
+    int optimization_guard =
+        LoadManifests(measure_command_evaluation, use_cache, subninja_threads);
+    int delta = (int)(GetTimeMillis() - start);
+    printf("%s%dms (hash: %x)\n", name, delta, optimization_guard);
+    times.push_back(delta);
+  }
+
+  int min = *min_element(times.begin(), times.end());
+  int max = *max_element(times.begin(), times.end());
+  float total = accumulate(times.begin(), times.end(), 0.0f);
+  printf("%smin %dms  max %dms  avg %.1fms\n", name, min, max,
+         total / times.size());
+}
+
 int main(int argc, char* argv[]) {
   bool measure_command_evaluation = true;
+  bool compare_cache = false;
+  int subninja_threads = 1;
   int opt;
-  while ((opt = getopt(argc, argv, const_cast<char*>("fh"))) != -1) {
+  while ((opt = getopt(argc, argv, const_cast<char*>("cfj:h"))) != -1) {
     switch (opt) {
+    case 'c':
+      compare_cache = true;
+      break;
+    case 'j':
+      subninja_threads = atoi(optarg);
+      break;
     case 'f':
       measure_command_evaluation = false;
       break;
@@ -84,7 +145,9 @@ int main(int argc, char* argv[]) {
       printf("usage: manifest_parser_perftest\n"
 "\n"
 "options:\n"
+"  -c     also measure loading the manifest cache, for comparison\n"
 "  -f     only measure manifest load time, not command evaluation time\n"
+"  -j N   parse subninja files on N threads\n"
              );
     return 1;
     }
@@ -101,18 +164,13 @@ int main(int argc, char* argv[]) {
   if (chdir(kManifestDir) < 0)
     Fatal("chdir: %s", strerror(errno));
 
-  const int kNumRepetitions = 5;
-  vector<int> times;
-  for (int i = 0; i < kNumRepetitions; ++i) {
-    int64_t start = GetTimeMillis();
-    int optimization_guard = LoadManifests(measure_command_evaluation);
-    int delta = (int)(GetTimeMillis() - start);
-    printf("%dms (hash: %x)\n", delta, optimization_guard);
-    times.push_back(delta);
+  Measure(compare_cache ? "parse: " : "", measure_command_evaluation, false,
+          subninja_threads);
+  if (compare_cache) {
+    if (!WriteManifestCache(&err)) {
+      fprintf(stderr, "Failed to write manifest cache: %s\n", err.c_str());
+      return 1;
+    }
+    Measure("cache: ", measure_command_evaluation, true, subninja_threads);
   }
-
-  int min = *min_element(times.begin(), times.end());
-  int max = *max_element(times.begin(), times.end());
-  float total = accumulate(times.begin(), times.end(), 0.0f);
-  printf("min %dms  max %dms  avg %.1fms\n", min, max, total / times.size());
 }
@@ -20,6 +20,7 @@
 #include "graph.h"
 #include "state.h"
 #include "test.h"
+#include "thread_pool.h"
 
 struct ParserTest : public testing::Test {
   void AssertParse(const char* input) {
@@ -834,6 +835,17 @@ TEST_F(ParserTest, Errors) {
                                   "build out: run in\n", &err));
     EXPECT_EQ("input:5: unknown pool name 'unnamed_pool'\n", err);
   }
+
+  {
+    State local_state;
+    ManifestParser parser(&local_state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("rule run\n"
+                                  "  command = echo\n"
+                                  "  memory = lots\n"
+                                  "build out: run in\n", &err));
+    EXPECT_EQ("input:5: invalid memory 'lots'\n", err);
+  }
 }
 
 TEST_F(ParserTest, MissingInput) {
@@ -1085,3 +1097,182 @@ TEST_F(ParserTest, CRLF) {
       "  description = YAY!\r\n",
       &err));
 }
+
+namespace {
+
+/// Lets the parser threads share a VirtualFileSystem.
+struct LockedFileReader : public FileReader {
+  explicit LockedFileReader(FileReader* reader) : reader_(reader) {}
+  virtual Status ReadFile(const string& path, string* contents, string* err) {
+    ScopedLock lock(&mutex_);
+    return reader_->ReadFile(path, contents, err);
+  }
+
+  FileReader* reader_;
+  Mutex mutex_;
+};
+
+/// Describe the graph of |state| in a string, in the order it was built.
+string DumpGraph(State* state) {
+  string result;
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    Edge* edge = *e;
+    result += edge->rule().name() + " [" + edge->pool()->name() + "]";
+    for (size_t i = 0; i < edge->outputs_.size(); ++i)
+      result += (edge->is_implicit_out(i) ? " |" : " ") +
+                edge->outputs_[i]->path();
+    result += " :";
+    for (size_t i = 0; i < edge->inputs_.size(); ++i)
+      result += (edge->is_order_only(i) ? " ||" :
+                 edge->is_implicit(i) ? " |" : " ") +
+                edge->inputs_[i]->path();
+    result += " -> " + edge->EvaluateCommand() + "\n";
+  }
+  for (vector<Node*>::iterator n = state->defaults_.begin();
+       n != state->defaults_.end(); ++n) {
+    result += "default " + (*n)->path() + "\n";
+  }
+  return result;
+}
+
+/// Parse |input| serially and in parallel, checking that both give the
+/// same result.
+void ParseBothWays(VirtualFileSystem* fs, const char* input,
+                   ManifestParserOptions options, bool expect_ok,
+                   string* err) {
+  State serial_state;
+  ManifestParser serial_parser(&serial_state, fs, options);
+  string serial_err;
+  EXPECT_EQ(expect_ok, serial_parser.ParseTest(input, &serial_err));
+
+  LockedFileReader reader(fs);
+  options.subninja_threads_ = 4;
+  State parallel_state;
+  ManifestParser parallel_parser(&parallel_state, &reader, options);
+  EXPECT_EQ(expect_ok, parallel_parser.ParseTest(input, err));
+  EXPECT_EQ(serial_err, *err);
+  if (expect_ok) {
+    VerifyGraph(parallel_state);
+    EXPECT_EQ(DumpGraph(&serial_state), DumpGraph(&parallel_state));
+    EXPECT_EQ(serial_state.paths_.size(), parallel_state.paths_.size());
+  }
+}
+
+}  // anonymous namespace
+
+TEST_F(ParserTest, ParallelSubNinja) {
+  fs_.Create("a.ninja",
+"var = a\n"
+"rule cc\n"
+"  command = cc-$var $in -o $out\n"
+"pool a_pool\n"
+"  depth = 1\n"
+"build a.o | a.d: cc a.c | a.h || gen\n"
+"  pool = a_pool\n"
+"build all_a: phony a.o\n"
+"default all_a\n"
+"include inc.ninja\n");
+  fs_.Create("inc.ninja", "build a2.o: cc a2.c\n");
+  // Uses a rule, a variable and a pool from the parent, and a pool
+  // from a sibling.
+  fs_.Create("b.ninja",
+"build b.o: link a.o b.c\n"
+"  pool = a_pool\n"
+"build b2.o: link b.c\n"
+"  pool = top_pool\n");
+  fs_.Create("c.ninja", "build c.o: link $var a.o\nsubninja d.ninja\n");
+  fs_.Create("d.ninja", "build d.o: link c.o\n");
+  // Same file in separate scopes.
+  fs_.Create("e.ninja", "rule e\n  command = e\nbuild e_$var: e\n");
+
+  string err;
+  ParseBothWays(&fs_,
+"var = top\n"
+"pool top_pool\n"
+"  depth = 2\n"
+"rule link\n"
+"  command = link-$var $in -o $out\n"
+"build gen: link\n"
+"subninja a.ninja\n"
+"subninja b.ninja\n"
+"\n"
+"# comment\n"
+"subninja c.ninja\n"
+"build top: link a.o b.o c.o d.o\n"
+"subninja e.ninja\n"
+"var = second\n"
+"subninja e.ninja\n"
+"build last: link top\n", ManifestParserOptions(), true, &err);
+  EXPECT_EQ("", err);
+}
+
+TEST_F(ParserTest, ParallelSubNinjaDupeEdges) {
+  fs_.Create("a.ninja",
+"build out1 out2: cat in\n"
+"build out2: cat in2\n");
+  fs_.Create("b.ninja",
+"build out1 | out3: cat in3\n"
+"build out4: cat in4\n");
+  fs_.Create("c.ninja",
+"build c: phony c\n");
+  const char kInput[] =
+"rule cat\n"
+"  command = cat $in > $out\n"
+"build out4: cat parent\n"
+"subninja a.ninja\n"
+"subninja b.ninja\n"
+"subninja c.ninja\n";
+
+  string err;
+  ParseBothWays(&fs_, kInput, ManifestParserOptions(), true, &err);
+  EXPECT_EQ("", err);
+
+  ManifestParserOptions options;
+  options.dupe_edge_action_ = kDupeEdgeActionError;
+  ParseBothWays(&fs_, kInput, options, false, &err);
+  EXPECT_EQ("a.ninja:3: multiple rules generate out2 [-w dupbuild=err]\n", err);
+}
+
+TEST_F(ParserTest, ParallelSubNinjaErrors) {
+  fs_.Create("good.ninja", "build good: cat in\n");
+  fs_.Create("bad.ninja", "build bad: cat in\nbuild\n");
+  fs_.Create("pool.ninja", "pool p\n  depth = 1\n");
+
+  string err;
+  ParseBothWays(&fs_,
+"rule cat\n"
+"  command = cat $in > $out\n"
+"subninja good.ninja\n"
+"subninja bad.ninja\n"
+"subninja missing.ninja\n",
+      ManifestParserOptions(), false, &err);
+  EXPECT_EQ("bad.ninja:2: expected path\n"
+            "build\n"
+            "     ^ near here", err);
+
+  ParseBothWays(&fs_,
+"rule cat\n"
+"  command = cat $in > $out\n"
+"subninja good.ninja\n"
+"subninja missing.ninja\n",
+      ManifestParserOptions(), false, &err);
+  EXPECT_EQ("input:4: loading 'missing.ninja': No such file or directory\n"
+            "subninja missing.ninja\n"
+            "                      ^ near here", err);
+
+  ParseBothWays(&fs_,
+"subninja pool.ninja\n"
+"subninja pool.ninja\n",
+      ManifestParserOptions(), false, &err);
+  EXPECT_EQ("pool.ninja:1: duplicate pool 'p'\n"
+            "pool p\n"
+            "      ^ near here", err);
+
+  ParseBothWays(&fs_,
+"subninja good.ninja foo\n",
+      ManifestParserOptions(), false, &err);
+  EXPECT_EQ("good.ninja:1: unknown build rule 'cat'\n"
+            "build good: cat in\n"
+            "            ^ near here", err);
+}
@@ -0,0 +1,124 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "mapped_file.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "util.h"
+
+MappedFile::MappedFile() : data_(NULL), size_(0), mapped_(false)
+#ifdef _WIN32
+    , mapping_(NULL)
+#endif
+{}
+
+MappedFile::~MappedFile() {
+  Unmap();
+}
+
+int MappedFile::Map(const string& path, string* err) {
+  Unmap();
+#ifdef _WIN32
+  HANDLE f = ::CreateFileA(path.c_str(), GENERIC_READ,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (f == INVALID_HANDLE_VALUE) {
+    err->assign(GetLastErrorString());
+    return -ENOENT;
+  }
+  LARGE_INTEGER size;
+  if (!::GetFileSizeEx(f, &size)) {
+    err->assign(GetLastErrorString());
+    ::CloseHandle(f);
+    return -1;
+  }
+  if (size.QuadPart == 0) {
+    // Zero-length files cannot be mapped.
+    ::CloseHandle(f);
+    mapped_ = true;
+    return 0;
+  }
+  HANDLE mapping = ::CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+  ::CloseHandle(f);
+  if (!mapping) {
+    err->assign(GetLastErrorString());
+    return -1;
+  }
+  void* data = ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!data) {
+    err->assign(GetLastErrorString());
+    ::CloseHandle(mapping);
+    return -1;
+  }
+  mapping_ = mapping;
+  data_ = static_cast<const char*>(data);
+  size_ = (size_t)size.QuadPart;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    err->assign(strerror(errno));
+    return -errno;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int saved_errno = errno;
+    err->assign(strerror(saved_errno));
+    close(fd);
+    return -saved_errno;
+  }
+  if (st.st_size == 0) {
+    // Zero-length files cannot be mapped.
+    close(fd);
+    mapped_ = true;
+    return 0;
+  }
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  int saved_errno = errno;
+  close(fd);
+  if (data == MAP_FAILED) {
+    err->assign(strerror(saved_errno));
+    return -saved_errno;
+  }
+  data_ = static_cast<const char*>(data);
+  size_ = st.st_size;
+#endif
+  mapped_ = true;
+  return 0;
+}
+
+void MappedFile::Unmap() {
+  if (data_) {
+#ifdef _WIN32
+    ::UnmapViewOfFile(data_);
+    ::CloseHandle(mapping_);
+    mapping_ = NULL;
+#else
+    munmap(const_cast<char*>(data_), size_);
+#endif
+  }
+  data_ = NULL;
+  size_ = 0;
+  mapped_ = false;
+}
@@ -0,0 +1,53 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_MAPPED_FILE_H_
+#define NINJA_MAPPED_FILE_H_
+
+#include <stddef.h>
+
+#include <string>
+using namespace std;
+
+/// A read-only memory mapping of a whole file.  Used to load the binary
+/// logs and caches without copying them into the heap first.
+struct MappedFile {
+  MappedFile();
+  ~MappedFile();
+
+  /// Map the contents of |path|, replacing any previous mapping.
+  /// Returns -errno and fills in |err| on error (like ReadFile()).
+  int Map(const string& path, string* err);
+
+  /// Release the mapping, if any.
+  void Unmap();
+
+  bool is_mapped() const { return mapped_; }
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const char* data_;
+  size_t size_;
+  bool mapped_;
+#ifdef _WIN32
+  void* mapping_;
+#endif
+
+  // Mappings are not copyable.
+  MappedFile(const MappedFile&);
+  void operator=(const MappedFile&);
+};
+
+#endif  // NINJA_MAPPED_FILE_H_
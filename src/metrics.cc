@@ -26,6 +26,7 @@
 
 #include <algorithm>
 
+#include "thread_pool.h"
 #include "util.h"
 
 Metrics* g_metrics = NULL;
@@ -72,6 +73,12 @@ int64_t TimerToMicros(int64_t dt) {
 }
 #endif
 
+/// Metrics may be recorded from ThreadPool threads too.
+Mutex* MetricsMutex() {
+  static Mutex mutex;
+  return &mutex;
+}
+
 }  // anonymous namespace
 
 
@@ -84,12 +91,14 @@ ScopedMetric::ScopedMetric(Metric* metric) {
 ScopedMetric::~ScopedMetric() {
   if (!metric_)
     return;
-  metric_->count++;
   int64_t dt = TimerToMicros(HighResTimer() - start_);
+  ScopedLock lock(MetricsMutex());
+  metric_->count++;
   metric_->sum += dt;
 }
 
 Metric* Metrics::NewMetric(const string& name) {
+  ScopedLock lock(MetricsMutex());
   Metric* metric = new Metric;
   metric->name = name;
   metric->count = 0;
@@ -30,15 +30,24 @@
 #include <unistd.h>
 #endif
 
+#include "action_cache.h"
 #include "browse.h"
 #include "build.h"
 #include "build_log.h"
+#ifndef _WIN32
+#include "build_server.h"
+
+extern char** environ;
+#endif
+#include "change_journal.h"
 #include "deps_log.h"
 #include "clean.h"
 #include "debug_flags.h"
 #include "disk_interface.h"
 #include "graph.h"
 #include "graphviz.h"
+#include "jobserver.h"
+#include "manifest_cache.h"
 #include "manifest_parser.h"
 #include "metrics.h"
 #include "state.h"
@@ -57,6 +66,17 @@ namespace {
 
 struct Tool;
 
+/// The name of the manifest cache, which lives in $builddir like the logs.
+const char kManifestCacheName[] = ".ninja_manifest";
+
+/// The socket of the build server ("-t server") and the lock that keeps
+/// builds in the same directory from running at the same time.
+const char kBuildServerPath[] = ".ninja_server";
+const char kBuildLockPath[] = ".ninja_lock";
+
+/// Limit number of manifest rebuilds, to prevent infinite loops.
+const int kCycleLimit = 100;
+
 /// Command-line options.
 struct Options {
   /// Build file to load.
@@ -77,6 +97,12 @@ struct Options {
   /// Whether a depfile with multiple targets on separate lines should
   /// warn or print an error.
   bool depfile_distinct_target_lines_should_err;
+
+  /// Whether -j was given.
+  bool parallelism_given;
+
+  /// The kind of jobserver to run for the build's commands, if not kNone.
+  JobserverConfig::Mode jobserver_mode;
 };
 
 /// The Ninja main() loads up a series of data structures; various tools need
@@ -125,7 +151,19 @@ struct NinjaMain : public BuildLogUser {
   int ToolClean(const Options* options, int argc, char* argv[]);
   int ToolCompilationDatabase(const Options* options, int argc, char* argv[]);
   int ToolRecompact(const Options* options, int argc, char* argv[]);
+  int ToolCacheTrim(const Options* options, int argc, char* argv[]);
   int ToolUrtle(const Options* options, int argc, char** argv);
+#ifndef _WIN32
+  int ToolServer(const Options* options, int argc, char* argv[]);
+#endif
+
+  /// Load the manifest named in \a options, from the manifest cache if
+  /// possible, and fill in the manifest files that were read in \a files
+  /// if it is not NULL.
+  /// @return false on error; with an empty \a err, loading must start
+  /// over with a fresh NinjaMain.
+  bool LoadManifest(const Options& options,
+                    vector<ManifestCache::File>* files, string* err);
 
   /// Open the build log.
   /// @return false on error.
@@ -139,6 +177,9 @@ struct NinjaMain : public BuildLogUser {
   /// @return false on error.
   bool EnsureBuildDirExists();
 
+  /// Apply the manifest's immutable_prefixes, unless -d noimmutable.
+  void SetUpImmutablePrefixes();
+
   /// Rebuild the manifest, if necessary.
   /// Fills in \a err on error.
   /// @return true if the manifest was rebuilt.
@@ -151,6 +192,9 @@ struct NinjaMain : public BuildLogUser {
   /// Dump the output requested by '-d stats'.
   void DumpMetrics();
 
+  /// Print an estimate of the memory used by the graph and the logs.
+  void DumpMemoryUsage();
+
   virtual bool IsPathDead(StringPiece s) const {
     Node* n = state_.LookupNode(s);
     if (!n || !n->in_edge())
@@ -214,8 +258,16 @@ void Usage(const BuildConfig& config) {
 "  -j N     run N jobs in parallel (0 means infinity) [default=%d on this system]\n"
 "  -k N     keep going until N jobs fail (0 means infinity) [default=1]\n"
 "  -l N     do not start new jobs if the load average is greater than N\n"
+"  -m SIZE  do not start new jobs expected to use more than SIZE memory in\n"
+"           total, like 16G\n"
 "  -n       dry run (don't run commands but act like they succeeded)\n"
 "\n"
+"  --jobserver       share the -j jobs with child makes through a pipe\n"
+"  --jobserver-fifo  same through a named fifo (GNU make 4.4 and later)\n"
+"  --async-spawn     start commands on a helper thread\n"
+"  --remote=ADDRESS  run the commands of rules with remote = 1 on the\n"
+"                    ninja_worker at ADDRESS (host:port or socket path)\n"
+"\n"
 "  -d MODE  enable debugging (use '-d list' to list modes)\n"
 "  -t TOOL  run a subtool (use '-t list' to list subtools)\n"
 "    terminates toplevel options; further flags are passed to the tool\n"
@@ -236,6 +288,83 @@ int GuessParallelism() {
   }
 }
 
+bool NinjaMain::LoadManifest(const Options& options,
+                             vector<ManifestCache::File>* files,
+                             string* err) {
+  ManifestParserOptions parser_opts;
+  if (options.dupe_edges_should_err) {
+    parser_opts.dupe_edge_action_ = kDupeEdgeActionError;
+  }
+  if (options.phony_cycle_should_err) {
+    parser_opts.phony_cycle_action_ = kPhonyCycleActionError;
+  }
+  parser_opts.subninja_threads_ = GetProcessorCount();
+
+  // The cache can only be found next to the logs if the top-level manifest
+  // sets builddir plainly.
+  string cache_build_dir, cache_path;
+  bool use_cache = false;
+  if (g_experimental_manifest_cache) {
+    string manifest, read_err;
+    use_cache = disk_interface_.ReadFile(options.input_file, &manifest,
+                                         &read_err) == DiskInterface::Okay &&
+        ManifestCache::FindBuildDir(manifest, &cache_build_dir);
+    cache_path = cache_build_dir.empty() ? kManifestCacheName :
+        cache_build_dir + "/" + kManifestCacheName;
+  }
+  if (use_cache) {
+    ManifestCache::LoadStatus status =
+        ManifestCache::Load(cache_path, options.input_file,
+                            parser_opts, &disk_interface_, &state_, err,
+                            files);
+    if (status == ManifestCache::LOAD_SUCCESS) {
+      SetUpImmutablePrefixes();
+      return true;
+    }
+    if (status == ManifestCache::LOAD_CORRUPT) {
+      // Start over with a fresh State; the next pass rewrites the cache.
+      Warning("%s; removing it", err->c_str());
+      disk_interface_.RemoveFile(cache_path);
+      err->clear();
+      return false;
+    }
+  }
+
+  ManifestCache::Recorder recorder(&disk_interface_);
+  ManifestParser parser(&state_, &recorder, parser_opts);
+  if (!parser.Load(options.input_file, err))
+    return false;
+  // An included file may have set builddir after all.
+  if (use_cache &&
+      state_.bindings_.LookupVariable("builddir") == cache_build_dir &&
+      disk_interface_.MakeDirs(cache_path) &&
+      !ManifestCache::Save(cache_path, options.input_file, parser_opts,
+                           recorder.files(), &disk_interface_, state_, err)) {
+    Warning("writing %s: %s", cache_path.c_str(), err->c_str());
+    err->clear();
+  }
+  if (files)
+    *files = recorder.files();
+  SetUpImmutablePrefixes();
+  return true;
+}
+
+void NinjaMain::SetUpImmutablePrefixes() {
+  if (!g_use_immutable_prefixes)
+    return;
+  vector<string> prefixes;
+  string value = state_.bindings_.LookupVariable("immutable_prefixes");
+  size_t start = 0;
+  while (start < value.size()) {
+    size_t end = value.find(' ', start);
+    if (end == string::npos)
+      end = value.size();
+    prefixes.push_back(value.substr(start, end - start));
+    start = end + 1;
+  }
+  state_.SetImmutablePrefixes(prefixes);
+}
+
 /// Rebuild the build manifest, if necessary.
 /// Returns true if the manifest was rebuilt.
 bool NinjaMain::RebuildManifest(const char* input_file, string* err) {
@@ -477,10 +606,13 @@ int ToolTargetsList(State* state) {
 int NinjaMain::ToolDeps(const Options* options, int argc, char** argv) {
   vector<Node*> nodes;
   if (argc == 0) {
-    for (vector<Node*>::const_iterator ni = deps_log_.nodes().begin();
-         ni != deps_log_.nodes().end(); ++ni) {
-      if (deps_log_.IsDepsEntryLiveFor(*ni))
-        nodes.push_back(*ni);
+    // Every id with deps has its Node.
+    for (int id = 0; id < (int)deps_log_.deps().size(); ++id) {
+      if (deps_log_.deps()[id].node_count < 0)
+        continue;
+      Node* node = deps_log_.NodeForId(id);
+      if (deps_log_.IsDepsEntryLiveFor(node))
+        nodes.push_back(node);
     }
   } else {
     string err;
@@ -507,7 +639,7 @@ int NinjaMain::ToolDeps(const Options* options, int argc, char** argv) {
            (*it)->path().c_str(), deps->node_count, deps->mtime,
            (!mtime || mtime > deps->mtime ? "STALE":"VALID"));
     for (int i = 0; i < deps->node_count; ++i)
-      printf("    %s\n", deps->nodes[i]->path().c_str());
+      printf("    %s\n", deps_log_.NodeForId(deps->id(i))->path().c_str());
     printf("\n");
   }
 
@@ -782,6 +914,28 @@ int NinjaMain::ToolRecompact(const Options* options, int argc, char* argv[]) {
   return 0;
 }
 
+int NinjaMain::ToolCacheTrim(const Options* options, int argc, char* argv[]) {
+  int64_t max_size;
+  if (argc != 1 || !ParseMemorySize(argv[0], &max_size)) {
+    printf("usage: ninja -t cachetrim SIZE\n"
+"\n"
+"removes the least recently used entries of the action cache in\n"
+"NINJA_CACHE_DIR until it takes at most SIZE bytes, like 10G\n");
+    return 1;
+  }
+  if (config_.cache_dir.empty()) {
+    Error("NINJA_CACHE_DIR is not set");
+    return 1;
+  }
+  string err;
+  if (!ActionCache::Trim(config_.cache_dir, max_size, &disk_interface_,
+                         &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+  return 0;
+}
+
 int NinjaMain::ToolUrtle(const Options* options, int argc, char** argv) {
   // RLE encoded.
   const char* urtle =
@@ -814,6 +968,8 @@ const Tool* ChooseTool(const string& tool_name) {
   static const Tool kTools[] = {
     { "browse", "browse dependency graph in a web browser",
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolBrowse },
+    { "cachetrim", "evict the least recently used entries of the action cache",
+      Tool::RUN_AFTER_FLAGS, &NinjaMain::ToolCacheTrim },
 #if defined(_MSC_VER)
     { "msvc", "build helper for MSVC cl.exe (EXPERIMENTAL)",
       Tool::RUN_AFTER_FLAGS, &NinjaMain::ToolMSVC },
@@ -834,6 +990,10 @@ const Tool* ChooseTool(const string& tool_name) {
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolCompilationDatabase },
     { "recompact",  "recompacts ninja-internal data structures",
       Tool::RUN_AFTER_LOAD, &NinjaMain::ToolRecompact },
+#ifndef _WIN32
+    { "server", "keep the build graph loaded and run builds for clients",
+      Tool::RUN_AFTER_FLAGS, &NinjaMain::ToolServer },
+#endif
     { "urtle", NULL,
       Tool::RUN_AFTER_FLAGS, &NinjaMain::ToolUrtle },
     { NULL, NULL, Tool::RUN_AFTER_FLAGS, NULL }
@@ -871,13 +1031,20 @@ const Tool* ChooseTool(const string& tool_name) {
 bool DebugEnable(const string& name) {
   if (name == "list") {
     printf("debugging modes:\n"
-"  stats        print operation counts/timing info\n"
+"  stats        print operation counts/timing info and memory usage\n"
 "  explain      explain what caused a command to execute\n"
 "  keepdepfile  don't delete depfiles after they're read by ninja\n"
 "  keeprsp      don't delete @response files on success\n"
-#ifdef _WIN32
+#if defined(_WIN32) || defined(__linux__)
 "  nostatcache  don't batch stat() calls per directory and cache them\n"
 #endif
+"  manifestcache  save the parsed manifest in $builddir/.ninja_manifest and\n"
+"               load it while the manifest files are unchanged\n"
+#ifndef _WIN32
+"  noserver     build here even if a build server (-t server) is running\n"
+#endif
+"  noimmutable  stat files under immutable_prefixes, and run the commands\n"
+"               whose deps were recorded without them (after an upgrade)\n"
 "multiple modes can be enabled via -d FOO -d BAR\n");
     return false;
   } else if (name == "stats") {
@@ -895,11 +1062,21 @@ bool DebugEnable(const string& name) {
   } else if (name == "nostatcache") {
     g_experimental_statcache = false;
     return true;
+  } else if (name == "manifestcache") {
+    g_experimental_manifest_cache = true;
+    return true;
+  } else if (name == "noserver") {
+    g_use_build_server = false;
+    return true;
+  } else if (name == "noimmutable") {
+    g_use_immutable_prefixes = false;
+    return true;
   } else {
     const char* suggestion =
         SpellcheckString(name.c_str(),
                          "stats", "explain", "keepdepfile", "keeprsp",
-                         "nostatcache", NULL);
+                         "nostatcache", "manifestcache", "noserver",
+                         "noimmutable", NULL);
     if (suggestion) {
       Error("unknown debug setting '%s', did you mean '%s'?",
             name.c_str(), suggestion);
@@ -1028,6 +1205,68 @@ void NinjaMain::DumpMetrics() {
   int buckets = (int)state_.paths_.bucket_count();
   printf("path->node hash load %.2f (%d entries / %d buckets)\n",
          count / (double) buckets, count, buckets);
+
+  DumpMemoryUsage();
+}
+
+namespace {
+
+void PrintMemoryUsage(const char* name, size_t count, int64_t bytes) {
+  printf("%-14s\t%-9d\t%.1f\n", name, (int)count, bytes / 1024.0);
+}
+
+}  // anonymous namespace
+
+void NinjaMain::DumpMemoryUsage() {
+  // Counts the payload of the data structures; malloc overhead and the
+  // slack of hash tables are not included.
+  const size_t kHashEntry = 2 * sizeof(void*) + sizeof(StringPiece);
+
+  int64_t path_bytes = 0;
+  int64_t edge_list_bytes = 0;
+  for (State::Paths::iterator i = state_.paths_.begin();
+       i != state_.paths_.end(); ++i) {
+    path_bytes += i->second->path().capacity() + 1;
+    edge_list_bytes += i->second->out_edges().capacity() * sizeof(Edge*);
+  }
+  for (vector<Edge*>::iterator e = state_.edges_.begin();
+       e != state_.edges_.end(); ++e) {
+    edge_list_bytes += ((*e)->inputs_.capacity() +
+                        (*e)->outputs_.capacity()) * sizeof(Node*);
+  }
+  int64_t path_hash_bytes = state_.paths_.bucket_count() * sizeof(void*) +
+                            state_.paths_.size() * kHashEntry;
+
+  int64_t build_log_bytes = build_log_.entries().bucket_count() *
+                            sizeof(void*);
+  for (BuildLog::Entries::const_iterator i = build_log_.entries().begin();
+       i != build_log_.entries().end(); ++i) {
+    build_log_bytes += kHashEntry + sizeof(BuildLog::LogEntry) +
+                       i->second->output.capacity() + 1;
+  }
+
+  // The dependency lists themselves stay in the mapped file.
+  int64_t deps_log_bytes =
+      deps_log_.nodes().capacity() * (sizeof(Node*) + sizeof(unsigned)) +
+      deps_log_.deps().capacity() * sizeof(DepsLog::Deps);
+  size_t deps_count = 0;
+  for (vector<DepsLog::Deps>::const_iterator i = deps_log_.deps().begin();
+       i != deps_log_.deps().end(); ++i) {
+    if (i->node_count >= 0)
+      ++deps_count;
+  }
+
+  printf("\n%-14s\t%-9s\t%s\n", "memory", "count", "KiB");
+  PrintMemoryUsage("graph arena", state_.paths_.size() + state_.edges_.size(),
+                   state_.arena_.bytes_reserved());
+  PrintMemoryUsage("node paths", state_.paths_.size(), path_bytes);
+  PrintMemoryUsage("edge lists", state_.edges_.size(), edge_list_bytes);
+  PrintMemoryUsage("path hash", state_.paths_.size(), path_hash_bytes);
+  PrintMemoryUsage("build log", build_log_.entries().size(), build_log_bytes);
+  PrintMemoryUsage("deps log", deps_count, deps_log_bytes);
+  int64_t peak = GetPeakMemoryUsage();
+  if (peak >= 0)
+    printf("peak RSS %.1f KiB\n", peak / 1024.0);
 }
 
 bool NinjaMain::EnsureBuildDirExists() {
@@ -1053,6 +1292,7 @@ int NinjaMain::RunBuild(int argc, char** argv) {
   disk_interface_.AllowStatCache(g_experimental_statcache);
 
   Builder builder(&state_, config_, &build_log_, &deps_log_, &disk_interface_);
+  builder.PrefetchStats(targets);
   for (size_t i = 0; i < targets.size(); ++i) {
     if (!builder.AddTarget(targets[i], &err)) {
       if (!err.empty()) {
@@ -1112,19 +1352,25 @@ int ExceptionFilter(unsigned int code, struct _EXCEPTION_POINTERS *ep) {
 int ReadFlags(int* argc, char*** argv,
               Options* options, BuildConfig* config) {
   config->parallelism = GuessParallelism();
+  config->deps_threads = GetProcessorCount();
 
-  enum { OPT_VERSION = 1 };
+  enum { OPT_VERSION = 1, OPT_JOBSERVER, OPT_JOBSERVER_FIFO,
+         OPT_ASYNC_SPAWN, OPT_REMOTE };
   const option kLongOptions[] = {
     { "help", no_argument, NULL, 'h' },
     { "version", no_argument, NULL, OPT_VERSION },
     { "verbose", no_argument, NULL, 'v' },
+    { "jobserver", no_argument, NULL, OPT_JOBSERVER },
+    { "jobserver-fifo", no_argument, NULL, OPT_JOBSERVER_FIFO },
+    { "async-spawn", no_argument, NULL, OPT_ASYNC_SPAWN },
+    { "remote", required_argument, NULL, OPT_REMOTE },
     { NULL, 0, NULL, 0 }
   };
 
   int opt;
   while (!options->tool &&
-         (opt = getopt_long(*argc, *argv, "d:f:j:k:l:nt:vw:C:h", kLongOptions,
-                            NULL)) != -1) {
+         (opt = getopt_long(*argc, *argv, "d:f:j:k:l:m:nt:vw:C:h",
+                            kLongOptions, NULL)) != -1) {
     switch (opt) {
       case 'd':
         if (!DebugEnable(optarg))
@@ -1142,6 +1388,7 @@ int ReadFlags(int* argc, char*** argv,
         // We want to run N jobs in parallel. For N = 0, INT_MAX
         // is close enough to infinite for most sane builds.
         config->parallelism = value > 0 ? value : INT_MAX;
+        options->parallelism_given = true;
         break;
       }
       case 'k': {
@@ -1164,6 +1411,10 @@ int ReadFlags(int* argc, char*** argv,
         config->max_load_average = value;
         break;
       }
+      case 'm':
+        if (!ParseMemorySize(optarg, &config->memory_budget))
+          Fatal("-m parameter not a size: did you mean -m 16G?");
+        break;
       case 'n':
         config->dry_run = true;
         break;
@@ -1185,6 +1436,21 @@ int ReadFlags(int* argc, char*** argv,
       case OPT_VERSION:
         printf("%s\n", kNinjaVersion);
         return 0;
+      case OPT_JOBSERVER:
+        options->jobserver_mode = JobserverConfig::kPipe;
+        break;
+      case OPT_JOBSERVER_FIFO:
+        options->jobserver_mode = JobserverConfig::kFifo;
+        break;
+      case OPT_ASYNC_SPAWN:
+        config->async_spawn = true;
+        break;
+      case OPT_REMOTE:
+#ifdef _WIN32
+        Fatal("--remote is not supported on Windows");
+#endif
+        config->remote = optarg;
+        break;
       case 'h':
       default:
         Usage(*config);
@@ -1197,6 +1463,329 @@ int ReadFlags(int* argc, char*** argv,
   return -1;
 }
 
+/// The jobserver shared by the commands of a build.
+struct BuildJobserver {
+  JobserverPool pool;
+  JobserverClient client;
+};
+
+/// Join the jobserver of the make that runs ninja, if any, or else create
+/// one if the flags ask for it, and point \a config at it.
+/// @return false on error.
+bool SetUpJobserver(const Options& options, BuildConfig* config,
+                    BuildJobserver* jobserver) {
+  if (config->dry_run)
+    return true;
+
+  JobserverConfig make_config;
+  string err;
+  const char* makeflags = getenv("MAKEFLAGS");
+  if (makeflags && !ParseMakeflags(makeflags, &make_config, &err)) {
+    Warning("%s; ignoring the jobserver", err.c_str());
+    return true;
+  }
+  if (make_config.mode != JobserverConfig::kNone) {
+    if (!jobserver->client.Connect(make_config, &err)) {
+      Warning("%s; ignoring the jobserver", err.c_str());
+      return true;
+    }
+    // make's -j is the limit then, unless one was given.
+    if (!options.parallelism_given)
+      config->parallelism = INT_MAX;
+  } else if (options.jobserver_mode != JobserverConfig::kNone) {
+    if (!jobserver->pool.Create(config->parallelism, options.jobserver_mode,
+                                &err) ||
+        !jobserver->client.Connect(jobserver->pool, &err)) {
+      Error("jobserver: %s", err.c_str());
+      return false;
+    }
+  } else {
+    return true;
+  }
+  config->jobserver = &jobserver->client;
+  return true;
+}
+
+#ifndef _WIN32
+
+/// The build graph that the build server keeps loaded between builds.
+struct ServerBuild {
+  explicit ServerBuild(const char* ninja_command)
+      : ninja_command_(ninja_command), ninja_(NULL) {}
+  ~ServerBuild() { delete ninja_; }
+
+  /// Load the graph for \a options.
+  /// @return false on error.
+  bool Load(const Options& options);
+
+  /// Run a build with the command line \a argv, like real_main() does.
+  /// @return an exit code.
+  int Run(int argc, char** argv);
+
+  /// Watch the files of the graph for changes, so that builds only stat()
+  /// the changed ones.
+  /// @return false on error.
+  bool WatchChanges(string* err) { return journal_.Start(err); }
+
+ private:
+  /// Whether the graph must be reloaded to build with \a options.
+  bool NeedsReload(const Options& options) const;
+
+  /// Remember the stamps of the logs, to notice builds that didn't run on
+  /// the server.
+  void RecordLogs();
+
+  const char* ninja_command_;
+  /// The configuration of the current build, referenced by ninja_.
+  BuildConfig config_;
+  NinjaMain* ninja_;
+  /// The options and files the graph was loaded with.
+  string input_file_;
+  bool dupe_edges_should_err_;
+  bool phony_cycle_should_err_;
+  bool dry_run_;
+  bool use_immutable_prefixes_;
+  vector<ManifestCache::File> manifest_files_;
+  vector<ManifestCache::File> log_files_;
+  ChangeJournal journal_;
+};
+
+bool ServerBuild::Load(const Options& options) {
+  for (int cycle = 1; cycle <= kCycleLimit; ++cycle) {
+    delete ninja_;
+    ninja_ = new NinjaMain(ninja_command_, config_);
+    string err;
+    if (!ninja_->LoadManifest(options, &manifest_files_, &err)) {
+      if (err.empty())
+        continue;
+      Error("%s", err.c_str());
+      break;
+    }
+    if (!ninja_->EnsureBuildDirExists() || !ninja_->OpenBuildLog() ||
+        !ninja_->OpenDepsLog())
+      break;
+    input_file_ = options.input_file;
+    dupe_edges_should_err_ = options.dupe_edges_should_err;
+    phony_cycle_should_err_ = options.phony_cycle_should_err;
+    dry_run_ = config_.dry_run;
+    use_immutable_prefixes_ = g_use_immutable_prefixes;
+    RecordLogs();
+    return true;
+  }
+  delete ninja_;
+  ninja_ = NULL;
+  return false;
+}
+
+bool ServerBuild::NeedsReload(const Options& options) const {
+  return !ninja_ || options.input_file != input_file_ ||
+      options.dupe_edges_should_err != dupe_edges_should_err_ ||
+      options.phony_cycle_should_err != phony_cycle_should_err_ ||
+      config_.dry_run != dry_run_ ||
+      g_use_immutable_prefixes != use_immutable_prefixes_ ||
+      ManifestCache::FilesChanged(manifest_files_, &ninja_->disk_interface_) ||
+      ManifestCache::FilesChanged(log_files_, &ninja_->disk_interface_);
+}
+
+void ServerBuild::RecordLogs() {
+  const char* kLogs[] = { ".ninja_log", ".ninja_deps" };
+  log_files_.resize(2);
+  for (int i = 0; i < 2; ++i) {
+    ManifestCache::File* file = &log_files_[i];
+    file->path = kLogs[i];
+    if (!ninja_->build_dir_.empty())
+      file->path = ninja_->build_dir_ + "/" + file->path;
+    string err;
+    file->mtime = ninja_->disk_interface_.StatWithSize(file->path,
+                                                       &file->size, &err);
+  }
+}
+
+int ServerBuild::Run(int argc, char** argv) {
+  // Start from the defaults of a fresh process.
+  Options options = {};
+  options.input_file = "build.ninja";
+  options.dupe_edges_should_err = true;
+  config_ = BuildConfig();
+  g_explaining = false;
+  g_keep_depfile = false;
+  g_keep_rsp = false;
+  g_experimental_statcache = true;
+  g_experimental_manifest_cache = false;
+  g_use_immutable_prefixes = true;
+  Metrics* metrics = g_metrics;
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+    defined(__OpenBSD__)
+  optreset = 1;
+  optind = 1;
+#else
+  optind = 0;
+#endif
+
+  // The client has checked the flags already, and changed to the directory
+  // of the server to find it, so -C is done.
+  int exit_code = ReadFlags(&argc, &argv, &options, &config_);
+  if (g_metrics != metrics) {
+    // The timers are set up as the code first runs.
+    Warning("-d stats only works when given to '-t server'");
+    delete g_metrics;
+    g_metrics = metrics;
+  }
+  if (exit_code >= 0)
+    return exit_code;
+  if (options.tool) {
+    Error("the build server doesn't run tools");
+    return 1;
+  }
+  if (options.depfile_distinct_target_lines_should_err) {
+    config_.depfile_parser_options.depfile_distinct_target_lines_action_ =
+        kDepfileDistinctTargetLinesActionError;
+  }
+
+  BuildLock lock;
+  lock.Acquire(kBuildLockPath, true);
+
+  // The client's environment is in place.
+  const char* cache_dir = getenv("NINJA_CACHE_DIR");
+  config_.cache_dir = cache_dir ? cache_dir : "";
+  BuildJobserver jobserver;
+  if (!SetUpJobserver(options, &config_, &jobserver))
+    return 1;
+
+  for (int cycle = 1; cycle <= kCycleLimit; ++cycle) {
+    if (NeedsReload(options) && !Load(options))
+      return 1;
+    journal_.ResetState(&ninja_->state_);
+    if (journal_.started()) {
+      EXPLAIN("%u mtimes unchanged since the last build",
+              (unsigned)journal_.kept());
+    }
+
+    string err;
+    if (ninja_->RebuildManifest(options.input_file, &err)) {
+      if (config_.dry_run)
+        return 0;
+      // Start the build over with the new manifest.
+      delete ninja_;
+      ninja_ = NULL;
+      continue;
+    } else if (!err.empty()) {
+      Error("rebuilding '%s': %s", options.input_file, err.c_str());
+      return 1;
+    }
+
+    int result = ninja_->RunBuild(argc, argv);
+    if (g_metrics)
+      ninja_->DumpMetrics();
+    RecordLogs();
+    return result;
+  }
+
+  Error("manifest '%s' still dirty after %d tries\n",
+      options.input_file, kCycleLimit);
+  return 1;
+}
+
+/// Run \a request on \a build with the client's stdio and environment.
+int RunServerRequest(ServerBuild* build, BuildRequest* request) {
+  fflush(stdout);
+  fflush(stderr);
+  int saved_fds[3];
+  for (int i = 0; i < 3; ++i) {
+    saved_fds[i] = dup(i);
+    SetCloseOnExec(saved_fds[i]);
+    dup2(request->fds[i], i);
+  }
+  request->CloseFds();
+
+  vector<char*> env;
+  for (size_t i = 0; i < request->env.size(); ++i)
+    env.push_back(const_cast<char*>(request->env[i].c_str()));
+  env.push_back(NULL);
+  char** saved_environ = environ;
+  environ = &env[0];
+
+  vector<char*> argv;
+  for (size_t i = 0; i < request->args.size(); ++i)
+    argv.push_back(const_cast<char*>(request->args[i].c_str()));
+  argv.push_back(NULL);
+  int result = build->Run((int)request->args.size(), &argv[0]);
+
+  fflush(stdout);
+  fflush(stderr);
+  environ = saved_environ;
+  for (int i = 0; i < 3; ++i) {
+    dup2(saved_fds[i], i);
+    close(saved_fds[i]);
+  }
+  return result;
+}
+
+int NinjaMain::ToolServer(const Options* options, int argc, char* argv[]) {
+  // getopt() expects argv[0] to contain the name of the tool.
+  ++argc;
+  --argv;
+
+  bool watch = false;
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("hw"))) != -1) {
+    switch (opt) {
+    case 'w':
+      watch = true;
+      break;
+    case 'h':
+    default:
+      printf("usage: ninja [-f FILE] -t server [options]\n"
+"\n"
+"keep the build graph loaded and run the builds of ninja invocations in\n"
+"this directory until interrupted.\n"
+"\n"
+"options:\n"
+"  -w     watch the files of the graph and only stat() the changed ones\n"
+"         (Linux only)\n");
+    return 1;
+    }
+  }
+  if (argc != optind) {
+    Error("unexpected arguments to -t server");
+    return 1;
+  }
+
+  BuildServer server;
+  string err;
+  if (!server.Listen(kBuildServerPath, &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+  printf("ninja: build server listening on %s\n", kBuildServerPath);
+
+  // Load the graph now so that the first build doesn't wait for it.  Like
+  // NinjaMain in real_main(), the graph isn't destroyed as the process
+  // exits, which would take time for nothing.
+  ServerBuild* build = new ServerBuild(ninja_command_);
+  if (watch && !build->WatchChanges(&err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+  {
+    BuildLock lock;
+    lock.Acquire(kBuildLockPath, true);
+    build->Load(*options);
+  }
+
+  BuildRequest request;
+  while (server.Accept(&request, &err))
+    server.Finish(RunServerRequest(build, &request));
+  if (!err.empty()) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+#endif  // !_WIN32
+
 NORETURN void real_main(int argc, char** argv) {
   // Use exit() instead of return in this function to avoid potentially
   // expensive cleanup when destructing NinjaMain.
@@ -1207,11 +1796,19 @@ NORETURN void real_main(int argc, char** argv) {
 
   setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
   const char* ninja_command = argv[0];
+  // The command line to forward to the build server.
+  vector<string> args(argv, argv + argc);
+#ifndef _WIN32
+  BuildLock build_lock;
+#endif
 
   int exit_code = ReadFlags(&argc, &argv, &options, &config);
   if (exit_code >= 0)
     exit(exit_code);
 
+  if (const char* cache_dir = getenv("NINJA_CACHE_DIR"))
+    config.cache_dir = cache_dir;
+
   if (options.depfile_distinct_target_lines_should_err) {
     config.depfile_parser_options.depfile_distinct_target_lines_action_ =
         kDepfileDistinctTargetLinesActionError;
@@ -1237,21 +1834,30 @@ NORETURN void real_main(int argc, char** argv) {
     exit((ninja.*options.tool->func)(&options, argc, argv));
   }
 
-  // Limit number of rebuilds, to prevent infinite loops.
-  const int kCycleLimit = 100;
+#ifndef _WIN32
+  if (!options.tool) {
+    // Let the build server run the build if there is one.
+    if (g_use_build_server && RunOnBuildServer(kBuildServerPath, args,
+                                               &exit_code)) {
+      exit(exit_code);
+    }
+    // Directories that never had a build server go without the lock.
+    build_lock.Acquire(kBuildLockPath, false);
+  }
+#endif
+
+  // Static, to be destroyed on exit().
+  static BuildJobserver jobserver;
+  if (!options.tool && !SetUpJobserver(options, &config, &jobserver))
+    exit(1);
+
   for (int cycle = 1; cycle <= kCycleLimit; ++cycle) {
     NinjaMain ninja(ninja_command, config);
 
-    ManifestParserOptions parser_opts;
-    if (options.dupe_edges_should_err) {
-      parser_opts.dupe_edge_action_ = kDupeEdgeActionError;
-    }
-    if (options.phony_cycle_should_err) {
-      parser_opts.phony_cycle_action_ = kPhonyCycleActionError;
-    }
-    ManifestParser parser(&ninja.state_, &ninja.disk_interface_, parser_opts);
     string err;
-    if (!parser.Load(options.input_file, &err)) {
+    if (!ninja.LoadManifest(options, NULL, &err)) {
+      if (err.empty())
+        continue;
       Error("%s", err.c_str());
       exit(1);
     }
@@ -0,0 +1,73 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Runs the commands that "ninja --remote=ADDRESS" sends, each in a scratch
+// directory, as a compile farm would.  See remote_exec.h.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "remote_exec.h"
+#include "util.h"
+
+void Usage() {
+  fprintf(stderr,
+"usage: ninja_worker [options] ADDRESS DIR\n"
+"\n"
+"runs the commands of ninja --remote=ADDRESS in DIR.\n"
+"ADDRESS is host:port, or the path of a Unix socket.  The worker runs the\n"
+"commands of anyone who connects, so it listens on the loopback address\n"
+"if host is empty; reach it from other hosts through a tunnel like ssh -L.\n"
+"\n"
+"options:\n"
+"  -j N  run N commands in parallel [default=%d on this system]\n",
+          GetProcessorCount());
+}
+
+int main(int argc, char* argv[]) {
+  int parallelism = GetProcessorCount();
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("j:h"))) != -1) {
+    switch (opt) {
+    case 'j': {
+      char* end;
+      parallelism = strtol(optarg, &end, 10);
+      if (*end != 0 || parallelism <= 0)
+        Fatal("invalid -j parameter");
+      break;
+    }
+    case 'h':
+    default:
+      Usage();
+      return 1;
+    }
+  }
+  if (argc - optind != 2) {
+    Usage();
+    return 1;
+  }
+
+  RemoteWorker worker(argv[optind + 1], parallelism);
+  string err;
+  if (!worker.Listen(argv[optind], &err))
+    Fatal("%s", err.c_str());
+  for (;;) {
+    if (!worker.Serve(&err)) {
+      if (err.empty())
+        return 0;
+      Fatal("%s", err.c_str());
+    }
+  }
+}
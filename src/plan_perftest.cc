@@ -0,0 +1,275 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Simulates builds of a synthetic project to compare the wall-clock time of
+// handing out ready edges in address order, which is what a set<Edge*>
+// does, with handing them out by critical path weight.  The project has
+// many short compiles in libraries and a few slow code generators, declared
+// last, that the final link waits for.
+
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <set>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include "getopt.h"
+#else
+#include <getopt.h>
+#endif
+
+#include "build.h"
+#include "build_log.h"
+#include "graph.h"
+#include "manifest_parser.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+namespace {
+
+const int kLibs = 20;
+const int kLibSources = 50;
+const int kGenerators = 4;
+const int kAppSources = 20;
+
+/// The duration of every edge, in milliseconds.
+typedef map<Edge*, int> Durations;
+
+string Printf(const char* format, int a, int b = 0) {
+  char buf[256];
+  snprintf(buf, sizeof(buf), format, a, b);
+  return buf;
+}
+
+/// Create the project in |state| and pick the durations of its edges.
+void CreateProject(State* state, Durations* durations) {
+  string manifest =
+"rule cc\n"
+"  command = cc -c $in -o $out\n"
+"rule ar\n"
+"  command = ar rcs $out $in\n"
+"rule gen\n"
+"  command = gen $in $out\n"
+"rule link\n"
+"  command = link $in -o $out\n";
+  string libs;
+  for (int i = 0; i < kLibs; ++i) {
+    string objs;
+    for (int j = 0; j < kLibSources; ++j) {
+      manifest += Printf("build lib%d/%d.o: cc lib%d/", i, j) +
+          Printf("%d.c\n", j);
+      objs += Printf(" lib%d/%d.o", i, j);
+    }
+    manifest += Printf("build lib%d.a: ar", i) + objs + "\n";
+    libs += Printf(" lib%d.a", i);
+  }
+  string objs;
+  for (int k = 0; k < kGenerators; ++k)
+    manifest += Printf("build gen/%d.h: gen gen/%d.in\n", k, k);
+  for (int j = 0; j < kAppSources; ++j) {
+    manifest += Printf("build app/%d.o: cc app/%d.c", j, j) +
+        Printf(" | gen/%d.h\n", j % kGenerators);
+    objs += Printf(" app/%d.o", j);
+  }
+  manifest += "build app: link" + objs + libs + "\n";
+
+  ManifestParser parser(state, NULL);
+  string err;
+  if (!parser.ParseTest(manifest, &err)) {
+    fprintf(stderr, "%s\n", err.c_str());
+    exit(1);
+  }
+
+  srand(1);
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    const string& rule = (*e)->rule().name();
+    int duration;
+    if (rule == "cc")
+      duration = 200 + rand() % 1800;
+    else if (rule == "ar")
+      duration = 100 + rand() % 200;
+    else if (rule == "gen")
+      duration = 10000 + rand() % 10000;
+    else
+      duration = 5000;
+    (*durations)[*e] = duration;
+  }
+}
+
+/// Make the next plan build everything.
+void MarkAllDirty(State* state) {
+  state->Reset();
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    for (vector<Node*>::iterator o = (*e)->outputs_.begin();
+         o != (*e)->outputs_.end(); ++o) {
+      (*o)->MarkDirty();
+    }
+  }
+}
+
+typedef pair<int64_t, Edge*> Running;
+
+/// Run a build of |target| with |parallelism| jobs through |plan|.
+/// @return the wall-clock time.
+int64_t SimulatePlan(Plan* plan, State* state, Node* target,
+                     const Durations& durations, int parallelism) {
+  MarkAllDirty(state);
+  string err;
+  if (!plan->AddTarget(target, &err)) {
+    fprintf(stderr, "%s\n", err.c_str());
+    exit(1);
+  }
+  priority_queue<Running, vector<Running>, greater<Running> > running;
+  int64_t now = 0;
+  while (plan->more_to_do()) {
+    while ((int)running.size() < parallelism) {
+      Edge* edge = plan->FindWork();
+      if (!edge)
+        break;
+      running.push(Running(now + durations.find(edge)->second, edge));
+    }
+    if (running.empty())
+      break;
+    now = running.top().first;
+    Edge* edge = running.top().second;
+    running.pop();
+    plan->EdgeFinished(edge, Plan::kEdgeSucceeded);
+  }
+  return now;
+}
+
+/// Run a build of all edges with |parallelism| jobs, starting ready edges
+/// in address order.
+/// @return the wall-clock time.
+int64_t SimulateAddressOrder(State* state, const Durations& durations,
+                             int parallelism) {
+  map<Edge*, int> pending;
+  set<Edge*> ready;
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    int count = 0;
+    for (vector<Node*>::iterator i = (*e)->inputs_.begin();
+         i != (*e)->inputs_.end(); ++i) {
+      count += (*i)->in_edge() != NULL;
+    }
+    pending[*e] = count;
+    if (!count)
+      ready.insert(*e);
+  }
+  priority_queue<Running, vector<Running>, greater<Running> > running;
+  int64_t now = 0;
+  for (;;) {
+    while ((int)running.size() < parallelism && !ready.empty()) {
+      Edge* edge = *ready.begin();
+      ready.erase(ready.begin());
+      running.push(Running(now + durations.find(edge)->second, edge));
+    }
+    if (running.empty())
+      break;
+    now = running.top().first;
+    Edge* edge = running.top().second;
+    running.pop();
+    for (vector<Node*>::iterator o = edge->outputs_.begin();
+         o != edge->outputs_.end(); ++o) {
+      for (vector<Edge*>::const_iterator oe = (*o)->out_edges().begin();
+           oe != (*o)->out_edges().end(); ++oe) {
+        if (--pending[*oe] == 0)
+          ready.insert(*oe);
+      }
+    }
+  }
+  return now;
+}
+
+void Report(const char* name, int64_t time, int64_t baseline) {
+  printf("%-24s %6.1fs", name, time / 1000.0);
+  if (baseline)
+    printf("  (%+.1f%%)", 100.0 * (time - baseline) / baseline);
+  printf("\n");
+}
+
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  int parallelism = 8;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("j:h"))) != -1) {
+    switch (opt) {
+    case 'j':
+      parallelism = atoi(optarg);
+      if (parallelism > 0)
+        break;
+      // Fall through.
+    case 'h':
+    default:
+      printf("usage: plan_perftest [-j N]\n"
+"\n"
+"options:\n"
+"  -j N   run N jobs in parallel [default=8]\n"
+             );
+      return 1;
+    }
+  }
+
+  State state;
+  Durations durations;
+  CreateProject(&state, &durations);
+  Node* target = state.LookupNode("app");
+
+  BuildLog log;
+  for (Durations::iterator d = durations.begin(); d != durations.end(); ++d)
+    log.RecordCommand(d->first, 0, d->second);
+
+  int64_t critical_path = 0;
+  {
+    // The first FindWork() computes the weights.
+    MarkAllDirty(&state);
+    Plan plan(&log);
+    string err;
+    plan.AddTarget(target, &err);
+    plan.FindWork();
+    for (vector<Edge*>::iterator e = state.edges_.begin();
+         e != state.edges_.end(); ++e) {
+      critical_path = max(critical_path, (*e)->critical_path_weight());
+    }
+  }
+  int64_t total = 0;
+  for (Durations::iterator d = durations.begin(); d != durations.end(); ++d)
+    total += d->second;
+  printf("%d edges, %d jobs\n", (int)state.edges_.size(), parallelism);
+  Report("lower bound:", max(critical_path, total / parallelism), 0);
+
+  int64_t baseline = SimulateAddressOrder(&state, durations, parallelism);
+  Report("address order:", baseline, 0);
+
+  {
+    Plan plan;
+    int64_t time = SimulatePlan(&plan, &state, target, durations,
+                                parallelism);
+    Report("critical path, no log:", time, baseline);
+  }
+
+  Plan plan(&log);
+  int64_t start = GetTimeMillis();
+  int64_t time = SimulatePlan(&plan, &state, target, durations, parallelism);
+  Report("critical path:", time, baseline);
+  printf("(simulated in %dms)\n", (int)(GetTimeMillis() - start));
+  return 0;
+}
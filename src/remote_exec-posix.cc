@@ -0,0 +1,749 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+
+#include "remote_exec.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "build_log.h"
+#include "metrics.h"
+
+namespace {
+
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;
+#endif
+
+enum MessageType {
+  kExec = 1,
+  kNeed,
+  kBlob,
+  kResult
+};
+
+/// Messages are not expected to come anywhere close to this.
+const uint32_t kMaxMessageSize = 1u << 30;
+
+void Put8(string* out, uint8_t value) {
+  out->push_back(value);
+}
+
+void Put32(string* out, uint32_t value) {
+  for (int i = 0; i < 4; ++i)
+    out->push_back((char)(value >> (8 * i)));
+}
+
+void Put64(string* out, uint64_t value) {
+  for (int i = 0; i < 8; ++i)
+    out->push_back((char)(value >> (8 * i)));
+}
+
+void PutString(string* out, const string& value) {
+  Put32(out, value.size());
+  out->append(value);
+}
+
+/// Start a message of |type|, whose size is filled in by WriteMessage().
+string NewMessage(MessageType type) {
+  string data(4, '\0');
+  Put8(&data, type);
+  return data;
+}
+
+/// Reads the fields of a message.
+struct MessageReader {
+  explicit MessageReader(const string& data)
+      : data_(data), pos_(0), ok_(true) {}
+
+  uint64_t Get(int size) {
+    if (pos_ + size > data_.size()) {
+      ok_ = false;
+      return 0;
+    }
+    uint64_t value = 0;
+    for (int i = 0; i < size; ++i)
+      value |= (uint64_t)(unsigned char)data_[pos_ + i] << (8 * i);
+    pos_ += size;
+    return value;
+  }
+
+  uint8_t Get8() { return Get(1); }
+  uint32_t Get32() { return Get(4); }
+  uint64_t Get64() { return Get(8); }
+
+  string GetString() {
+    uint32_t size = Get32();
+    if (!ok_ || pos_ + size > data_.size()) {
+      ok_ = false;
+      return string();
+    }
+    string value = data_.substr(pos_, size);
+    pos_ += size;
+    return value;
+  }
+
+  const string& data_;
+  size_t pos_;
+  bool ok_;
+};
+
+/// Don't let a peer that went away kill us with SIGPIPE.
+void SetNoSigPipe(int fd) {
+#ifdef SO_NOSIGPIPE
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#else
+  (void)fd;
+#endif
+}
+
+bool WriteAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t len = send(fd, data, size, kSendFlags);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return false;
+    data += len;
+    size -= len;
+  }
+  return true;
+}
+
+bool ReadAll(int fd, char* data, size_t size) {
+  while (size > 0) {
+    ssize_t len = read(fd, data, size);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return false;
+    data += len;
+    size -= len;
+  }
+  return true;
+}
+
+/// Fill in the size of the message |data| started by NewMessage() and
+/// send it.
+bool WriteMessage(int fd, string* data) {
+  uint32_t size = data->size() - 4;
+  for (int i = 0; i < 4; ++i)
+    (*data)[i] = (char)(size >> (8 * i));
+  return WriteAll(fd, data->data(), data->size());
+}
+
+/// Read a message into its |type| and the rest of it, |data|.
+bool ReadMessageFrom(int fd, MessageType* type, string* data) {
+  unsigned char header[5];
+  if (!ReadAll(fd, (char*)header, sizeof(header)))
+    return false;
+  uint32_t size = header[0] | header[1] << 8 | header[2] << 16 |
+                  (uint32_t)header[3] << 24;
+  if (size < 1 || size > kMaxMessageSize)
+    return false;
+  *type = (MessageType)header[4];
+  data->resize(size - 1);
+  return data->empty() || ReadAll(fd, &(*data)[0], data->size());
+}
+
+/// Create a stream socket for |address|, connected to it or, with
+/// |listen|, listening on it.  Returns -1 on error.
+int OpenSocket(const string& address, bool listen, string* err) {
+  size_t colon = address.rfind(':');
+  if (colon == string::npos) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (address.size() >= sizeof(addr.sun_path)) {
+      *err = "socket path too long: " + address;
+      return -1;
+    }
+    strcpy(addr.sun_path, address.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      *err = string("socket: ") + strerror(errno);
+      return -1;
+    }
+    SetCloseOnExec(fd);
+    if (listen) {
+      // A socket without a worker is left over from one that died.
+      if (connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0) {
+        *err = "another worker is listening on " + address;
+        close(fd);
+        return -1;
+      }
+      unlink(address.c_str());
+    }
+    // Only this user may run commands on a worker that listens here.
+    mode_t old_umask = listen ? umask(0077) : 0;
+    bool ok = listen ? bind(fd, (sockaddr*)&addr, sizeof(addr)) == 0 &&
+                       ::listen(fd, 16) == 0
+                     : connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0;
+    if (listen)
+      umask(old_umask);
+    if (!ok) {
+      *err = address + ": " + strerror(errno);
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  string host = address.substr(0, colon);
+  string port = address.substr(colon + 1);
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  // Without AI_PASSIVE, an empty host is the loopback address, also to
+  // listen on: the protocol has no authentication.
+  addrinfo* addrs;
+  int ret = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(),
+                        &hints, &addrs);
+  if (ret != 0) {
+    *err = address + ": " + gai_strerror(ret);
+    return -1;
+  }
+  int fd = -1;
+  for (addrinfo* a = addrs; a; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if (fd < 0)
+      continue;
+    SetCloseOnExec(fd);
+    int one = 1;
+    if (listen) {
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      if (bind(fd, a->ai_addr, a->ai_addrlen) == 0 && ::listen(fd, 16) == 0)
+        break;
+    } else if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+      // Requests and their answers are small and waited for.
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      break;
+    }
+    *err = address + ": " + strerror(errno);
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addrs);
+  if (fd < 0 && err->empty())
+    *err = address + ": no usable address";
+  return fd;
+}
+
+/// Remove |path| and, if it's a directory, everything in it.
+void RemoveTree(const string& path) {
+  struct stat st;
+  if (lstat(path.c_str(), &st) < 0)
+    return;
+  if (!S_ISDIR(st.st_mode)) {
+    unlink(path.c_str());
+    return;
+  }
+  if (DIR* d = opendir(path.c_str())) {
+    while (struct dirent* entry = readdir(d)) {
+      if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+        RemoveTree(path + "/" + entry->d_name);
+    }
+    closedir(d);
+  }
+  rmdir(path.c_str());
+}
+
+bool IsAbsolute(const string& path) {
+  return !path.empty() && path[0] == '/';
+}
+
+}  // namespace
+
+uint64_t HashInput(const string& content) {
+  uint64_t hash = BuildLog::LogEntry::HashContent(content);
+  return hash ? hash : 1;
+}
+
+bool IsExecutable(const string& path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+      (st.st_mode & S_IXUSR);
+}
+
+void MakeExecutable(const string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0)
+    chmod(path.c_str(), (st.st_mode | (st.st_mode & 0444) >> 2) & 07777);
+}
+
+RemoteClient::RemoteClient(DiskInterface* disk_interface)
+    : fd_(-1), disk_interface_(disk_interface) {}
+
+RemoteClient::~RemoteClient() {
+  Close();
+}
+
+bool RemoteClient::Connect(const string& address, string* err) {
+  Close();
+  fd_ = OpenSocket(address, false, err);
+  if (fd_ < 0)
+    return false;
+  SetNoSigPipe(fd_);
+  return true;
+}
+
+void RemoteClient::Close() {
+  if (fd_ >= 0)
+    close(fd_);
+  fd_ = -1;
+  inputs_.clear();
+}
+
+bool RemoteClient::Readable() const {
+  pollfd pfd = { fd_, POLLIN, 0 };
+  return fd_ >= 0 && poll(&pfd, 1, 0) > 0;
+}
+
+bool RemoteClient::Send(const RemoteRequest& request) {
+  string data = NewMessage(kExec);
+  Put32(&data, request.id);
+  Put32(&data, request.depth);
+  PutString(&data, request.command);
+  Put32(&data, request.inputs.size());
+  for (vector<RemoteInput>::const_iterator i = request.inputs.begin();
+       i != request.inputs.end(); ++i) {
+    PutString(&data, i->path);
+    Put64(&data, i->hash);
+    Put8(&data, i->executable);
+  }
+  Put32(&data, request.outputs.size());
+  for (vector<string>::const_iterator o = request.outputs.begin();
+       o != request.outputs.end(); ++o) {
+    PutString(&data, *o);
+  }
+  inputs_[request.id] = request.inputs;
+  return WriteMessage(fd_, &data);
+}
+
+bool RemoteClient::Receive(vector<RemoteResult>* results) {
+  MessageType type;
+  string data;
+  if (!ReadMessageFrom(fd_, &type, &data))
+    return false;
+  MessageReader reader(data);
+
+  if (type == kNeed) {
+    map<uint32_t, vector<RemoteInput> >::iterator request =
+        inputs_.find(reader.Get32());
+    uint32_t count = reader.Get32();
+    if (!reader.ok_ || request == inputs_.end())
+      return false;
+    METRIC_RECORD("remote upload");
+    for (uint32_t n = 0; n < count; ++n) {
+      uint64_t hash = reader.Get64();
+      vector<RemoteInput>::iterator i = request->second.begin();
+      while (i != request->second.end() && i->hash != hash)
+        ++i;
+      string content, err;
+      if (!reader.ok_ || i == request->second.end() ||
+          disk_interface_->ReadFile(i->path, &content, &err) !=
+              DiskInterface::Okay) {
+        return false;
+      }
+      string blob = NewMessage(kBlob);
+      Put64(&blob, hash);
+      PutString(&blob, content);
+      if (!WriteMessage(fd_, &blob))
+        return false;
+    }
+    return true;
+  }
+
+  if (type == kResult) {
+    RemoteResult result;
+    result.id = reader.Get32();
+    result.status = (ExitStatus)reader.Get32();
+    result.output = reader.GetString();
+    uint32_t count = reader.Get32();
+    for (uint32_t n = 0; n < count && reader.ok_; ++n) {
+      RemoteFile file;
+      file.path = reader.GetString();
+      file.executable = reader.Get8();
+      file.content = reader.GetString();
+      result.outputs.push_back(file);
+    }
+    if (!reader.ok_ || !inputs_.erase(result.id))
+      return false;
+    results->push_back(result);
+    return true;
+  }
+
+  return false;
+}
+
+/// A request of the client, as the worker runs it.
+struct RemoteWorker::Job {
+  RemoteRequest request;
+  /// The scratch directory of the job.
+  string dir;
+  /// The directory in |dir| that the command runs in.
+  string cwd;
+  /// The inputs that haven't been uploaded yet.
+  set<uint64_t> missing;
+
+  /// The path in the scratch directory of |path|, which must stay in it.
+  bool Path(const string& path, string* result, string* err) const {
+    if (IsAbsolute(path)) {
+      *err = "absolute output path: " + path;
+      return false;
+    }
+    *result = cwd + "/" + path;
+    uint64_t slash_bits;
+    if (!CanonicalizePath(result, &slash_bits, err))
+      return false;
+    if (result->compare(0, dir.size() + 1, dir + "/") != 0) {
+      *err = "path outside the build directory: " + path;
+      return false;
+    }
+    return true;
+  }
+};
+
+void RemoteWorker::WriteTask::Run() {
+  WriteMessage(fd, &data);
+}
+
+RemoteWorker::RemoteWorker(const string& dir, int parallelism)
+    : dir_(dir), parallelism_(parallelism), listen_fd_(-1), fd_(-1),
+      next_job_(0), writer_(1) {
+  uint64_t slash_bits;
+  string err;
+  CanonicalizePath(&dir_, &slash_bits, &err);
+  // Leftovers of a worker that died.
+  RemoveTree(dir_ + "/jobs");
+}
+
+RemoteWorker::~RemoteWorker() {
+  if (fd_ >= 0)
+    Disconnect();
+  if (listen_fd_ >= 0)
+    close(listen_fd_);
+  if (!socket_path_.empty())
+    unlink(socket_path_.c_str());
+}
+
+bool RemoteWorker::Listen(const string& address, string* err) {
+  listen_fd_ = OpenSocket(address, true, err);
+  if (listen_fd_ < 0)
+    return false;
+  if (address.find(':') == string::npos)
+    socket_path_ = address;
+  return true;
+}
+
+bool RemoteWorker::Serve(string* err) {
+  // Wait in DoWork(), which is where the signals get through.
+  subprocs_.WatchFd(listen_fd_);
+  do {
+    if (subprocs_.DoWork())
+      return false;
+  } while (!subprocs_.watched_fd_ready());
+  fd_ = accept(listen_fd_, NULL, NULL);
+  if (fd_ < 0) {
+    subprocs_.WatchFd(-1);
+    if (errno == EINTR || errno == ECONNABORTED)
+      return true;
+    *err = string("accept: ") + strerror(errno);
+    return false;
+  }
+  SetCloseOnExec(fd_);
+  SetNoSigPipe(fd_);
+  int one = 1;
+  setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  subprocs_.WatchFd(fd_);
+
+  // The commands of a client that went away finish, unreported.
+  for (;;) {
+    StartJobs();
+    if (fd_ < 0 && running_.empty())
+      return true;
+    if (subprocs_.DoWork()) {
+      subprocs_.Clear();
+      for (map<Subprocess*, Job*>::iterator i = running_.begin();
+           i != running_.end(); ++i) {
+        RemoveJob(i->second);
+      }
+      running_.clear();
+      if (fd_ >= 0)
+        Disconnect();
+      return false;
+    }
+    while (Subprocess* subproc = subprocs_.NextFinished())
+      FinishJob(subproc);
+    if (fd_ >= 0 && subprocs_.watched_fd_ready() && !ReadMessage())
+      Disconnect();
+  }
+}
+
+bool RemoteWorker::ReadMessage() {
+  MessageType type;
+  string data;
+  if (!ReadMessageFrom(fd_, &type, &data))
+    return false;
+  MessageReader reader(data);
+
+  if (type == kExec) {
+    Job* job = new Job;
+    RemoteRequest& request = job->request;
+    request.id = reader.Get32();
+    request.depth = reader.Get32();
+    request.command = reader.GetString();
+    uint32_t count = reader.Get32();
+    for (uint32_t n = 0; n < count && reader.ok_; ++n) {
+      RemoteInput input;
+      input.path = reader.GetString();
+      input.hash = reader.Get64();
+      input.executable = reader.Get8();
+      request.inputs.push_back(input);
+    }
+    count = reader.Get32();
+    for (uint32_t n = 0; n < count && reader.ok_; ++n)
+      request.outputs.push_back(reader.GetString());
+    if (!reader.ok_ || request.depth > 256) {
+      delete job;
+      return false;
+    }
+
+    char name[16];
+    snprintf(name, sizeof(name), "%d", next_job_++);
+    job->dir = dir_ + "/jobs/" + name;
+    job->cwd = job->dir;
+    for (uint32_t i = 0; i < request.depth; ++i)
+      job->cwd += "/w";
+
+    string need = NewMessage(kNeed);
+    Put32(&need, request.id);
+    vector<uint64_t> asked;
+    string err;
+    for (vector<RemoteInput>::iterator i = request.inputs.begin();
+         i != request.inputs.end(); ++i) {
+      if (job->missing.count(i->hash))
+        continue;
+      if (disk_interface_.Stat(BlobPath(i->hash), &err) > 0)
+        continue;
+      job->missing.insert(i->hash);
+      if (asked_.insert(i->hash).second)
+        asked.push_back(i->hash);
+    }
+    if (!asked.empty()) {
+      Put32(&need, asked.size());
+      for (vector<uint64_t>::iterator h = asked.begin(); h != asked.end(); ++h)
+        Put64(&need, *h);
+      Send(need);
+    }
+    if (job->missing.empty())
+      ready_.push_back(job);
+    else
+      waiting_.push_back(job);
+    return true;
+  }
+
+  if (type == kBlob) {
+    uint64_t hash = reader.Get64();
+    string content = reader.GetString();
+    if (!reader.ok_ || HashInput(content) != hash || !asked_.erase(hash))
+      return false;
+    string path = BlobPath(hash);
+    bool stored = disk_interface_.MakeDirs(path) &&
+                  disk_interface_.WriteFile(path, content);
+    for (vector<Job*>::iterator j = waiting_.begin(); j != waiting_.end(); ) {
+      Job* job = *j;
+      if (!job->missing.erase(hash) || (stored && !job->missing.empty())) {
+        ++j;
+        continue;
+      }
+      j = waiting_.erase(j);
+      if (stored)
+        ready_.push_back(job);
+      else
+        Fail(job, "ninja_worker: can't write " + path + "\n");
+    }
+    return true;
+  }
+
+  return false;
+}
+
+string RemoteWorker::BlobPath(uint64_t hash) const {
+  char name[17];
+  snprintf(name, sizeof(name), "%016" PRIx64, hash);
+  return dir_ + "/blobs/" + name;
+}
+
+void RemoteWorker::Send(const string& data) {
+  while (!writes_.empty() && writer_.IsDone(writes_.front())) {
+    delete writes_.front();
+    writes_.pop_front();
+  }
+  WriteTask* task = new WriteTask;
+  task->fd = fd_;
+  task->data = data;
+  writes_.push_back(task);
+  writer_.Post(task);
+}
+
+void RemoteWorker::StartJobs() {
+  while (!ready_.empty() && (int)running_.size() < parallelism_) {
+    Job* job = ready_.front();
+    ready_.pop_front();
+    string err;
+    if (!StartJob(job, &err))
+      Fail(job, "ninja_worker: " + err + "\n");
+  }
+}
+
+bool RemoteWorker::StartJob(Job* job, string* err) {
+  const RemoteRequest& request = job->request;
+  string path;
+  for (vector<RemoteInput>::const_iterator i = request.inputs.begin();
+       i != request.inputs.end(); ++i) {
+    // Absolute paths, like system headers, are the worker's own.
+    if (IsAbsolute(i->path))
+      continue;
+    if (!job->Path(i->path, &path, err))
+      return false;
+    if (!disk_interface_.MakeDirs(path)) {
+      *err = "can't create the directory of " + path;
+      return false;
+    }
+    if (!disk_interface_.Copy(BlobPath(i->hash), path, err))
+      return false;
+    if (i->executable)
+      MakeExecutable(path);
+  }
+  for (vector<string>::const_iterator o = request.outputs.begin();
+       o != request.outputs.end(); ++o) {
+    if (!job->Path(*o, &path, err))
+      return false;
+    if (!disk_interface_.MakeDirs(path)) {
+      *err = "can't create the directory of " + path;
+      return false;
+    }
+  }
+  if (!disk_interface_.MakeDirs(job->cwd + "/.")) {
+    *err = "can't create " + job->cwd;
+    return false;
+  }
+
+  string command = "cd ";
+  GetShellEscapedString(job->cwd, &command);
+  command += " || exit 1\n" + request.command;
+  Subprocess* subproc = subprocs_.Add(command);
+  if (!subproc) {
+    *err = "can't run " + request.command;
+    return false;
+  }
+  running_[subproc] = job;
+  return true;
+}
+
+void RemoteWorker::FinishJob(Subprocess* subproc) {
+  map<Subprocess*, Job*>::iterator i = running_.find(subproc);
+  Job* job = i->second;
+  running_.erase(i);
+  ExitStatus status = subproc->Finish();
+
+  if (fd_ >= 0) {
+    const RemoteRequest& request = job->request;
+    string data = NewMessage(kResult);
+    Put32(&data, request.id);
+    Put32(&data, status);
+    PutString(&data, subproc->GetOutput());
+    vector<RemoteFile> files;
+    for (vector<string>::const_iterator o = request.outputs.begin();
+         o != request.outputs.end(); ++o) {
+      RemoteFile file;
+      string path, err;
+      if (!job->Path(*o, &path, &err) ||
+          disk_interface_.ReadFile(path, &file.content, &err) !=
+              DiskInterface::Okay) {
+        continue;
+      }
+      file.path = *o;
+      file.executable = IsExecutable(path);
+      files.push_back(file);
+    }
+    Put32(&data, files.size());
+    for (vector<RemoteFile>::iterator f = files.begin(); f != files.end();
+         ++f) {
+      PutString(&data, f->path);
+      Put8(&data, f->executable);
+      PutString(&data, f->content);
+    }
+    Send(data);
+  }
+  delete subproc;
+  RemoveJob(job);
+}
+
+void RemoteWorker::Fail(Job* job, const string& output) {
+  if (fd_ >= 0) {
+    string data = NewMessage(kResult);
+    Put32(&data, job->request.id);
+    Put32(&data, ExitFailure);
+    PutString(&data, output);
+    Put32(&data, 0);
+    Send(data);
+  }
+  RemoveJob(job);
+}
+
+void RemoteWorker::RemoveJob(Job* job) {
+  RemoveTree(job->dir);
+  delete job;
+}
+
+void RemoteWorker::Disconnect() {
+  subprocs_.WatchFd(-1);
+  for (deque<WriteTask*>::iterator w = writes_.begin(); w != writes_.end();
+       ++w) {
+    writer_.Wait(*w);
+    delete *w;
+  }
+  writes_.clear();
+  close(fd_);
+  fd_ = -1;
+
+  for (vector<Job*>::iterator j = waiting_.begin(); j != waiting_.end(); ++j)
+    RemoveJob(*j);
+  waiting_.clear();
+  for (deque<Job*>::iterator j = ready_.begin(); j != ready_.end(); ++j)
+    RemoveJob(*j);
+  ready_.clear();
+  asked_.clear();
+}
@@ -0,0 +1,191 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_REMOTE_EXEC_H_
+#define NINJA_REMOTE_EXEC_H_
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "disk_interface.h"
+#include "exit_status.h"
+#include "subprocess.h"
+#include "thread_pool.h"
+#include "util.h"  // uint64_t
+
+/// Remote execution runs the commands of edges with remote = 1 on a worker
+/// ("ninja_worker") reached over a socket, instead of here.  This file has
+/// the transport and the worker; build.cc decides what runs where.
+///
+/// The protocol, over a stream socket: each message is its size and its
+/// type, followed by its fields.  Integers are little-endian, of 8 (a
+/// flag), 32 or 64 bits; strings are their 32 bit length and their bytes.
+/// The client sends kExec with the request id, the depth (see
+/// RemoteRequest), the command, the inputs as path, content hash and
+/// executable flag, and the paths of the outputs.  The worker answers with
+/// kNeed and the id and the hashes that it has neither stored nor asked for
+/// yet, if any, and the client sends kBlob with the hash and the content of
+/// each.  Once it has all of its inputs, the worker runs the command and
+/// sends kResult with the id, the exit status, the output of the command
+/// and the outputs that it wrote, as path, executable flag and content.
+/// The client doesn't wait for any of this before sending more requests.
+/// There is no authentication: anyone who reaches the worker can run
+/// commands as its user, so it listens on the loopback address unless
+/// given another host, which should then be reached through an
+/// authenticated tunnel, like that of ssh -L.
+
+/// An input of a remote command.
+struct RemoteInput {
+  RemoteInput() : hash(0), executable(false) {}
+  string path;
+  /// The hash of the content, with HashInput().
+  uint64_t hash;
+  bool executable;
+};
+
+/// A command to run on the worker.
+struct RemoteRequest {
+  RemoteRequest() : id(0), depth(0) {}
+  uint32_t id;
+  string command;
+  /// The largest number of leading "../" of the paths, so that the worker
+  /// can run the command as deep in its scratch directory.
+  uint32_t depth;
+  vector<RemoteInput> inputs;
+  vector<string> outputs;
+};
+
+/// A file written by a remote command.
+struct RemoteFile {
+  RemoteFile() : executable(false) {}
+  string path;
+  bool executable;
+  string content;
+};
+
+/// The result of a remote command.
+struct RemoteResult {
+  RemoteResult() : id(0), status(ExitFailure) {}
+  uint32_t id;
+  ExitStatus status;
+  string output;
+  /// The outputs of the request that the command wrote.
+  vector<RemoteFile> outputs;
+};
+
+/// The hash of |content| that names an input, which is never 0, as with
+/// DependencyScan::HashContent().
+uint64_t HashInput(const string& content);
+
+/// Whether the file |path| is executable.
+bool IsExecutable(const string& path);
+
+/// Make the file |path| executable by those who can read it.
+void MakeExecutable(const string& path);
+
+/// The client side, which sends requests and uploads their inputs.
+struct RemoteClient {
+  /// The inputs are read through |disk_interface|.
+  explicit RemoteClient(DiskInterface* disk_interface);
+  ~RemoteClient();
+
+  /// Connect to the worker at |address|, either host:port or the path of a
+  /// Unix socket.  An empty host is the loopback address.
+  bool Connect(const string& address, string* err);
+  void Close();
+
+  /// The socket, which has a message to Receive() once readable; -1 if not
+  /// connected.
+  int fd() const { return fd_; }
+
+  /// Whether the worker sent more than was received.
+  bool Readable() const;
+
+  /// Send |request|.  Returns false if the worker went away.
+  bool Send(const RemoteRequest& request);
+
+  /// Read one message of the worker, which must have sent one: upload the
+  /// inputs that it asks for, or append its result to |results|.  Returns
+  /// false if the worker went away or broke the protocol.
+  bool Receive(vector<RemoteResult>* results);
+
+ private:
+  int fd_;
+  DiskInterface* disk_interface_;
+  /// The inputs of the requests in flight, for the worker to ask for.
+  map<uint32_t, vector<RemoteInput> > inputs_;
+};
+
+/// The worker side, which runs the requests of one client at a time in a
+/// scratch directory, keeping the inputs that clients uploaded.
+struct RemoteWorker {
+  /// The inputs are kept in |dir|/blobs and the requests run in
+  /// |dir|/jobs, |parallelism| of them at a time.
+  RemoteWorker(const string& dir, int parallelism);
+  ~RemoteWorker();
+
+  /// Listen on |address|, as for RemoteClient::Connect().  A Unix socket
+  /// is only for this user.
+  bool Listen(const string& address, string* err);
+
+  /// Wait for a client and run its requests until it goes away.  Returns
+  /// false with an empty |err| when interrupted by a signal.
+  bool Serve(string* err);
+
+ private:
+  struct Job;
+  /// Sends a message on the writer thread, so that reading from the
+  /// client goes on while a large result is sent.
+  struct WriteTask : public ThreadPool::Task {
+    virtual void Run();
+    int fd;
+    string data;
+  };
+
+  bool ReadMessage();
+  /// Where the input with |hash| is stored.
+  string BlobPath(uint64_t hash) const;
+  void Send(const string& data);
+  void StartJobs();
+  bool StartJob(Job* job, string* err);
+  void FinishJob(Subprocess* subproc);
+  /// Send a failure for |job|, with |output|, and forget it.
+  void Fail(Job* job, const string& output);
+  void RemoveJob(Job* job);
+  void Disconnect();
+
+  string dir_;
+  int parallelism_;
+  int listen_fd_;
+  /// The Unix socket listened on, if any, removed on destruction.
+  string socket_path_;
+  int fd_;
+  int next_job_;
+  RealDiskInterface disk_interface_;
+  SubprocessSet subprocs_;
+  /// The jobs that wait for inputs.
+  vector<Job*> waiting_;
+  deque<Job*> ready_;
+  map<Subprocess*, Job*> running_;
+  /// The inputs that were asked for and not uploaded yet.
+  set<uint64_t> asked_;
+  ThreadPool writer_;
+  deque<WriteTask*> writes_;
+};
+
+#endif  // NINJA_REMOTE_EXEC_H_
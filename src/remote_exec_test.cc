@@ -0,0 +1,187 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "remote_exec.h"
+
+#include <unistd.h>
+
+#include "test.h"
+
+namespace {
+
+const char kSocketPath[] = "worker.sock";
+
+/// Runs RemoteWorker::Serve() on a thread, for the client on this one.
+struct ServeTask : public ThreadPool::Task {
+  virtual void Run() { ok = worker->Serve(&err); }
+  RemoteWorker* worker;
+  bool ok;
+  string err;
+};
+
+struct RemoteExecTest : public testing::Test {
+  RemoteExecTest() : pool_(1), client_(&disk_) {}
+
+  virtual void SetUp() {
+    // These tests do real disk accesses, so create a temp dir.  The build
+    // is in a subdirectory, so that it can have inputs in "..".
+    temp_dir_.CreateAndEnter("Ninja-RemoteExecTest");
+    ASSERT_TRUE(disk_.MakeDirs("build/."));
+    ASSERT_EQ(0, chdir("build"));
+  }
+
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  /// Start a worker with its scratch directory in the temp dir, and
+  /// connect to it.
+  void Connect(RemoteWorker* worker) {
+    string err;
+    ASSERT_TRUE(worker->Listen(kSocketPath, &err));
+    ASSERT_TRUE(client_.Connect(kSocketPath, &err));
+    ASSERT_EQ("", err);
+    serve_.worker = worker;
+    pool_.Post(&serve_);
+  }
+
+  /// Disconnect from the worker and wait for it to notice.
+  void Disconnect() {
+    client_.Close();
+    pool_.Wait(&serve_);
+    EXPECT_TRUE(serve_.ok);
+    EXPECT_EQ("", serve_.err);
+  }
+
+  /// Receive until there are |count| results.
+  void ReceiveResults(size_t count, vector<RemoteResult>* results) {
+    while (results->size() < count)
+      ASSERT_TRUE(client_.Receive(results));
+  }
+
+  RemoteInput Input(const string& path, const string& content) {
+    EXPECT_TRUE(disk_.MakeDirs(path));
+    EXPECT_TRUE(disk_.WriteFile(path, content));
+    RemoteInput input;
+    input.path = path;
+    input.hash = HashInput(content);
+    return input;
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_;
+  ThreadPool pool_;
+  ServeTask serve_;
+  RemoteClient client_;
+};
+
+TEST_F(RemoteExecTest, Run) {
+  RemoteWorker worker("../scratch", 2);
+  ASSERT_NO_FATAL_FAILURE(Connect(&worker));
+
+  RemoteRequest request;
+  request.id = 1;
+  request.command = "cat in ../src/up > out/out && echo done";
+  request.depth = 1;
+  request.inputs.push_back(Input("in", "in\n"));
+  request.inputs.push_back(Input("../src/up", "up\n"));
+  request.outputs.push_back("out/out");
+  request.outputs.push_back("not_written");
+  ASSERT_TRUE(client_.Send(request));
+
+  vector<RemoteResult> results;
+  ASSERT_NO_FATAL_FAILURE(ReceiveResults(1, &results));
+  EXPECT_EQ(1u, results[0].id);
+  EXPECT_EQ(ExitSuccess, results[0].status);
+  EXPECT_EQ("done\n", results[0].output);
+  ASSERT_EQ(1u, results[0].outputs.size());
+  EXPECT_EQ("out/out", results[0].outputs[0].path);
+  EXPECT_EQ("in\nup\n", results[0].outputs[0].content);
+  EXPECT_FALSE(results[0].outputs[0].executable);
+
+  // The worker keeps the inputs, so none are read for the next requests,
+  // which are all sent before waiting for any.
+  ASSERT_EQ(0, unlink("in"));
+  for (uint32_t id = 2; id <= 4; ++id) {
+    request.id = id;
+    ASSERT_TRUE(client_.Send(request));
+  }
+  results.clear();
+  ASSERT_NO_FATAL_FAILURE(ReceiveResults(3, &results));
+  for (size_t i = 0; i < results.size(); ++i) {
+    EXPECT_EQ(ExitSuccess, results[i].status);
+    EXPECT_EQ("in\nup\n", results[i].outputs[0].content);
+  }
+
+  Disconnect();
+  string err;
+  EXPECT_EQ(0, disk_.Stat("../scratch/jobs/0", &err));
+}
+
+TEST_F(RemoteExecTest, Failure) {
+  RemoteWorker worker("../scratch", 1);
+  ASSERT_NO_FATAL_FAILURE(Connect(&worker));
+
+  RemoteRequest request;
+  request.id = 1;
+  request.command = "echo failed; exit 3";
+  ASSERT_TRUE(client_.Send(request));
+
+  // A path that would leave the scratch directory fails the request.
+  request.id = 2;
+  request.command = "true";
+  request.outputs.push_back("../out");
+  ASSERT_TRUE(client_.Send(request));
+
+  vector<RemoteResult> results;
+  ASSERT_NO_FATAL_FAILURE(ReceiveResults(2, &results));
+  EXPECT_EQ(1u, results[0].id);
+  EXPECT_EQ(ExitFailure, results[0].status);
+  EXPECT_EQ("failed\n", results[0].output);
+  EXPECT_EQ(2u, results[1].id);
+  EXPECT_EQ(ExitFailure, results[1].status);
+  EXPECT_EQ("ninja_worker: path outside the build directory: ../out\n",
+            results[1].output);
+  Disconnect();
+}
+
+TEST_F(RemoteExecTest, ExecutableInput) {
+  RemoteWorker worker("../scratch", 1);
+  ASSERT_NO_FATAL_FAILURE(Connect(&worker));
+
+  RemoteRequest request;
+  request.id = 1;
+  request.command = "./gen.sh > tool && chmod +x tool";
+  request.inputs.push_back(Input("gen.sh", "#!/bin/sh\necho '#!/bin/sh'\n"));
+  request.inputs[0].executable = true;
+  request.outputs.push_back("tool");
+  ASSERT_TRUE(client_.Send(request));
+
+  vector<RemoteResult> results;
+  ASSERT_NO_FATAL_FAILURE(ReceiveResults(1, &results));
+  EXPECT_EQ(ExitSuccess, results[0].status);
+  ASSERT_EQ(1u, results[0].outputs.size());
+  EXPECT_EQ("#!/bin/sh\n", results[0].outputs[0].content);
+  EXPECT_TRUE(results[0].outputs[0].executable);
+  Disconnect();
+}
+
+TEST_F(RemoteExecTest, NoWorker) {
+  string err;
+  EXPECT_FALSE(client_.Connect(kSocketPath, &err));
+  EXPECT_NE("", err);
+  EXPECT_EQ(-1, client_.fd());
+}
+
+}  // anonymous namespace
@@ -0,0 +1,111 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Compares stat()ing files one by one with the directory stat cache, on
+// directories with thousands of headers.  Expects to be run in ninja's
+// root directory.
+
+#include <algorithm>
+#include <numeric>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "disk_interface.h"
+#include "metrics.h"
+#include "util.h"
+
+const char kDataDir[] = "build/stat_perftest";
+const int kNumDirs = 10;
+const int kFilesPerDir = 2000;
+
+/// Create the headers unless they exist, and return the paths to stat():
+/// every header, and as many headers that don't exist, like a build that
+/// checks for generated files would.
+bool WriteTestData(vector<string>* paths) {
+  RealDiskInterface disk_interface;
+  for (int d = 0; d < kNumDirs; ++d) {
+    char dir[64];
+    snprintf(dir, sizeof(dir), "%s/dir%d", kDataDir, d);
+    for (int f = 0; f < kFilesPerDir; ++f) {
+      char path[128];
+      snprintf(path, sizeof(path), "%s/header%d.h", dir, f);
+      paths->push_back(path);
+      snprintf(path, sizeof(path), "%s/missing%d.h", dir, f);
+      paths->push_back(path);
+    }
+  }
+
+  string err;
+  if (disk_interface.Stat((*paths)[paths->size() - 2], &err) > 0)
+    return true;
+  printf("Creating test data..."); fflush(stdout);
+  for (size_t i = 0; i < paths->size(); i += 2) {
+    if (!disk_interface.MakeDirs((*paths)[i]) ||
+        !disk_interface.WriteFile((*paths)[i], "#pragma once\n"))
+      return false;
+  }
+  printf("done.\n");
+  return true;
+}
+
+int StatAll(const vector<string>& paths, bool use_cache, bool batch) {
+  RealDiskInterface disk_interface;
+  disk_interface.AllowStatCache(use_cache);
+  int optimization_guard = 0;
+  if (batch) {
+    vector<TimeStamp> mtimes;
+    disk_interface.StatBatch(paths, &mtimes);
+    for (size_t i = 0; i < mtimes.size(); ++i)
+      optimization_guard += mtimes[i] > 0;
+  } else {
+    string err;
+    for (size_t i = 0; i < paths.size(); ++i)
+      optimization_guard += disk_interface.Stat(paths[i], &err) > 0;
+  }
+  return optimization_guard;
+}
+
+void Measure(const char* name, const vector<string>& paths, bool use_cache,
+             bool batch) {
+  const int kNumRepetitions = 5;
+  vector<int> times;
+  for (int i = 0; i < kNumRepetitions; ++i) {
+    int64_t start = GetTimeMillis();
+    int optimization_guard = StatAll(paths, use_cache, batch);
+    int delta = (int)(GetTimeMillis() - start);
+    printf("%s%dms (existing: %d)\n", name, delta, optimization_guard);
+    times.push_back(delta);
+  }
+
+  int min = *min_element(times.begin(), times.end());
+  int max = *max_element(times.begin(), times.end());
+  float total = accumulate(times.begin(), times.end(), 0.0f);
+  printf("%smin %dms  max %dms  avg %.1fms\n", name, min, max,
+         total / times.size());
+}
+
+int main() {
+  vector<string> paths;
+  if (!WriteTestData(&paths)) {
+    fprintf(stderr, "Failed to write test data\n");
+    return 1;
+  }
+
+  Measure("stat:        ", paths, false, false);
+  Measure("cache:       ", paths, true, false);
+  Measure("stat batch:  ", paths, false, true);
+  Measure("cache batch: ", paths, true, true);
+  return 0;
+}
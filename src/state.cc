@@ -17,6 +17,8 @@
 #include <assert.h>
 #include <stdio.h>
 
+#include <new>
+
 #include "edit_distance.h"
 #include "graph.h"
 #include "metrics.h"
@@ -38,13 +40,13 @@ void Pool::DelayEdge(Edge* edge) {
   delayed_.insert(edge);
 }
 
-void Pool::RetrieveReadyEdges(set<Edge*>* ready_queue) {
+void Pool::RetrieveReadyEdges(EdgePriorityQueue* ready_queue) {
   DelayedEdges::iterator it = delayed_.begin();
   while (it != delayed_.end()) {
     Edge* edge = *it;
     if (current_use_ + edge->weight() > depth_)
       break;
-    ready_queue->insert(edge);
+    ready_queue->push(edge);
     EdgeScheduled(*edge);
     ++it;
   }
@@ -66,7 +68,9 @@ bool Pool::WeightedEdgeCmp(const Edge* a, const Edge* b) {
   if (!a) return b;
   if (!b) return false;
   int weight_diff = a->weight() - b->weight();
-  return ((weight_diff < 0) || (weight_diff == 0 && a < b));
+  if (weight_diff != 0)
+    return weight_diff < 0;
+  return EdgePriorityGreater()(a, b);
 }
 
 Pool State::kDefaultPool("", 0);
@@ -79,6 +83,17 @@ State::State() {
   AddPool(&kConsolePool);
 }
 
+State::~State() {
+  // The arena frees the memory, but the strings and vectors inside need
+  // their destructors.  Processes that exit after a build don't destroy
+  // their State at all, so this only runs when a graph is replaced, as
+  // after the manifest was rebuilt or by the build server.
+  for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i)
+    i->second->~Node();
+  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e)
+    (*e)->~Edge();
+}
+
 void State::AddPool(Pool* pool) {
   assert(LookupPool(pool->name()) == NULL);
   pools_[pool->name()] = pool;
@@ -92,23 +107,54 @@ Pool* State::LookupPool(const string& pool_name) {
 }
 
 Edge* State::AddEdge(const Rule* rule) {
-  Edge* edge = new Edge();
+  Edge* edge = new (arena_.Alloc(sizeof(Edge))) Edge();
   edge->rule_ = rule;
   edge->pool_ = &State::kDefaultPool;
   edge->env_ = &bindings_;
+  edge->id_ = edges_.size();
   edges_.push_back(edge);
   return edge;
 }
 
+void State::PopEdge() {
+  edges_.back()->~Edge();
+  edges_.pop_back();
+}
+
 Node* State::GetNode(StringPiece path, uint64_t slash_bits) {
   Node* node = LookupNode(path);
   if (node)
     return node;
-  node = new Node(path.AsString(), slash_bits);
+  node = new (arena_.Alloc(sizeof(Node))) Node(path.AsString(), slash_bits);
   paths_[node->path()] = node;
+  if (!immutable_prefixes_.empty())
+    node->set_immutable(HasImmutablePrefix(node->path()));
   return node;
 }
 
+void State::SetImmutablePrefixes(const vector<string>& prefixes) {
+  immutable_prefixes_.clear();
+  for (vector<string>::const_iterator i = prefixes.begin();
+       i != prefixes.end(); ++i) {
+    if (i->empty())
+      continue;
+    immutable_prefixes_.push_back(*i);
+    if (*i->rbegin() != '/')
+      immutable_prefixes_.back() += '/';
+  }
+  for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i)
+    i->second->set_immutable(HasImmutablePrefix(i->second->path()));
+}
+
+bool State::HasImmutablePrefix(const string& path) const {
+  for (vector<string>::const_iterator i = immutable_prefixes_.begin();
+       i != immutable_prefixes_.end(); ++i) {
+    if (path.compare(0, i->size(), *i) == 0)
+      return true;
+  }
+  return false;
+}
+
 Node* State::LookupNode(StringPiece path) const {
   METRIC_RECORD("lookup node");
   Paths::const_iterator i = paths_.find(path);
@@ -184,6 +230,10 @@ vector<Node*> State::DefaultNodes(string* err) const {
 void State::Reset() {
   for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i)
     i->second->ResetState();
+  ResetEdges();
+}
+
+void State::ResetEdges() {
   for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e) {
     (*e)->outputs_ready_ = false;
     (*e)->mark_ = Edge::VisitNone;
@@ -21,11 +21,13 @@
 #include <vector>
 using namespace std;
 
+#include "arena.h"
 #include "eval_env.h"
 #include "hash_map.h"
 #include "util.h"
 
 struct Edge;
+struct EdgePriorityQueue;
 struct Node;
 struct Rule;
 
@@ -62,7 +64,7 @@ struct Pool {
   void DelayEdge(Edge* edge);
 
   /// Pool will add zero or more edges to the ready_queue
-  void RetrieveReadyEdges(set<Edge*>* ready_queue);
+  void RetrieveReadyEdges(EdgePriorityQueue* ready_queue);
 
   /// Dump the Pool and its edges (useful for debugging).
   void Dump() const;
@@ -88,16 +90,24 @@ struct State {
   static const Rule kPhonyRule;
 
   State();
+  ~State();
 
   void AddPool(Pool* pool);
   Pool* LookupPool(const string& pool_name);
 
   Edge* AddEdge(const Rule* rule);
+  /// Remove the edge returned by the last AddEdge(), before it was
+  /// connected to any nodes.
+  void PopEdge();
 
   Node* GetNode(StringPiece path, uint64_t slash_bits);
   Node* LookupNode(StringPiece path) const;
   Node* SpellcheckNode(const string& path);
 
+  /// Mark the nodes under |prefixes|, including those created later, as
+  /// immutable; see Node::immutable().  A prefix is a directory.
+  void SetImmutablePrefixes(const vector<string>& prefixes);
+
   void AddIn(Edge* edge, StringPiece path, uint64_t slash_bits);
   bool AddOut(Edge* edge, StringPiece path, uint64_t slash_bits);
   bool AddDefault(StringPiece path, string* error);
@@ -105,6 +115,8 @@ struct State {
   /// Reset state.  Keeps all nodes and edges, but restores them to the
   /// state where we haven't yet examined the disk for dirty state.
   void Reset();
+  /// The part of Reset() for the edges.
+  void ResetEdges();
 
   /// Dump the nodes and Pools (useful for debugging).
   void Dump();
@@ -114,6 +126,9 @@ struct State {
   vector<Node*> RootNodes(string* error) const;
   vector<Node*> DefaultNodes(string* error) const;
 
+  /// Holds all Nodes and Edges.  They are destroyed with the State.
+  Arena arena_;
+
   /// Mapping of path -> Node.
   typedef ExternalStringHashMap<Node*>::Type Paths;
   Paths paths_;
@@ -126,6 +141,12 @@ struct State {
 
   BindingEnv bindings_;
   vector<Node*> defaults_;
+
+  /// See SetImmutablePrefixes(); each ends with a slash.
+  vector<string> immutable_prefixes_;
+
+ private:
+  bool HasImmutablePrefix(const string& path) const;
 };
 
 #endif  // NINJA_STATE_H_
@@ -15,6 +15,7 @@
 #include "subprocess.h"
 
 #include <sys/select.h>
+#include <algorithm>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -22,29 +23,54 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <spawn.h>
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#endif
+
 extern char** environ;
 
 #include "util.h"
 
-Subprocess::Subprocess(bool use_console) : fd_(-1), pid_(-1),
+Subprocess::Subprocess(bool use_console) : peak_rss_(0), fd_(-1), pid_(-1),
+                                           spawn_thread_(NULL), write_fd_(-1),
+                                           set_(NULL),
+#ifdef USE_EPOLL
+                                           epoll_fd_(-1),
+#endif
                                            use_console_(use_console) {
 }
 
 Subprocess::~Subprocess() {
   if (fd_ >= 0)
-    close(fd_);
+    ClosePipe();
   // Reap child if forgotten.
   if (pid_ != -1)
     Finish();
 }
 
-bool Subprocess::Start(SubprocessSet* set, const string& command) {
+bool Subprocess::Start(SubprocessSet* set, const string& command,
+                       ExecMode exec) {
+  // Both ends are closed on exec, so that no other command inherits them;
+  // Spawn() passes the write end on to this one.  Commands being spawned
+  // on the spawn thread meanwhile mustn't see them before that is set.
   int output_pipe[2];
-  if (pipe(output_pipe) < 0)
+#ifdef __linux__
+  if (pipe2(output_pipe, O_CLOEXEC) < 0)
     Fatal("pipe: %s", strerror(errno));
+#else
+  {
+    ScopedLock lock(&set->spawn_mutex_);
+    if (pipe(output_pipe) < 0)
+      Fatal("pipe: %s", strerror(errno));
+    SetCloseOnExec(output_pipe[0]);
+    SetCloseOnExec(output_pipe[1]);
+  }
+#endif
   fd_ = output_pipe[0];
 #if !defined(USE_PPOLL)
   // If available, we use ppoll in DoWork(); otherwise we use pselect
@@ -52,17 +78,30 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
   if (fd_ >= static_cast<int>(FD_SETSIZE))
     Fatal("pipe: %s", strerror(EMFILE));
 #endif  // !USE_PPOLL
-  SetCloseOnExec(fd_);
 
+  command_ = command;
+  if (exec != kExecShell &&
+      !SplitShellFreeCommand(command, exec == kExecDirect, &args_)) {
+    args_.clear();
+  }
+  write_fd_ = output_pipe[1];
+  set_ = set;
+  spawn_thread_ = set->spawn_thread_;
+  if (spawn_thread_) {
+    spawn_task_.subprocess = this;
+    spawn_thread_->Post(&spawn_task_);
+  } else {
+    Spawn();
+  }
+  return true;
+}
+
+void Subprocess::Spawn() {
   posix_spawn_file_actions_t action;
   int err = posix_spawn_file_actions_init(&action);
   if (err != 0)
     Fatal("posix_spawn_file_actions_init: %s", strerror(err));
 
-  err = posix_spawn_file_actions_addclose(&action, output_pipe[0]);
-  if (err != 0)
-    Fatal("posix_spawn_file_actions_addclose: %s", strerror(err));
-
   posix_spawnattr_t attr;
   err = posix_spawnattr_init(&attr);
   if (err != 0)
@@ -71,7 +110,7 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
   short flags = 0;
 
   flags |= POSIX_SPAWN_SETSIGMASK;
-  err = posix_spawnattr_setsigmask(&attr, &set->old_mask_);
+  err = posix_spawnattr_setsigmask(&attr, &set_->old_mask_);
   if (err != 0)
     Fatal("posix_spawnattr_setsigmask: %s", strerror(err));
   // Signals which are set to be caught in the calling process image are set to
@@ -90,17 +129,18 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
       Fatal("posix_spawn_file_actions_addopen: %s", strerror(err));
     }
 
-    err = posix_spawn_file_actions_adddup2(&action, output_pipe[1], 1);
+    err = posix_spawn_file_actions_adddup2(&action, write_fd_, 1);
     if (err != 0)
       Fatal("posix_spawn_file_actions_adddup2: %s", strerror(err));
-    err = posix_spawn_file_actions_adddup2(&action, output_pipe[1], 2);
+    err = posix_spawn_file_actions_adddup2(&action, write_fd_, 2);
     if (err != 0)
       Fatal("posix_spawn_file_actions_adddup2: %s", strerror(err));
-    err = posix_spawn_file_actions_addclose(&action, output_pipe[1]);
-    if (err != 0)
-      Fatal("posix_spawn_file_actions_addclose: %s", strerror(err));
+  } else {
     // In the console case, output_pipe is still inherited by the child and
     // closed when the subprocess finishes, which then notifies ninja.
+    // Only this thread spawns commands, so no other one inherits it.
+    if (fcntl(write_fd_, F_SETFD, 0) < 0)
+      Fatal("fcntl: %s", strerror(errno));
   }
 #ifdef POSIX_SPAWN_USEVFORK
   flags |= POSIX_SPAWN_USEVFORK;
@@ -110,9 +150,24 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
   if (err != 0)
     Fatal("posix_spawnattr_setflags: %s", strerror(err));
 
-  const char* spawned_args[] = { "/bin/sh", "-c", command.c_str(), NULL };
-  err = posix_spawn(&pid_, "/bin/sh", &action, &attr,
-        const_cast<char**>(spawned_args), environ);
+  const char* spawned_args[] = { "/bin/sh", "-c", command_.c_str(), NULL };
+  {
+#ifndef __linux__
+    ScopedLock lock(&set_->spawn_mutex_);
+#endif
+    if (!args_.empty()) {
+      vector<char*> argv;
+      for (size_t i = 0; i < args_.size(); ++i)
+        argv.push_back(const_cast<char*>(args_[i].c_str()));
+      argv.push_back(NULL);
+      err = posix_spawnp(&pid_, argv[0], &action, &attr, &argv[0], environ);
+    }
+    // A program that can't be run fails as the shell reports it.
+    if (args_.empty() || err != 0) {
+      err = posix_spawn(&pid_, "/bin/sh", &action, &attr,
+            const_cast<char**>(spawned_args), environ);
+    }
+  }
   if (err != 0)
     Fatal("posix_spawn: %s", strerror(err));
 
@@ -123,8 +178,15 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
   if (err != 0)
     Fatal("posix_spawn_file_actions_destroy: %s", strerror(err));
 
-  close(output_pipe[1]);
-  return true;
+  close(write_fd_);
+  write_fd_ = -1;
+}
+
+void Subprocess::WaitForSpawn() {
+  if (spawn_thread_) {
+    spawn_thread_->Wait(&spawn_task_);
+    spawn_thread_ = NULL;
+  }
 }
 
 void Subprocess::OnPipeReady() {
@@ -135,17 +197,36 @@ void Subprocess::OnPipeReady() {
   } else {
     if (len < 0)
       Fatal("read: %s", strerror(errno));
-    close(fd_);
-    fd_ = -1;
+    // Don't leave the spawn thread to the set, which may go first.
+    WaitForSpawn();
+    ClosePipe();
   }
 }
 
+void Subprocess::ClosePipe() {
+#ifdef USE_EPOLL
+  // Closing fd_ doesn't end the registration while a command that is being
+  // spawned still holds the pipe, which would then report it again.
+  if (epoll_fd_ >= 0 && epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd_, NULL) < 0)
+    Fatal("epoll_ctl: %s", strerror(errno));
+#endif
+  close(fd_);
+  fd_ = -1;
+}
+
 ExitStatus Subprocess::Finish() {
+  WaitForSpawn();
   assert(pid_ != -1);
   int status;
-  if (waitpid(pid_, &status, 0) < 0)
-    Fatal("waitpid(%d): %s", pid_, strerror(errno));
+  struct rusage usage;
+  if (wait4(pid_, &status, 0, &usage) < 0)
+    Fatal("wait4(%d): %s", pid_, strerror(errno));
   pid_ = -1;
+#ifdef __APPLE__
+  peak_rss_ = usage.ru_maxrss;
+#else
+  peak_rss_ = (int64_t)usage.ru_maxrss * 1024;
+#endif
 
   if (WIFEXITED(status)) {
     int exit = WEXITSTATUS(status);
@@ -188,7 +269,8 @@ void SubprocessSet::HandlePendingInterruption() {
     interrupted_ = SIGHUP;
 }
 
-SubprocessSet::SubprocessSet() {
+SubprocessSet::SubprocessSet(bool async_spawn)
+    : watched_fd_(-1), watched_fd_ready_(false), spawn_thread_(NULL) {
   sigset_t set;
   sigemptyset(&set);
   sigaddset(&set, SIGINT);
@@ -206,10 +288,46 @@ SubprocessSet::SubprocessSet() {
     Fatal("sigaction: %s", strerror(errno));
   if (sigaction(SIGHUP, &act, &old_hup_act_) < 0)
     Fatal("sigaction: %s", strerror(errno));
+
+#ifdef USE_EPOLL
+  // The signals stay blocked while waiting, so they are read from a
+  // signalfd instead.  Kernels (or sandboxes) without either leave us with
+  // ppoll().
+  signal_fd_ = -1;
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ >= 0)
+    signal_fd_ = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signal_fd_ >= 0) {
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, signal_fd_, &event) < 0) {
+      close(signal_fd_);
+      signal_fd_ = -1;
+    }
+  }
+  if (signal_fd_ < 0 && epoll_fd_ >= 0) {
+    close(epoll_fd_);
+    epoll_fd_ = -1;
+  }
+#endif
+
+  // The thread inherits the blocked signals, so they still only interrupt
+  // DoWork().
+  if (async_spawn)
+    spawn_thread_ = new ThreadPool(1);
 }
 
 SubprocessSet::~SubprocessSet() {
   Clear();
+  delete spawn_thread_;
+#ifdef USE_EPOLL
+  if (epoll_fd_ >= 0) {
+    close(signal_fd_);
+    close(epoll_fd_);
+  }
+#endif
 
   if (sigaction(SIGINT, &old_int_act_, 0) < 0)
     Fatal("sigaction: %s", strerror(errno));
@@ -221,18 +339,99 @@ SubprocessSet::~SubprocessSet() {
     Fatal("sigprocmask: %s", strerror(errno));
 }
 
-Subprocess *SubprocessSet::Add(const string& command, bool use_console) {
+Subprocess *SubprocessSet::Add(const string& command, bool use_console,
+                               ExecMode exec) {
   Subprocess *subprocess = new Subprocess(use_console);
-  if (!subprocess->Start(this, command)) {
+  if (!subprocess->Start(this, command, exec)) {
     delete subprocess;
     return 0;
   }
+#ifdef USE_EPOLL
+  if (epoll_fd_ >= 0) {
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLPRI;
+    event.data.ptr = subprocess;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, subprocess->fd_, &event) < 0)
+      Fatal("epoll_ctl: %s", strerror(errno));
+    subprocess->epoll_fd_ = epoll_fd_;
+  }
+#endif
   running_.push_back(subprocess);
   return subprocess;
 }
 
-#ifdef USE_PPOLL
+void SubprocessSet::WatchFd(int fd) {
+#ifdef USE_EPOLL
+  if (epoll_fd_ >= 0) {
+    if (watched_fd_ >= 0)
+      epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, watched_fd_, NULL);
+    if (fd >= 0) {
+      epoll_event event;
+      memset(&event, 0, sizeof(event));
+      event.events = EPOLLIN;
+      event.data.ptr = &watched_fd_;
+      if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+        Fatal("epoll_ctl: %s", strerror(errno));
+    }
+  }
+#endif
+  watched_fd_ = fd;
+  watched_fd_ready_ = false;
+}
+
 bool SubprocessSet::DoWork() {
+  watched_fd_ready_ = false;
+#ifdef USE_EPOLL
+  if (epoll_fd_ >= 0)
+    return EpollWork();
+#endif
+  return PollWork();
+}
+
+#ifdef USE_EPOLL
+bool SubprocessSet::EpollWork() {
+  epoll_event events[64];
+  interrupted_ = 0;
+  int ret = epoll_wait(epoll_fd_, events, sizeof(events) / sizeof(events[0]),
+                       -1);
+  if (ret == -1) {
+    if (errno != EINTR) {
+      perror("ninja: epoll_wait");
+      return false;
+    }
+    return IsInterrupted();
+  }
+
+  for (int i = 0; i < ret; ++i) {
+    if (events[i].data.ptr == &watched_fd_)
+      watched_fd_ready_ = true;
+    if (events[i].data.ptr)
+      continue;
+    signalfd_siginfo info;
+    while (read(signal_fd_, &info, sizeof(info)) == sizeof(info))
+      interrupted_ = info.ssi_signo;
+  }
+  if (IsInterrupted())
+    return true;
+
+  for (int i = 0; i < ret; ++i) {
+    if (!events[i].data.ptr || events[i].data.ptr == &watched_fd_)
+      continue;
+    Subprocess* subproc = static_cast<Subprocess*>(events[i].data.ptr);
+    subproc->OnPipeReady();
+    if (subproc->Done()) {
+      finished_.push(subproc);
+      running_.erase(find(running_.begin(), running_.end(), subproc));
+    }
+  }
+
+  return IsInterrupted();
+}
+#endif  // USE_EPOLL
+
+#ifdef USE_PPOLL
+bool SubprocessSet::PollWork() {
   vector<pollfd> fds;
   nfds_t nfds = 0;
 
@@ -245,9 +444,14 @@ bool SubprocessSet::DoWork() {
     fds.push_back(pfd);
     ++nfds;
   }
+  if (watched_fd_ >= 0) {
+    pollfd pfd = { watched_fd_, POLLIN, 0 };
+    fds.push_back(pfd);
+  }
 
   interrupted_ = 0;
-  int ret = ppoll(&fds.front(), nfds, NULL, &old_mask_);
+  int ret = ppoll(fds.empty() ? NULL : &fds.front(), fds.size(), NULL,
+                  &old_mask_);
   if (ret == -1) {
     if (errno != EINTR) {
       perror("ninja: ppoll");
@@ -260,6 +464,9 @@ bool SubprocessSet::DoWork() {
   if (IsInterrupted())
     return true;
 
+  if (watched_fd_ >= 0 && fds[nfds].revents)
+    watched_fd_ready_ = true;
+
   nfds_t cur_nfd = 0;
   for (vector<Subprocess*>::iterator i = running_.begin();
        i != running_.end(); ) {
@@ -282,7 +489,7 @@ bool SubprocessSet::DoWork() {
 }
 
 #else  // !defined(USE_PPOLL)
-bool SubprocessSet::DoWork() {
+bool SubprocessSet::PollWork() {
   fd_set set;
   int nfds = 0;
   FD_ZERO(&set);
@@ -296,6 +503,11 @@ bool SubprocessSet::DoWork() {
         nfds = fd+1;
     }
   }
+  if (watched_fd_ >= 0) {
+    FD_SET(watched_fd_, &set);
+    if (nfds < watched_fd_ + 1)
+      nfds = watched_fd_ + 1;
+  }
 
   interrupted_ = 0;
   int ret = pselect(nfds, &set, 0, 0, 0, &old_mask_);
@@ -311,6 +523,9 @@ bool SubprocessSet::DoWork() {
   if (IsInterrupted())
     return true;
 
+  if (watched_fd_ >= 0 && FD_ISSET(watched_fd_, &set))
+    watched_fd_ready_ = true;
+
   for (vector<Subprocess*>::iterator i = running_.begin();
        i != running_.end(); ) {
     int fd = (*i)->fd_;
@@ -338,6 +553,10 @@ Subprocess* SubprocessSet::NextFinished() {
 }
 
 void SubprocessSet::Clear() {
+  // The process groups to kill have to exist.
+  for (vector<Subprocess*>::iterator i = running_.begin();
+       i != running_.end(); ++i)
+    (*i)->WaitForSpawn();
   for (vector<Subprocess*>::iterator i = running_.begin();
        i != running_.end(); ++i)
     // Since the foreground process is in our process group, it will receive
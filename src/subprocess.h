@@ -20,6 +20,8 @@
 #include <queue>
 using namespace std;
 
+#include "util.h"  // int64_t
+
 #ifdef _WIN32
 #include <windows.h>
 #else
@@ -35,6 +37,19 @@ using namespace std;
 #endif
 
 #include "exit_status.h"
+#include "thread_pool.h"
+
+/// How a command is run on POSIX systems.  Windows always passes the
+/// command line to CreateProcess.
+enum ExecMode {
+  /// Through `/bin/sh -c`.
+  kExecShell,
+  /// Without the shell, if SplitShellFreeCommand() finds that it's not
+  /// needed.
+  kExecAuto,
+  /// Without the shell, split at whitespace.
+  kExecDirect
+};
 
 /// Subprocess wraps a single async subprocess.  It is entirely
 /// passive: it expects the caller to notify it when its fds are ready
@@ -51,12 +66,18 @@ struct Subprocess {
 
   const string& GetOutput() const;
 
+  /// The peak resident set size of the finished command and the processes
+  /// it waited for, in bytes, or 0 if unknown.
+  int64_t peak_rss() const { return peak_rss_; }
+
  private:
   Subprocess(bool use_console);
-  bool Start(struct SubprocessSet* set, const string& command);
+  bool Start(struct SubprocessSet* set, const string& command,
+             ExecMode exec);
   void OnPipeReady();
 
   string buf_;
+  int64_t peak_rss_;
 
 #ifdef _WIN32
   /// Set up pipe_ as the parent-side pipe of the subprocess; return the
@@ -69,22 +90,56 @@ struct Subprocess {
   char overlapped_buf_[4 << 10];
   bool is_reading_;
 #else
+  /// Close fd_, first removing it from the epoll instance if any.
+  void ClosePipe();
+
+  /// Runs Spawn() on the SubprocessSet's spawn thread.
+  struct SpawnTask : public ThreadPool::Task {
+    virtual void Run() { subprocess->Spawn(); }
+    Subprocess* subprocess;
+  };
+
+  /// Start command_ with its output going to write_fd_, and close
+  /// write_fd_.
+  void Spawn();
+  /// Wait for Spawn() to have run, if it was left to the spawn thread.
+  void WaitForSpawn();
+
   int fd_;
   pid_t pid_;
+  /// The set's spawn thread, or NULL if Start() spawns the command itself.
+  ThreadPool* spawn_thread_;
+  SpawnTask spawn_task_;
+  string command_;
+  /// The arguments to run the command with directly, if it is.
+  vector<string> args_;
+  int write_fd_;
+  /// The set that started the command.
+  SubprocessSet* set_;
+#ifdef USE_EPOLL
+  /// The SubprocessSet's epoll instance that fd_ is registered with, or -1.
+  int epoll_fd_;
+#endif
 #endif
   bool use_console_;
 
   friend struct SubprocessSet;
 };
 
-/// SubprocessSet runs a ppoll/pselect() loop around a set of Subprocesses.
-/// DoWork() waits for any state change in subprocesses; finished_
-/// is a queue of subprocesses as they finish.
+/// SubprocessSet runs an epoll/ppoll/pselect() loop around a set of
+/// Subprocesses.  DoWork() waits for any state change in subprocesses;
+/// finished_ is a queue of subprocesses as they finish.
 struct SubprocessSet {
-  SubprocessSet();
+  /// With \a async_spawn, Add() leaves process creation to a helper thread
+  /// and returns at once; the command's output pipe exists right away, and
+  /// DoWork() sees it close once the command has been started and exited.
+  /// Spawning from a process with a large address space is slow enough to
+  /// hold up a build with many jobs.  Windows ignores \a async_spawn.
+  explicit SubprocessSet(bool async_spawn = false);
   ~SubprocessSet();
 
-  Subprocess* Add(const string& command, bool use_console = false);
+  Subprocess* Add(const string& command, bool use_console = false,
+                  ExecMode exec = kExecShell);
   bool DoWork();
   Subprocess* NextFinished();
   void Clear();
@@ -104,10 +159,42 @@ struct SubprocessSet {
 
   static bool IsInterrupted() { return interrupted_ != 0; }
 
+  /// Also have DoWork() return once |fd|, a socket say, has data to read,
+  /// with watched_fd_ready() true; -1 stops watching.
+  void WatchFd(int fd);
+  bool watched_fd_ready() const { return watched_fd_ready_; }
+
+  /// DoWork() with ppoll() or pselect(), which pass every running
+  /// subprocess to the kernel on each call.
+  bool PollWork();
+
+#ifdef USE_EPOLL
+  /// DoWork() with epoll, which keeps the subprocesses registered so that
+  /// a wakeup only costs as much as the subprocesses that are ready.
+  bool EpollWork();
+
+  /// The epoll instance, or -1 if it couldn't be set up and PollWork() is
+  /// used instead.
+  int epoll_fd_;
+  /// A signalfd for the blocked interruption signals, registered with
+  /// epoll_fd_ in place of the sigmask that ppoll() waits with.
+  int signal_fd_;
+#endif
+
+  /// The fd of WatchFd(), or -1.
+  int watched_fd_;
+  bool watched_fd_ready_;
+
   struct sigaction old_int_act_;
   struct sigaction old_term_act_;
   struct sigaction old_hup_act_;
   sigset_t old_mask_;
+
+  /// The thread that starts the commands, with async_spawn.
+  ThreadPool* spawn_thread_;
+  /// Held while pipes are created without being closed on exec yet, and
+  /// while a command is spawned, where there is no pipe2().
+  Mutex spawn_mutex_;
 #endif
 };
 
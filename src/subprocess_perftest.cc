@@ -0,0 +1,136 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Runs thousands of trivial commands through a SubprocessSet, keeping as
+// many running as a -j build of a compile farm would, first through the
+// shell and then directly, and reports the time spent overall, in Add(),
+// which spawns the command unless -a leaves that to a helper thread, and
+// in DoWork(), whose cost grows with the number of running subprocesses
+// when it polls them all on every wakeup.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include "getopt.h"
+#else
+#include <getopt.h>
+#endif
+
+#include "metrics.h"
+#include "subprocess.h"
+#include "util.h"
+
+namespace {
+
+#ifdef _WIN32
+const char* kCommand = "cmd /c exit 0";
+#else
+const char* kCommand = "true";
+#endif
+
+int Usage() {
+  printf("usage: subprocess_perftest [-a] [-n N] [-j N]\n"
+"\n"
+"options:\n"
+"  -a     spawn the commands on a helper thread\n"
+"  -n N   run N commands in total [default=5000]\n"
+"  -j N   keep N commands running [default=1000]\n"
+         );
+  return 1;
+}
+
+/// Run |num_jobs| commands, |parallelism| at once, and report the times.
+bool Run(const char* name, ExecMode exec, bool async_spawn, int num_jobs,
+         int parallelism) {
+  SubprocessSet subprocs(async_spawn);
+  int started = 0, finished = 0, failed = 0, wakeups = 0;
+  int64_t add_time = 0, work_time = 0;
+  int64_t start = GetTimeMillis();
+  while (finished < num_jobs) {
+    int64_t add_start = GetTimeMillis();
+    while (started < num_jobs && started - finished < parallelism) {
+      if (!subprocs.Add(kCommand, false, exec)) {
+        fprintf(stderr, "failed to start '%s'\n", kCommand);
+        return false;
+      }
+      ++started;
+    }
+    add_time += GetTimeMillis() - add_start;
+
+    Subprocess* subproc;
+    while ((subproc = subprocs.NextFinished()) == NULL) {
+      int64_t work_start = GetTimeMillis();
+      bool interrupted = subprocs.DoWork();
+      work_time += GetTimeMillis() - work_start;
+      ++wakeups;
+      if (interrupted)
+        return false;
+    }
+    for (; subproc; subproc = subprocs.NextFinished()) {
+      if (subproc->Finish() != ExitSuccess)
+        ++failed;
+      delete subproc;
+      ++finished;
+    }
+  }
+  int64_t total = GetTimeMillis() - start;
+
+  printf("%s\n", name);
+  printf("  %-14s %6dms  (%.0f commands/s)\n", "total:", (int)total,
+         total ? 1000.0 * num_jobs / total : 0.0);
+  printf("  %-14s %6dms\n", "in Add():", (int)add_time);
+  printf("  %-14s %6dms  (%d wakeups, %.1fus each)\n", "in DoWork():",
+         (int)work_time, wakeups, wakeups ? 1000.0 * work_time / wakeups : 0.0);
+  if (failed) {
+    fprintf(stderr, "%d commands failed\n", failed);
+    return false;
+  }
+  return true;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  int num_jobs = 5000;
+  int parallelism = 1000;
+  bool async_spawn = false;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("an:j:h"))) != -1) {
+    switch (opt) {
+    case 'a':
+      async_spawn = true;
+      break;
+    case 'n':
+      num_jobs = atoi(optarg);
+      break;
+    case 'j':
+      parallelism = atoi(optarg);
+      break;
+    case 'h':
+    default:
+      return Usage();
+    }
+  }
+  if (num_jobs <= 0 || parallelism <= 0)
+    return Usage();
+
+  printf("%d x '%s', %d jobs\n", num_jobs, kCommand, parallelism);
+  if (!Run("through /bin/sh:", kExecShell, async_spawn, num_jobs,
+           parallelism) ||
+      !Run("directly:", kExecAuto, async_spawn, num_jobs, parallelism)) {
+    return 1;
+  }
+  return 0;
+}
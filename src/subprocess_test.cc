@@ -170,6 +170,9 @@ TEST_F(SubprocessTest, SetWithSingle) {
   }
   ASSERT_EQ(ExitSuccess, subproc->Finish());
   ASSERT_NE("", subproc->GetOutput());
+#ifndef _WIN32
+  EXPECT_GT(subproc->peak_rss(), 0);
+#endif
 
   ASSERT_EQ(1u, subprocs_.finished_.size());
 }
@@ -245,6 +248,56 @@ TEST_F(SubprocessTest, SetWithLots) {
 }
 #endif  // !__APPLE__ && !_WIN32
 
+#ifndef _WIN32
+TEST_F(SubprocessTest, ExecDirect) {
+  Subprocess* auto_shell = subprocs_.Add("echo a$b", false, kExecAuto);
+  Subprocess* auto_direct = subprocs_.Add("echo a b", false, kExecAuto);
+  Subprocess* direct = subprocs_.Add("echo a$b  'c'", false, kExecDirect);
+  Subprocess* missing = subprocs_.Add("ninja_no_such_command", false,
+                                      kExecAuto);
+  while (!subprocs_.running_.empty())
+    subprocs_.DoWork();
+
+  EXPECT_EQ(ExitSuccess, auto_shell->Finish());
+  EXPECT_EQ("a\n", auto_shell->GetOutput());
+  EXPECT_EQ(ExitSuccess, auto_direct->Finish());
+  EXPECT_EQ("a b\n", auto_direct->GetOutput());
+  EXPECT_EQ(ExitSuccess, direct->Finish());
+  EXPECT_EQ("a$b 'c'\n", direct->GetOutput());
+  // The shell reports that the program is missing.
+  EXPECT_EQ(ExitFailure, missing->Finish());
+  EXPECT_NE(string::npos, missing->GetOutput().find("ninja_no_such_command"));
+  delete auto_shell;
+  delete auto_direct;
+  delete direct;
+  delete missing;
+}
+
+TEST(SubprocessAsyncSpawnTest, SetWithMulti) {
+  SubprocessSet subprocs(/*async_spawn=*/true);
+  // The command that finishes early mustn't wait for the other one, which
+  // it would if that had inherited its pipe.
+  Subprocess* slow = subprocs.Add("sleep 2");
+  Subprocess* fast = subprocs.Add("echo hi");
+  ASSERT_NE((Subprocess *) 0, slow);
+  ASSERT_NE((Subprocess *) 0, fast);
+  ASSERT_EQ(2u, subprocs.running_.size());
+
+  while (!fast->Done())
+    subprocs.DoWork();
+  EXPECT_FALSE(slow->Done());
+  EXPECT_EQ(ExitSuccess, fast->Finish());
+  EXPECT_EQ("hi\n", fast->GetOutput());
+
+  while (!slow->Done())
+    subprocs.DoWork();
+  EXPECT_EQ(ExitSuccess, slow->Finish());
+  ASSERT_EQ(2u, subprocs.finished_.size());
+  delete fast;
+  delete slow;
+}
+#endif  // _WIN32
+
 // TODO: this test could work on Windows, just not sure how to simply
 // read stdin.
 #ifndef _WIN32
@@ -259,3 +312,30 @@ TEST_F(SubprocessTest, ReadStdin) {
   ASSERT_EQ(1u, subprocs_.finished_.size());
 }
 #endif  // _WIN32
+
+#ifndef _WIN32
+// DoWork() returns for a watched fd as well as for the commands.
+TEST_F(SubprocessTest, WatchFd) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  subprocs_.WatchFd(fds[0]);
+  Subprocess* subproc = subprocs_.Add("sleep 0.1 && echo done");
+  ASSERT_EQ(1, write(fds[1], "x", 1));
+  EXPECT_FALSE(subprocs_.DoWork());
+  EXPECT_TRUE(subprocs_.watched_fd_ready());
+  EXPECT_TRUE(subprocs_.finished_.empty());
+
+  char c;
+  ASSERT_EQ(1, read(fds[0], &c, 1));
+  while (!subproc->Done()) {
+    subprocs_.DoWork();
+    EXPECT_FALSE(subprocs_.watched_fd_ready());
+  }
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+  EXPECT_EQ("done\n", subproc->GetOutput());
+
+  subprocs_.WatchFd(-1);
+  close(fds[0]);
+  close(fds[1]);
+}
+#endif  // _WIN32
@@ -142,12 +142,19 @@ void VerifyGraph(const State& state) {
 
 void VirtualFileSystem::Create(const string& path,
                                const string& contents) {
+  ScopedLock lock(&mutex_);
+  CreateLocked(path, contents);
+}
+
+void VirtualFileSystem::CreateLocked(const string& path,
+                                     const string& contents) {
   files_[path].mtime = now_;
   files_[path].contents = contents;
   files_created_.insert(path);
 }
 
 TimeStamp VirtualFileSystem::Stat(const string& path, string* err) const {
+  ScopedLock lock(&mutex_);
   FileMap::const_iterator i = files_.find(path);
   if (i != files_.end()) {
     *err = i->second.stat_error;
@@ -156,12 +163,24 @@ TimeStamp VirtualFileSystem::Stat(const string& path, string* err) const {
   return 0;
 }
 
+bool VirtualFileSystem::IsDir(const string& path) const {
+  ScopedLock lock(&mutex_);
+  if (find(directories_made_.begin(), directories_made_.end(), path) !=
+      directories_made_.end())
+    return true;
+  // A directory holding a file exists, even if it wasn't made.
+  FileMap::const_iterator i = files_.lower_bound(path + "/");
+  return i != files_.end() && i->first.compare(0, path.size() + 1,
+                                               path + "/") == 0;
+}
+
 bool VirtualFileSystem::WriteFile(const string& path, const string& contents) {
   Create(path, contents);
   return true;
 }
 
 bool VirtualFileSystem::MakeDir(const string& path) {
+  ScopedLock lock(&mutex_);
   directories_made_.push_back(path);
   return true;  // success
 }
@@ -169,6 +188,7 @@ bool VirtualFileSystem::MakeDir(const string& path) {
 FileReader::Status VirtualFileSystem::ReadFile(const string& path,
                                                string* contents,
                                                string* err) {
+  ScopedLock lock(&mutex_);
   files_read_.push_back(path);
   FileMap::iterator i = files_.find(path);
   if (i != files_.end()) {
@@ -179,7 +199,65 @@ FileReader::Status VirtualFileSystem::ReadFile(const string& path,
   return NotFound;
 }
 
+bool VirtualFileSystem::Touch(const string& path, string* err) {
+  ScopedLock lock(&mutex_);
+  FileMap::iterator i = files_.find(path);
+  if (i == files_.end()) {
+    CreateLocked(path, "");
+  } else {
+    i->second.mtime = now_;
+  }
+  return true;
+}
+
+bool VirtualFileSystem::Copy(const string& from, const string& to,
+                             string* err) {
+  ScopedLock lock(&mutex_);
+  files_read_.push_back(from);
+  FileMap::iterator i = files_.find(from);
+  if (i == files_.end()) {
+    *err = from + ": " + strerror(ENOENT);
+    return false;
+  }
+  CreateLocked(to, i->second.contents);
+  return true;
+}
+
+bool VirtualFileSystem::Rename(const string& from, const string& to,
+                               string* err) {
+  ScopedLock lock(&mutex_);
+  FileMap::iterator i = files_.find(from);
+  if (i != files_.end()) {
+    files_[to] = i->second;
+    files_.erase(i);
+    files_removed_.insert(from);
+    return true;
+  }
+
+  // A directory is the files under it, and can't replace one with files.
+  string from_dir = from + "/", to_dir = to + "/";
+  FileMap::iterator to_begin = files_.lower_bound(to_dir);
+  if (to_begin != files_.end() && to_begin->first.compare(
+          0, to_dir.size(), to_dir) == 0) {
+    *err = to + ": " + strerror(EEXIST);
+    return false;
+  }
+  i = files_.lower_bound(from_dir);
+  if (i == files_.end() || i->first.compare(0, from_dir.size(), from_dir)) {
+    *err = from + ": " + strerror(ENOENT);
+    return false;
+  }
+  while (i != files_.end() &&
+         i->first.compare(0, from_dir.size(), from_dir) == 0) {
+    files_[to_dir + i->first.substr(from_dir.size())] = i->second;
+    files_removed_.insert(i->first);
+    files_.erase(i++);
+  }
+  return true;
+}
+
 int VirtualFileSystem::RemoveFile(const string& path) {
+  ScopedLock lock(&mutex_);
   if (find(directories_made_.begin(), directories_made_.end(), path)
       != directories_made_.end())
     return -1;
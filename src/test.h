@@ -18,6 +18,7 @@
 #include "disk_interface.h"
 #include "manifest_parser.h"
 #include "state.h"
+#include "thread_pool.h"
 #include "util.h"
 
 // A tiny testing framework inspired by googletest, but much simpler and
@@ -145,9 +146,13 @@ struct VirtualFileSystem : public DiskInterface {
 
   // DiskInterface
   virtual TimeStamp Stat(const string& path, string* err) const;
+  virtual bool IsDir(const string& path) const;
   virtual bool WriteFile(const string& path, const string& contents);
   virtual bool MakeDir(const string& path);
   virtual Status ReadFile(const string& path, string* contents, string* err);
+  virtual bool Touch(const string& path, string* err);
+  virtual bool Copy(const string& from, const string& to, string* err);
+  virtual bool Rename(const string& from, const string& to, string* err);
   virtual int RemoveFile(const string& path);
 
   /// An entry for a single in-memory file.
@@ -166,6 +171,13 @@ struct VirtualFileSystem : public DiskInterface {
 
   /// A simple fake timestamp for file operations.
   int now_;
+
+ private:
+  void CreateLocked(const string& path, const string& contents);
+
+  /// Held by the DiskInterface methods, which Builder's deps threads call
+  /// concurrently with the main thread.
+  mutable Mutex mutex_;
 };
 
 struct ScopedTempDir {
@@ -0,0 +1,187 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thread_pool.h"
+
+#include <string.h>
+
+#include "util.h"
+
+#ifdef _WIN32
+
+Mutex::Mutex() {
+  InitializeCriticalSection(&mutex_);
+}
+
+Mutex::~Mutex() {
+  DeleteCriticalSection(&mutex_);
+}
+
+void Mutex::Lock() {
+  EnterCriticalSection(&mutex_);
+}
+
+void Mutex::Unlock() {
+  LeaveCriticalSection(&mutex_);
+}
+
+#else
+
+Mutex::Mutex() {
+  pthread_mutex_init(&mutex_, NULL);
+}
+
+Mutex::~Mutex() {
+  pthread_mutex_destroy(&mutex_);
+}
+
+void Mutex::Lock() {
+  pthread_mutex_lock(&mutex_);
+}
+
+void Mutex::Unlock() {
+  pthread_mutex_unlock(&mutex_);
+}
+
+#endif
+
+ThreadPool::ThreadPool(int num_threads)
+    : max_threads_(num_threads < 1 ? 1 : num_threads), idle_threads_(0),
+      quit_(false) {
+#ifdef _WIN32
+  InitializeConditionVariable(&work_cond_);
+  InitializeConditionVariable(&done_cond_);
+#else
+  pthread_cond_init(&work_cond_, NULL);
+  pthread_cond_init(&done_cond_, NULL);
+#endif
+}
+
+ThreadPool::~ThreadPool() {
+  mutex_.Lock();
+  quit_ = true;
+#ifdef _WIN32
+  WakeAllConditionVariable(&work_cond_);
+#else
+  pthread_cond_broadcast(&work_cond_);
+#endif
+  mutex_.Unlock();
+
+  for (size_t i = 0; i < threads_.size(); ++i) {
+#ifdef _WIN32
+    WaitForSingleObject(threads_[i], INFINITE);
+    CloseHandle(threads_[i]);
+#else
+    pthread_join(threads_[i], NULL);
+#endif
+  }
+
+#ifndef _WIN32
+  pthread_cond_destroy(&work_cond_);
+  pthread_cond_destroy(&done_cond_);
+#endif
+}
+
+void ThreadPool::Post(Task* task) {
+  ScopedLock lock(&mutex_);
+  task->done_ = false;
+  queue_.push_back(task);
+
+  if (idle_threads_ == 0 && (int)threads_.size() < max_threads_) {
+#ifdef _WIN32
+    HANDLE thread = CreateThread(NULL, 0, ThreadMain, this, 0, NULL);
+    if (!thread)
+      Fatal("CreateThread: %s", GetLastErrorString().c_str());
+    threads_.push_back(thread);
+#else
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, ThreadMain, this);
+    if (ret != 0)
+      Fatal("pthread_create: %s", strerror(ret));
+    threads_.push_back(thread);
+#endif
+  } else {
+#ifdef _WIN32
+    WakeConditionVariable(&work_cond_);
+#else
+    pthread_cond_signal(&work_cond_);
+#endif
+  }
+}
+
+bool ThreadPool::IsDone(Task* task) {
+  ScopedLock lock(&mutex_);
+  return task->done_;
+}
+
+void ThreadPool::Wait(Task* task) {
+  ScopedLock lock(&mutex_);
+  while (!task->done_) {
+#ifdef _WIN32
+    SleepConditionVariableCS(&done_cond_, &mutex_.mutex_, INFINITE);
+#else
+    pthread_cond_wait(&done_cond_, &mutex_.mutex_);
+#endif
+  }
+}
+
+void ThreadPool::RunAll(const vector<Task*>& tasks) {
+  for (vector<Task*>::const_iterator i = tasks.begin(); i != tasks.end(); ++i)
+    Post(*i);
+  for (vector<Task*>::const_iterator i = tasks.begin(); i != tasks.end(); ++i)
+    Wait(*i);
+}
+
+#ifdef _WIN32
+DWORD WINAPI ThreadPool::ThreadMain(void* arg) {
+  static_cast<ThreadPool*>(arg)->WorkLoop();
+  return 0;
+}
+#else
+void* ThreadPool::ThreadMain(void* arg) {
+  static_cast<ThreadPool*>(arg)->WorkLoop();
+  return NULL;
+}
+#endif
+
+void ThreadPool::WorkLoop() {
+  mutex_.Lock();
+  for (;;) {
+    if (queue_.empty()) {
+      if (quit_)
+        break;
+      ++idle_threads_;
+#ifdef _WIN32
+      SleepConditionVariableCS(&work_cond_, &mutex_.mutex_, INFINITE);
+#else
+      pthread_cond_wait(&work_cond_, &mutex_.mutex_);
+#endif
+      --idle_threads_;
+      continue;
+    }
+
+    Task* task = queue_.front();
+    queue_.pop_front();
+    mutex_.Unlock();
+    task->Run();
+    mutex_.Lock();
+    task->done_ = true;
+#ifdef _WIN32
+    WakeAllConditionVariable(&done_cond_);
+#else
+    pthread_cond_broadcast(&done_cond_);
+#endif
+  }
+  mutex_.Unlock();
+}
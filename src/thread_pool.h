@@ -0,0 +1,117 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_THREAD_POOL_H_
+#define NINJA_THREAD_POOL_H_
+
+#include <deque>
+#include <vector>
+using namespace std;
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+/// A plain (non-recursive) mutex.
+struct Mutex {
+  Mutex();
+  ~Mutex();
+  void Lock();
+  void Unlock();
+
+ private:
+  friend struct ThreadPool;
+#ifdef _WIN32
+  CRITICAL_SECTION mutex_;
+#else
+  pthread_mutex_t mutex_;
+#endif
+
+  Mutex(const Mutex&);
+  void operator=(const Mutex&);
+};
+
+/// Holds a Mutex locked for the lifetime of the object.
+struct ScopedLock {
+  explicit ScopedLock(Mutex* mutex) : mutex_(mutex) { mutex_->Lock(); }
+  ~ScopedLock() { mutex_->Unlock(); }
+
+ private:
+  Mutex* mutex_;
+};
+
+/// A fixed set of worker threads running Tasks in the order they were
+/// posted.  Ninja is otherwise single-threaded; the pool is only used for
+/// work that touches no shared mutable state, such as parsing files into
+/// private data structures, with the results consumed on the main thread.
+struct ThreadPool {
+  /// A unit of work.  Tasks are owned by the caller, who must keep them
+  /// alive until Wait() has returned for them.
+  struct Task {
+    Task() : done_(false) {}
+    virtual ~Task() {}
+    virtual void Run() = 0;
+
+   private:
+    friend struct ThreadPool;
+    bool done_;
+  };
+
+  /// The threads are started on demand, up to |num_threads| of them.
+  explicit ThreadPool(int num_threads);
+  /// Finishes all posted tasks before returning.
+  ~ThreadPool();
+
+  /// Queue |task| to be run on one of the threads.
+  void Post(Task* task);
+
+  /// Return true if |task| has finished running.
+  bool IsDone(Task* task);
+
+  /// Block until |task| has finished running.
+  void Wait(Task* task);
+
+  /// Run all of |tasks| and wait for them to finish.
+  void RunAll(const vector<Task*>& tasks);
+
+ private:
+#ifdef _WIN32
+  static DWORD WINAPI ThreadMain(void* arg);
+#else
+  static void* ThreadMain(void* arg);
+#endif
+  void WorkLoop();
+
+  int max_threads_;
+  Mutex mutex_;
+#ifdef _WIN32
+  CONDITION_VARIABLE work_cond_;
+  CONDITION_VARIABLE done_cond_;
+  vector<HANDLE> threads_;
+#else
+  pthread_cond_t work_cond_;
+  pthread_cond_t done_cond_;
+  vector<pthread_t> threads_;
+#endif
+  deque<Task*> queue_;
+  int idle_threads_;
+  bool quit_;
+
+  ThreadPool(const ThreadPool&);
+  void operator=(const ThreadPool&);
+};
+
+#endif  // NINJA_THREAD_POOL_H_
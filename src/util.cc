@@ -35,6 +35,7 @@
 
 #ifndef _WIN32
 #include <unistd.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #endif
 
@@ -227,6 +228,21 @@ static inline bool IsKnownShellSafeCharacter(char ch) {
   }
 }
 
+/// Characters that the shell takes literally in arguments, but not at the
+/// start of a command.
+static inline bool IsShellSafeArgumentCharacter(char ch) {
+  switch (ch) {
+    case '=':  // Would make the command's first word an assignment.
+    case ',':
+    case ':':
+    case '@':
+    case '%':
+      return true;
+    default:
+      return IsKnownShellSafeCharacter(ch);
+  }
+}
+
 static inline bool IsKnownWin32SafeCharacter(char ch) {
   switch (ch) {
     case ' ':
@@ -278,6 +294,48 @@ void GetShellEscapedString(const string& input, string* result) {
 }
 
 
+bool SplitShellFreeCommand(const string& command, bool force,
+                           vector<string>* args) {
+  args->clear();
+  size_t start = string::npos;
+  for (size_t i = 0; i <= command.size(); ++i) {
+    if (i == command.size() || command[i] == ' ' || command[i] == '\t') {
+      if (start != string::npos)
+        args->push_back(command.substr(start, i - start));
+      start = string::npos;
+      continue;
+    }
+    if (start == string::npos)
+      start = i;
+    if (force)
+      continue;
+    if (args->empty() ? !IsKnownShellSafeCharacter(command[i])
+                      : !IsShellSafeArgumentCharacter(command[i])) {
+      return false;
+    }
+  }
+  if (args->empty())
+    return false;
+  if (force)
+    return true;
+
+  // Keywords and builtins that aren't (only) programs.
+  static const char* const kShellWords[] = {
+    ".", "alias", "bg", "break", "case", "cd", "command", "continue", "do",
+    "done", "elif", "else", "esac", "eval", "exec", "exit", "export", "fc",
+    "fg", "fi", "for", "function", "getopts", "hash", "if", "in", "jobs",
+    "local", "read", "readonly", "return", "select", "set", "shift",
+    "source", "then", "time", "times", "trap", "type", "ulimit", "umask",
+    "unalias", "unset", "until", "wait", "while",
+  };
+  const string& program = (*args)[0];
+  for (size_t i = 0; i < sizeof(kShellWords) / sizeof(kShellWords[0]); ++i) {
+    if (program == kShellWords[i])
+      return false;
+  }
+  return true;
+}
+
 void GetWin32EscapedString(const string& input, string* result) {
   assert(result);
   if (!StringNeedsWin32Escaping(input)) {
@@ -596,6 +654,41 @@ string ElideMiddle(const string& str, size_t width) {
   return result;
 }
 
+int64_t GetPeakMemoryUsage() {
+#ifdef _WIN32
+  return -1;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) < 0)
+    return -1;
+#ifdef __APPLE__
+  return usage.ru_maxrss;  // Already in bytes.
+#else
+  return (int64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+bool ParseMemorySize(const string& value, int64_t* bytes) {
+  const char* str = value.c_str();
+  char* end;
+  double size = strtod(str, &end);
+  if (end == str || size < 0)
+    return false;
+  switch (*end) {
+  case 'T': case 't': size *= 1024;  // Fall through.
+  case 'G': case 'g': size *= 1024;  // Fall through.
+  case 'M': case 'm': size *= 1024;  // Fall through.
+  case 'K': case 'k': size *= 1024;
+    ++end;
+    break;
+  }
+  if (*end != '\0')
+    return false;
+  *bytes = (int64_t)size;
+  return true;
+}
+
 bool Truncate(const string& path, size_t size, string* err) {
 #ifdef _WIN32
   int fh = _sopen(path.c_str(), _O_RDWR | _O_CREAT, _SH_DENYNO,
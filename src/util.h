@@ -68,6 +68,14 @@ bool CanonicalizePath(char* path, size_t* len, uint64_t* slash_bits,
 void GetShellEscapedString(const string& input, string* result);
 void GetWin32EscapedString(const string& input, string* result);
 
+/// Split |command| into the arguments that `sh -c` would run it with, if
+/// it is a plain list of words that the shell neither expands nor
+/// interprets, nor runs as one of its builtins.  With |force|, split it at
+/// spaces and tabs regardless.
+/// @return false if the command needs the shell.
+bool SplitShellFreeCommand(const string& command, bool force,
+                           vector<string>* args);
+
 /// Read a file to a string (in text mode: with CRLF conversion
 /// on Windows).
 /// Returns -errno and fills in \a err on error.
@@ -97,6 +105,15 @@ int GetProcessorCount();
 /// on error.
 double GetLoadAverage();
 
+/// @return the peak resident set size of this process in bytes.  A
+/// negative value is returned when it is not known.
+int64_t GetPeakMemoryUsage();
+
+/// Parse a memory size: a number of bytes, with an optional K, M, G or T
+/// suffix for powers of 1024, like "512M" or "1.5G".
+/// @return false if \a value isn't one.
+bool ParseMemorySize(const string& value, int64_t* bytes);
+
 /// Elide the given string @a str with '...' in the middle if the length
 /// exceeds @a width.
 string ElideMiddle(const string& str, size_t width);
@@ -391,6 +391,48 @@ TEST(PathEscaping, SensiblePathsAreNotNeedlesslyEscaped) {
   EXPECT_EQ(path, result);
 }
 
+TEST(SplitShellFreeCommand, PlainWords) {
+  vector<string> args;
+  EXPECT_TRUE(SplitShellFreeCommand(
+      "  cc -DFOO=1 -c\tsrc/foo.c -o obj/foo.o ", false, &args));
+  ASSERT_EQ(6u, args.size());
+  EXPECT_EQ("cc", args[0]);
+  EXPECT_EQ("-DFOO=1", args[1]);
+  EXPECT_EQ("src/foo.c", args[3]);
+  EXPECT_EQ("obj/foo.o", args[5]);
+
+  EXPECT_TRUE(SplitShellFreeCommand("./gen.py --out=a,b:c@d%e", false,
+                                    &args));
+  EXPECT_EQ(2u, args.size());
+}
+
+TEST(SplitShellFreeCommand, ShellSyntax) {
+  vector<string> args;
+  EXPECT_FALSE(SplitShellFreeCommand("", false, &args));
+  EXPECT_FALSE(SplitShellFreeCommand(" ", false, &args));
+  EXPECT_FALSE(SplitShellFreeCommand("cc -c $in", false, &args));
+  EXPECT_FALSE(SplitShellFreeCommand("cc -c foo.c > log", false, &args));
+  EXPECT_FALSE(SplitShellFreeCommand("cc -c foo.c && touch x", false, &args));
+  EXPECT_FALSE(SplitShellFreeCommand("cc -DX='y z'", false, &args));
+  EXPECT_FALSE(SplitShellFreeCommand("cp *.h inc", false, &args));
+  EXPECT_FALSE(SplitShellFreeCommand("cp ~/a b", false, &args));
+  EXPECT_FALSE(SplitShellFreeCommand("cc\nld", false, &args));
+  // An assignment, and builtins.
+  EXPECT_FALSE(SplitShellFreeCommand("CC=gcc make", false, &args));
+  EXPECT_FALSE(SplitShellFreeCommand("cd out", false, &args));
+  EXPECT_FALSE(SplitShellFreeCommand("exit 1", false, &args));
+  EXPECT_FALSE(SplitShellFreeCommand(". env.sh", false, &args));
+}
+
+TEST(SplitShellFreeCommand, Force) {
+  vector<string> args;
+  EXPECT_TRUE(SplitShellFreeCommand("sed -e s/a*/$b/ 'x' ", true, &args));
+  ASSERT_EQ(4u, args.size());
+  EXPECT_EQ("s/a*/$b/", args[2]);
+  EXPECT_EQ("'x'", args[3]);
+  EXPECT_FALSE(SplitShellFreeCommand(" \t", true, &args));
+}
+
 TEST(PathEscaping, SensibleWin32PathsAreNotNeedlesslyEscaped) {
   const char* path = "some\\sensible\\path\\without\\crazy\\characters.c++";
   string result;
@@ -428,3 +470,21 @@ TEST(ElideMiddle, ElideInTheMiddle) {
   EXPECT_EQ("012...789", elided);
   EXPECT_EQ("01234567...23456789", ElideMiddle(input, 19));
 }
+
+TEST(ParseMemorySize, Sizes) {
+  int64_t bytes = 0;
+  EXPECT_TRUE(ParseMemorySize("4096", &bytes));
+  EXPECT_EQ(4096, bytes);
+  EXPECT_TRUE(ParseMemorySize("512k", &bytes));
+  EXPECT_EQ(512 << 10, bytes);
+  EXPECT_TRUE(ParseMemorySize("1.5G", &bytes));
+  EXPECT_EQ(3LL << 29, bytes);
+  EXPECT_TRUE(ParseMemorySize("2T", &bytes));
+  EXPECT_EQ(2LL << 40, bytes);
+
+  EXPECT_FALSE(ParseMemorySize("", &bytes));
+  EXPECT_FALSE(ParseMemorySize("G", &bytes));
+  EXPECT_FALSE(ParseMemorySize("-1G", &bytes));
+  EXPECT_FALSE(ParseMemorySize("16GB", &bytes));
+  EXPECT_EQ(2LL << 40, bytes);
+}